@@ -8,6 +8,10 @@
 #cmakedefine HAVE_LCHMOD
 #cmakedefine HAVE_UTIMENSAT
 #cmakedefine HAVE_FDATASYNC
+#cmakedefine HAVE_STATX
+#cmakedefine HAVE_SYNCFS
+#cmakedefine HAVE_FALLOCATE
+#cmakedefine HAVE_LINUX_IO_URING_H
 
 #cmakedefine HAVE_DIRENT_D_TYPE
 
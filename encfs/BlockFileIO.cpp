@@ -20,6 +20,7 @@
 
 #include "BlockFileIO.h"
 
+#include <cerrno>   // for EOPNOTSUPP
 #include <cstring>  // for memset, memcpy, NULL
 
 #include "Error.h"
@@ -40,77 +41,106 @@ static void clearCache(IORequest &req, unsigned int blockSize) {
   req.dataLen = 0;
 }
 
-BlockFileIO::BlockFileIO(unsigned int blockSize, const FSConfigPtr &cfg)
+BlockFileIO::BlockFileIO(unsigned int blockSize, const FSConfigPtr &cfg,
+                         unsigned int headroom)
     : _blockSize(blockSize), _allowHoles(cfg->config->allowHoles) {
   CHECK(_blockSize > 1);
-  _cache.data = new unsigned char[_blockSize];
+  _cache.data = new unsigned char[headroom + _blockSize] + headroom;
+  _cache.headroom = headroom;
   _noCache = cfg->opts->noCache;
 }
 
 BlockFileIO::~BlockFileIO() {
   clearCache(_cache, _blockSize);
-  delete[] _cache.data;
+  delete[](_cache.data - _cache.headroom);
+}
+
+void BlockFileIO::release(bool closeFd) {
+  (void)closeFd;
+  clearCache(_cache, _blockSize);
+}
+
+bool BlockFileIO::isCached(off_t offset) const {
+  return !_noCache && offset == _cache.offset && _cache.dataLen != 0;
+}
+
+ssize_t BlockFileIO::readBlockPart(const IORequest &) const {
+  return -EOPNOTSUPP;
+}
+
+ssize_t BlockFileIO::writeBlockPart(const IORequest &) { return -EOPNOTSUPP; }
+
+/**
+ * Read the block at a block-aligned offset into the cache, unless it is
+ * there already.  Returns the size of the block, or -errno in case of
+ * failure.
+ */
+ssize_t BlockFileIO::cacheBlock(off_t offset) const {
+  /* For reverse encryption, the cache must not be used at all, because
+   * the lower file may have changed behind our back. */
+  if (isCached(offset)) {
+    return _cache.dataLen;
+  }
+  // the read below replaces the cached block
+  _cache.dataLen = 0;
+
+  IORequest tmp;
+  tmp.offset = offset;
+  tmp.data = _cache.data;
+  tmp.dataLen = _blockSize;
+  tmp.headroom = _cache.headroom;
+  ssize_t result = readOneBlock(tmp);
+  if (result > 0) {
+    _cache.offset = offset;
+    _cache.dataLen = result;  // the amount we really have
+  }
+  return result;
 }
 
 /**
  * Serve a read request for the size of one block or less,
  * at block-aligned offsets.
  * Always requests full blocks form the lower layer, truncates the
- * returned data as neccessary.
+ * returned data as neccessary.  Whole blocks which aren't cached are read
+ * straight into the request buffer.
  */
 ssize_t BlockFileIO::cacheReadOneBlock(const IORequest &req) const {
   CHECK(req.dataLen <= _blockSize);
   CHECK(req.offset % _blockSize == 0);
 
-  /* we can satisfy the request even if _cache.dataLen is too short, because
-   * we always request a full block during reads. This just means we are
-   * in the last block of a file, which may be smaller than the blocksize.
-   * For reverse encryption, the cache must not be used at all, because
-   * the lower file may have changed behind our back. */
-  if ((!_noCache) && (req.offset == _cache.offset) && (_cache.dataLen != 0)) {
-    // satisfy request from cache
-    size_t len = req.dataLen;
-    if (_cache.dataLen < len) {
-      len = _cache.dataLen;  // Don't read past EOF
-    }
-    memcpy(req.data, _cache.data, len);
-    return len;
-  }
-  if (_cache.dataLen > 0) {
-    clearCache(_cache, _blockSize);
+  if (req.dataLen == _blockSize && !isCached(req.offset)) {
+    return readOneBlock(req);
   }
 
-  // cache results of read -- issue reads for full blocks
-  IORequest tmp;
-  tmp.offset = req.offset;
-  tmp.data = _cache.data;
-  tmp.dataLen = _blockSize;
-  ssize_t result = readOneBlock(tmp);
+  /* we can satisfy the request even if _cache.dataLen is too short, because
+   * we always request a full block during reads. This just means we are
+   * in the last block of a file, which may be smaller than the blocksize. */
+  ssize_t result = cacheBlock(req.offset);
   if (result > 0) {
-    _cache.offset = req.offset;
-    _cache.dataLen = result;  // the amount we really have
     if ((size_t)result > req.dataLen) {
       result = req.dataLen;  // only as much as requested
     }
-    memcpy(req.data, _cache.data, result);
+    if (req.data != _cache.data) {
+      memcpy(req.data, _cache.data, result);
+    }
   }
   return result;
 }
 
+/**
+ * Write one block, or the partial block at the end of the file.  The data
+ * is written from where it is, as writeOneBlock() leaves it untouched.  It
+ * is only copied to the cache if it is a partial block, which is likely to
+ * be extended by the next write, or if the cache has an older copy.
+ */
 ssize_t BlockFileIO::cacheWriteOneBlock(const IORequest &req) {
-  // Let's point request buffer to our own buffer, as it may be modified by
-  // encryption : originating process may not like to have its buffer modified
-  memcpy(_cache.data, req.data, req.dataLen);
-  IORequest tmp;
-  tmp.offset = req.offset;
-  tmp.data = _cache.data;
-  tmp.dataLen = req.dataLen;
-  ssize_t res = writeOneBlock(tmp);
+  ssize_t res = writeOneBlock(req);
   if (res < 0) {
     clearCache(_cache, _blockSize);
-  }
-  else {
-    // And now we can cache the write buffer from the request
+  } else if (req.data == _cache.data) {
+    _cache.offset = req.offset;
+    _cache.dataLen = req.dataLen;
+  } else if (req.dataLen < _blockSize || isCached(req.offset)) {
     memcpy(_cache.data, req.data, req.dataLen);
     _cache.offset = req.offset;
     _cache.dataLen = req.dataLen;
@@ -118,6 +148,51 @@ ssize_t BlockFileIO::cacheWriteOneBlock(const IORequest &req) {
   return res;
 }
 
+ssize_t BlockFileIO::readBlocks(const IORequest &req) const {
+  IORequest blockReq;
+  blockReq.dataLen = _blockSize;
+  ssize_t result = 0;
+  for (size_t pos = 0; pos < req.dataLen; pos += _blockSize) {
+    blockReq.offset = req.offset + pos;
+    blockReq.data = req.data + pos;
+    ssize_t res = cacheReadOneBlock(blockReq);
+    if (res < 0) {
+      return res;
+    }
+    result += res;
+    if ((size_t)res < _blockSize) {
+      break;
+    }
+  }
+  return result;
+}
+
+ssize_t BlockFileIO::writeBlocks(const IORequest &req) {
+  IORequest blockReq;
+  blockReq.dataLen = _blockSize;
+  for (size_t pos = 0; pos < req.dataLen; pos += _blockSize) {
+    blockReq.offset = req.offset + pos;
+    blockReq.data = req.data + pos;
+    ssize_t res = cacheWriteOneBlock(blockReq);
+    if (res < 0) {
+      return res;
+    }
+  }
+  return req.dataLen;
+}
+
+ssize_t BlockFileIO::cacheWriteBlocks(const IORequest &req) {
+  CHECK(req.offset % _blockSize == 0);
+  CHECK(req.dataLen % _blockSize == 0);
+
+  // the cached block is overwritten
+  if (_cache.offset >= req.offset &&
+      _cache.offset < req.offset + (off_t)req.dataLen) {
+    clearCache(_cache, _blockSize);
+  }
+  return writeBlocks(req);
+}
+
 /**
  * Serve a read request of arbitrary size at an arbitrary offset.
  * Stitches together multiple blocks to serve large requests, drops
@@ -134,36 +209,94 @@ ssize_t BlockFileIO::read(const IORequest &req) const {
   off_t blockNum = req.offset / _blockSize;
   ssize_t result = 0;
 
-  if (partialOffset == 0 && req.dataLen <= _blockSize) {
+  if (partialOffset == 0 && req.dataLen <= _blockSize &&
+      (req.dataLen == _blockSize || _blockSize < PartialBlockSize)) {
     // read completely within a single block -- can be handled as-is by
     // readOneBlock().
     return cacheReadOneBlock(req);
   }
   size_t size = req.dataLen;
 
+  // only needed to find the whole blocks for readBlockPart()
+  off_t fileSize = 0;
+  bool haveFileSize = false;
+
   // if the request is larger then a block, then request each block
   // individually
-  MemBlock mb;         // in case we need to allocate a temporary block..
   IORequest blockReq;  // for requests we may need to make
   blockReq.dataLen = _blockSize;
   blockReq.data = nullptr;
 
+  // runs of whole blocks are read in batches
+  size_t batch = WriteBatchSize - WriteBatchSize % _blockSize;
+  if (batch == 0) {
+    batch = _blockSize;
+  }
+
   unsigned char *out = req.data;
   while (size != 0u) {
     blockReq.offset = blockNum * _blockSize;
 
+    if (partialOffset == 0 && size >= 2 * (size_t)_blockSize) {
+      blockReq.data = out;
+      blockReq.dataLen = min(size - size % _blockSize, batch);
+      ssize_t readSize = readBlocks(blockReq);
+      if (readSize < 0) {
+        result = readSize;
+        break;
+      }
+      result += readSize;
+      size -= readSize;
+      out += readSize;
+      blockNum += readSize / _blockSize;
+      if ((size_t)readSize < blockReq.dataLen) {
+        break;
+      }
+      continue;
+    }
+    blockReq.dataLen = _blockSize;
+
+    // a small part of a large block is read on its own
+    size_t partSize = min((size_t)_blockSize - (size_t)partialOffset, size);
+    if (partSize < _blockSize && _blockSize >= PartialBlockSize &&
+        !isCached(blockReq.offset)) {
+      if (!haveFileSize) {
+        fileSize = getSize();
+        haveFileSize = true;
+      }
+      if (blockReq.offset + (off_t)_blockSize <= fileSize) {
+        IORequest partReq;
+        partReq.offset = blockReq.offset + partialOffset;
+        partReq.data = out;
+        partReq.dataLen = partSize;
+        ssize_t readSize = readBlockPart(partReq);
+        if (readSize != -EOPNOTSUPP) {
+          if (readSize < 0) {
+            result = readSize;
+            break;
+          }
+          result += readSize;
+          size -= readSize;
+          out += readSize;
+          ++blockNum;
+          partialOffset = 0;
+          if ((size_t)readSize < partSize) {
+            break;
+          }
+          continue;
+        }
+      }
+    }
+
     // if we're reading a full block, then read directly into the
-    // result buffer instead of using a temporary
+    // result buffer, otherwise copy the part needed from the cache
+    ssize_t readSize;
     if (partialOffset == 0 && size >= _blockSize) {
       blockReq.data = out;
+      readSize = cacheReadOneBlock(blockReq);
     } else {
-      if (mb.data == nullptr) {
-        mb = MemoryPool::allocate(_blockSize);
-      }
-      blockReq.data = mb.data;
+      readSize = cacheBlock(blockReq.offset);
     }
-
-    ssize_t readSize = cacheReadOneBlock(blockReq);
     if (readSize < 0) {
       result = readSize;
       break;
@@ -175,9 +308,8 @@ ssize_t BlockFileIO::read(const IORequest &req) const {
     size_t cpySize = min((size_t)readSize - (size_t)partialOffset, size);
     CHECK(cpySize <= (size_t)readSize);
 
-    // if we read to a temporary buffer, then move the data
     if (blockReq.data != out) {
-      memcpy(out, blockReq.data + partialOffset, cpySize);
+      memcpy(out, _cache.data + partialOffset, cpySize);
     }
 
     result += cpySize;
@@ -191,10 +323,6 @@ ssize_t BlockFileIO::read(const IORequest &req) const {
     }
   }
 
-  if (mb.data != nullptr) {
-    MemoryPool::release(mb);
-  }
-
   return result;
 }
 
@@ -248,8 +376,6 @@ ssize_t BlockFileIO::write(const IORequest &req) {
   }
 
   // have to merge data with existing block(s)..
-  MemBlock mb;
-
   IORequest blockReq;
   blockReq.data = nullptr;
   blockReq.dataLen = _blockSize;
@@ -259,8 +385,47 @@ ssize_t BlockFileIO::write(const IORequest &req) {
   unsigned char *inPtr = req.data;
   while (size != 0u) {
     blockReq.offset = blockNum * _blockSize;
+
+    // several whole blocks are handed down together
+    if (partialOffset == 0 && size >= 2 * (size_t)_blockSize) {
+      blockReq.data = inPtr;
+      blockReq.dataLen = size - size % _blockSize;
+      res = cacheWriteBlocks(blockReq);
+      if (res < 0) {
+        break;
+      }
+      size -= blockReq.dataLen;
+      inPtr += blockReq.dataLen;
+      blockNum += blockReq.dataLen / _blockSize;
+      continue;
+    }
     size_t toCopy = min((size_t)_blockSize - (size_t)partialOffset, size);
 
+    // a small change to a whole block of a large block size is written on
+    // its own, and merged into the cached block if there is one
+    if (toCopy < _blockSize && _blockSize >= PartialBlockSize &&
+        blockReq.offset + (off_t)_blockSize <= fileSize) {
+      IORequest partReq;
+      partReq.offset = blockReq.offset + partialOffset;
+      partReq.data = inPtr;
+      partReq.dataLen = toCopy;
+      res = writeBlockPart(partReq);
+      if (res != -EOPNOTSUPP) {
+        if (res < 0) {
+          break;
+        }
+        if (isCached(blockReq.offset)) {
+          memcpy(_cache.data + partialOffset, inPtr, toCopy);
+        }
+        size -= toCopy;
+        inPtr += toCopy;
+        ++blockNum;
+        partialOffset = 0;
+        continue;
+      }
+      res = 0;
+    }
+
     // if writing an entire block, or writing a partial block that requires
     // no merging with existing data..
     if ((toCopy == _blockSize) ||
@@ -269,31 +434,30 @@ ssize_t BlockFileIO::write(const IORequest &req) {
       blockReq.data = inPtr;
       blockReq.dataLen = toCopy;
     } else {
-      // need a temporary buffer, since we have to either merge or pad
-      // the data.
-      if (mb.data == nullptr) {
-        mb = MemoryPool::allocate(_blockSize);
-      }
-      memset(mb.data, 0, _blockSize);
-      blockReq.data = mb.data;
-
+      // the data is merged with the existing block, or padded, in the
+      // cache, and written from there
+      ssize_t readSize = 0;
       if (blockNum > lastNonEmptyBlock) {
         // just pad..
-        blockReq.dataLen = partialOffset + toCopy;
+        _cache.dataLen = 0;
       } else {
         // have to merge with existing block data..
-        blockReq.dataLen = _blockSize;
-        ssize_t readSize = cacheReadOneBlock(blockReq);
+        readSize = cacheBlock(blockReq.offset);
         if (readSize < 0) {
           res = readSize;
           break;
         }
-        blockReq.dataLen = readSize;
+      }
+      if (readSize < partialOffset) {
+        memset(_cache.data + readSize, 0, partialOffset - readSize);
+      }
+      blockReq.data = _cache.data;
+      blockReq.headroom = _cache.headroom;
 
-        // extend data if necessary..
-        if (partialOffset + toCopy > blockReq.dataLen) {
-          blockReq.dataLen = partialOffset + toCopy;
-        }
+      // extend data if necessary..
+      blockReq.dataLen = readSize;
+      if (partialOffset + toCopy > blockReq.dataLen) {
+        blockReq.dataLen = partialOffset + toCopy;
       }
       // merge in the data to be written..
       memcpy(blockReq.data + partialOffset, inPtr, toCopy);
@@ -306,16 +470,13 @@ ssize_t BlockFileIO::write(const IORequest &req) {
     }
 
     // prepare to start all over with the next block..
+    blockReq.headroom = 0;
     size -= toCopy;
     inPtr += toCopy;
     ++blockNum;
     partialOffset = 0;
   }
 
-  if (mb.data != nullptr) {
-    MemoryPool::release(mb);
-  }
-
   if (res < 0) {
     return res;
   }
@@ -379,15 +540,29 @@ int BlockFileIO::padFile(off_t oldSize, off_t newSize, bool forceWrite) {
       ++oldLastBlock;
     }
 
-    // 2, pad zero blocks unless holes are allowed
-    if (!_allowHoles) {
-      for (; (res >= 0) && (oldLastBlock != newLastBlock); ++oldLastBlock) {
-        VLOG(1) << "padding block " << oldLastBlock;
-        req.offset = oldLastBlock * _blockSize;
-        req.dataLen = _blockSize;
-        memset(mb.data, 0, req.dataLen);
-        res = cacheWriteOneBlock(req);
+    // 2, pad zero blocks unless holes are allowed.  writeBlocks() doesn't
+    // modify its input, so one buffer of zeros serves every batch.
+    if (!_allowHoles && (res >= 0) && (oldLastBlock != newLastBlock)) {
+      off_t batch = WriteBatchSize / _blockSize;
+      if (batch == 0) {
+        batch = 1;
+      }
+      off_t count = min(batch, newLastBlock - oldLastBlock);
+      MemBlock zeros = MemoryPool::allocate(count * _blockSize);
+      memset(zeros.data, 0, count * _blockSize);
+
+      IORequest padReq;
+      padReq.data = zeros.data;
+      while ((res >= 0) && (oldLastBlock != newLastBlock)) {
+        count = min(batch, newLastBlock - oldLastBlock);
+        VLOG(1) << "padding blocks " << oldLastBlock << " to "
+                << oldLastBlock + count - 1;
+        padReq.offset = oldLastBlock * _blockSize;
+        padReq.dataLen = count * _blockSize;
+        res = cacheWriteBlocks(padReq);
+        oldLastBlock += count;
       }
+      MemoryPool::release(zeros);
     }
 
     // 3. only necessary if write is forced and block is non 0 length
@@ -34,11 +34,19 @@ namespace encfs {
 
     When a partial block write is requested it will be turned into a read of
     the existing block, merge with the write request, and a write of the full
-    block.
+    block.  With large blocks, derived classes may handle partial block
+    requests on their own, see readBlockPart() / writeBlockPart().
+
+    Whole blocks are read and written straight from the caller's buffer.
+    The last block read or written is kept in a cache, which partial block
+    requests are merged in.  A derived class which puts a header in front of
+    each block can ask for headroom in front of the cached block, see
+    IORequest::headroom.
 */
 class BlockFileIO : public FileIO {
  public:
-  BlockFileIO(unsigned int blockSize, const FSConfigPtr &cfg);
+  BlockFileIO(unsigned int blockSize, const FSConfigPtr &cfg,
+              unsigned int headroom = 0);
   virtual ~BlockFileIO();
 
   // implemented in terms of blocks.
@@ -47,17 +55,45 @@ class BlockFileIO : public FileIO {
 
   virtual unsigned int blockSize() const;
 
+  // drops the cached block
+  virtual void release(bool closeFd);
+
  protected:
   int truncateBase(off_t size, FileIO *base);
   int padFile(off_t oldSize, off_t newSize, bool forceWrite);
 
   // same as read(), except that the request.offset field is guarenteed to be
   // block aligned, and the request size will not be larger then 1 block.
+  // writeOneBlock() must leave req.data untouched, though it may use the
+  // headroom in front of it.
   virtual ssize_t readOneBlock(const IORequest &req) const = 0;
   virtual ssize_t writeOneBlock(const IORequest &req) = 0;
 
+  // read or write a run of whole blocks, starting at a block aligned
+  // offset, so that derived classes can code them with one request to the
+  // next layer.  The read may be cut short by the end of the file.  req.data
+  // is left untouched by writes.  The defaults go one block at a time.
+  virtual ssize_t readBlocks(const IORequest &req) const;
+  virtual ssize_t writeBlocks(const IORequest &req);
+
+  // largest request readBlocks() / writeBlocks() implementations pass down
+  // at once
+  static const size_t WriteBatchSize = 1024 * 1024;
+
+  // read or write a range within one whole block of the file (not the
+  // partial block at its end), without coding all of the block.  Used for
+  // blocks of at least PartialBlockSize bytes.  Return -EOPNOTSUPP if that
+  // isn't possible, in which case the whole block is read or written.
+  virtual ssize_t readBlockPart(const IORequest &req) const;
+  virtual ssize_t writeBlockPart(const IORequest &req);
+
+  static const unsigned int PartialBlockSize = 16 * 1024;
+
+  bool isCached(off_t offset) const;
+  ssize_t cacheBlock(off_t offset) const;
   ssize_t cacheReadOneBlock(const IORequest &req) const;
   ssize_t cacheWriteOneBlock(const IORequest &req);
+  ssize_t cacheWriteBlocks(const IORequest &req);
 
   unsigned int _blockSize;
   bool _allowHoles;
@@ -20,6 +20,7 @@
 
 #include "BlockNameIO.h"
 
+#include <cerrno>
 #include <cstring>
 #include <memory>
 #include <utility>
@@ -197,13 +198,14 @@ int BlockNameIO::decodeName(const char *encodedName, int length, uint64_t *iv,
       _caseInsensitive ? B32ToB256Bytes(length) : B64ToB256Bytes(length);
   int decodedStreamLen = decLen256 - 2;
 
-  // don't bother trying to decode files which are too small
-  if (decodedStreamLen < _bs) {
+  // don't bother trying to decode files which are too small, or which
+  // don't hold whole cipher blocks (block coding always pads up to one)
+  if (decodedStreamLen < _bs || decodedStreamLen % _bs != 0) {
     VLOG(1) << "Rejecting filename " << encodedName;
-    throw Error("Filename too small to decode");
+    return -EINVAL;
   }
 
-  BUFFER_INIT(tmpBuf, 32, (unsigned int)length);
+  BUFFER_INIT(tmpBuf, 256, (unsigned int)length);
 
   // decode into tmpBuf,
   if (_caseInsensitive) {
@@ -227,7 +229,9 @@ int BlockNameIO::decodeName(const char *encodedName, int length, uint64_t *iv,
   ok = _cipher->blockDecode((unsigned char *)tmpBuf + 2, decodedStreamLen,
                             (uint64_t)mac ^ tmpIV, _key);
   if (!ok) {
-    throw Error("block decode failed in filename decode");
+    VLOG(1) << "block decode failed on " << encodedName;
+    BUFFER_RESET(tmpBuf);
+    return -EINVAL;
   }
 
   // find out true string length
@@ -238,7 +242,8 @@ int BlockNameIO::decodeName(const char *encodedName, int length, uint64_t *iv,
   if (padding > _bs || finalSize < 0) {
     VLOG(1) << "padding, _bx, finalSize = " << padding << ", " << _bs << ", "
             << finalSize;
-    throw Error("invalid padding size");
+    BUFFER_RESET(tmpBuf);
+    return -EINVAL;
   }
 
   // copy out the result..
@@ -255,7 +260,7 @@ int BlockNameIO::decodeName(const char *encodedName, int length, uint64_t *iv,
   if (mac2 != mac) {
     VLOG(1) << "checksum mismatch: expected " << mac << ", got " << mac2
             << " on decode of " << finalSize << " bytes";
-    throw Error("checksum mismatch in filename decode");
+    return -EBADMSG;
   }
 
   return finalSize;
@@ -19,6 +19,7 @@
  */
 
 #include <cstddef>
+#include <cstring>
 #include <iostream>
 #include <list>
 #include <map>
@@ -185,6 +186,60 @@ bool Cipher::nameDecode(unsigned char *data, int len, uint64_t iv64,
   return streamDecode(data, len, iv64, key);
 }
 
+bool Cipher::blockEncodeTo(const unsigned char *src, unsigned char *dst,
+                           int size, uint64_t iv64,
+                           const CipherKey &key) const {
+  memcpy(dst, src, size);
+  return blockEncode(dst, size, iv64, key);
+}
+
+bool Cipher::blockDecodeTo(const unsigned char *src, unsigned char *dst,
+                           int size, uint64_t iv64,
+                           const CipherKey &key) const {
+  memcpy(dst, src, size);
+  return blockDecode(dst, size, iv64, key);
+}
+
+bool Cipher::blockEncodeRun(const unsigned char *src, unsigned char *dst,
+                            int size, int count, uint64_t blockNum,
+                            uint64_t iv64, const CipherKey &key) const {
+  for (int i = 0; i < count; ++i, src += size, dst += size) {
+    bool ok = src == dst ? blockEncode(dst, size, (blockNum + i) ^ iv64, key)
+                         : blockEncodeTo(src, dst, size,
+                                         (blockNum + i) ^ iv64, key);
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Cipher::blockDecodeRun(const unsigned char *src, unsigned char *dst,
+                            int size, int count, uint64_t blockNum,
+                            uint64_t iv64, const CipherKey &key) const {
+  for (int i = 0; i < count; ++i, src += size, dst += size) {
+    bool ok = src == dst ? blockDecode(dst, size, (blockNum + i) ^ iv64, key)
+                         : blockDecodeTo(src, dst, size,
+                                         (blockNum + i) ^ iv64, key);
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Cipher::hasBlockParts() const { return false; }
+
+bool Cipher::blockEncodePart(unsigned char *, int, const unsigned char *,
+                             uint64_t, const CipherKey &) const {
+  return false;
+}
+
+bool Cipher::blockDecodePart(unsigned char *, int, const unsigned char *,
+                             uint64_t, const CipherKey &) const {
+  return false;
+}
+
 string Cipher::encodeAsString(const CipherKey &key,
                               const CipherKey &encodingKey) {
   int encodedKeySize = this->encodedKeySize();
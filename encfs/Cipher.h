@@ -151,6 +151,47 @@ class Cipher {
                            const CipherKey &key) const = 0;
   virtual bool blockDecode(unsigned char *buf, int size, uint64_t iv64,
                            const CipherKey &key) const = 0;
+
+  /*
+      Block coding from 'src' into 'dst', which don't overlap, so that data
+      can be coded from where it lies without changing it.  By default the
+      data is copied over and coded in-place.
+  */
+  virtual bool blockEncodeTo(const unsigned char *src, unsigned char *dst,
+                             int size, uint64_t iv64,
+                             const CipherKey &key) const;
+  virtual bool blockDecodeTo(const unsigned char *src, unsigned char *dst,
+                             int size, uint64_t iv64,
+                             const CipherKey &key) const;
+
+  /*
+      Block coding of a run of 'count' blocks of 'size' bytes each, from
+      'src' into 'dst', which are either the same or don't overlap.  Block i
+      of the run uses the IV (blockNum + i) ^ iv64, the way files number
+      their blocks.  By default each block is coded on its own.
+  */
+  virtual bool blockEncodeRun(const unsigned char *src, unsigned char *dst,
+                              int size, int count, uint64_t blockNum,
+                              uint64_t iv64, const CipherKey &key) const;
+  virtual bool blockDecodeRun(const unsigned char *src, unsigned char *dst,
+                              int size, int count, uint64_t blockNum,
+                              uint64_t iv64, const CipherKey &key) const;
+
+  /*
+      Block coding of a part of a block, for ciphers where each cipher block
+      only depends on the encoded one before it.  The part starts on a cipher
+      block boundary, and 'chain' is the encoded cipher block in front of it,
+      or null for a part at the start of the block.  The size must be a
+      multiple of the cipher block size.  Returns false if not supported, see
+      hasBlockParts().
+  */
+  virtual bool hasBlockParts() const;
+  virtual bool blockEncodePart(unsigned char *buf, int size,
+                               const unsigned char *chain, uint64_t iv64,
+                               const CipherKey &key) const;
+  virtual bool blockDecodePart(unsigned char *buf, int size,
+                               const unsigned char *chain, uint64_t iv64,
+                               const CipherKey &key) const;
 };
 
 }  // namespace encfs
@@ -21,6 +21,7 @@
 #include "CipherFileIO.h"
 
 #include "easylogging++.h"
+#include <algorithm>
 #include <cerrno>
 #include <cinttypes>
 #include <cstring>
@@ -35,6 +36,8 @@
 #include "CipherKey.h"
 #include "Error.h"
 #include "FileIO.h"
+#include "MemoryPool.h"
+#include "ZeroBlock.h"
 
 namespace encfs {
 
@@ -48,17 +51,24 @@ static Interface CipherFileIO_iface("FileIO/Cipher", 2, 0, 1);
 
 const int HEADER_SIZE = 8;  // 64 bit initialization vector..
 
+// with alignedHeader, the header is padded to a multiple of this size
+const int ALIGNED_HEADER_SIZE = 4096;
+
 CipherFileIO::CipherFileIO(std::shared_ptr<FileIO> _base,
                            const FSConfigPtr &cfg)
-    : BlockFileIO(cfg->config->blockSize, cfg),
+    : BlockFileIO(cfg->config->blockSize, cfg, headerSpace(cfg)),
       base(std::move(_base)),
       haveHeader(cfg->config->uniqueIV),
+      dataOffset(headerSpace(cfg)),
       externalIV(0),
       fileIV(0),
+      headerPending(false),
       lastFlags(0) {
   fsConfig = cfg;
   cipher = cfg->cipher;
   key = cfg->key;
+  decodeRunFn = _allowHoles ? &CipherFileIO::decodeRun<true>
+                            : &CipherFileIO::decodeRun<false>;
 
   CHECK_EQ(fsConfig->config->blockSize % fsConfig->cipher->cipherBlockSize(), 0)
       << "FS block size must be multiple of cipher block size";
@@ -78,6 +88,31 @@ int CipherFileIO::open(int flags) {
   return res;
 }
 
+int CipherFileIO::create(int flags, mode_t mode) {
+  int res = base->create(flags, mode);
+
+  if (res >= 0) {
+    lastFlags = flags;
+  }
+
+  return res;
+}
+
+/*
+    The IV of an existing file stays valid while the file is released, and
+    is what makes reusing the file cheap.  A header which was never written
+    is forgotten, a new header is made if the empty file is used again.
+*/
+void CipherFileIO::release(bool closeFd) {
+  BlockFileIO::release(closeFd);
+  base->release(closeFd);
+
+  if (headerPending) {
+    headerPending = false;
+    fileIV = 0;
+  }
+}
+
 void CipherFileIO::setFileName(const char *fileName) {
   base->setFileName(fileName);
 }
@@ -137,22 +172,46 @@ int CipherFileIO::getAttr(struct stat *stbuf) const {
   // stat() the backing file
   int res = base->getAttr(stbuf);
 
+  if (res == 0) {
+    adjustAttr(fsConfig, stbuf);
+  }
+
+  return res;
+}
+
+/*
+    Space taken by the header in front of the data in the backing file.  With
+    alignedHeader, the header is padded so that the data blocks start on a
+    page boundary.  The padding is not used, and reads back as 0's.
+*/
+int CipherFileIO::headerSpace(const FSConfigPtr &cfg) {
+  if (!cfg->config->uniqueIV) {
+    return 0;
+  }
+  if (cfg->config->alignedHeader && !cfg->reverseEncryption) {
+    int size = std::max(cfg->config->blockSize, HEADER_SIZE);
+    return ((size + ALIGNED_HEADER_SIZE - 1) / ALIGNED_HEADER_SIZE) *
+           ALIGNED_HEADER_SIZE;
+  }
+  return HEADER_SIZE;
+}
+
+void CipherFileIO::adjustAttr(const FSConfigPtr &cfg, struct stat *stbuf) {
   // adjust size if we have a file header
-  if ((res == 0) && haveHeader && S_ISREG(stbuf->st_mode) &&
+  if (cfg->config->uniqueIV && S_ISREG(stbuf->st_mode) &&
       (stbuf->st_size > 0)) {
-    if (!fsConfig->reverseEncryption) {
+    if (!cfg->reverseEncryption) {
       /* In normal mode, the upper file (plaintext) is smaller
-       * than the backing ciphertext file */
+       * than the backing ciphertext file.  A file which has only its
+       * header is empty. */
       rAssert(stbuf->st_size >= HEADER_SIZE);
-      stbuf->st_size -= HEADER_SIZE;
+      stbuf->st_size = std::max(stbuf->st_size - headerSpace(cfg), (off_t)0);
     } else {
       /* In reverse mode, the upper file (ciphertext) is larger than
        * the backing plaintext file */
       stbuf->st_size += HEADER_SIZE;
     }
   }
-
-  return res;
 }
 
 /**
@@ -166,7 +225,7 @@ off_t CipherFileIO::getSize() const {
   if (haveHeader && size > 0) {
     if (!fsConfig->reverseEncryption) {
       rAssert(size >= HEADER_SIZE);
-      size -= HEADER_SIZE;
+      size = std::max(size - dataOffset, (off_t)0);
     } else {
       size += HEADER_SIZE;
     }
@@ -181,27 +240,10 @@ int CipherFileIO::initHeader() {
   if (rawSize >= HEADER_SIZE) {
     VLOG(1) << "reading existing header, rawSize = " << rawSize;
     // has a header.. read it
-    unsigned char buf[8] = {0};
-
-    IORequest req;
-    req.offset = 0;
-    req.data = buf;
-    req.dataLen = 8;
-    ssize_t readSize = base->read(req);
-    if (readSize < 0) {
-      return readSize;
-    }
-
-    if (!cipher->streamDecode(buf, sizeof(buf), externalIV, key)) {
-      return -EBADMSG;
-    }
-
-    fileIV = 0;
-    for (int i = 0; i < 8; ++i) {
-      fileIV = (fileIV << 8) | (uint64_t)buf[i];
+    int res = readHeader();
+    if (res < 0) {
+      return res;
     }
-
-    rAssert(fileIV != 0);  // 0 is never used..
   } else {
     VLOG(1) << "creating new file IV header";
 
@@ -223,19 +265,9 @@ int CipherFileIO::initHeader() {
     } while (fileIV == 0);  // don't accept 0 as an option..
 
     if (base->isWritable()) {
-      if (!cipher->streamEncode(buf, sizeof(buf), externalIV, key)) {
-        return -EBADMSG;
-      }
-
-      IORequest req;
-      req.offset = 0;
-      req.data = buf;
-      req.dataLen = 8;
-
-      ssize_t writeSize = base->write(req);
-      if (writeSize < 0) {
-        return writeSize;
-      }
+      // The header is written by the first block write, saving a syscall.
+      // Until then the file stays empty, which is a valid empty file.
+      headerPending = true;
     } else {
       VLOG(1) << "base not writable, IV not written..";
     }
@@ -244,28 +276,160 @@ int CipherFileIO::initHeader() {
   return 0;
 }
 
-bool CipherFileIO::writeHeader() {
-  if (fileIV == 0) {
-    RLOG(ERROR) << "Internal error: fileIV == 0 in writeHeader!!!";
+// read the header of a file which is known to have one
+int CipherFileIO::readHeader() {
+  unsigned char buf[HEADER_SIZE] = {0};
+
+  IORequest req;
+  req.offset = 0;
+  req.data = buf;
+  req.dataLen = HEADER_SIZE;
+  ssize_t readSize = base->read(req);
+  if (readSize < 0) {
+    return readSize;
   }
-  VLOG(1) << "writing fileIV " << fileIV;
 
-  unsigned char buf[8] = {0};
-  for (int i = 0; i < 8; ++i) {
-    buf[sizeof(buf) - 1 - i] = (unsigned char)(fileIV & 0xff);
-    fileIV >>= 8;
+  return decodeHeader(buf);
+}
+
+// set fileIV from the on-disk form of the header
+int CipherFileIO::decodeHeader(unsigned char *buf) {
+  if (!cipher->streamDecode(buf, HEADER_SIZE, externalIV, key)) {
+    return -EBADMSG;
+  }
+
+  fileIV = 0;
+  for (int i = 0; i < HEADER_SIZE; ++i) {
+    fileIV = (fileIV << 8) | (uint64_t)buf[i];
+  }
+
+  rAssert(fileIV != 0);  // 0 is never used..
+  return 0;
+}
+
+/*
+    First read of block 0: read the header along with the block, instead of
+    stat'ing the file and reading the header separately.  Returns the amount
+    of block data read.  The header is read into the headroom of the
+    request if there is enough of it.
+*/
+ssize_t CipherFileIO::readWithHeader(const IORequest &req) {
+  bool inPlace = req.headroom >= (size_t)dataOffset;
+  MemBlock mb;
+
+  IORequest tmpReq;
+  tmpReq.offset = 0;
+  if (inPlace) {
+    tmpReq.data = req.data - dataOffset;
+    tmpReq.headroom = req.headroom - dataOffset;
+  } else {
+    mb = MemoryPool::allocate(dataOffset + req.dataLen);
+    tmpReq.data = mb.data;
   }
+  tmpReq.dataLen = dataOffset + req.dataLen;
+  ssize_t readSize = base->read(tmpReq);
 
-  if (!cipher->streamEncode(buf, sizeof(buf), externalIV, key)) {
+  if (readSize >= HEADER_SIZE) {
+    int res = decodeHeader(tmpReq.data);
+    if (res < 0) {
+      readSize = res;
+    } else {
+      readSize = std::max(readSize - dataOffset, (ssize_t)0);
+      if (!inPlace) {
+        memcpy(req.data, mb.data + dataOffset, readSize);
+      }
+    }
+  } else if (readSize > 0) {
+    // too short to have a header, so there is no data either
+    readSize = 0;
+  }
+
+  if (mb.data != nullptr) {
+    MemoryPool::release(mb);
+  }
+  return readSize;
+}
+
+bool CipherFileIO::writeHeader() {
+  VLOG(1) << "writing fileIV " << fileIV;
+
+  unsigned char buf[HEADER_SIZE];
+  if (!encodeHeader(buf)) {
     return false;
   }
 
   IORequest req;
   req.offset = 0;
   req.data = buf;
-  req.dataLen = 8;
+  req.dataLen = HEADER_SIZE;
 
-  return (base->write(req) >= 0);
+  if (base->write(req) < 0) {
+    return false;
+  }
+  headerPending = false;
+  return true;
+}
+
+// fill buf with the encrypted on-disk form of fileIV
+bool CipherFileIO::encodeHeader(unsigned char *buf) const {
+  if (fileIV == 0) {
+    RLOG(ERROR) << "Internal error: fileIV == 0 in writeHeader!!!";
+  }
+
+  uint64_t iv = fileIV;
+  for (int i = 0; i < HEADER_SIZE; ++i) {
+    buf[HEADER_SIZE - 1 - i] = (unsigned char)(iv & 0xff);
+    iv >>= 8;
+  }
+
+  return cipher->streamEncode(buf, HEADER_SIZE, externalIV, key);
+}
+
+// Write the pending header together with an encoded block.  Blocks are
+// written in order from the start of a new file (BlockFileIO pads the file
+// first), so this is normally the first block and takes one syscall.  The
+// header goes into the headroom of the request if there is enough of it.
+ssize_t CipherFileIO::writeWithHeader(const IORequest &req) {
+  if (req.offset != 0) {
+    if (!writeHeader()) {
+      return -EIO;
+    }
+    IORequest tmpReq = req;
+    tmpReq.offset += dataOffset;
+    return base->write(tmpReq);
+  }
+
+  bool inPlace = req.headroom >= (size_t)dataOffset;
+  MemBlock mb;
+
+  IORequest tmpReq;
+  tmpReq.offset = 0;
+  if (inPlace) {
+    tmpReq.data = req.data - dataOffset;
+    tmpReq.headroom = req.headroom - dataOffset;
+  } else {
+    mb = MemoryPool::allocate(dataOffset + req.dataLen);
+    tmpReq.data = mb.data;
+  }
+  tmpReq.dataLen = dataOffset + req.dataLen;
+
+  ssize_t res = -EBADMSG;
+  if (encodeHeader(tmpReq.data)) {
+    memset(tmpReq.data + HEADER_SIZE, 0, dataOffset - HEADER_SIZE);
+    if (!inPlace) {
+      memcpy(mb.data + dataOffset, req.data, req.dataLen);
+    }
+
+    res = base->write(tmpReq);
+    if (res >= 0) {
+      headerPending = false;
+      res = req.dataLen;
+    }
+  }
+  if (mb.data != nullptr) {
+    MemoryPool::release(mb);
+  }
+  return res;
 }
 
 /**
@@ -331,16 +495,49 @@ ssize_t CipherFileIO::readOneBlock(const IORequest &req) const {
 
   IORequest tmpReq = req;
 
-  // adjust offset if we have a file header
-  if (haveHeader && !fsConfig->reverseEncryption) {
-    tmpReq.offset += HEADER_SIZE;
+  ssize_t readSize;
+  bool needHeader = haveHeader && fileIV == 0;
+  if (needHeader && !fsConfig->reverseEncryption && req.offset == 0) {
+    readSize = const_cast<CipherFileIO *>(this)->readWithHeader(tmpReq);
+    needHeader = false;
+  } else {
+    // adjust offset if we have a file header
+    if (haveHeader && !fsConfig->reverseEncryption) {
+      tmpReq.offset += dataOffset;
+    }
+    if (_allowHoles && !fsConfig->reverseEncryption &&
+        tmpReq.dataLen == (size_t)bs &&
+        base->isHole(tmpReq.offset, tmpReq.dataLen)) {
+      // a block of 0's is passed through as-is, no need to read it
+      memset(tmpReq.data, 0, bs);
+      return bs;
+    }
+    if (!needHeader && !fsConfig->reverseEncryption) {
+      // decode the block from where the base layer keeps it, if it can
+      readSize = base->readMapped(
+          tmpReq.offset, tmpReq.dataLen,
+          [&](const unsigned char *src, size_t len) {
+            if (!readFrom(src, tmpReq.data, (int)len, blockNum ^ fileIV)) {
+              VLOG(1) << "decodeBlock failed for block " << blockNum
+                      << ", size " << len;
+              return -EBADMSG;
+            }
+            return 0;
+          });
+      if (readSize != -EOPNOTSUPP) {
+        return readSize;
+      }
+    }
+    readSize = base->read(tmpReq);
   }
-  ssize_t readSize = base->read(tmpReq);
 
   bool ok;
   if (readSize > 0) {
-    if (haveHeader && fileIV == 0) {
-      int res = const_cast<CipherFileIO *>(this)->initHeader();
+    if (needHeader) {
+      // there is data after the header, so no need to check the file size
+      int res = fsConfig->reverseEncryption
+                    ? const_cast<CipherFileIO *>(this)->initHeader()
+                    : const_cast<CipherFileIO *>(this)->readHeader();
       if (res < 0) {
         return res;
       }
@@ -387,34 +584,413 @@ ssize_t CipherFileIO::writeOneBlock(const IORequest &req) {
     }
   }
 
+  if (storeAsHole(req.data, req.dataLen)) {
+    ssize_t res = writeHole(req.offset, bs);
+    if (res != -EOPNOTSUPP) {
+      return res < 0 ? res : (ssize_t)bs;
+    }
+  }
+
+  // the block is encoded into a buffer of its own, with room for the header
+  // in front of it
+  MemBlock mb = MemoryPool::allocate(dataOffset + req.dataLen);
+  IORequest tmpReq;
+  tmpReq.offset = req.offset;
+  tmpReq.data = mb.data + dataOffset;
+  tmpReq.dataLen = req.dataLen;
+  tmpReq.headroom = dataOffset;
+
   bool ok;
   if (req.dataLen != bs) {
-    ok = streamWrite(req.data, (int)req.dataLen,
+    memcpy(tmpReq.data, req.data, req.dataLen);
+    ok = streamWrite(tmpReq.data, (int)req.dataLen,
                      blockNum ^ fileIV);  // cast works because we work on a
                                           // block and blocksize fit an int
   } else {
-    ok = blockWrite(req.data, (int)req.dataLen,
-                    blockNum ^ fileIV);  // cast works because we work on a
-                                         // block and blocksize fit an int
+    ok = writeTo(req.data, tmpReq.data, (int)req.dataLen,
+                 blockNum ^ fileIV);  // cast works because we work on a
+                                      // block and blocksize fit an int
   }
 
   ssize_t res = 0;
   if (ok) {
-    if (haveHeader) {
-      IORequest tmpReq = req;
-      tmpReq.offset += HEADER_SIZE;
-      res = base->write(tmpReq);
+    if (headerPending) {
+      res = writeWithHeader(tmpReq);
     } else {
-      res = base->write(req);
+      if (haveHeader) {
+        tmpReq.offset += dataOffset;
+      }
+      res = base->write(tmpReq);
     }
   } else {
     VLOG(1) << "encodeBlock failed for block " << blockNum << ", size "
             << req.dataLen;
     res = -EBADMSG;
   }
+  MemoryPool::release(mb);
+  return res;
+}
+
+/*
+    Same as readOneBlock, for a run of whole blocks, which are read with one
+    request and decoded together.  Reverse mode, and finding the header of a
+    file anywhere but at its start, is left to readOneBlock.
+    Longer runs are read in chunks, each one started before the one in front
+    of it is decoded, so that the backing file is read while decoding.
+*/
+ssize_t CipherFileIO::readBlocks(const IORequest &req) const {
+  bool needHeader = haveHeader && fileIV == 0;
+  if (fsConfig->reverseEncryption || (needHeader && req.offset != 0)) {
+    return BlockFileIO::readBlocks(req);
+  }
+
+  off_t blockNum = req.offset / blockSize();
+  ssize_t readSize;
+  if (needHeader) {
+    readSize = const_cast<CipherFileIO *>(this)->readWithHeader(req);
+  } else {
+    IORequest tmpReq = req;
+    if (haveHeader) {
+      tmpReq.offset += dataOffset;
+    }
+    if (_allowHoles && base->isHole(tmpReq.offset, tmpReq.dataLen)) {
+      memset(req.data, 0, req.dataLen);
+      return req.dataLen;
+    }
+    readSize = base->readMapped(
+        tmpReq.offset, tmpReq.dataLen,
+        [&](const unsigned char *src, size_t len) {
+          return readRun(src, req.data, len, blockNum) ? 0 : -EBADMSG;
+        });
+    if (readSize != -EOPNOTSUPP) {
+      return readSize;
+    }
+    if (tmpReq.dataLen > ReadChunkSize) {
+      return readChunks(tmpReq, req.data, blockNum);
+    }
+    readSize = base->read(tmpReq);
+  }
+
+  if (readSize > 0 && !readRun(req.data, req.data, readSize, blockNum)) {
+    VLOG(1) << "decodeBlock failed for blocks from " << blockNum << ", size "
+            << readSize;
+    readSize = -EBADMSG;
+  }
+  return readSize;
+}
+
+/*
+    Read a run from the backing file into buf, at most ReadChunkSize bytes at
+    a time, and decode it.  The read of the next chunk is started before the
+    current one is decoded, and waited for before this returns.  Where reads
+    can't be started in the background, the rest of the run is read at once.
+*/
+ssize_t CipherFileIO::readChunks(const IORequest &req, unsigned char *buf,
+                                 off_t blockNum) const {
+  unsigned int bs = blockSize();
+  size_t chunk = std::max((size_t)1, ReadChunkSize / bs) * bs;
+
+  IORequest part = req;
+  part.data = buf;
+  part.dataLen = std::min(chunk, req.dataLen);
+  bool started = base->startRead(part) == 0;
+  if (!started) {
+    part.dataLen = req.dataLen;
+  }
+
+  size_t done = 0;
+  while (true) {
+    ssize_t readSize = started ? base->waitRead() : base->read(part);
+    if (readSize < 0) {
+      return readSize;
+    }
+
+    size_t next = done + readSize;
+    bool more = (size_t)readSize == part.dataLen && next < req.dataLen;
+    if (more) {
+      part.offset = req.offset + next;
+      part.data = buf + next;
+      part.dataLen = std::min(chunk, req.dataLen - next);
+      started = base->startRead(part) == 0;
+      if (!started) {
+        part.dataLen = req.dataLen - next;
+      }
+    }
+
+    if (readSize > 0 &&
+        !readRun(buf + done, buf + done, readSize, blockNum + done / bs)) {
+      VLOG(1) << "decodeBlock failed for blocks from " << blockNum + done / bs
+              << ", size " << readSize;
+      if (more && started) {
+        base->waitRead();
+      }
+      return -EBADMSG;
+    }
+    done = next;
+    if (!more) {
+      return done;
+    }
+  }
+}
+
+/*
+    Same as writeOneBlock, for a run of whole blocks.  The blocks are
+    encrypted into a scratch buffer, with room for the header in front of
+    it, and written with one call per batch.
+    Two buffers take turns, so that a batch can be encrypted while the one
+    before it is still being written, where the backing file supports that.
+*/
+ssize_t CipherFileIO::writeBlocks(const IORequest &req) {
+  if (haveHeader && fsConfig->reverseEncryption) {
+    VLOG(1)
+        << "writing to a reverse mount with per-file IVs is not implemented";
+    return -EPERM;
+  }
+
+  if (haveHeader && fileIV == 0) {
+    int res = initHeader();
+    if (res < 0) {
+      return res;
+    }
+  }
+
+  unsigned int bs = blockSize();
+  size_t batch = std::max((size_t)1, (size_t)WriteBatchSize / bs) * bs;
+
+  MemBlock mb[2];
+  int current = 0;
+  ssize_t res = 0;
+  size_t done = 0;
+  while (done < req.dataLen) {
+    size_t len = std::min(batch, req.dataLen - done);
+
+    // runs of 0 blocks become holes, the rest is encrypted up to the next
+    // such run
+    size_t zeros = 0;
+    while (zeros < len && storeAsHole(req.data + done + zeros, bs)) {
+      zeros += bs;
+    }
+    if (zeros > 0) {
+      res = base->waitWrites();
+      if (res < 0) {
+        break;
+      }
+      res = writeHole(req.offset + done, zeros);
+      if (res >= 0) {
+        done += zeros;
+        continue;
+      }
+      if (res != -EOPNOTSUPP) {
+        break;
+      }
+      res = 0;
+    } else if (_allowHoles) {
+      size_t dataLen = bs;
+      while (dataLen < len && !isZeroBlock(req.data + done + dataLen, bs)) {
+        dataLen += bs;
+      }
+      len = dataLen;
+    }
+
+    if (mb[current].data == nullptr) {
+      mb[current] = MemoryPool::allocate(
+          dataOffset + std::min(batch, req.dataLen - done));
+    }
+
+    IORequest tmpReq;
+    tmpReq.offset = req.offset + done;
+    tmpReq.data = mb[current].data + dataOffset;
+    tmpReq.dataLen = len;
+    tmpReq.headroom = dataOffset;
+
+    off_t blockNum = tmpReq.offset / bs;
+    if (!writeRun(req.data + done, tmpReq.data, len, blockNum)) {
+      VLOG(1) << "encodeBlock failed for blocks from " << blockNum;
+      res = -EBADMSG;
+      break;
+    }
+
+    // the other buffer is free again once its batch is written
+    res = base->waitWrites();
+    if (res < 0) {
+      break;
+    }
+    if (headerPending) {
+      res = writeWithHeader(tmpReq);
+    } else {
+      if (haveHeader) {
+        tmpReq.offset += dataOffset;
+      }
+      res = base->startWrite(tmpReq);
+    }
+    if (res < 0) {
+      break;
+    }
+    done += len;
+    current = 1 - current;
+  }
+
+  int waitRes = base->waitWrites();
+  if (res >= 0 && waitRes < 0) {
+    res = waitRes;
+  }
+  for (MemBlock &block : mb) {
+    if (block.data != nullptr) {
+      MemoryPool::release(block);
+    }
+  }
+  return res < 0 ? res : (ssize_t)req.dataLen;
+}
+
+// Blocks are encoded when reading in reverse mode, which is left to
+// readOneBlock.
+bool CipherFileIO::codesBlockParts() const {
+  return !fsConfig->reverseEncryption && cipher->hasBlockParts();
+}
+
+/*
+    Read the cipher blocks covering the request, along with the encoded
+    cipher block in front of them which the decoding continues from.
+*/
+ssize_t CipherFileIO::readBlockPart(const IORequest &req) const {
+  if (!codesBlockParts()) {
+    return -EOPNOTSUPP;
+  }
+  if (haveHeader && fileIV == 0) {
+    // there is a whole block, so there is a header
+    int res = const_cast<CipherFileIO *>(this)->readHeader();
+    if (res < 0) {
+      return res;
+    }
+  }
+
+  int bs = blockSize();
+  int cbs = cipher->cipherBlockSize();
+  off_t blockNum = req.offset / bs;
+  int offset = req.offset % bs;
+  int start = offset - offset % cbs;
+  int end = std::min(bs, (int)((offset + req.dataLen + cbs - 1) / cbs * cbs));
+  int chain = start > 0 ? cbs : 0;
+
+  MemBlock mb = MemoryPool::allocate(chain + end - start);
+  IORequest tmpReq;
+  tmpReq.offset = blockNum * bs + start - chain;
+  if (haveHeader) {
+    tmpReq.offset += dataOffset;
+  }
+  tmpReq.data = mb.data;
+  tmpReq.dataLen = chain + end - start;
+
+  ssize_t res = base->read(tmpReq);
+  if (res == (ssize_t)tmpReq.dataLen) {
+    // a part of a 0 block (see blockRead) is passed through as-is
+    if (!(_allowHoles && isZeroBlock(mb.data, tmpReq.dataLen)) &&
+        !cipher->blockDecodePart(mb.data + chain, end - start,
+                                 chain != 0 ? mb.data : nullptr,
+                                 blockNum ^ fileIV, key)) {
+      VLOG(1) << "decodeBlock failed for block " << blockNum << ", part "
+              << start << " - " << end;
+      res = -EBADMSG;
+    } else {
+      memcpy(req.data, mb.data + chain + offset - start, req.dataLen);
+      res = req.dataLen;
+    }
+  } else if (res >= 0) {
+    // the file got shorter
+    res = -EOPNOTSUPP;
+  }
+
+  MemoryPool::release(mb);
   return res;
 }
 
+/*
+    CBC encoding of a cipher block changes everything after it in the block,
+    so the block is decoded, merged and encoded again from the first changed
+    cipher block on.
+*/
+ssize_t CipherFileIO::writeBlockPart(const IORequest &req) {
+  if (!codesBlockParts()) {
+    return -EOPNOTSUPP;
+  }
+  if (haveHeader && fileIV == 0) {
+    int res = readHeader();
+    if (res < 0) {
+      return res;
+    }
+  }
+  if (headerPending) {
+    return -EOPNOTSUPP;
+  }
+
+  int bs = blockSize();
+  int cbs = cipher->cipherBlockSize();
+  off_t blockNum = req.offset / bs;
+  int offset = req.offset % bs;
+  int start = offset - offset % cbs;
+  int chain = start > 0 ? cbs : 0;
+
+  MemBlock mb = MemoryPool::allocate(chain + bs - start);
+  IORequest tmpReq;
+  tmpReq.offset = blockNum * bs + start - chain;
+  if (haveHeader) {
+    tmpReq.offset += dataOffset;
+  }
+  tmpReq.data = mb.data;
+  tmpReq.dataLen = chain + bs - start;
+
+  ssize_t res = base->read(tmpReq);
+  if (res == (ssize_t)tmpReq.dataLen) {
+    const unsigned char *chainData = chain != 0 ? mb.data : nullptr;
+    if (_allowHoles && isZeroBlock(mb.data, tmpReq.dataLen)) {
+      // may be a 0 block, which is only known when reading all of it
+      res = -EOPNOTSUPP;
+    } else if (!cipher->blockDecodePart(mb.data + chain, bs - start,
+                                        chainData, blockNum ^ fileIV, key)) {
+      VLOG(1) << "decodeBlock failed for block " << blockNum;
+      res = -EBADMSG;
+    } else {
+      memcpy(mb.data + chain + offset - start, req.data, req.dataLen);
+      if (!cipher->blockEncodePart(mb.data + chain, bs - start, chainData,
+                                   blockNum ^ fileIV, key)) {
+        VLOG(1) << "encodeBlock failed for block " << blockNum;
+        res = -EBADMSG;
+      } else {
+        tmpReq.offset += chain;
+        tmpReq.data += chain;
+        tmpReq.dataLen -= chain;
+        res = base->write(tmpReq);
+      }
+    }
+  } else if (res >= 0) {
+    res = -EOPNOTSUPP;
+  }
+
+  MemoryPool::release(mb);
+  return res < 0 ? res : (ssize_t)req.dataLen;
+}
+
+// 0 blocks are stored as holes, which read back as 0's
+bool CipherFileIO::storeAsHole(const unsigned char *buf, size_t size) const {
+  return _allowHoles && !fsConfig->reverseEncryption && size == blockSize() &&
+         isZeroBlock(buf, size);
+}
+
+/*
+    Turn a block aligned range into a hole.  Returns -EOPNOTSUPP if the
+    backing file can't have holes punched into it, in which case the data is
+    written as usual.
+*/
+ssize_t CipherFileIO::writeHole(off_t offset, size_t length) {
+  if (headerPending && !writeHeader()) {
+    return -EIO;
+  }
+  if (haveHeader) {
+    offset += dataOffset;
+  }
+  return base->punchHole(offset, length);
+}
+
 bool CipherFileIO::blockWrite(unsigned char *buf, int size,
                               uint64_t _iv64) const {
   VLOG(1) << "Called blockWrite";
@@ -433,19 +1009,35 @@ bool CipherFileIO::streamWrite(unsigned char *buf, int size,
   return cipher->streamDecode(buf, size, _iv64, key);
 }
 
+// blockWrite() of a block held elsewhere, into buf
+bool CipherFileIO::writeTo(const unsigned char *src, unsigned char *buf,
+                           int size, uint64_t _iv64) const {
+  if (fsConfig->reverseEncryption) {
+    memcpy(buf, src, size);
+    return blockWrite(buf, size, _iv64);
+  }
+  return cipher->blockEncodeTo(src, buf, size, _iv64, key);
+}
+
+// blockWrite() of a run of whole blocks held elsewhere, into buf
+bool CipherFileIO::writeRun(const unsigned char *src, unsigned char *buf,
+                            size_t len, off_t blockNum) const {
+  int bs = blockSize();
+  if (fsConfig->reverseEncryption) {
+    return cipher->blockDecodeRun(src, buf, bs, (int)(len / bs), blockNum,
+                                  fileIV, key);
+  }
+  return cipher->blockEncodeRun(src, buf, bs, (int)(len / bs), blockNum,
+                                fileIV, key);
+}
+
 bool CipherFileIO::blockRead(unsigned char *buf, int size,
                              uint64_t _iv64) const {
   if (fsConfig->reverseEncryption) {
     return cipher->blockEncode(buf, size, _iv64, key);
   }
-  if (_allowHoles) {
+  if (_allowHoles && isZeroBlock(buf, size)) {
     // special case - leave all 0's alone
-    for (int i = 0; i < size; ++i) {
-      if (buf[i] != 0) {
-        return cipher->blockDecode(buf, size, _iv64, key);
-      }
-    }
-
     return true;
   }
   return cipher->blockDecode(buf, size, _iv64, key);
@@ -459,6 +1051,75 @@ bool CipherFileIO::streamRead(unsigned char *buf, int size,
   return cipher->streamDecode(buf, size, _iv64, key);
 }
 
+// blockRead() / streamRead() of a block held elsewhere, into buf
+bool CipherFileIO::readFrom(const unsigned char *src, unsigned char *buf,
+                            int size, uint64_t _iv64) const {
+  if (size != (int)blockSize() || fsConfig->reverseEncryption) {
+    memcpy(buf, src, size);
+    return size == (int)blockSize() ? blockRead(buf, size, _iv64)
+                                    : streamRead(buf, size, _iv64);
+  }
+  if (_allowHoles && isZeroBlock(src, size)) {
+    memset(buf, 0, size);
+    return true;
+  }
+  return cipher->blockDecodeTo(src, buf, size, _iv64, key);
+}
+
+// readFrom() of a run of whole blocks, which may end with the partial block
+// at the end of the file.  src and buf may be the same.
+bool CipherFileIO::readRun(const unsigned char *src, unsigned char *buf,
+                           size_t len, off_t blockNum) const {
+  int bs = blockSize();
+  size_t whole = len - len % bs;
+  if (whole > 0 && !(this->*decodeRunFn)(src, buf, whole, blockNum)) {
+    return false;
+  }
+  if (whole == len) {
+    return true;
+  }
+  if (src != buf) {
+    memcpy(buf + whole, src + whole, len - whole);
+  }
+  return streamRead(buf + whole, (int)(len - whole),
+                    (blockNum + whole / bs) ^ fileIV);
+}
+
+/*
+    Decode whole blocks, with the cipher coding as many of them at once as
+    it can.  With holes allowed, 0 blocks are passed through as-is (see
+    blockRead), which splits the runs.
+*/
+template <bool Holes>
+bool CipherFileIO::decodeRun(const unsigned char *src, unsigned char *buf,
+                             size_t len, off_t blockNum) const {
+  size_t bs = blockSize();
+  size_t pos = 0;
+  while (pos < len) {
+    size_t end = len;
+    if (Holes) {
+      if (isZeroBlock(src + pos, bs)) {
+        if (src != buf) {
+          memset(buf + pos, 0, bs);
+        }
+        pos += bs;
+        continue;
+      }
+      end = pos + bs;
+      while (end < len && !isZeroBlock(src + end, bs)) {
+        end += bs;
+      }
+    }
+    if (!cipher->blockDecodeRun(src + pos, buf + pos, bs,
+                                (int)((end - pos) / bs), blockNum + pos / bs,
+                                fileIV, key)) {
+      return false;
+    }
+    pos = end;
+  }
+  return true;
+}
+
 int CipherFileIO::truncate(off_t size) {
   int res = 0;
   int reopen = 0;
@@ -480,13 +1141,16 @@ int CipherFileIO::truncate(off_t size) {
       // empty file.. create the header..
       res = initHeader();
     }
+    if (res == 0 && headerPending && !writeHeader()) {
+      res = -EIO;
+    }
     // can't let BlockFileIO call base->truncate(), since it would be using
     // the wrong size..
     if (res == 0) {
       res = BlockFileIO::truncateBase(size, nullptr);
     }
     if (res == 0) {
-      res = base->truncate(size + HEADER_SIZE);
+      res = base->truncate(size + dataOffset);
     }
   }
   if (reopen == 1) {
@@ -557,6 +1221,7 @@ ssize_t CipherFileIO::read(const IORequest &origReq) const {
     rAssert(req.offset == 0);
     req.data += headerBytes;
     req.dataLen -= headerBytes;
+    req.headroom = 0;
   }
 
   // read the payload
@@ -571,6 +1236,13 @@ ssize_t CipherFileIO::read(const IORequest &origReq) const {
   return sum;
 }
 
+int CipherFileIO::allocate(off_t offset, off_t length) {
+  if (haveHeader) {
+    offset += dataOffset;
+  }
+  return base->allocate(offset, length);
+}
+
 bool CipherFileIO::isWritable() const { return base->isWritable(); }
 
 }  // namespace encfs
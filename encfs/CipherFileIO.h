@@ -55,24 +55,63 @@ class CipherFileIO : public BlockFileIO {
   virtual bool setIV(uint64_t iv);
 
   virtual int open(int flags);
+  virtual int create(int flags, mode_t mode);
+  virtual void release(bool closeFd);
 
   virtual int getAttr(struct stat *stbuf) const;
   virtual off_t getSize() const;
 
+  // adjust the stat() of a backing file to the size seen through this layer
+  static void adjustAttr(const FSConfigPtr &cfg, struct stat *stbuf);
+
+  // bytes in front of the data in a backing file
+  static int headerSpace(const FSConfigPtr &cfg);
+
   virtual int truncate(off_t size);
+  virtual int allocate(off_t offset, off_t length);
 
   virtual bool isWritable() const;
 
+  // longest read of the backing file in readBlocks() when reads can be
+  // started in the background, the rest of a run is read while this much
+  // is decoded
+  static const size_t ReadChunkSize = 128 * 1024;
+
  private:
   virtual ssize_t readOneBlock(const IORequest &req) const;
   virtual ssize_t writeOneBlock(const IORequest &req);
+  virtual ssize_t readBlocks(const IORequest &req) const;
+  virtual ssize_t writeBlocks(const IORequest &req);
+  virtual ssize_t readBlockPart(const IORequest &req) const;
+  ssize_t readChunks(const IORequest &req, unsigned char *buf,
+                     off_t blockNum) const;
+  virtual ssize_t writeBlockPart(const IORequest &req);
   virtual int generateReverseHeader(unsigned char *data);
 
   int initHeader();
+  int readHeader();
+  int decodeHeader(unsigned char *buf);
+  ssize_t readWithHeader(const IORequest &req);
   bool writeHeader();
+  bool encodeHeader(unsigned char *buf) const;
+  ssize_t writeWithHeader(const IORequest &req);
+  bool codesBlockParts() const;
+  bool storeAsHole(const unsigned char *buf, size_t size) const;
+  ssize_t writeHole(off_t offset, size_t length);
   bool blockRead(unsigned char *buf, int size, uint64_t iv64) const;
   bool streamRead(unsigned char *buf, int size, uint64_t iv64) const;
+  bool readFrom(const unsigned char *src, unsigned char *buf, int size,
+                uint64_t iv64) const;
+  bool readRun(const unsigned char *src, unsigned char *buf, size_t len,
+               off_t blockNum) const;
+  template <bool Holes>
+  bool decodeRun(const unsigned char *src, unsigned char *buf, size_t len,
+                 off_t blockNum) const;
+  bool writeRun(const unsigned char *src, unsigned char *buf, size_t len,
+                off_t blockNum) const;
   bool blockWrite(unsigned char *buf, int size, uint64_t iv64) const;
+  bool writeTo(const unsigned char *src, unsigned char *buf, int size,
+               uint64_t iv64) const;
   bool streamWrite(unsigned char *buf, int size, uint64_t iv64) const;
 
   ssize_t read(const IORequest &req) const;
@@ -84,12 +123,21 @@ class CipherFileIO : public BlockFileIO {
   // if haveHeader is true, then we have a transparent file header which
   // contains a 64 bit initialization vector.
   bool haveHeader;
+  // where the data starts in the backing file, see headerSpace()
+  int dataOffset;
   uint64_t externalIV;
   uint64_t fileIV;
+  // a new file's header is written along with its first block
+  bool headerPending;
   int lastFlags;
 
   std::shared_ptr<Cipher> cipher;
   CipherKey key;
+
+  // decodeRun() for the volume's configuration, chosen once
+  bool (CipherFileIO::*decodeRunFn)(const unsigned char *src,
+                                    unsigned char *buf, size_t len,
+                                    off_t blockNum) const;
 };
 
 }  // namespace encfs
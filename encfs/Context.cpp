@@ -19,6 +19,8 @@
  */
 
 #include "easylogging++.h"
+#include <iterator>
+#include <sched.h>
 #include <utility>
 
 #include "Context.h"
@@ -28,24 +30,68 @@
 
 namespace encfs {
 
+namespace {
+
+// Every root a context is given gets a new number, unique across contexts,
+// so that a thread's cached root is never taken for another one.
+std::atomic<std::uint64_t> nextRootGeneration(1);
+
+// The root last returned by getRoot() on this thread.  A weak_ptr, so that
+// it doesn't keep a detached root alive.
+struct CachedRoot {
+  CachedRoot() : generation(0) {}
+  std::uint64_t generation;
+  std::weak_ptr<DirNode> root;
+};
+thread_local CachedRoot cachedRoot;
+
+}  // namespace
+
 EncFS_Context::EncFS_Context() {
   pthread_cond_init(&wakeupCond, nullptr);
   pthread_mutex_init(&wakeupMutex, nullptr);
   pthread_mutex_init(&contextMutex, nullptr);
+  pthread_mutex_init(&fhMutex, nullptr);
+  pthread_mutex_init(&releasedMutex, nullptr);
+  for (auto &shard : openFileShards) {
+    pthread_mutex_init(&shard.mutex, nullptr);
+  }
+  for (auto &chunk : fuseFhChunks) {
+    chunk = nullptr;
+  }
 
+  rootGeneration = nextRootGeneration++;
   usageCount = 0;
   idleCount = -1;
   isUnmounting = false;
-  currentFuseFh = 1;
+  usedFhSlots = 0;
+  openNodes = 0;
+  releasedNodeLimit = 256;
+  releasedFdLimit = 64;
 }
 
 EncFS_Context::~EncFS_Context() {
   pthread_mutex_destroy(&contextMutex);
   pthread_mutex_destroy(&wakeupMutex);
   pthread_cond_destroy(&wakeupCond);
+  pthread_mutex_destroy(&fhMutex);
+
+  releasedIndex.clear();
+  releasedNodes.clear();
+  pthread_mutex_destroy(&releasedMutex);
 
   // release all entries from map
-  openFiles.clear();
+  for (auto &shard : openFileShards) {
+    shard.openFiles.clear();
+    pthread_mutex_destroy(&shard.mutex);
+  }
+  for (auto &chunk : fuseFhChunks) {
+    delete[] chunk.load();
+  }
+}
+
+EncFS_Context::OpenFileShard &EncFS_Context::shardFor(const std::string &path) {
+  return openFileShards[std::hash<std::string>()(path) % OpenFileShards];
 }
 
 std::shared_ptr<DirNode> EncFS_Context::getRoot(int *errCode) {
@@ -55,18 +101,29 @@ std::shared_ptr<DirNode> EncFS_Context::getRoot(int *errCode) {
 std::shared_ptr<DirNode> EncFS_Context::getRoot(int *errCode, bool skipUsageCount) {
   std::shared_ptr<DirNode> ret = nullptr;
   do {
-    {
-      Lock lock(contextMutex);
-      if (isUnmounting) {
-        *errCode = -EBUSY;
-        break;      	
-      }
-      ret = root;
-      // On some system, stat of "/" is allowed even if the calling user is
-      // not allowed to list / to go deeper. Do not then count this call.
-      if (!skipUsageCount) {
-        ++usageCount;
-      }
+    if (isUnmounting.load(std::memory_order_acquire)) {
+      *errCode = -EBUSY;
+      break;
+    }
+    // std::atomic_load() of a shared_ptr takes a lock, in libstdc++ one of
+    // a global pool.  The root rarely changes, so each thread keeps the one
+    // it saw last and only checks that the generation is still the same.
+    std::uint64_t generation = rootGeneration.load(std::memory_order_acquire);
+    if (cachedRoot.generation == generation) {
+      ret = cachedRoot.root.lock();
+    }
+    if (!ret) {
+      ret = std::atomic_load(&root);
+      cachedRoot.generation = generation;
+      cachedRoot.root = ret;
+    }
+    // On some system, stat of "/" is allowed even if the calling user is
+    // not allowed to list / to go deeper. Do not then count this call.
+    // The idle monitor only cares whether there was any activity, so avoid
+    // the write when another call already recorded it.
+    if (!skipUsageCount &&
+        usageCount.load(std::memory_order_relaxed) == 0) {
+      usageCount.store(1, std::memory_order_relaxed);
     }
 
     if (!ret) {
@@ -84,21 +141,28 @@ std::shared_ptr<DirNode> EncFS_Context::getRoot(int *errCode, bool skipUsageCoun
 void EncFS_Context::setRoot(const std::shared_ptr<DirNode> &r) {
   Lock lock(contextMutex);
 
-  root = r;
+  std::atomic_store(&root, r);
+  // after the store, so a thread which sees the new generation loads r
+  rootGeneration.store(nextRootGeneration++, std::memory_order_release);
   if (r) {
     rootCipherDir = r->rootDirectory();
   }
+  // released nodes belong to the previous root
+  dropReleasedNodes();
 }
 
 // This function is called periodically by the idle monitoring thread.
 // It checks for inactivity and unmount the FS after enough inactive cycles have passed.
 // Returns true if FS has really been unmounted, false otherwise.
 bool EncFS_Context::usageAndUnmount(int timeoutCycles) {
-  Lock lock(contextMutex);
+  {
+    Lock lock(contextMutex);
 
-  if (root != nullptr) {
+    if (std::atomic_load(&root) == nullptr) {
+      return false;
+    }
 
-    if (usageCount == 0) {
+    if (usageCount.exchange(0, std::memory_order_relaxed) == 0) {
       ++idleCount;
     }
     else {
@@ -107,34 +171,34 @@ bool EncFS_Context::usageAndUnmount(int timeoutCycles) {
     VLOG(1) << "idle cycle count: " << idleCount << ", timeout at "
             << timeoutCycles;
 
-    usageCount = 0;
-
     if (idleCount < timeoutCycles) {
       return false;
     }
 
-    if (!openFiles.empty()) {
+    int openCount = openFileCount();
+    if (openCount != 0) {
       if (idleCount % timeoutCycles == 0) {
-        RLOG(WARNING) << "Filesystem inactive, but " << openFiles.size()
+        RLOG(WARNING) << "Filesystem inactive, but " << openCount
                       << " files opened: " << this->opts->unmountPoint;
       }
       return false;
     }
     if (!this->opts->mountOnDemand) {
-      isUnmounting = true;
+      isUnmounting.store(true, std::memory_order_release);
     }
-    lock.~Lock();
-    return unmountFS(this);
-
   }
-  return false;
+
+  // unmountFS() resets the root through setRoot(), which takes contextMutex
+  return unmountFS(this);
 }
 
 std::shared_ptr<FileNode> EncFS_Context::lookupNode(const char *path) {
-  Lock lock(contextMutex);
+  std::string key(path);
+  OpenFileShard &shard = shardFor(key);
+  Lock lock(shard.mutex);
 
-  auto it = openFiles.find(std::string(path));
-  if (it != openFiles.end()) {
+  auto it = shard.openFiles.find(key);
+  if (it != shard.openFiles.end()) {
     // every entry in the list is fine... so just use the
     // first
     return it->second.front();
@@ -143,44 +207,69 @@ std::shared_ptr<FileNode> EncFS_Context::lookupNode(const char *path) {
 }
 
 void EncFS_Context::renameNode(const char *from, const char *to) {
-  Lock lock(contextMutex);
+  std::string fromKey(from);
+  std::string toKey(to);
+  OpenFileShard &src = shardFor(fromKey);
+  OpenFileShard &dst = shardFor(toKey);
+
+  // take both shard locks in a fixed order
+  Lock lock(&src < &dst ? src.mutex : dst.mutex);
+  std::unique_ptr<Lock> lock2;
+  if (&src != &dst) {
+    lock2.reset(new Lock(&src < &dst ? dst.mutex : src.mutex));
+  }
 
-  auto it = openFiles.find(std::string(from));
-  if (it != openFiles.end()) {
-    auto val = it->second;
-    openFiles.erase(it);
-    openFiles[std::string(to)] = val;
+  auto it = src.openFiles.find(fromKey);
+  if (it != src.openFiles.end()) {
+    auto val = std::move(it->second);
+    src.openFiles.erase(it);
+    dst.openFiles[toKey] = std::move(val);
   }
 }
 
 // putNode stores "node" under key "path" in the "openFiles" map. It
 // increments the reference count if the key already exists.
-void EncFS_Context::putNode(const char *path,
-                            const std::shared_ptr<FileNode> &node) {
-  Lock lock(contextMutex);
-  auto &list = openFiles[std::string(path)];
+int EncFS_Context::putNode(const char *path,
+                           const std::shared_ptr<FileNode> &node) {
+  std::string key(path);
+  OpenFileShard &shard = shardFor(key);
+  Lock lock(shard.mutex);
+
+  auto &list = shard.openFiles[key];
+  // The first reference gives the node its FUSE file handle.
+  if (std::find(list.begin(), list.end(), node) == list.end()) {
+    int res = registerFuseFh(node);
+    if (res != 0) {
+      if (list.empty()) {
+        shard.openFiles.erase(key);
+      }
+      return res;
+    }
+  }
   // The length of "list" serves as the reference count.
   list.push_front(node);
-  fuseFhMap[node->fuseFh] = node;
+  return 0;
 }
 
 // eraseNode is called by encfs_release in response to the RELEASE
 // FUSE-command we get from the kernel.
 void EncFS_Context::eraseNode(const char *path,
                               const std::shared_ptr<FileNode> &fnode) {
-  Lock lock(contextMutex);
+  std::string key(path);
+  OpenFileShard &shard = shardFor(key);
+  Lock lock(shard.mutex);
 
-  auto it = openFiles.find(std::string(path));
+  auto it = shard.openFiles.find(key);
 #ifdef __CYGWIN__
   // When renaming a file, Windows first opens it, renames it and then closes it
   // Filenode may have then been renamed too
-  if (it == openFiles.end()) {
+  if (it == shard.openFiles.end()) {
     RLOG(WARNING) << "Filenode to erase not found, file has certainly be renamed: "
                   << path;
     return;
   }
 #endif
-  rAssert(it != openFiles.end());
+  rAssert(it != shard.openFiles.end());
   auto &list = it->second;
 
   // Find "fnode" in the list of FileNodes registered under this path.
@@ -188,36 +277,204 @@ void EncFS_Context::eraseNode(const char *path,
   rAssert(findIter != list.end());
   list.erase(findIter);
 
-  // If no reference to "fnode" remains, drop the entry from fuseFhMap
+  // If no reference to "fnode" remains, release its FUSE file handle
   // and overwrite the canary.
   findIter = std::find(list.begin(), list.end(), fnode);
   if (findIter == list.end()) {
-    fuseFhMap.erase(fnode->fuseFh);
+    releaseFuseFh(fnode);
     fnode->canary = CANARY_RELEASED;
+    cacheReleasedNode(key, fnode);
   }
 
   // If no FileNode is registered at this path anymore, drop the entry
   // from openFiles.
   if (list.empty()) {
-    openFiles.erase(it);
+    shard.openFiles.erase(it);
   }
 }
 
-// nextFuseFh returns the next unused uint64 to serve as the FUSE file
-// handle for the kernel.
-uint64_t EncFS_Context::nextFuseFh() {
-  // This is thread-safe because currentFuseFh is declared as std::atomic
-  return currentFuseFh++;
+// registerFuseFh gives "node" a free slot in the file handle table and
+// stores the resulting handle in node->fuseFh.
+int EncFS_Context::registerFuseFh(const std::shared_ptr<FileNode> &node) {
+  Lock lock(fhMutex);
+
+  std::uint32_t slot;
+  if (!freeFhSlots.empty()) {
+    slot = freeFhSlots.back();
+    freeFhSlots.pop_back();
+  } else {
+    if (usedFhSlots == FuseFhChunkSize * FuseFhChunks) {
+      RLOG(WARNING) << "out of FUSE file handles";
+      return -EMFILE;
+    }
+    slot = usedFhSlots++;
+    if (slot % FuseFhChunkSize == 0) {
+      auto *chunk = new FuseFhSlot[FuseFhChunkSize];
+      for (unsigned int i = 0; i < FuseFhChunkSize; ++i) {
+        chunk[i].fh = 0;
+        chunk[i].readers = 0;
+        chunk[i].generation = 0;
+      }
+      fuseFhChunks[slot / FuseFhChunkSize].store(chunk,
+                                                 std::memory_order_release);
+    }
+  }
+
+  FuseFhSlot &entry = fuseFhChunks[slot / FuseFhChunkSize].load(
+      std::memory_order_relaxed)[slot % FuseFhChunkSize];
+  ++entry.generation;
+  uint64_t fh = ((uint64_t)entry.generation << 32) | (slot + 1);
+  node->fuseFh = fh;
+  // fh is 0 while the slot is free, so no lookup reads node here.  Publish
+  // the node before the handle which lookupFuseFh matches on.
+  entry.node = node;
+  entry.fh.store(fh, std::memory_order_release);
+  ++openNodes;
+  return 0;
+}
+
+void EncFS_Context::releaseFuseFh(const std::shared_ptr<FileNode> &node) {
+  std::uint32_t slot = (std::uint32_t)node->fuseFh - 1;
+  Lock lock(fhMutex);
+
+  FuseFhSlot &entry = fuseFhChunks[slot / FuseFhChunkSize].load(
+      std::memory_order_relaxed)[slot % FuseFhChunkSize];
+  rAssert(entry.fh.load(std::memory_order_relaxed) == node->fuseFh);
+  entry.fh.store(0);
+  // A lookup which still saw the handle is copying node.  Lookups only
+  // hold readers for a few instructions.
+  while (entry.readers.load() != 0) {
+    sched_yield();
+  }
+  entry.node.reset();
+  freeFhSlots.push_back(slot);
+  --openNodes;
 }
 
-// lookupFuseFh finds "n" in "fuseFhMap" and returns the FileNode.
+// lookupFuseFh finds the FileNode for FUSE file handle "n".  This is done for
+// every read and write, so it takes no mutex, see FuseFhSlot.
 std::shared_ptr<FileNode> EncFS_Context::lookupFuseFh(uint64_t n) {
-  Lock lock(contextMutex);
-  auto it = fuseFhMap.find(n);
-  if (it == fuseFhMap.end()) {
+  // handle 0 wraps around and is rejected with the other invalid slots
+  std::uint32_t slot = (std::uint32_t)n - 1;
+  if (slot >= FuseFhChunkSize * FuseFhChunks) {
+    return nullptr;
+  }
+  FuseFhSlot *chunk =
+      fuseFhChunks[slot / FuseFhChunkSize].load(std::memory_order_acquire);
+  if (chunk == nullptr) {
     return nullptr;
   }
-  return it->second;
+
+  // readers and fh are sequentially consistent, so either releaseFuseFh
+  // sees us in readers and waits, or we see the handle cleared.
+  FuseFhSlot &entry = chunk[slot % FuseFhChunkSize];
+  std::shared_ptr<FileNode> node;
+  entry.readers.fetch_add(1);
+  if (entry.fh.load() == n) {
+    node = entry.node;
+  }
+  entry.readers.fetch_sub(1);
+  return node;
+}
+
+int EncFS_Context::openFileCount() const { return openNodes; }
+
+// cacheReleasedNode is called by eraseNode when the last reference to "node"
+// is gone.
+void EncFS_Context::cacheReleasedNode(const std::string &path,
+                                      const std::shared_ptr<FileNode> &node) {
+  if (!opts || opts->noCache || opts->reverseEncryption) {
+    return;
+  }
+
+  Lock lock(releasedMutex);
+  if (releasedNodeLimit <= 0) {
+    return;
+  }
+
+  auto it = releasedIndex.find(path);
+  if (it != releasedIndex.end()) {
+    releasedNodes.erase(it->second);
+    releasedIndex.erase(it);
+  }
+
+  node->release(false);
+  releasedNodes.emplace_front(path, node);
+  releasedIndex[path] = releasedNodes.begin();
+
+  // The node pushed out of the descriptor budget closes its file.  This is
+  // done while holding releasedMutex, so that the node can't be reused and
+  // opened again in the meantime.
+  if ((int)releasedNodes.size() > releasedFdLimit) {
+    auto fdIt = releasedNodes.begin();
+    std::advance(fdIt, releasedFdLimit);
+    fdIt->second->release(true);
+  }
+
+  if ((int)releasedNodes.size() > releasedNodeLimit) {
+    VLOG(1) << "dropping released node " << releasedNodes.back().first;
+    releasedIndex.erase(releasedNodes.back().first);
+    releasedNodes.pop_back();
+  }
+}
+
+std::shared_ptr<FileNode> EncFS_Context::reuseNode(const char *path) {
+  std::shared_ptr<FileNode> node;
+  Lock lock(releasedMutex);
+
+  auto it = releasedIndex.find(path);
+  if (it != releasedIndex.end()) {
+    node = std::move(it->second->second);
+    releasedNodes.erase(it->second);
+    releasedIndex.erase(it);
+    node->canary = CANARY_OK;
+    VLOG(1) << "reusing released node for " << node->cipherName();
+  }
+  return node;
+}
+
+bool EncFS_Context::hasReleasedNode(const char *path) const {
+  Lock lock(releasedMutex);
+  return releasedIndex.find(path) != releasedIndex.end();
+}
+
+void EncFS_Context::dropReleasedNode(const char *path) {
+  Lock lock(releasedMutex);
+
+  auto it = releasedIndex.find(path);
+  if (it != releasedIndex.end()) {
+    releasedNodes.erase(it->second);
+    releasedIndex.erase(it);
+  }
+}
+
+void EncFS_Context::dropReleasedNodes() {
+  Lock lock(releasedMutex);
+
+  releasedIndex.clear();
+  releasedNodes.clear();
+}
+
+void EncFS_Context::setReleasedNodeLimits(int nodes, int fds) {
+  Lock lock(releasedMutex);
+
+  releasedNodeLimit = nodes;
+  releasedFdLimit = fds;
+  while ((int)releasedNodes.size() > releasedNodeLimit) {
+    releasedIndex.erase(releasedNodes.back().first);
+    releasedNodes.pop_back();
+  }
+  int count = 0;
+  for (auto &entry : releasedNodes) {
+    if (count++ >= releasedFdLimit) {
+      entry.second->release(true);
+    }
+  }
+}
+
+int EncFS_Context::releasedNodeCount() const {
+  Lock lock(releasedMutex);
+  return releasedNodes.size();
 }
 
 }  // namespace encfs
@@ -29,6 +29,7 @@
 #include <set>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "encfs.h"
 
@@ -48,7 +49,8 @@ class EncFS_Context {
 
   bool usageAndUnmount(int timeoutCycles);
 
-  void putNode(const char *path, const std::shared_ptr<FileNode> &node);
+  // Returns 0 on success, -EMFILE if there are no free file handles.
+  int putNode(const char *path, const std::shared_ptr<FileNode> &node);
 
   void eraseNode(const char *path, const std::shared_ptr<FileNode> &fnode);
 
@@ -71,9 +73,25 @@ class EncFS_Context {
   pthread_cond_t wakeupCond;
   pthread_mutex_t wakeupMutex;
 
-  uint64_t nextFuseFh();
   std::shared_ptr<FileNode> lookupFuseFh(uint64_t);
 
+  // number of FileNodes which are currently open
+  int openFileCount() const;
+
+  // FileNodes are kept for a while after their last release, so that a file
+  // which is opened again soon doesn't need a new name encoding, open() and
+  // header read.  reuseNode() takes the node for "path" out of the cache,
+  // or returns nullptr.
+  std::shared_ptr<FileNode> reuseNode(const char *path);
+  bool hasReleasedNode(const char *path) const;
+  // Forget released nodes which may no longer match their backing file.
+  void dropReleasedNode(const char *path);
+  void dropReleasedNodes();
+  // Limits on the number of released nodes kept, and on how many of them
+  // keep their file descriptor open.
+  void setReleasedNodeLimits(int nodes, int fds);
+  int releasedNodeCount() const;
+
  private:
   /* This placeholder is what is referenced in FUSE context (passed to
    * callbacks).
@@ -88,16 +106,73 @@ class EncFS_Context {
   using FileMap =
       std::unordered_map<std::string, std::list<std::shared_ptr<FileNode>>>;
 
+  // openFiles is split by path hash, so that opens and releases of
+  // different files don't serialize on one lock.
+  static const int OpenFileShards = 16;
+  struct OpenFileShard {
+    pthread_mutex_t mutex;
+    FileMap openFiles;
+  };
+  OpenFileShard openFileShards[OpenFileShards];
+  OpenFileShard &shardFor(const std::string &path);
+
+  /* FUSE file handles index a table of slots directly.  The low 32 bits of a
+   * handle are the slot number plus one, the high bits are a generation
+   * count, so a stale handle never matches a reused slot.  Chunks of slots
+   * are allocated on demand and never freed while mounted.  fhMutex only
+   * protects slot allocation and release.
+   *
+   * lookupFuseFh() runs without taking any mutex.  It counts itself in
+   * readers while it checks fh and copies node, and releaseFuseFh() waits
+   * for readers to drop to zero after clearing fh, before it resets node.
+   * So node is never changed while a lookup which matched fh copies it.
+   */
+  struct FuseFhSlot {
+    std::atomic<std::uint64_t> fh;
+    std::atomic<int> readers;
+    std::shared_ptr<FileNode> node;
+    std::uint32_t generation;
+  };
+  static const unsigned int FuseFhChunkSize = 1024;
+  static const unsigned int FuseFhChunks = 1024;
+  std::atomic<FuseFhSlot *> fuseFhChunks[FuseFhChunks];
+  pthread_mutex_t fhMutex;
+  std::vector<std::uint32_t> freeFhSlots;
+  std::uint32_t usedFhSlots;
+  std::atomic<int> openNodes;
+
+  int registerFuseFh(const std::shared_ptr<FileNode> &node);
+  void releaseFuseFh(const std::shared_ptr<FileNode> &node);
+
+  /* Released nodes, most recently released first.  Only the first
+   * releasedFdLimit nodes keep their descriptor, the others reopen their
+   * file when reused.  The cache is not used with --nocache or in reverse
+   * mode, where the backing files may change behind our back.
+   */
+  using ReleasedList =
+      std::list<std::pair<std::string, std::shared_ptr<FileNode>>>;
+  mutable pthread_mutex_t releasedMutex;
+  ReleasedList releasedNodes;
+  std::unordered_map<std::string, ReleasedList::iterator> releasedIndex;
+  int releasedNodeLimit;
+  int releasedFdLimit;
+
+  void cacheReleasedNode(const std::string &path,
+                         const std::shared_ptr<FileNode> &node);
+
   mutable pthread_mutex_t contextMutex;
-  FileMap openFiles;
 
-  int usageCount;
+  // getRoot() is called by every operation, so it doesn't take contextMutex.
+  // root is only accessed through std::atomic_load / std::atomic_store, which
+  // take a lock, so getRoot() reuses a per thread copy while rootGeneration
+  // is unchanged.  Returning the root still increments its reference count.
+  // usageCount is only set to 1 when it is 0, so busy filesystems don't
+  // bounce its cache line between CPUs.
+  std::atomic<std::uint64_t> rootGeneration;
+  std::atomic<int> usageCount;
   int idleCount;
-  bool isUnmounting;
+  std::atomic<bool> isUnmounting;
   std::shared_ptr<DirNode> root;
-
-  std::atomic<std::uint64_t> currentFuseFh;
-  std::unordered_map<uint64_t, std::shared_ptr<FileNode>> fuseFhMap;
 };
 
 int remountFS(EncFS_Context *ctx);
@@ -21,6 +21,7 @@
 #include "DirNode.h"
 
 #include <cerrno>
+#include <climits>
 #include <cstdio>
 #include <cstring>
 #ifdef __linux__
@@ -95,13 +96,13 @@ std::string DirTraverse::nextPlaintextName(int *fileType, ino_t *inode) {
       VLOG(1) << "skipping filename: " << de->d_name;
       continue;
     }
-    try {
-      uint64_t localIv = iv;
-      return naming->decodePath(de->d_name, &localIv);
-    } catch (encfs::Error &ex) {
-      // .. .problem decoding, ignore it and continue on to next name..
-      VLOG(1) << "error decoding filename: " << de->d_name;
+    uint64_t localIv = iv;
+    string plainName;
+    if (naming->tryDecodePath(de->d_name, &localIv, &plainName) == 0) {
+      return plainName;
     }
+    // .. .problem decoding, ignore it and continue on to next name..
+    VLOG(1) << "error decoding filename: " << de->d_name;
   }
 
   return string();
@@ -115,11 +116,9 @@ std::string DirTraverse::nextInvalid() {
       VLOG(1) << "skipping filename: " << de->d_name;
       continue;
     }
-    try {
-      uint64_t localIv = iv;
-      naming->decodePath(de->d_name, &localIv);
-      continue;
-    } catch (encfs::Error &ex) {
+    uint64_t localIv = iv;
+    string plainName;
+    if (naming->tryDecodePath(de->d_name, &localIv, &plainName) < 0) {
       return string(de->d_name);
     }
   }
@@ -246,20 +245,73 @@ void RenameOp::undo() {
   RLOG(WARNING) << "Undo rename count: " << undoCount;
 }
 
+static uint64_t hashName(const char *name) {
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for (; *name != '\0'; ++name) {
+    hash = (hash ^ (unsigned char)*name) * 1099511628211ULL;
+  }
+  return hash;
+}
+
 DirNode::DirNode(EncFS_Context *_ctx, const string &sourceDir,
                  const FSConfigPtr &_config) {
-  pthread_mutex_init(&mutex, nullptr);
-
-  Lock _lock(mutex);
+  for (auto &lock : pathLocks) {
+    pthread_mutex_init(&lock, nullptr);
+  }
+  for (auto &stripe : attrStripes) {
+    pthread_mutex_init(&stripe.mutex, nullptr);
+    stripe.nextGeneration = 0;
+  }
 
   ctx = _ctx;
   rootDir = sourceDir;  // .. and fsConfig->opts->mountPoint have trailing slash
   fsConfig = _config;
+  checkAttr = fsConfig->reverseEncryption || fsConfig->opts->checkAttr;
+  prepareHook = nullptr;
 
   naming = fsConfig->nameCoding;
 }
 
-DirNode::~DirNode() = default;
+DirNode::~DirNode() {
+  for (auto &lock : pathLocks) {
+    pthread_mutex_destroy(&lock);
+  }
+  for (auto &stripe : attrStripes) {
+    pthread_mutex_destroy(&stripe.mutex);
+  }
+}
+
+namespace {
+
+// Holds every mutex of an array, taken in index order.
+class LockAll {
+ public:
+  LockAll(pthread_mutex_t *mutexes, int count)
+      : _mutexes(mutexes), _count(count) {
+    for (int i = 0; i < _count; ++i) {
+      pthread_mutex_lock(&_mutexes[i]);
+    }
+  }
+  ~LockAll() {
+    for (int i = _count - 1; i >= 0; --i) {
+      pthread_mutex_unlock(&_mutexes[i]);
+    }
+  }
+
+ private:
+  LockAll(const LockAll &src);             // not allowed
+  LockAll &operator=(const LockAll &src);  // not allowed
+
+  pthread_mutex_t *_mutexes;
+  int _count;
+};
+
+}  // namespace
+
+pthread_mutex_t &DirNode::pathLock(const char *plainName) {
+  return pathLocks[hashName(plainName) % PathLockStripes];
+}
 
 bool DirNode::hasDirectoryNameDependency() const {
   return naming ? naming->getChainedNameIV() : false;
@@ -307,6 +359,25 @@ string DirNode::cipherPath(const char *plaintextPath) {
   return rootDir + naming->encodePath(plaintextPath);
 }
 
+/**
+ * Same as cipherPath(), but writes the result into a caller supplied buffer
+ * instead of allocating.  Returns the length of the result, or a negative
+ * errno value (-ENAMETOOLONG if the buffer is too small).
+ */
+int DirNode::cipherPath(const char *plaintextPath, char *buf,
+                        int bufferLength) {
+  int rootLen = rootDir.length();
+  if (rootLen >= bufferLength) {
+    return -ENAMETOOLONG;
+  }
+  memcpy(buf, rootDir.data(), rootLen);
+
+  uint64_t iv = 0;
+  int res = naming->encodePath(plaintextPath, &iv, buf + rootLen,
+                               bufferLength - rootLen);
+  return res < 0 ? res : rootLen + res;
+}
+
 /**
  * Same as cipherPath(), but does not prefix the ciphertext root directory
  */
@@ -328,13 +399,23 @@ string DirNode::plainPath(const char *cipherPath_) {
       mark = '/';
       prefix = "+";
     }
+    string plainName;
+    int res;
     if (cipherPath_[0] == mark) {
-      return prefix +
-             naming->decodeName(cipherPath_ + 1, strlen(cipherPath_ + 1));
+      res = naming->tryDecodeName(cipherPath_ + 1, strlen(cipherPath_ + 1),
+                                  &plainName);
+      plainName.insert(0, prefix);
+    } else {
+      // Default.
+      uint64_t iv = 0;
+      res = naming->tryDecodePath(cipherPath_, &iv, &plainName);
     }
 
-    // Default.
-    return naming->decodePath(cipherPath_);
+    if (res < 0) {
+      RLOG(ERROR) << "decode err: " << strerror(-res);
+      return string();
+    }
+    return plainName;
   } catch (encfs::Error &err) {
     RLOG(ERROR) << "decode err: " << err.what();
     return string();
@@ -418,9 +499,7 @@ bool DirNode::genRenameList(list<RenameEl> &renameList, const char *fromP,
       continue;
     }
 
-    try {
-      plainName = naming->decodePath(de->d_name, &localIV);
-    } catch (encfs::Error &ex) {
+    if (naming->tryDecodePath(de->d_name, &localIV, &plainName) < 0) {
       // if filename can't be decoded, then ignore it..
       continue;
     }
@@ -552,11 +631,18 @@ int DirNode::mkdir(const char *plaintextPath, mode_t mode, uid_t uid,
     }
   }
 
+  invalidateEntry(plaintextPath);
   return res;
 }
 
 int DirNode::rename(const char *fromPlaintext, const char *toPlaintext) {
-  Lock _lock(mutex);
+  LockAll _lock(pathLocks, PathLockStripes);
+
+  // a directory rename moves everything below it
+  invalidateAttr();
+  if (ctx != nullptr) {
+    ctx->dropReleasedNodes();
+  }
 
   string fromCName = rootDir + naming->encodePath(fromPlaintext);
   string toCName = rootDir + naming->encodePath(toPlaintext);
@@ -625,6 +711,7 @@ int DirNode::rename(const char *fromPlaintext, const char *toPlaintext) {
     RLOG(WARNING) << err.what();
     res = -EIO;
   }
+  invalidateAttr();
 
   if (res != 0) {
     VLOG(1) << "rename failed: " << strerror(-res);
@@ -634,7 +721,11 @@ int DirNode::rename(const char *fromPlaintext, const char *toPlaintext) {
 }
 
 int DirNode::link(const char *to, const char *from) {
-  Lock _lock(mutex);
+  LockAll _lock(pathLocks, PathLockStripes);
+
+  if (ctx != nullptr) {
+    ctx->dropReleasedNode(from);
+  }
 
   string toCName = rootDir + naming->encodePath(to);
   string fromCName = rootDir + naming->encodePath(from);
@@ -654,6 +745,9 @@ int DirNode::link(const char *to, const char *from) {
     } else {
       res = 0;
     }
+    // the link count of the existing name changes too
+    invalidateAttr(to);
+    invalidateEntry(from);
   }
 
   return res;
@@ -695,36 +789,255 @@ std::shared_ptr<FileNode> DirNode::renameNode(const char *from, const char *to,
 
 // findOrCreate checks if we already have a FileNode for "plainName" and
 // creates a new one if we don't. Returns the FileNode.
-std::shared_ptr<FileNode> DirNode::findOrCreate(const char *plainName) {
+std::shared_ptr<FileNode> DirNode::findOrCreate(
+    const char *plainName, const std::shared_ptr<FileNode> &created) {
   std::shared_ptr<FileNode> node;
 
   // See if we already have a FileNode for this path.
   if (ctx != nullptr) {
     node = ctx->lookupNode(plainName);
 
-    // If we don't, create a new one.
+    // If we don't, reuse a released one, or use the one prepared by the
+    // caller, or create a new one.
     if (!node) {
-      uint64_t iv = 0;
-      string cipherName = naming->encodePath(plainName, &iv);
-      uint64_t fuseFh = ctx->nextFuseFh();
-      node.reset(new FileNode(this, fsConfig, plainName,
-                              (rootDir + cipherName).c_str(), fuseFh));
+      node = ctx->reuseNode(plainName);
+    }
+    if (!node) {
+      node = created ? created : newNode(plainName);
+    }
+  }
 
-      if (fsConfig->config->externalIVChaining) {
-        node->setName(nullptr, nullptr, iv);
-      }
+  return node;
+}
 
-      VLOG(1) << "created FileNode for " << node->cipherName();
-    }
+std::shared_ptr<FileNode> DirNode::newNode(const char *plainName) {
+  uint64_t iv = 0;
+  string cipherName = naming->encodePath(plainName, &iv);
+  std::shared_ptr<FileNode> node(
+      new FileNode(this, fsConfig, plainName, (rootDir + cipherName).c_str()));
+
+  if (fsConfig->config->externalIVChaining) {
+    node->setName(nullptr, nullptr, iv);
+  }
+
+  VLOG(1) << "created FileNode for " << node->cipherName();
+  return node;
+}
+
+// The name encoding for a new node only depends on the plaintext path, so it
+// can be done without holding any lock.  A recently released node is only
+// taken by findOrCreate, under the path lock, so nothing is prepared if there
+// is one.  The node is dropped again if another thread opened the path in the
+// meantime.
+std::shared_ptr<FileNode> DirNode::prepareNode(const char *plainName) {
+  std::shared_ptr<FileNode> node;
+  if ((ctx != nullptr) && !ctx->lookupNode(plainName) &&
+      !ctx->hasReleasedNode(plainName)) {
+    node = newNode(plainName);
   }
 
+  PrepareHook hook = prepareHook.load(std::memory_order_acquire);
+  if (hook != nullptr) {
+    hook(this, plainName);
+  }
   return node;
 }
 
+void DirNode::setPrepareHook(PrepareHook hook) {
+  prepareHook.store(hook, std::memory_order_release);
+}
+
 shared_ptr<FileNode> DirNode::lookupNode(const char *plainName,
                                          const char * /* requestor */) {
-  Lock _lock(mutex);
-  return findOrCreate(plainName);
+  std::shared_ptr<FileNode> created = prepareNode(plainName);
+
+  Lock _lock(pathLock(plainName));
+  return findOrCreate(plainName, created);
+}
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#define st_ctim st_ctimespec
+#endif
+
+namespace {
+
+bool sameTime(const struct timespec &a, const struct timespec &b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+}  // namespace
+
+int DirNode::getAttr(const char *plainName, struct stat *stbuf) {
+  char cipherName[PATH_MAX];
+  uint64_t key = hashName(plainName);
+  AttrCacheStripe &stripe = attrStripe(key);
+
+  // a copy of the cache entry, or a new one which holds the place of the
+  // result until storeAttr
+  AttrCacheEntry entry = AttrCacheEntry();
+  bool cached = false;
+  {
+    Lock _lock(stripe.mutex);
+    auto it = stripe.map.find(key);
+    if (it != stripe.map.end() && it->second->plainName == plainName) {
+      const AttrCacheEntry &hit = *it->second;
+      stripe.list.splice(stripe.list.begin(), stripe.list, it->second);
+      if (hit.attrValid && !hit.checkAttr) {
+        *stbuf = hit.attr;
+        return 0;
+      }
+      entry.generation = hit.generation;
+      if (!hit.cipherName.empty() &&
+          hit.cipherName.length() < sizeof(cipherName)) {
+        cached = true;
+        memcpy(cipherName, hit.cipherName.c_str(),
+               hit.cipherName.length() + 1);
+        entry.stamp = hit.stamp;
+        entry.linkSize = hit.linkSize;
+        entry.attrValid = hit.attrValid;
+        entry.attr = hit.attr;
+      }
+    } else {
+      if (it != stripe.map.end()) {
+        // another path with the same hash
+        stripe.list.erase(it->second);
+        stripe.map.erase(it);
+      } else if (stripe.list.size() >= AttrCacheEntries / AttrCacheStripes) {
+        stripe.map.erase(stripe.list.back().key);
+        stripe.list.pop_back();
+      }
+      AttrCacheEntry placeholder = AttrCacheEntry();
+      placeholder.key = key;
+      placeholder.plainName = plainName;
+      placeholder.generation = entry.generation = ++stripe.nextGeneration;
+      stripe.list.push_front(std::move(placeholder));
+      stripe.map[key] = stripe.list.begin();
+    }
+  }
+
+  if (!cached) {
+    int res = cipherPath(plainName, cipherName, sizeof(cipherName));
+    if (res < 0) {
+      invalidateAttr(plainName);
+      return res;
+    }
+
+    // check that we're not recursing into the mount point itself
+    if (touchesMountpoint(cipherName)) {
+      VLOG(1) << "getAttr error: Tried to touch mountpoint: '" << cipherName
+              << "'";
+      invalidateAttr(plainName);
+      return -EIO;
+    }
+  }
+
+  if (lstat(cipherName, stbuf) < 0) {
+    int eno = errno;
+    RLOG(DEBUG) << "getAttr error on " << cipherName << ": " << strerror(eno);
+    invalidateAttr(plainName);
+    return -eno;
+  }
+
+  bool unchanged = cached && entry.stamp.ino == stbuf->st_ino &&
+                   entry.stamp.size == stbuf->st_size &&
+                   sameTime(entry.stamp.mtime, stbuf->st_mtim) &&
+                   sameTime(entry.stamp.ctime, stbuf->st_ctim);
+  if (unchanged && entry.attrValid) {
+    *stbuf = entry.attr;
+    return 0;
+  }
+
+  entry.stamp.ino = stbuf->st_ino;
+  entry.stamp.size = stbuf->st_size;
+  entry.stamp.mtime = stbuf->st_mtim;
+  entry.stamp.ctime = stbuf->st_ctim;
+  // a hard linked file can change through its other names
+  entry.checkAttr = checkAttr ||
+                    (!S_ISDIR(stbuf->st_mode) && stbuf->st_nlink > 1);
+
+  if (S_ISLNK(stbuf->st_mode)) {
+    if (unchanged && entry.linkSize >= 0) {
+      stbuf->st_size = entry.linkSize;
+    } else {
+      int res = adjustLinkSize(cipherName, stbuf);
+      if (res < 0) {
+        invalidateAttr(plainName);
+        return res;
+      }
+    }
+    entry.linkSize = stbuf->st_size;
+  } else {
+    FileNode::adjustAttr(fsConfig, stbuf);
+    entry.linkSize = -1;
+  }
+
+  entry.key = key;
+  entry.plainName = plainName;
+  entry.cipherName = cipherName;
+  entry.attrValid = true;
+  entry.attr = *stbuf;
+  storeAttr(entry);
+  return 0;
+}
+
+DirNode::AttrCacheStripe &DirNode::attrStripe(uint64_t key) {
+  return attrStripes[key % AttrCacheStripes];
+}
+
+void DirNode::storeAttr(AttrCacheEntry &entry) {
+  AttrCacheStripe &stripe = attrStripe(entry.key);
+  Lock _lock(stripe.mutex);
+  // the entry is dropped by every invalidation and gets a new generation
+  // when created again, so what we have is only stored if nothing changed
+  // since we looked it up
+  auto it = stripe.map.find(entry.key);
+  if (it != stripe.map.end() && it->second->generation == entry.generation &&
+      it->second->plainName == entry.plainName) {
+    *it->second = std::move(entry);
+  }
+}
+
+void DirNode::invalidateAttr(const char *plainName) {
+  uint64_t key = hashName(plainName);
+  AttrCacheStripe &stripe = attrStripe(key);
+  Lock _lock(stripe.mutex);
+  auto it = stripe.map.find(key);
+  if (it != stripe.map.end()) {
+    stripe.list.erase(it->second);
+    stripe.map.erase(it);
+  }
+}
+
+void DirNode::invalidateAttr() {
+  for (auto &stripe : attrStripes) {
+    Lock _lock(stripe.mutex);
+    stripe.map.clear();
+    stripe.list.clear();
+  }
+}
+
+void DirNode::invalidateEntry(const char *plainName) {
+  invalidateAttr(plainName);
+  string parent = parentDirectory(plainName);
+  invalidateAttr(parent.empty() ? "/" : parent.c_str());
+}
+
+int DirNode::adjustLinkSize(const char *cipherName, struct stat *stbuf) {
+  // determine plaintext link size..  Easiest to read and decrypt..
+  std::vector<char> buf(stbuf->st_size + 1, '\0');
+
+  int res = ::readlink(cipherName, buf.data(), stbuf->st_size);
+  if (res < 0) {
+    return -errno;
+  }
+
+  // other functions expect c-strings to be null-terminated, which
+  // readlink doesn't provide
+  buf[res] = '\0';
+
+  stbuf->st_size = plainPath(buf.data()).length();
+  return 0;
 }
 
 /*
@@ -738,9 +1051,11 @@ std::shared_ptr<FileNode> DirNode::openNode(const char *plainName,
                                             int *result) {
   (void)requestor;
   rAssert(result != nullptr);
-  Lock _lock(mutex);
+  std::shared_ptr<FileNode> created = prepareNode(plainName);
+
+  Lock _lock(pathLock(plainName));
 
-  std::shared_ptr<FileNode> node = findOrCreate(plainName);
+  std::shared_ptr<FileNode> node = findOrCreate(plainName, created);
 
   if (node && (*result = node->open(flags)) >= 0) {
     return node;
@@ -748,11 +1063,39 @@ std::shared_ptr<FileNode> DirNode::openNode(const char *plainName,
   return std::shared_ptr<FileNode>();
 }
 
+std::shared_ptr<FileNode> DirNode::createNode(const char *plainName,
+                                              const char *requestor,
+                                              mode_t mode, int flags,
+                                              uid_t uid, gid_t gid,
+                                              int *result) {
+  (void)requestor;
+  rAssert(result != nullptr);
+  std::shared_ptr<FileNode> created = prepareNode(plainName);
+
+  Lock _lock(pathLock(plainName));
+
+  // a released node for this path refers to a file which is gone
+  if (ctx != nullptr) {
+    ctx->dropReleasedNode(plainName);
+  }
+
+  std::shared_ptr<FileNode> node = findOrCreate(plainName, created);
+
+  if (node && (*result = node->create(mode, flags, uid, gid)) >= 0) {
+    return node;
+  }
+  return std::shared_ptr<FileNode>();
+}
+
 int DirNode::unlink(const char *plaintextName) {
   string cyName = naming->encodePath(plaintextName);
   VLOG(1) << "unlink " << cyName;
 
-  Lock _lock(mutex);
+  Lock _lock(pathLock(plaintextName));
+
+  if (ctx != nullptr) {
+    ctx->dropReleasedNode(plaintextName);
+  }
 
 // Windows does not allow deleting opened files, so no need to check
 // There is this "issue" however : https://github.com/billziss-gh/winfsp/issues/157
@@ -775,6 +1118,7 @@ int DirNode::unlink(const char *plaintextName) {
     res = -errno;
     VLOG(1) << "unlink error: " << strerror(-res);
   }
+  invalidateEntry(plaintextName);
 
   return res;
 }
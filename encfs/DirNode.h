@@ -21,6 +21,7 @@
 #ifndef _DirNode_incl_
 #define _DirNode_incl_
 
+#include <atomic>
 #include <dirent.h>
 #include <inttypes.h>
 #include <list>
@@ -29,7 +30,9 @@
 #include <pthread.h>
 #include <stdint.h>
 #include <string>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <unordered_map>
 #include <vector>
 
 #include "CipherKey.h"
@@ -103,7 +106,50 @@ class DirNode {
                                      const char *requestor, int flags,
                                      int *openResult);
 
+  /*
+      Same as openNode, but creates the file (which must not exist).  uid and
+      gid are used as the file owner, only if not zero.
+  */
+  std::shared_ptr<FileNode> createNode(const char *plaintextName,
+                                       const char *requestor, mode_t mode,
+                                       int flags, uid_t uid, gid_t gid,
+                                       int *openResult);
+
+  /*
+      Same result as lookupNode() + getAttr(), including the plaintext length
+      of symlinks, but without building a FileNode.  Returns 0 on success,
+      -errno on failure.
+
+      The ciphertext path, symlink length and attributes are cached per
+      plaintext path, in a bounded LRU cache.  In forward mode the cached
+      attributes are used until a change made through encfs drops them.  In
+      reverse mode, where the backing files change behind our back, with
+      --checkattr and for hard linked files, which can change through
+      another path, they are only used while a fresh lstat() shows the same
+      inode, size, mtime and ctime.  The cached symlink length is checked
+      the same way.
+  */
+  int getAttr(const char *plaintextName, struct stat *stbuf);
+
+  // maximum number of paths getAttr keeps, spread over AttrCacheStripes
+  // separately locked parts.  The least recently used path of a part is
+  // dropped when it is full.
+  static const unsigned int AttrCacheEntries = 4096;
+  static const unsigned int AttrCacheStripes = 16;
+
+  // drop cached getAttr data for a path, or for every path
+  void invalidateAttr(const char *plaintextName);
+  void invalidateAttr();
+
+  // drop cached getAttr data for a path and the directory holding it, after
+  // a directory entry was added or removed
+  void invalidateEntry(const char *plaintextName);
+
+  // replace the st_size of a symlink with the length of its plaintext target
+  int adjustLinkSize(const char *cipherName, struct stat *stbuf);
+
   std::string cipherPath(const char *plaintextPath);
+  int cipherPath(const char *plaintextPath, char *buf, int bufferLength);
   std::string cipherPathWithoutRoot(const char *plaintextPath);
   std::string plainPath(const char *cipherPath);
 
@@ -136,6 +182,12 @@ class DirNode {
   // returns idle time of filesystem in seconds
   int idleSeconds();
 
+  // called by lookupNode, openNode and createNode after preparing a node,
+  // before taking the path lock.  Used by the tests to change the file in
+  // between.
+  typedef void (*PrepareHook)(DirNode *dirNode, const char *plainName);
+  void setPrepareHook(PrepareHook hook);
+
  protected:
   /*
       notify that a file is being renamed.
@@ -161,12 +213,75 @@ class DirNode {
   bool genRenameList(std::list<RenameEl> &list, const char *fromP,
                      const char *toP);
 
-  std::shared_ptr<FileNode> findOrCreate(const char *plainName);
+  // Returns the open FileNode for plainName, or a recently released one, or
+  // "created" (or a new node if that is empty) if there is none.  The caller
+  // holds the path lock, which unlink and rename hold when they drop
+  // released nodes, so a released node is never taken for a file which was
+  // replaced.
+  std::shared_ptr<FileNode> findOrCreate(
+      const char *plainName,
+      const std::shared_ptr<FileNode> &created = std::shared_ptr<FileNode>());
+
+  // Builds a FileNode for plainName, doing the name encoding.
+  std::shared_ptr<FileNode> newNode(const char *plainName);
 
-  pthread_mutex_t mutex;
+  // newNode(), if plainName isn't open already and has no released node to
+  // reuse.  Called before taking the path lock.
+  std::shared_ptr<FileNode> prepareNode(const char *plainName);
+  std::atomic<PrepareHook> prepareHook;
+
+  /*
+      Operations on a single path only serialize with other operations on
+      paths that hash to the same lock.  rename and link can affect many
+      paths (a directory rename with chained name IVs renames every open node
+      below it), so they hold all of the locks.
+  */
+  static const int PathLockStripes = 64;
+  pthread_mutex_t pathLocks[PathLockStripes];
+  pthread_mutex_t &pathLock(const char *plainName);
 
   EncFS_Context *ctx;
 
+  // state of a backing file, as returned by lstat()
+  struct BackingStamp {
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+  };
+
+  struct AttrCacheEntry {
+    uint64_t key;
+    std::string plainName;
+    // empty while the first getAttr for the path is running
+    std::string cipherName;
+    // changes whenever the entry is created, see storeAttr
+    uint64_t generation;
+    BackingStamp stamp;
+    // symlink target length, -1 if not a symlink
+    off_t linkSize;
+    // getAttr result, only used after a matching lstat() if checkAttr
+    bool attrValid;
+    bool checkAttr;
+    struct stat attr;
+  };
+  typedef std::list<AttrCacheEntry> AttrCacheList;
+
+  // list is most recently used first, map is keyed by a hash of the
+  // plaintext name, so lookups don't allocate.
+  struct AttrCacheStripe {
+    pthread_mutex_t mutex;
+    AttrCacheList list;
+    std::unordered_map<uint64_t, AttrCacheList::iterator> map;
+    uint64_t nextGeneration;
+  };
+
+  AttrCacheStripe &attrStripe(uint64_t key);
+  void storeAttr(AttrCacheEntry &entry);
+
+  AttrCacheStripe attrStripes[AttrCacheStripes];
+  bool checkAttr;
+
   // passed in as configuration
   std::string rootDir;
   FSConfigPtr fsConfig;
@@ -69,14 +69,16 @@ struct EncFSConfig {
 
   bool plainData;         // do not encrypt file content
 
-  int blockMACBytes;      // MAC headers on blocks..
-  int blockMACRandBytes;  // number of random bytes in the block header
+  int blockMACBytes;       // MAC headers on blocks..
+  int blockMACRandBytes;   // number of random bytes in the block header
+  bool blockMACTagBlocks;  // MAC headers kept apart from the data blocks
 
   bool uniqueIV;            // per-file Initialization Vector
   bool externalIVChaining;  // IV seeding by filename IV chaining
 
   bool chainedNameIV;  // filename IV chaining
   bool allowHoles;     // allow holes in files (implicit zero blocks)
+  bool alignedHeader;  // per-file IV header padded to a page boundary
 
   EncFSConfig() : keyData(), salt() {
     cfgType = Config_None;
@@ -84,10 +86,12 @@ struct EncFSConfig {
     plainData = false;
     blockMACBytes = 0;
     blockMACRandBytes = 0;
+    blockMACTagBlocks = false;
     uniqueIV = false;
     externalIVChaining = false;
     chainedNameIV = false;
     allowHoles = false;
+    alignedHeader = false;
 
     kdfIterations = 0;
     desiredKDFDuration = 500;
@@ -20,6 +20,8 @@
 
 #include "FileIO.h"
 
+#include <cerrno>
+
 namespace encfs {
 
 FileIO::FileIO() = default;
@@ -33,4 +35,48 @@ bool FileIO::setIV(uint64_t iv) {
   return true;
 }
 
+int FileIO::create(int flags, mode_t mode) {
+  (void)flags;
+  (void)mode;
+  return -ENOSYS;
+}
+
+void FileIO::release(bool closeFd) { (void)closeFd; }
+
+int FileIO::allocate(off_t offset, off_t length) {
+  (void)offset;
+  (void)length;
+  return -EOPNOTSUPP;
+}
+
+bool FileIO::isHole(off_t offset, size_t length) const {
+  (void)offset;
+  (void)length;
+  return false;
+}
+
+int FileIO::punchHole(off_t offset, off_t length) {
+  (void)offset;
+  (void)length;
+  return -EOPNOTSUPP;
+}
+
+ssize_t FileIO::readMapped(off_t offset, size_t len, const DataFn &fn) const {
+  (void)offset;
+  (void)len;
+  (void)fn;
+  return -EOPNOTSUPP;
+}
+
+int FileIO::startRead(const IORequest &req) const {
+  (void)req;
+  return -EOPNOTSUPP;
+}
+
+ssize_t FileIO::waitRead() const { return -EINVAL; }
+
+ssize_t FileIO::startWrite(const IORequest &req) { return write(req); }
+
+int FileIO::waitWrites() { return 0; }
+
 }  // namespace encfs
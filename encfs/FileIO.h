@@ -21,6 +21,7 @@
 #ifndef _FileIO_incl_
 #define _FileIO_incl_
 
+#include <functional>
 #include <inttypes.h>
 #include <stdint.h>
 #include <sys/types.h>
@@ -37,10 +38,14 @@ struct IORequest {
   size_t dataLen;
   unsigned char *data;
 
+  // bytes in front of data which are free for use, so that a layer can put
+  // its header there instead of copying the data behind one.
+  size_t headroom;
+
   IORequest();
 };
 
-inline IORequest::IORequest() : offset(0), dataLen(0), data(0) {}
+inline IORequest::IORequest() : offset(0), dataLen(0), data(0), headroom(0) {}
 
 class FileIO {
  public:
@@ -63,6 +68,16 @@ class FileIO {
   // file is open until the FileIO interface is destroyed.
   virtual int open(int flags) = 0;
 
+  // create a new file (O_CREAT | O_EXCL) and open it for the specified mode.
+  // Returns -ENOSYS if the layer doesn't support it.
+  virtual int create(int flags, mode_t mode);
+
+  // called when the last user of the file goes away, but the interface is
+  // kept for reuse.  Cached state which may go stale is dropped, and the
+  // descriptor is closed as well if closeFd is set.  A later open() starts
+  // over.  The default does nothing.
+  virtual void release(bool closeFd);
+
   // get filesystem attributes for a file
   virtual int getAttr(struct stat *stbuf) const = 0;
   virtual off_t getSize() const = 0;
@@ -70,8 +85,45 @@ class FileIO {
   virtual ssize_t read(const IORequest &req) const = 0;
   virtual ssize_t write(const IORequest &req) = 0;
 
+  // read without a copy, for layers which have the data in memory.  fn is
+  // called with up to len bytes at offset, fewer at the end of the file,
+  // and returns 0 or -errno.  Returns the number of bytes fn was given (0
+  // at the end of the file), fn's error, or -EOPNOTSUPP if the data can't
+  // be had this way, in which case the caller read()s it.  The default
+  // returns -EOPNOTSUPP.
+  using DataFn = std::function<int(const unsigned char *data, size_t len)>;
+  virtual ssize_t readMapped(off_t offset, size_t len,
+                             const DataFn &fn) const;
+
+  // start a read which may complete in the background, returning 0 once it
+  // is under way.  The request's data must be left alone until waitRead()
+  // returns the read's result.  Only one read at a time can be in flight in
+  // a thread, and none while writes are.  Returns -EOPNOTSUPP if the caller
+  // has to read() the data instead, which is what the default does.
+  virtual int startRead(const IORequest &req) const;
+  virtual ssize_t waitRead() const;
+
+  // start a write which may complete in the background.  The request's data
+  // must be left alone until waitWrites() returns, which waits for all
+  // writes started so far and returns 0 or the first error.  Only one file
+  // at a time can have writes in flight in a thread.  By default the write
+  // is done right away.
+  virtual ssize_t startWrite(const IORequest &req);
+  virtual int waitWrites();
+
   virtual int truncate(off_t size) = 0;
 
+  // reserve backing storage for a range of the file, without changing its
+  // size.  Returns -EOPNOTSUPP if the layer doesn't support it.
+  virtual int allocate(off_t offset, off_t length);
+
+  // sparse file support, used when holes are allowed.  isHole() returns
+  // true if the whole range is a hole within the file, which reads as 0's.
+  // punchHole() turns a range into a hole, extending the file if needed,
+  // and returns -EOPNOTSUPP if the layer doesn't support it.
+  virtual bool isHole(off_t offset, size_t length) const;
+  virtual int punchHole(off_t offset, off_t length);
+
   virtual bool isWritable() const = 0;
 
  private:
@@ -32,12 +32,16 @@
 #include <unistd.h>
 
 #include "CipherFileIO.h"
+#include "DirNode.h"
 #include "Error.h"
 #include "FileIO.h"
 #include "FileUtils.h"
 #include "MACFileIO.h"
+#include "MACTagFileIO.h"
+#include "MMapFileIO.h"
 #include "Mutex.h"
 #include "RawFileIO.h"
+#include "SyncScheduler.h"
 
 using namespace std;
 
@@ -53,8 +57,7 @@ namespace encfs {
 */
 
 FileNode::FileNode(DirNode *parent_, const FSConfigPtr &cfg,
-                   const char *plaintextName_, const char *cipherName_,
-                   uint64_t fuseFh) {
+                   const char *plaintextName_, const char *cipherName_) {
 
   pthread_mutex_init(&mutex, nullptr);
 
@@ -68,15 +71,26 @@ FileNode::FileNode(DirNode *parent_, const FSConfigPtr &cfg,
 
   this->fsConfig = cfg;
 
-  this->fuseFh = fuseFh;
+  this->fuseFh = 0;
 
   // chain RawFileIO & CipherFileIO
-  std::shared_ptr<FileIO> rawIO(new RawFileIO(_cname));
+  std::shared_ptr<FileIO> rawIO;
+  if (cfg->opts->mmapRead) {
+    rawIO.reset(
+        new MMapFileIO(_cname, cfg->opts->syncTruncate, cfg->opts->ioUring));
+  } else {
+    rawIO.reset(new RawFileIO(_cname, cfg->opts->syncTruncate,
+                              cfg->opts->ioUring, cfg->opts->directIO));
+  }
   io = std::shared_ptr<FileIO>(new CipherFileIO(rawIO, fsConfig));
 
   if ((cfg->config->blockMACBytes != 0) ||
       (cfg->config->blockMACRandBytes != 0)) {
-    io = std::shared_ptr<FileIO>(new MACFileIO(io, fsConfig));
+    if (cfg->config->blockMACTagBlocks) {
+      io = std::shared_ptr<FileIO>(new MACTagFileIO(io, fsConfig));
+    } else {
+      io = std::shared_ptr<FileIO>(new MACFileIO(io, fsConfig));
+    }
   }
 }
 
@@ -148,28 +162,57 @@ bool FileNode::setName(const char *plaintextName_, const char *cipherName_,
   return true;
 }
 
-int FileNode::mknod(mode_t mode, dev_t rdev, uid_t uid, gid_t gid) {
-  Lock _lock(mutex);
-
-  int res;
-  int olduid = -1;
-  int oldgid = -1;
+// Switch the filesystem uid / gid to the ones given, if not 0, so that new
+// files get the right owner.  The previous ids are returned in olduid and
+// oldgid, for restoreFsIds.
+static int switchFsIds(uid_t uid, gid_t gid, int *olduid, int *oldgid) {
+  *olduid = -1;
+  *oldgid = -1;
   if (gid != 0) {
-    oldgid = setfsgid(gid);
-    if (oldgid == -1) {
+    *oldgid = setfsgid(gid);
+    if (*oldgid == -1) {
       int eno = errno;
       RLOG(DEBUG) << "setfsgid error: " << strerror(eno);
       return -EPERM;
     }
   }
   if (uid != 0) {
-    olduid = setfsuid(uid);
-    if (olduid == -1) {
+    *olduid = setfsuid(uid);
+    if (*olduid == -1) {
       int eno = errno;
       RLOG(DEBUG) << "setfsuid error: " << strerror(eno);
       return -EPERM;
     }
   }
+  return 0;
+}
+
+static void restoreFsIds(int olduid, int oldgid) {
+  if (olduid >= 0) {
+    if(setfsuid(olduid) == -1) {
+      int eno = errno;
+      RLOG(DEBUG) << "setfsuid back error: " << strerror(eno);
+      // does not return error here as initial setfsuid worked
+    }
+  }
+  if (oldgid >= 0) {
+    if(setfsgid(oldgid) == -1) {
+      int eno = errno;
+      RLOG(DEBUG) << "setfsgid back error: " << strerror(eno);
+      // does not return error here as initial setfsgid worked
+    }
+  }
+}
+
+int FileNode::mknod(mode_t mode, dev_t rdev, uid_t uid, gid_t gid) {
+  Lock _lock(mutex);
+
+  int olduid;
+  int oldgid;
+  int res = switchFsIds(uid, gid, &olduid, &oldgid);
+  if (res != 0) {
+    return res;
+  }
 
   /*
    * cf. xmp_mknod() in fusexmp.c
@@ -193,21 +236,30 @@ int FileNode::mknod(mode_t mode, dev_t rdev, uid_t uid, gid_t gid) {
     res = -eno;
   }
 
-  if (olduid >= 0) {
-    if(setfsuid(olduid) == -1) {
-      int eno = errno;
-      RLOG(DEBUG) << "setfsuid back error: " << strerror(eno);
-      // does not return error here as initial setfsuid worked
-    }
+  restoreFsIds(olduid, oldgid);
+  parent->invalidateEntry(_pname.c_str());
+
+  return res;
+}
+
+int FileNode::create(mode_t mode, int flags, uid_t uid, gid_t gid) {
+  Lock _lock(mutex);
+
+  int olduid;
+  int oldgid;
+  int res = switchFsIds(uid, gid, &olduid, &oldgid);
+  if (res != 0) {
+    return res;
   }
-  if (oldgid >= 0) {
-    if(setfsgid(oldgid) == -1) {
-      int eno = errno;
-      RLOG(DEBUG) << "setfsgid back error: " << strerror(eno);
-      // does not return error here as initial setfsgid worked
-    }
+
+  res = io->create(flags, mode);
+  if (res < 0) {
+    VLOG(1) << "create error: " << strerror(-res);
   }
 
+  restoreFsIds(olduid, oldgid);
+  parent->invalidateEntry(_pname.c_str());
+
   return res;
 }
 
@@ -215,9 +267,18 @@ int FileNode::open(int flags) const {
   Lock _lock(mutex);
 
   int res = io->open(flags);
+  if ((flags & O_TRUNC) != 0) {
+    parent->invalidateAttr(_pname.c_str());
+  }
   return res;
 }
 
+void FileNode::release(bool closeFd) {
+  Lock _lock(mutex);
+
+  io->release(closeFd);
+}
+
 int FileNode::getAttr(struct stat *stbuf) const {
   Lock _lock(mutex);
 
@@ -225,6 +286,19 @@ int FileNode::getAttr(struct stat *stbuf) const {
   return res;
 }
 
+void FileNode::adjustAttr(const FSConfigPtr &cfg, struct stat *stbuf) {
+  // must match the FileIO stack built by the constructor
+  CipherFileIO::adjustAttr(cfg, stbuf);
+  if ((cfg->config->blockMACBytes != 0) ||
+      (cfg->config->blockMACRandBytes != 0)) {
+    if (cfg->config->blockMACTagBlocks) {
+      MACTagFileIO::adjustAttr(cfg, stbuf);
+    } else {
+      MACFileIO::adjustAttr(cfg, stbuf);
+    }
+  }
+}
+
 off_t FileNode::getSize() const {
   Lock _lock(mutex);
 
@@ -254,6 +328,7 @@ ssize_t FileNode::write(off_t offset, unsigned char *data, size_t size) {
   Lock _lock(mutex);
 
   ssize_t res = io->write(req);
+  parent->invalidateAttr(_pname.c_str());
   // Of course due to encryption we genrally write more than requested
   if (res < 0) {
     return res;
@@ -264,31 +339,49 @@ ssize_t FileNode::write(off_t offset, unsigned char *data, size_t size) {
 int FileNode::truncate(off_t size) {
   Lock _lock(mutex);
 
-  return io->truncate(size);
+  int res = io->truncate(size);
+  parent->invalidateAttr(_pname.c_str());
+  return res;
 }
 
-int FileNode::sync(bool datasync) {
+/*
+    The space is reserved in the backing file first, where its filesystem
+    supports that.  Extending the file then only writes encrypted zero
+    blocks if holes are not allowed, and in that case the space is also
+    reserved when the backing filesystem can't do it.
+*/
+int FileNode::allocate(off_t offset, off_t length, bool keepSize) {
   Lock _lock(mutex);
 
-  int fh = io->open(O_RDONLY);
-  if (fh >= 0) {
-    int res = -EIO;
-#if defined(HAVE_FDATASYNC)
-    if (datasync) {
-      res = fdatasync(fh);
-    } else {
-      res = fsync(fh);
+  int res = io->allocate(offset, length);
+  if (res == -EOPNOTSUPP && !keepSize && !fsConfig->config->allowHoles) {
+    res = 0;
+  }
+  if (res == 0 && !keepSize) {
+    off_t size = io->getSize();
+    if (size < 0) {
+      return (int)size;
     }
-#else
-    (void)datasync;
-    res = fsync(fh);
-#endif
-
-    if (res == -1) {
-      res = -errno;
+    if (offset + length > size) {
+      res = io->truncate(offset + length);
     }
+  }
+  parent->invalidateAttr(_pname.c_str());
+  return res;
+}
 
-    return res;
+/*
+    The node is only locked to get the descriptor.  It stays open while the
+    node is in use, and reads and writes don't have to wait for the sync.
+*/
+int FileNode::sync(bool datasync) {
+  int fh;
+  {
+    Lock _lock(mutex);
+    fh = io->open(O_RDONLY);
+  }
+  if (fh >= 0) {
+    return SyncScheduler::sync(fh, datasync);
   }
   return fh;
 }
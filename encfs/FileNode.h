@@ -47,14 +47,15 @@ class FileIO;
 class FileNode {
  public:
   FileNode(DirNode *parent, const FSConfigPtr &cfg, const char *plaintextName,
-           const char *cipherName, uint64_t fuseFh);
+           const char *cipherName);
   ~FileNode();
 
   // Use an atomic type. The canary is accessed without holding any
   // locks.
   std::atomic<std::uint32_t> canary;
 
-  // FUSE file handle that is passed to the kernel
+  // FUSE file handle that is passed to the kernel, assigned by
+  // EncFS_Context::putNode() while the node is open
   uint64_t fuseFh;
 
   const char *plaintextName() const;
@@ -72,11 +73,22 @@ class FileNode {
   // If uid/gid are not 0, then chown is used change ownership as specified
   int mknod(mode_t mode, dev_t rdev, uid_t uid = 0, gid_t gid = 0);
 
+  // create and open a regular file in one step, keeping the descriptor.
+  // Returns < 0 on error (-errno), file descriptor on success.
+  int create(mode_t mode, int flags, uid_t uid = 0, gid_t gid = 0);
+
   // Returns < 0 on error (-errno), file descriptor on success.
   int open(int flags) const;
 
+  // called when the node is no longer open, but kept for reuse.  See
+  // FileIO::release().
+  void release(bool closeFd);
+
   // getAttr returns 0 on success, -errno on failure
   int getAttr(struct stat *stbuf) const;
+  // same size adjustments as getAttr, applied to a stat() of the backing file
+  // for callers which don't have a FileNode
+  static void adjustAttr(const FSConfigPtr &cfg, struct stat *stbuf);
   off_t getSize() const;
 
   ssize_t read(off_t offset, unsigned char *data, size_t size) const;
@@ -85,6 +97,10 @@ class FileNode {
   // truncate the file to a particular size
   int truncate(off_t size);
 
+  // reserve space for a range of the file, extending it unless keepSize is
+  // set.  Returns 0 on success, -errno on failure.
+  int allocate(off_t offset, off_t length, bool keepSize);
+
   // datasync or full sync
   int sync(bool dataSync);
 
@@ -99,7 +99,17 @@ static int V5SubVersionDefault = 0;
  * numbering scheme does not work any longer.
  * boost-versioning.h implements a workaround that sets the version to
  * 20 for boost 1.42+. */
-const int V6SubVersion = 20100713;  // add version field for boost 1.42+
+// const int V6SubVersion = 20100713; // add version field for boost 1.42+
+const int V6SubVersion = 20261018;  // add alignedHeader, blockMACTagBlocks
+
+/*
+    Cipher interface version from which a volume may use a block layout that
+    older versions can't read: the aligned header or MAC tag blocks.  Older
+    versions don't implement it, so they refuse to mount such a volume
+    instead of misreading it.  Other volumes keep recording the version
+    before it.
+*/
+const int LayoutCipherVersion = 4;
 
 struct ConfigInfo {
   const char *fileName;
@@ -311,6 +321,12 @@ bool readV6Config(const char *configFile, EncFSConfig *cfg, ConfigInfo *info) {
     cfg->subVersion = version;
   }
   VLOG(1) << "subVersion = " << cfg->subVersion;
+  if (cfg->subVersion > V6SubVersion) {
+    RLOG(ERROR) << "Config subversion " << cfg->subVersion
+                << " found, which is newer than supported version "
+                << V6SubVersion;
+    return false;
+  }
 
   config->read("creator", &cfg->creator);
   config->read("cipherAlg", &cfg->cipherIface);
@@ -325,7 +341,15 @@ bool readV6Config(const char *configFile, EncFSConfig *cfg, ConfigInfo *info) {
   config->read("externalIVChaining", &cfg->externalIVChaining);
   config->read("blockMACBytes", &cfg->blockMACBytes);
   config->read("blockMACRandBytes", &cfg->blockMACRandBytes);
+  config->read("blockMACTagBlocks", &cfg->blockMACTagBlocks);
   config->read("allowHoles", &cfg->allowHoles);
+  config->read("alignedHeader", &cfg->alignedHeader);
+  if ((cfg->alignedHeader || cfg->blockMACTagBlocks) &&
+      cfg->cipherIface.current() < LayoutCipherVersion) {
+    RLOG(ERROR) << "Config uses a block layout its cipher version "
+                << cfg->cipherIface.current() << " doesn't allow";
+    return false;
+  }
 
   int encodedSize;
   config->read("encodedKeySize", &encodedSize);
@@ -554,7 +578,13 @@ bool writeV6Config(const char *configFile, const EncFSConfig *cfg) {
   addEl(doc, config, "externalIVChaining", (int)cfg->externalIVChaining);
   addEl(doc, config, "blockMACBytes", cfg->blockMACBytes);
   addEl(doc, config, "blockMACRandBytes", cfg->blockMACRandBytes);
+  if (cfg->blockMACTagBlocks) {
+    addEl(doc, config, "blockMACTagBlocks", (int)cfg->blockMACTagBlocks);
+  }
   addEl(doc, config, "allowHoles", (int)cfg->allowHoles);
+  if (cfg->alignedHeader) {
+    addEl(doc, config, "alignedHeader", (int)cfg->alignedHeader);
+  }
   addEl(doc, config, "encodedKeySize", (int)cfg->keyData.size());
   addEl(doc, config, "encodedKeyData", cfg->keyData);
   addEl(doc, config, "saltLen", (int)cfg->salt.size());
@@ -944,6 +974,19 @@ static void selectBlockMAC(int *macBytes, int *macRandBytes, bool forceMac) {
   *macRandBytes = randSize;
 }
 
+/**
+ * Ask the user where block MAC headers should be stored
+ */
+static bool selectMACTagBlocks() {
+  // xgroup(setup)
+  return boolDefaultNo(
+      _("Store the block headers apart from the data?\n"
+        "The headers of consecutive blocks are then kept together in\n"
+        "separate tag blocks, so the data blocks stay aligned with the\n"
+        "underlying filesystem.  Filesystems using this can't be read by\n"
+        "older versions of EncFS."));
+}
+
 /**
  * Ask the user if per-file unique IVs should be used
  */
@@ -957,6 +1000,19 @@ static bool selectUniqueIV(bool default_answer) {
       default_answer);
 }
 
+/**
+ * Ask the user if the per-file IV header should be padded to a page
+ */
+static bool selectAlignedHeader() {
+  // xgroup(setup)
+  return boolDefaultNo(
+      _("Pad the per-file IV header to a full page?\n"
+        "This keeps the encrypted blocks aligned with the pages of the\n"
+        "underlying filesystem, which is faster for block-aligned file io,\n"
+        "but adds 4 KiB per file to the storage requirements.\n"
+        "Filesystems using this can't be read by older versions of EncFS."));
+}
+
 /**
  * Ask the user if the filename IV should depend on the complete path
  */
@@ -992,6 +1048,20 @@ static bool selectZeroBlockPassThrough() {
         "This avoids writing encrypted blocks when file holes are created."));
 }
 
+/**
+ * The cipher interface to record for a new volume.  Unless the volume uses
+ * a layout older versions can't read, this is the version before
+ * LayoutCipherVersion, so that they can still mount it.
+ */
+static Interface volumeCipherIface(const Interface &iface, bool newLayout) {
+  if (newLayout || iface.current() < LayoutCipherVersion) {
+    return iface;
+  }
+  int back = iface.current() - (LayoutCipherVersion - 1);
+  return Interface(iface.name(), LayoutCipherVersion - 1, iface.revision(),
+                   std::max(0, iface.age() - back));
+}
+
 RootPtr createV6Config(EncFS_Context *ctx,
                        const std::shared_ptr<EncFS_Opts> &opts) {
   const std::string rootDir = opts->rootDir;
@@ -1036,8 +1106,10 @@ RootPtr createV6Config(EncFS_Context *ctx,
   Interface nameIOIface;        // selectNameCoding()
   int blockMACBytes = 0;        // selectBlockMAC()
   int blockMACRandBytes = 0;    // selectBlockMAC()
+  bool macTagBlocks = false;    // selectMACTagBlocks()
   bool plainData = false;       // selectPlainData()
   bool uniqueIV = true;         // selectUniqueIV()
+  bool alignedHeader = false;   // selectAlignedHeader()
   bool chainedIV = true;        // selectChainedIV()
   bool externalIV = false;      // selectExternalChainedIV()
   bool allowHoles = true;       // selectZeroBlockPassThrough()
@@ -1141,6 +1213,9 @@ RootPtr createV6Config(EncFS_Context *ctx,
       } else {
         chainedIV = selectChainedIV();
         uniqueIV = selectUniqueIV(true);
+        if (uniqueIV) {
+          alignedHeader = selectAlignedHeader();
+        }
         if (chainedIV && uniqueIV) {
           externalIV = selectExternalChainedIV();
         } else {
@@ -1151,6 +1226,9 @@ RootPtr createV6Config(EncFS_Context *ctx,
           externalIV = false;
         }
         selectBlockMAC(&blockMACBytes, &blockMACRandBytes, opts->requireMac);
+        if (blockMACBytes != 0 || blockMACRandBytes != 0) {
+          macTagBlocks = selectMACTagBlocks();
+        }
         allowHoles = selectZeroBlockPassThrough();
       }
     }
@@ -1168,8 +1246,19 @@ RootPtr createV6Config(EncFS_Context *ctx,
 
   std::shared_ptr<EncFSConfig> config(new EncFSConfig);
 
+  if ((alignedHeader || macTagBlocks) &&
+      cipher->interface().current() < LayoutCipherVersion) {
+    // xgroup(setup)
+    cout << _("The cipher doesn't support the aligned header or MAC tag "
+              "blocks, disabled.")
+         << "\n";
+    alignedHeader = false;
+    macTagBlocks = false;
+  }
+
   config->cfgType = Config_V6;
-  config->cipherIface = cipher->interface();
+  config->cipherIface =
+      volumeCipherIface(cipher->interface(), alignedHeader || macTagBlocks);
   config->keySize = keySize;
   config->blockSize = blockSize;
   config->plainData = plainData;
@@ -1178,10 +1267,12 @@ RootPtr createV6Config(EncFS_Context *ctx,
   config->subVersion = V6SubVersion;
   config->blockMACBytes = blockMACBytes;
   config->blockMACRandBytes = blockMACRandBytes;
+  config->blockMACTagBlocks = macTagBlocks;
   config->uniqueIV = uniqueIV;
   config->chainedNameIV = chainedIV;
   config->externalIVChaining = externalIV;
   config->allowHoles = allowHoles;
+  config->alignedHeader = alignedHeader;
 
   config->salt.clear();
   config->kdfIterations = 0;  // filled in by keying function
@@ -1353,7 +1444,15 @@ void showFSInfo(const EncFSConfig *config) {
          << "\n";
   }
   if ((config->blockMACBytes != 0) || (config->blockMACRandBytes != 0)) {
-    if (config->subVersion < 20040813) {
+    if (config->blockMACTagBlocks) {
+      cout << autosprintf(
+                  // xgroup(diag)
+                  _("Block Size: %i bytes, with %i byte MAC headers in "
+                    "separate tag blocks"),
+                  config->blockSize,
+                  config->blockMACBytes + config->blockMACRandBytes)
+           << endl;
+    } else if (config->subVersion < 20040813) {
       cout << autosprintf(
                   // xgroup(diag)
                   _("Block Size: %i bytes + %i byte MAC header"),
@@ -1376,8 +1475,14 @@ void showFSInfo(const EncFSConfig *config) {
   }
 
   if (config->uniqueIV) {
-    // xgroup(diag)
-    cout << _("Each file contains 8 byte header with unique IV data.\n");
+    if (config->alignedHeader) {
+      // xgroup(diag)
+      cout << _("Each file contains a page aligned header with unique IV "
+                "data.\n");
+    } else {
+      // xgroup(diag)
+      cout << _("Each file contains 8 byte header with unique IV data.\n");
+    }
   }
   if (config->chainedNameIV) {
     // xgroup(diag)
@@ -1622,7 +1727,8 @@ RootPtr initFS(EncFS_Context *ctx, const std::shared_ptr<EncFS_Opts> &opts) {
 
     if (opts->reverseEncryption) {
       if (config->blockMACBytes != 0 || config->blockMACRandBytes != 0 ||
-          config->externalIVChaining || config->chainedNameIV) {
+          config->externalIVChaining || config->chainedNameIV ||
+          config->alignedHeader) {
         cout << _(
             "The configuration loaded is not compatible with --reverse\n");
         return rootInfo;
@@ -96,8 +96,20 @@ struct EncFS_Opts {
                  * behind the back of EncFS (for example, in reverse mode).
                  * See main.cpp for a longer explaination. */
 
+  bool checkAttr;  // check cached getattr results against the backing file
+
   bool readOnly;  // Mount read-only
 
+  bool syncTruncate;  // sync the backing file after a truncate
+
+  int syncfsThreshold;  // waiting files synced with syncfs(), 0 = never
+
+  bool ioUring;  // backing file I/O through io_uring, see IOUring
+
+  bool directIO;  // open backing files with O_DIRECT
+
+  bool mmapRead;  // read backing files through a mapping, see MMapFileIO
+
   bool insecure; // Allow to use plain data / to disable data encoding
 
   bool requireMac;  // Throw an error if MAC is disabled
@@ -119,7 +131,13 @@ struct EncFS_Opts {
     reverseEncryption = false;
     configMode = Config_Prompt;
     noCache = false;
+    checkAttr = false;
     readOnly = false;
+    syncTruncate = true;
+    syncfsThreshold = 0;
+    ioUring = false;
+    directIO = false;
+    mmapRead = false;
     insecure = false;
     requireMac = false;
   }
@@ -0,0 +1,366 @@
+/*****************************************************************************
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "IOUring.h"
+
+#include "easylogging++.h"
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <sys/uio.h>
+
+#include "MemoryPool.h"
+#include "config.h"
+
+#if defined(HAVE_LINUX_IO_URING_H)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace encfs {
+
+// submission queue size of each ring
+static const unsigned RingEntries = 64;
+
+// MemoryPool blocks registered with a ring at the same time
+static const unsigned RegisteredBuffers = 32;
+
+IOUring::IOUring()
+    : ringFd(-1),
+      entries(0),
+      queued(0),
+      inFlight(0),
+      ringMem(nullptr),
+      ringSize(0),
+      sqes(nullptr),
+      sqesSize(0),
+      sqHead(nullptr),
+      sqTail(nullptr),
+      sqMask(0),
+      sqArray(nullptr),
+      cqHead(nullptr),
+      cqTail(nullptr),
+      cqMask(0),
+      cqes(nullptr),
+      fixedBuffers(false),
+      nextBuffer(0),
+      poolGeneration(0) {}
+
+IOUring *IOUring::get() {
+  static thread_local std::unique_ptr<IOUring> ring;
+  static thread_local bool tried = false;
+
+  if (!tried) {
+    tried = true;
+    ring.reset(new IOUring());
+    if (!ring->init()) {
+      ring.reset();
+    }
+  }
+  return ring.get();
+}
+
+bool IOUring::available() {
+  IOUring ring;
+  return ring.init();
+}
+
+#if defined(HAVE_LINUX_IO_URING_H)
+
+template <typename T>
+static T *ringField(void *base, unsigned offset) {
+  return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+}
+
+static unsigned loadAcquire(const unsigned *p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void storeRelease(unsigned *p, unsigned value) {
+  __atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+/*
+    Sets up the ring with the submission and completion queues in one
+    mapping, which kernels since 5.4 provide.  Older kernels are left to the
+    usual system calls.
+*/
+bool IOUring::init() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ringFd = (int)syscall(__NR_io_uring_setup, RingEntries, &params);
+  if (ringFd < 0) {
+    VLOG(1) << "io_uring not available: " << strerror(errno);
+    return false;
+  }
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+    VLOG(1) << "io_uring too old, no single mmap";
+    return false;
+  }
+
+  entries = params.sq_entries;
+  size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cqSize =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ringSize = sqSize > cqSize ? sqSize : cqSize;
+  ringMem = mmap(nullptr, ringSize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+  if (ringMem == MAP_FAILED) {
+    ringMem = nullptr;
+    return false;
+  }
+  sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  void *sqeMem = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+  if (sqeMem == MAP_FAILED) {
+    return false;
+  }
+  sqes = static_cast<struct io_uring_sqe *>(sqeMem);
+
+  sqHead = ringField<unsigned>(ringMem, params.sq_off.head);
+  sqTail = ringField<unsigned>(ringMem, params.sq_off.tail);
+  sqMask = *ringField<unsigned>(ringMem, params.sq_off.ring_mask);
+  sqArray = ringField<unsigned>(ringMem, params.sq_off.array);
+  cqHead = ringField<unsigned>(ringMem, params.cq_off.head);
+  cqTail = ringField<unsigned>(ringMem, params.cq_off.tail);
+  cqMask = *ringField<unsigned>(ringMem, params.cq_off.ring_mask);
+  cqes = ringField<struct io_uring_cqe>(ringMem, params.cq_off.cqes);
+
+#if defined(IORING_RSRC_REGISTER_SPARSE)
+  // an empty table, which MemoryPool blocks are added to as they are used
+  struct io_uring_rsrc_register reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.nr = RegisteredBuffers;
+  reg.flags = IORING_RSRC_REGISTER_SPARSE;
+  if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS2, &reg,
+              sizeof(reg)) == 0) {
+    fixedBuffers = true;
+    buffers.resize(RegisteredBuffers, Buffer{nullptr, 0});
+    poolGeneration = MemoryPool::generation();
+  } else {
+    VLOG(1) << "io_uring buffers can't be registered: " << strerror(errno);
+  }
+#endif
+
+  return true;
+}
+
+IOUring::~IOUring() {
+  if (sqes != nullptr) {
+    munmap(sqes, sqesSize);
+  }
+  if (ringMem != nullptr) {
+    munmap(ringMem, ringSize);
+  }
+  if (ringFd >= 0) {
+    close(ringFd);
+  }
+}
+
+struct io_uring_sqe *IOUring::nextSqe() {
+  if (queued + inFlight >= entries) {
+    return nullptr;
+  }
+  unsigned tail = *sqTail;
+  unsigned index = tail & sqMask;
+  struct io_uring_sqe *sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqArray[index] = index;
+  storeRelease(sqTail, tail + 1);
+  ++queued;
+  return sqe;
+}
+
+/*
+    Slot of the registered buffer holding [buf, buf + len), registering the
+    MemoryPool block it belongs to if needed.  Returns -1 for other buffers.
+    All slots are dropped when a pool block has been freed, as its address
+    may since have been reused for a different block.
+*/
+int IOUring::fixedBuffer(const unsigned char *buf, size_t len) {
+  if (!fixedBuffers) {
+    return -1;
+  }
+  unsigned long generation = MemoryPool::generation();
+  if (generation != poolGeneration) {
+    dropBuffers();
+    poolGeneration = generation;
+  }
+
+  for (unsigned i = 0; i < buffers.size(); ++i) {
+    const Buffer &b = buffers[i];
+    if (b.data != nullptr && buf >= b.data && buf + len <= b.data + b.size) {
+      return (int)i;
+    }
+  }
+
+  const unsigned char *start;
+  int size;
+  if (!MemoryPool::findBlock(buf, &start, &size) || buf + len > start + size) {
+    return -1;
+  }
+
+#if defined(IORING_RSRC_REGISTER_SPARSE)
+  unsigned slot = nextBuffer;
+  nextBuffer = (nextBuffer + 1) % buffers.size();
+
+  struct iovec iov;
+  iov.iov_base = const_cast<unsigned char *>(start);
+  iov.iov_len = size;
+  struct io_uring_rsrc_update2 update;
+  memset(&update, 0, sizeof(update));
+  update.offset = slot;
+  update.data = (uint64_t)(uintptr_t)&iov;
+  update.nr = 1;
+  if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS_UPDATE,
+              &update, sizeof(update)) < 0) {
+    // most likely over the locked memory limit
+    VLOG(1) << "io_uring buffer registration failed: " << strerror(errno);
+    fixedBuffers = false;
+    return -1;
+  }
+  buffers[slot].data = start;
+  buffers[slot].size = size;
+  return (int)slot;
+#else
+  return -1;
+#endif
+}
+
+void IOUring::dropBuffers() {
+#if defined(IORING_RSRC_REGISTER_SPARSE)
+  std::vector<struct iovec> iovs(buffers.size());
+  memset(iovs.data(), 0, iovs.size() * sizeof(struct iovec));
+  struct io_uring_rsrc_update2 update;
+  memset(&update, 0, sizeof(update));
+  update.offset = 0;
+  update.data = (uint64_t)(uintptr_t)iovs.data();
+  update.nr = buffers.size();
+  if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS_UPDATE,
+              &update, sizeof(update)) < 0) {
+    fixedBuffers = false;
+  }
+#endif
+  for (Buffer &b : buffers) {
+    b.data = nullptr;
+    b.size = 0;
+  }
+  nextBuffer = 0;
+}
+
+bool IOUring::prepRead(int fd, unsigned char *buf, size_t len, off_t offset,
+                       uint64_t tag) {
+  int slot = fixedBuffer(buf, len);
+  struct io_uring_sqe *sqe = nextSqe();
+  if (sqe == nullptr) {
+    return false;
+  }
+  sqe->opcode = slot >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->buf_index = slot >= 0 ? slot : 0;
+  sqe->user_data = tag;
+  return true;
+}
+
+bool IOUring::prepWrite(int fd, const unsigned char *buf, size_t len,
+                        off_t offset, uint64_t tag) {
+  int slot = fixedBuffer(buf, len);
+  struct io_uring_sqe *sqe = nextSqe();
+  if (sqe == nullptr) {
+    return false;
+  }
+  sqe->opcode = slot >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->buf_index = slot >= 0 ? slot : 0;
+  sqe->user_data = tag;
+  return true;
+}
+
+bool IOUring::prepFsync(int fd, bool dataSync, uint64_t tag) {
+  struct io_uring_sqe *sqe = nextSqe();
+  if (sqe == nullptr) {
+    return false;
+  }
+  sqe->opcode = IORING_OP_FSYNC;
+  sqe->fd = fd;
+  sqe->fsync_flags = dataSync ? IORING_FSYNC_DATASYNC : 0;
+  sqe->user_data = tag;
+  return true;
+}
+
+int IOUring::submit(unsigned minComplete) {
+  while (true) {
+    unsigned flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int res = (int)syscall(__NR_io_uring_enter, ringFd, queued, minComplete,
+                           flags, nullptr, 0);
+    if (res >= 0) {
+      queued -= res;
+      inFlight += res;
+      if (queued == 0) {
+        return 0;
+      }
+      continue;
+    }
+    // out of resources for the moment, or interrupted
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      return -errno;
+    }
+  }
+}
+
+bool IOUring::reap(uint64_t *tag, int *res) {
+  unsigned head = *cqHead;
+  if (head == loadAcquire(cqTail)) {
+    return false;
+  }
+  const struct io_uring_cqe &cqe = cqes[head & cqMask];
+  *tag = cqe.user_data;
+  *res = cqe.res;
+  storeRelease(cqHead, head + 1);
+  --inFlight;
+  return true;
+}
+
+#else
+
+bool IOUring::init() { return false; }
+
+IOUring::~IOUring() {}
+
+bool IOUring::prepRead(int, unsigned char *, size_t, off_t, uint64_t) {
+  return false;
+}
+
+bool IOUring::prepWrite(int, const unsigned char *, size_t, off_t, uint64_t) {
+  return false;
+}
+
+bool IOUring::prepFsync(int, bool, uint64_t) { return false; }
+
+int IOUring::submit(unsigned) { return -ENOSYS; }
+
+bool IOUring::reap(uint64_t *, int *) { return false; }
+
+#endif
+
+}  // namespace encfs
@@ -0,0 +1,114 @@
+/*****************************************************************************
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _IOUring_incl_
+#define _IOUring_incl_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace encfs {
+
+/*
+    Backing file I/O through io_uring, using the kernel interface directly.
+
+    Each thread has a ring of its own, set up on first use.  Operations are
+    queued with prepRead() / prepWrite() / prepFsync(), handed to the kernel
+    with submit(), and their results taken with reap() in the order they
+    complete, along with the tag they were queued with.
+
+    Buffers from MemoryPool are registered with the ring the first time they
+    are used, so that their pages are not looked up again for every request.
+
+    Usage:
+    IOUring *ring = IOUring::get();
+    if (ring != nullptr && ring->prepRead(fd, buf, len, offset, tag)) {
+      ring->submit(1);
+      ring->reap(&tag, &res);
+    }
+*/
+class IOUring {
+ public:
+  // the calling thread's ring, or null if io_uring can't be used
+  static IOUring *get();
+
+  // whether io_uring can be used at all
+  static bool available();
+
+  ~IOUring();
+
+  // queue an operation.  Returns false if there's no room for it, in which
+  // case the operations in flight have to be reaped first.
+  bool prepRead(int fd, unsigned char *buf, size_t len, off_t offset,
+                uint64_t tag);
+  bool prepWrite(int fd, const unsigned char *buf, size_t len, off_t offset,
+                 uint64_t tag);
+  bool prepFsync(int fd, bool dataSync, uint64_t tag);
+
+  // submit the queued operations, and wait until at least minComplete
+  // operations are ready to be reaped.  Returns 0 or -errno.
+  int submit(unsigned minComplete);
+
+  // take the result of a completed operation, false if there is none
+  bool reap(uint64_t *tag, int *res);
+
+  // operations queued or in flight, which haven't been reaped yet
+  unsigned pending() const { return queued + inFlight; }
+
+ private:
+  IOUring();
+  bool init();
+  struct io_uring_sqe *nextSqe();
+  int fixedBuffer(const unsigned char *buf, size_t len);
+  void dropBuffers();
+
+  int ringFd;
+  unsigned entries;
+  unsigned queued;
+  unsigned inFlight;
+
+  void *ringMem;
+  size_t ringSize;
+  struct io_uring_sqe *sqes;
+  size_t sqesSize;
+
+  unsigned *sqHead;
+  unsigned *sqTail;
+  unsigned sqMask;
+  unsigned *sqArray;
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned cqMask;
+  struct io_uring_cqe *cqes;
+
+  // MemoryPool blocks registered with the ring, by slot
+  struct Buffer {
+    const unsigned char *data;
+    size_t size;
+  };
+  bool fixedBuffers;
+  std::vector<Buffer> buffers;
+  unsigned nextBuffer;
+  unsigned long poolGeneration;
+};
+
+}  // namespace encfs
+
+#endif
@@ -21,6 +21,7 @@
 #include "MACFileIO.h"
 
 #include "easylogging++.h"
+#include <algorithm>
 #include <cinttypes>
 #include <cstring>
 #include <sys/stat.h>
@@ -33,6 +34,7 @@
 #include "FileUtils.h"
 #include "MemoryPool.h"
 #include "i18n.h"
+#include "ZeroBlock.h"
 
 using namespace std;
 
@@ -52,13 +54,18 @@ namespace encfs {
 //
 static Interface MACFileIO_iface("FileIO/MAC", 2, 1, 0);
 
+// blocks and headers read together in readBlocks(), small enough to stay
+// in the CPU caches between decoding and checking them
+static const size_t ReadBatchSize = 32 * 1024;
+
 int dataBlockSize(const FSConfigPtr &cfg) {
   return cfg->config->blockSize - cfg->config->blockMACBytes -
          cfg->config->blockMACRandBytes;
 }
 
 MACFileIO::MACFileIO(std::shared_ptr<FileIO> _base, const FSConfigPtr &cfg)
-    : BlockFileIO(dataBlockSize(cfg), cfg),
+    : BlockFileIO(dataBlockSize(cfg), cfg,
+                  cfg->config->blockMACBytes + cfg->config->blockMACRandBytes),
       base(std::move(_base)),
       cipher(cfg->cipher),
       key(cfg->key),
@@ -78,6 +85,15 @@ Interface MACFileIO::interface() const { return MACFileIO_iface; }
 
 int MACFileIO::open(int flags) { return base->open(flags); }
 
+int MACFileIO::create(int flags, mode_t mode) {
+  return base->create(flags, mode);
+}
+
+void MACFileIO::release(bool closeFd) {
+  BlockFileIO::release(closeFd);
+  base->release(closeFd);
+}
+
 void MACFileIO::setFileName(const char *fileName) {
   base->setFileName(fileName);
 }
@@ -131,6 +147,14 @@ int MACFileIO::getAttr(struct stat *stbuf) const {
   return res;
 }
 
+void MACFileIO::adjustAttr(const FSConfigPtr &cfg, struct stat *stbuf) {
+  if (S_ISREG(stbuf->st_mode)) {
+    int headerSize = cfg->config->blockMACBytes + cfg->config->blockMACRandBytes;
+    int bs = dataBlockSize(cfg) + headerSize;
+    stbuf->st_size = locWithoutHeader(stbuf->st_size, bs, headerSize);
+  }
+}
+
 off_t MACFileIO::getSize() const {
   // adjust the size to hide the header overhead we tack on..
   int headerSize = macBytes + randBytes;
@@ -144,114 +168,253 @@ off_t MACFileIO::getSize() const {
   return size;
 }
 
+// The header is read into the headroom of the request if there is enough
+// of it, otherwise the block is read into a temporary buffer and copied.
 ssize_t MACFileIO::readOneBlock(const IORequest &req) const {
   int headerSize = macBytes + randBytes;
 
   int bs = blockSize() + headerSize;  // ok, should clearly fit into an int
 
-  MemBlock mb = MemoryPool::allocate(bs);
+  bool inPlace = req.headroom >= (size_t)headerSize;
+  MemBlock mb;
 
   IORequest tmp;
   tmp.offset = locWithHeader(req.offset, bs, headerSize);
-  tmp.data = mb.data;
+  if (inPlace) {
+    tmp.data = req.data - headerSize;
+    tmp.headroom = req.headroom - headerSize;
+  } else {
+    mb = MemoryPool::allocate(bs);
+    tmp.data = mb.data;
+  }
   tmp.dataLen = headerSize + req.dataLen;
 
   // get the data from the base FileIO layer
   ssize_t readSize = base->read(tmp);
 
-  // don't store zeros if configured for zero-block pass-through
-  bool skipBlock = true;
-  if (_allowHoles) {
-    for (int i = 0; i < readSize; ++i) {
-      if (tmp.data[i] != 0) {
-        skipBlock = false;
-        break;
+  if (readSize > headerSize) {
+    if (!checkBlock(tmp.data, readSize, req.offset)) {
+      readSize = -EBADMSG;
+    } else {
+      // now copy the data to the output buffer
+      readSize -= headerSize;
+      if (!inPlace) {
+        memcpy(req.data, tmp.data + headerSize, readSize);
       }
     }
-  } else if (macBytes > 0) {
-    skipBlock = false;
+  } else {
+    VLOG(1) << "readSize " << readSize << " at offset " << req.offset;
+    if (readSize > 0) {
+      readSize = 0;
+    }
   }
 
-  if (readSize > headerSize) {
-    if (!skipBlock) {
-      // At this point the data has been decoded.  So, compute the MAC of
-      // the block and check against the checksum stored in the header..
-      uint64_t mac =
-          cipher->MAC_64(tmp.data + macBytes, readSize - macBytes, key);
+  if (mb.data != nullptr) {
+    MemoryPool::release(mb);
+  }
 
-      // Constant time comparision to prevent timing attacks
-      unsigned char fail = 0;
-      for (int i = 0; i < macBytes; ++i, mac >>= 8) {
-        int test = mac & 0xff;
-        int stored = tmp.data[i];
+  return readSize;
+}
 
-        fail |= (test ^ stored);
-      }
+/*
+    Same as readOneBlock, for a run of whole blocks.  The blocks and their
+    headers are read a few at a time, and the data copied out.
+*/
+ssize_t MACFileIO::readBlocks(const IORequest &req) const {
+  int headerSize = macBytes + randBytes;
+  int userBs = blockSize();
+  int bs = userBs + headerSize;  // ok, should clearly fit into an int
+  size_t count = req.dataLen / userBs;
+  size_t batch = max((size_t)1, ReadBatchSize / bs);
+
+  MemBlock mb = MemoryPool::allocate(min(count, batch) * bs);
+  ssize_t res = 0;
+  size_t done = 0;
+  while (done < count) {
+    size_t n = min(batch, count - done);
+    IORequest tmp;
+    tmp.offset =
+        locWithHeader(req.offset + (off_t)(done * userBs), bs, headerSize);
+    tmp.data = mb.data;
+    tmp.dataLen = n * bs;
+    ssize_t readSize = base->read(tmp);
+    if (readSize < 0) {
+      res = readSize;
+      break;
+    }
 
-      if (fail > 0) {
-        // uh oh..
-        long blockNum = req.offset / bs;
-        RLOG(WARNING) << "MAC comparison failure in block " << blockNum;
-        if (!warnOnly) {
-          MemoryPool::release(mb);
-          return -EBADMSG;
-        }
+    size_t i = 0;
+    for (; i < n && readSize > (ssize_t)(i * bs) + headerSize; ++i) {
+      const unsigned char *block = mb.data + i * bs;
+      ssize_t blockLen = min((ssize_t)bs, readSize - (ssize_t)(i * bs));
+      if (!checkBlock(block, blockLen,
+                      req.offset + (off_t)((done + i) * userBs))) {
+        res = -EBADMSG;
+        break;
       }
+      memcpy(req.data + res, block + headerSize, blockLen - headerSize);
+      res += blockLen - headerSize;
     }
-
-    // now copy the data to the output buffer
-    readSize -= headerSize;
-    memcpy(req.data, tmp.data + headerSize, readSize);
-  } else {
-    VLOG(1) << "readSize " << readSize << " at offset " << req.offset;
-    if (readSize > 0) {
-      readSize = 0;
+    if (res < 0 || readSize < (ssize_t)tmp.dataLen) {
+      break;
     }
+    done += n;
   }
 
   MemoryPool::release(mb);
+  return res;
+}
 
-  return readSize;
+/*
+    Check the MAC of a block read along with its header, of more than
+    headerSize bytes.  A failure is only reported as such if the data isn't
+    to be made available anyway.
+*/
+bool MACFileIO::checkBlock(const unsigned char *block, ssize_t size,
+                           off_t offset) const {
+  // don't store zeros if configured for zero-block pass-through
+  bool skipBlock = true;
+  if (_allowHoles) {
+    skipBlock = isZeroBlock(block, size);
+  } else if (macBytes > 0) {
+    skipBlock = false;
+  }
+  if (skipBlock) {
+    return true;
+  }
+
+  // At this point the data has been decoded.  So, compute the MAC of
+  // the block and check against the checksum stored in the header..
+  uint64_t mac = cipher->MAC_64(block + macBytes, size - macBytes, key);
+
+  // Constant time comparision to prevent timing attacks
+  unsigned char fail = 0;
+  for (int i = 0; i < macBytes; ++i, mac >>= 8) {
+    int test = mac & 0xff;
+    int stored = block[i];
+
+    fail |= (test ^ stored);
+  }
+
+  if (fail > 0) {
+    // uh oh..
+    int bs = blockSize() + macBytes + randBytes;
+    long blockNum = offset / bs;
+    RLOG(WARNING) << "MAC comparison failure in block " << blockNum;
+    return warnOnly;
+  }
+  return true;
 }
 
+// The header is attached in the headroom of the request if there is
+// enough of it, otherwise the block is copied behind a header.
 ssize_t MACFileIO::writeOneBlock(const IORequest &req) {
   int headerSize = macBytes + randBytes;
 
   int bs = blockSize() + headerSize;  // ok, should clearly fit into an int
 
   // we have the unencrypted data, so we need to attach a header to it.
-  MemBlock mb = MemoryPool::allocate(bs);
+  MemBlock mb;
 
   IORequest newReq;
   newReq.offset = locWithHeader(req.offset, bs, headerSize);
-  newReq.data = mb.data;
+  if (req.headroom >= (size_t)headerSize) {
+    newReq.data = req.data - headerSize;
+    newReq.headroom = req.headroom - headerSize;
+  } else {
+    mb = MemoryPool::allocate(bs);
+    newReq.data = mb.data;
+    memcpy(newReq.data + headerSize, req.data, req.dataLen);
+  }
   newReq.dataLen = headerSize + req.dataLen;
 
   memset(newReq.data, 0, headerSize);
-  memcpy(newReq.data + headerSize, req.data, req.dataLen);
-  if (randBytes > 0) {
-    if (!cipher->randomize(newReq.data + macBytes, randBytes, false)) {
-      return -EBADMSG;
+  ssize_t writeSize = -EBADMSG;
+  if (storeAsHole(req.data, req.dataLen)) {
+    // passed through without a MAC, so the next level can make it a hole
+    writeSize = base->write(newReq);
+  } else if (randBytes == 0 ||
+             cipher->randomize(newReq.data + macBytes, randBytes, false)) {
+    if (macBytes > 0) {
+      // compute the mac (which includes the random data) and fill it in
+      uint64_t mac =
+          cipher->MAC_64(newReq.data + macBytes, req.dataLen + randBytes, key);
+
+      for (int i = 0; i < macBytes; ++i) {
+        newReq.data[i] = mac & 0xff;
+        mac >>= 8;
+      }
     }
+
+    // now, we can let the next level have it..
+    writeSize = base->write(newReq);
   }
 
-  if (macBytes > 0) {
-    // compute the mac (which includes the random data) and fill it in
-    uint64_t mac =
-        cipher->MAC_64(newReq.data + macBytes, req.dataLen + randBytes, key);
+  if (mb.data != nullptr) {
+    MemoryPool::release(mb);
+  }
 
-    for (int i = 0; i < macBytes; ++i) {
-      newReq.data[i] = mac & 0xff;
-      mac >>= 8;
+  // the header isn't part of what the caller wrote
+  return writeSize < 0 ? writeSize : (ssize_t)req.dataLen;
+}
+
+/*
+    Same as writeOneBlock, for a run of whole blocks.  The blocks and their
+    headers are put together in one buffer and passed down in large
+    requests.
+*/
+ssize_t MACFileIO::writeBlocks(const IORequest &req) {
+  int headerSize = macBytes + randBytes;
+  int userBs = blockSize();
+  int bs = userBs + headerSize;  // ok, should clearly fit into an int
+  size_t count = req.dataLen / userBs;
+  size_t batch = max((size_t)1, (size_t)WriteBatchSize / bs);
+
+  MemBlock mb = MemoryPool::allocate(min(count, batch) * bs);
+  ssize_t res = 0;
+  size_t done = 0;
+  while (done < count) {
+    size_t n = min(batch, count - done);
+    for (size_t i = 0; i < n; ++i) {
+      unsigned char *out = mb.data + i * bs;
+      memset(out, 0, headerSize);
+      memcpy(out + headerSize, req.data + (done + i) * userBs, userBs);
+      if (storeAsHole(out + headerSize, userBs)) {
+        continue;
+      }
+      if (randBytes > 0) {
+        if (!cipher->randomize(out + macBytes, randBytes, false)) {
+          res = -EBADMSG;
+          break;
+        }
+      }
+
+      if (macBytes > 0) {
+        uint64_t mac = cipher->MAC_64(out + macBytes, userBs + randBytes, key);
+        for (int j = 0; j < macBytes; ++j) {
+          out[j] = mac & 0xff;
+          mac >>= 8;
+        }
+      }
+    }
+    if (res < 0) {
+      break;
     }
-  }
 
-  // now, we can let the next level have it..
-  ssize_t writeSize = base->write(newReq);
+    IORequest newReq;
+    newReq.offset =
+        locWithHeader(req.offset + (off_t)(done * userBs), bs, headerSize);
+    newReq.data = mb.data;
+    newReq.dataLen = n * bs;
+    res = base->write(newReq);
+    if (res < 0) {
+      break;
+    }
+    done += n;
+  }
 
   MemoryPool::release(mb);
-
-  return writeSize;
+  return res < 0 ? res : (ssize_t)req.dataLen;
 }
 
 int MACFileIO::truncate(off_t size) {
@@ -267,6 +430,20 @@ int MACFileIO::truncate(off_t size) {
   return res;
 }
 
+int MACFileIO::allocate(off_t offset, off_t length) {
+  int headerSize = macBytes + randBytes;
+  int bs = blockSize() + headerSize;  // ok, should clearly fit into an int
+
+  off_t start = locWithHeader(offset, bs, headerSize);
+  off_t end = locWithHeader(offset + length, bs, headerSize);
+  return base->allocate(start, end - start);
+}
+
+// with holes allowed, 0 blocks are written without a header
+bool MACFileIO::storeAsHole(const unsigned char *buf, size_t size) const {
+  return _allowHoles && size == blockSize() && isZeroBlock(buf, size);
+}
+
 bool MACFileIO::isWritable() const { return base->isWritable(); }
 
 }  // namespace encfs
@@ -55,16 +55,27 @@ class MACFileIO : public BlockFileIO {
   virtual bool setIV(uint64_t iv);
 
   virtual int open(int flags);
+  virtual int create(int flags, mode_t mode);
+  virtual void release(bool closeFd);
   virtual int getAttr(struct stat *stbuf) const;
   virtual off_t getSize() const;
 
+  // adjust the stat() of a backing file to the size seen through this layer
+  static void adjustAttr(const FSConfigPtr &cfg, struct stat *stbuf);
+
   virtual int truncate(off_t size);
+  virtual int allocate(off_t offset, off_t length);
 
   virtual bool isWritable() const;
 
  private:
   virtual ssize_t readOneBlock(const IORequest &req) const;
   virtual ssize_t writeOneBlock(const IORequest &req);
+  virtual ssize_t readBlocks(const IORequest &req) const;
+  virtual ssize_t writeBlocks(const IORequest &req);
+  bool checkBlock(const unsigned char *block, ssize_t size,
+                  off_t offset) const;
+  bool storeAsHole(const unsigned char *buf, size_t size) const;
 
   std::shared_ptr<FileIO> base;
   std::shared_ptr<Cipher> cipher;
@@ -0,0 +1,386 @@
+/*****************************************************************************
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "MACTagFileIO.h"
+
+#include "easylogging++.h"
+#include <algorithm>
+#include <cstring>
+#include <sys/stat.h>
+#include <utility>
+
+#include "BlockFileIO.h"
+#include "Cipher.h"
+#include "Error.h"
+#include "FileIO.h"
+#include "FileUtils.h"
+#include "MemoryPool.h"
+#include "ZeroBlock.h"
+
+namespace encfs {
+
+static Interface MACTagFileIO_iface("FileIO/MACTag", 1, 0, 0);
+
+static int tagsPerBlockFor(const FSConfigPtr &cfg) {
+  return cfg->config->blockSize /
+         (cfg->config->blockMACBytes + cfg->config->blockMACRandBytes);
+}
+
+// location in the backing file of an offset in the user data
+static off_t dataLoc(off_t offset, int blockSize, int tagsPerBlock) {
+  off_t blockNum = offset / blockSize;
+  return (blockNum + blockNum / tagsPerBlock + 1) * blockSize +
+         offset % blockSize;
+}
+
+// location of the tag block for a group of tagsPerBlock blocks
+static off_t tagLoc(off_t group, int blockSize, int tagsPerBlock) {
+  return group * (tagsPerBlock + 1) * blockSize;
+}
+
+static off_t rawSize(off_t size, int blockSize, int tagsPerBlock) {
+  return size == 0 ? 0 : dataLoc(size - 1, blockSize, tagsPerBlock) + 1;
+}
+
+static off_t userSize(off_t rawSize, int blockSize, int tagsPerBlock) {
+  off_t groupSize = (off_t)(tagsPerBlock + 1) * blockSize;
+  off_t partial = rawSize % groupSize;
+  return (rawSize / groupSize) * tagsPerBlock * blockSize +
+         (partial > blockSize ? partial - blockSize : 0);
+}
+
+MACTagFileIO::MACTagFileIO(std::shared_ptr<FileIO> _base,
+                           const FSConfigPtr &cfg)
+    : BlockFileIO(cfg->config->blockSize, cfg),
+      base(std::move(_base)),
+      cipher(cfg->cipher),
+      key(cfg->key),
+      macBytes(cfg->config->blockMACBytes),
+      randBytes(cfg->config->blockMACRandBytes),
+      tagSize(macBytes + randBytes),
+      tagsPerBlock(tagsPerBlockFor(cfg)),
+      warnOnly(cfg->opts->forceDecode),
+      tagGroup(-1) {
+  rAssert(macBytes >= 0 && macBytes <= 8);
+  rAssert(randBytes >= 0);
+  rAssert(tagsPerBlock > 0);
+  tags = new unsigned char[_blockSize];
+  VLOG(1) << "fs block size = " << cfg->config->blockSize
+          << ", macBytes = " << macBytes << ", randBytes = " << randBytes
+          << ", tags per block = " << tagsPerBlock;
+}
+
+MACTagFileIO::~MACTagFileIO() { delete[] tags; }
+
+Interface MACTagFileIO::interface() const { return MACTagFileIO_iface; }
+
+int MACTagFileIO::open(int flags) { return base->open(flags); }
+
+int MACTagFileIO::create(int flags, mode_t mode) {
+  tagGroup = -1;
+  return base->create(flags, mode);
+}
+
+void MACTagFileIO::release(bool closeFd) {
+  BlockFileIO::release(closeFd);
+  tagGroup = -1;
+  base->release(closeFd);
+}
+
+void MACTagFileIO::setFileName(const char *fileName) {
+  base->setFileName(fileName);
+}
+
+const char *MACTagFileIO::getFileName() const { return base->getFileName(); }
+
+bool MACTagFileIO::setIV(uint64_t iv) {
+  // the tag block is encoded with the file IV
+  tagGroup = -1;
+  return base->setIV(iv);
+}
+
+int MACTagFileIO::getAttr(struct stat *stbuf) const {
+  int res = base->getAttr(stbuf);
+
+  if (res == 0 && S_ISREG(stbuf->st_mode)) {
+    stbuf->st_size = userSize(stbuf->st_size, _blockSize, tagsPerBlock);
+  }
+
+  return res;
+}
+
+void MACTagFileIO::adjustAttr(const FSConfigPtr &cfg, struct stat *stbuf) {
+  if (S_ISREG(stbuf->st_mode)) {
+    stbuf->st_size =
+        userSize(stbuf->st_size, cfg->config->blockSize, tagsPerBlockFor(cfg));
+  }
+}
+
+off_t MACTagFileIO::getSize() const {
+  off_t size = base->getSize();
+  if (size > 0) {
+    size = userSize(size, _blockSize, tagsPerBlock);
+  }
+  return size;
+}
+
+// make the tag block of a group current.  Tags past the end of the file
+// read as 0's.
+int MACTagFileIO::loadTags(off_t group) const {
+  if (group == tagGroup) {
+    return 0;
+  }
+
+  IORequest req;
+  req.offset = tagLoc(group, _blockSize, tagsPerBlock);
+  req.data = tags;
+  req.dataLen = _blockSize;
+  ssize_t readSize = base->read(req);
+  if (readSize < 0) {
+    tagGroup = -1;
+    return (int)readSize;
+  }
+  memset(tags + readSize, 0, _blockSize - readSize);
+  tagGroup = group;
+  return 0;
+}
+
+ssize_t MACTagFileIO::storeTags() {
+  IORequest req;
+  req.offset = tagLoc(tagGroup, _blockSize, tagsPerBlock);
+  req.data = tags;
+  req.dataLen = _blockSize;
+  ssize_t res = base->write(req);
+  if (res < 0) {
+    // the cached tags don't match the file any more
+    tagGroup = -1;
+  }
+  return res;
+}
+
+// compute the tag of a block, keeping the random bytes already in the tag
+static uint64_t blockMAC(const std::shared_ptr<Cipher> &cipher,
+                         const CipherKey &key, const unsigned char *data,
+                         int len, const unsigned char *rand, int randBytes) {
+  if (randBytes == 0) {
+    return cipher->MAC_64(data, len, key);
+  }
+  // same input as MACFileIO, the random bytes followed by the data
+  MemBlock mb = MemoryPool::allocate(randBytes + len);
+  memcpy(mb.data, rand, randBytes);
+  memcpy(mb.data + randBytes, data, len);
+  uint64_t mac = cipher->MAC_64(mb.data, randBytes + len, key);
+  MemoryPool::release(mb);
+  return mac;
+}
+
+bool MACTagFileIO::computeTag(const unsigned char *data, int len,
+                              unsigned char *tag) const {
+  memset(tag, 0, tagSize);
+  if (randBytes > 0) {
+    if (!cipher->randomize(tag + macBytes, randBytes, false)) {
+      return false;
+    }
+  }
+
+  if (macBytes > 0) {
+    uint64_t mac = blockMAC(cipher, key, data, len, tag + macBytes, randBytes);
+    for (int i = 0; i < macBytes; ++i) {
+      tag[i] = mac & 0xff;
+      mac >>= 8;
+    }
+  }
+  return true;
+}
+
+/*
+    Check the MAC of a block of the current tag group.  A failure is only
+    reported as such if the data isn't to be made available anyway.
+*/
+bool MACTagFileIO::checkBlock(const unsigned char *data, ssize_t size,
+                              off_t blockNum) const {
+  // don't check zeros if configured for zero-block pass-through
+  if (macBytes == 0 || (_allowHoles && isZeroBlock(data, size))) {
+    return true;
+  }
+
+  const unsigned char *tag = tags + (blockNum % tagsPerBlock) * tagSize;
+  uint64_t mac =
+      blockMAC(cipher, key, data, (int)size, tag + macBytes, randBytes);
+
+  // Constant time comparision to prevent timing attacks
+  unsigned char fail = 0;
+  for (int i = 0; i < macBytes; ++i, mac >>= 8) {
+    fail |= ((mac & 0xff) ^ tag[i]);
+  }
+
+  if (fail > 0) {
+    RLOG(WARNING) << "MAC comparison failure in block " << blockNum;
+    return warnOnly;
+  }
+  return true;
+}
+
+/*
+    The block is read straight into the caller's buffer, there are no
+    headers to strip.
+*/
+ssize_t MACTagFileIO::readOneBlock(const IORequest &req) const {
+  off_t blockNum = req.offset / _blockSize;
+  int res = loadTags(blockNum / tagsPerBlock);
+  if (res < 0) {
+    return res;
+  }
+
+  IORequest tmp = req;
+  tmp.offset = dataLoc(req.offset, _blockSize, tagsPerBlock);
+  ssize_t readSize = base->read(tmp);
+  if (readSize <= 0) {
+    VLOG(1) << "readSize " << readSize << " at offset " << req.offset;
+    return readSize;
+  }
+
+  if (!checkBlock(req.data, readSize, blockNum)) {
+    return -EBADMSG;
+  }
+  return readSize;
+}
+
+/*
+    Same as readOneBlock, for a run of whole blocks.  The blocks of a group
+    are next to each other in the backing file, so each group takes one
+    read of its tag block, if that isn't current already, and one of its
+    blocks.
+*/
+ssize_t MACTagFileIO::readBlocks(const IORequest &req) const {
+  off_t firstBlock = req.offset / _blockSize;
+  size_t done = 0;
+  while (done < req.dataLen) {
+    off_t blockNum = firstBlock + done / _blockSize;
+    int slot = blockNum % tagsPerBlock;
+    size_t len = std::min(req.dataLen - done,
+                          (size_t)(tagsPerBlock - slot) * _blockSize);
+
+    int res = loadTags(blockNum / tagsPerBlock);
+    if (res < 0) {
+      return res;
+    }
+
+    IORequest tmp;
+    tmp.offset = dataLoc(req.offset + done, _blockSize, tagsPerBlock);
+    tmp.data = req.data + done;
+    tmp.dataLen = len;
+    ssize_t readSize = base->read(tmp);
+    if (readSize < 0) {
+      return readSize;
+    }
+
+    for (ssize_t pos = 0; pos < readSize; pos += _blockSize) {
+      ssize_t blockLen = std::min(readSize - pos, (ssize_t)_blockSize);
+      if (!checkBlock(tmp.data + pos, blockLen, blockNum + pos / _blockSize)) {
+        return -EBADMSG;
+      }
+    }
+    done += readSize;
+    if ((size_t)readSize < len) {
+      break;
+    }
+  }
+  return done;
+}
+
+ssize_t MACTagFileIO::writeOneBlock(const IORequest &req) {
+  return writeBlocks(req);
+}
+
+/*
+    Tags are updated a group at a time: the group's blocks are written in
+    one request, then its tag block.  The data is passed down untouched, the
+    next level encodes it into a buffer of its own.
+    Blocks are always written before their tags, so that a tag block on disk
+    is never newer than the data it covers.  There is no journal: a crash
+    between the two writes leaves the blocks just written with their old
+    tags, which fail the MAC check (or pass with --forcedecode) until the
+    blocks are written again, as with a torn write of a block in front of
+    its MAC header in MACFileIO.
+*/
+ssize_t MACTagFileIO::writeBlocks(const IORequest &req) {
+  off_t firstBlock = req.offset / _blockSize;
+  size_t done = 0;
+  while (done < req.dataLen) {
+    off_t blockNum = firstBlock + done / _blockSize;
+    int slot = blockNum % tagsPerBlock;
+    size_t len = std::min(req.dataLen - done,
+                          (size_t)(tagsPerBlock - slot) * _blockSize);
+
+    int res = loadTags(blockNum / tagsPerBlock);
+    if (res < 0) {
+      return res;
+    }
+    for (size_t pos = 0; pos < len; pos += _blockSize, ++slot) {
+      const unsigned char *data = req.data + done + pos;
+      int blockLen = (int)std::min(len - pos, (size_t)_blockSize);
+      unsigned char *tag = tags + slot * tagSize;
+      if (_allowHoles && blockLen == (int)_blockSize &&
+          isZeroBlock(data, blockLen)) {
+        // 0 blocks get 0 tags, so the next level can make holes of them
+        memset(tag, 0, tagSize);
+      } else if (!computeTag(data, blockLen, tag)) {
+        tagGroup = -1;
+        return -EBADMSG;
+      }
+    }
+
+    IORequest tmp;
+    tmp.offset = dataLoc(req.offset + done, _blockSize, tagsPerBlock);
+    tmp.data = req.data + done;
+    tmp.dataLen = len;
+    ssize_t writeSize = base->write(tmp);
+    if (writeSize < 0) {
+      // the cached tags are ahead of the file
+      tagGroup = -1;
+      return writeSize;
+    }
+
+    writeSize = storeTags();
+    if (writeSize < 0) {
+      return writeSize;
+    }
+    done += len;
+  }
+  return req.dataLen;
+}
+
+int MACTagFileIO::truncate(off_t size) {
+  int res = BlockFileIO::truncateBase(size, nullptr);
+
+  if (res == 0) {
+    tagGroup = -1;
+    res = base->truncate(rawSize(size, _blockSize, tagsPerBlock));
+  }
+
+  return res;
+}
+
+int MACTagFileIO::allocate(off_t offset, off_t length) {
+  off_t group = offset / _blockSize / tagsPerBlock;
+  off_t start = tagLoc(group, _blockSize, tagsPerBlock);
+  off_t end = rawSize(offset + length, _blockSize, tagsPerBlock);
+  return base->allocate(start, end - start);
+}
+
+bool MACTagFileIO::isWritable() const { return base->isWritable(); }
+
+}  // namespace encfs
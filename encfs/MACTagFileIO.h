@@ -0,0 +1,104 @@
+/*****************************************************************************
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MACTagFileIO_incl_
+#define _MACTagFileIO_incl_
+
+#include <memory>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "BlockFileIO.h"
+#include "Cipher.h"
+#include "CipherKey.h"
+#include "FSConfig.h"
+#include "Interface.h"
+
+namespace encfs {
+
+class Cipher;
+class FileIO;
+struct IORequest;
+
+/*
+    Block MACs stored out of band, in tag blocks.
+
+    Same checks as MACFileIO, but instead of a header in front of every
+    block, the MACs (and random bytes) of N consecutive blocks are kept
+    together in a tag block which precedes them:
+
+      [tags 0..N-1][block 0]...[block N-1][tags N..2N-1][block N]...
+
+    with N = blockSize / (macBytes + randBytes).  Blocks hold a full
+    blockSize of user data, so they stay aligned in the backing file, and a
+    sequential read or write needs one tag block access per N blocks.  A
+    write of fewer blocks still rewrites their whole tag block.
+
+    Blocks are written before their tag block, see writeBlocks().
+*/
+class MACTagFileIO : public BlockFileIO {
+ public:
+  MACTagFileIO(std::shared_ptr<FileIO> base, const FSConfigPtr &cfg);
+  virtual ~MACTagFileIO();
+
+  virtual Interface interface() const;
+
+  virtual void setFileName(const char *fileName);
+  virtual const char *getFileName() const;
+  virtual bool setIV(uint64_t iv);
+
+  virtual int open(int flags);
+  virtual int create(int flags, mode_t mode);
+  virtual void release(bool closeFd);
+  virtual int getAttr(struct stat *stbuf) const;
+  virtual off_t getSize() const;
+
+  // adjust the stat() of a backing file to the size seen through this layer
+  static void adjustAttr(const FSConfigPtr &cfg, struct stat *stbuf);
+
+  virtual int truncate(off_t size);
+  virtual int allocate(off_t offset, off_t length);
+
+  virtual bool isWritable() const;
+
+ private:
+  virtual ssize_t readOneBlock(const IORequest &req) const;
+  virtual ssize_t writeOneBlock(const IORequest &req);
+  virtual ssize_t readBlocks(const IORequest &req) const;
+  virtual ssize_t writeBlocks(const IORequest &req);
+
+  int loadTags(off_t group) const;
+  ssize_t storeTags();
+  bool checkBlock(const unsigned char *data, ssize_t size,
+                  off_t blockNum) const;
+  bool computeTag(const unsigned char *data, int len, unsigned char *tag) const;
+
+  std::shared_ptr<FileIO> base;
+  std::shared_ptr<Cipher> cipher;
+  CipherKey key;
+  int macBytes;
+  int randBytes;
+  int tagSize;
+  int tagsPerBlock;
+  bool warnOnly;
+
+  // tag block of the last group used, -1 if none
+  mutable off_t tagGroup;
+  unsigned char *tags;
+};
+
+}  // namespace encfs
+
+#endif
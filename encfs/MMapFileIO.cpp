@@ -0,0 +1,236 @@
+/*****************************************************************************
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "MMapFileIO.h"
+
+#include "easylogging++.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
+
+namespace encfs {
+
+// reads in a row which make an access pattern
+static const int PatternReads = 4;
+
+// how far ahead of a sequential reader the kernel is asked to read
+static const off_t ReadAhead = 1024 * 1024;
+
+static long gPageSize = 4096;
+static struct sigaction gOldBusAction;
+static pthread_once_t gBusHandlerOnce = PTHREAD_ONCE_INIT;
+
+// the mapped range being accessed by this thread, and whether it faulted
+static thread_local const unsigned char *tGuardStart = nullptr;
+static thread_local const unsigned char *tGuardEnd = nullptr;
+static thread_local volatile sig_atomic_t tFaulted = 0;
+
+/*
+    A SIGBUS inside the guarded range means that the file was truncated
+    under the mapping.  The missing page is replaced by a page of 0's, so
+    that the access can go on, and the reader checks tFaulted afterwards.
+    Other faults are passed on to whoever had the signal before.
+*/
+static void busHandler(int sig, siginfo_t *info, void *context) {
+  auto *addr = static_cast<const unsigned char *>(info->si_addr);
+  if (addr >= tGuardStart && addr < tGuardEnd) {
+    uintptr_t page = (uintptr_t)addr & ~(uintptr_t)(gPageSize - 1);
+    if (mmap((void *)page, gPageSize, PROT_READ,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+      tFaulted = 1;
+      return;
+    }
+  }
+
+  if ((gOldBusAction.sa_flags & SA_SIGINFO) != 0) {
+    gOldBusAction.sa_sigaction(sig, info, context);
+  } else if (gOldBusAction.sa_handler != SIG_DFL &&
+             gOldBusAction.sa_handler != SIG_IGN) {
+    gOldBusAction.sa_handler(sig);
+  } else {
+    // the access is retried on return, and then gets the default action
+    sigaction(SIGBUS, &gOldBusAction, nullptr);
+  }
+}
+
+static void installBusHandler() {
+  gPageSize = sysconf(_SC_PAGESIZE);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = busHandler;
+  action.sa_flags = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGBUS, &action, &gOldBusAction);
+}
+
+MMapFileIO::MMapFileIO(std::string fileName, bool syncTruncate, bool ioUring)
+    : RawFileIO(std::move(fileName), syncTruncate, ioUring),
+      mapData(nullptr),
+      mapLen(0),
+      nextOffset(0),
+      sequentialReads(0),
+      randomReads(0),
+      advice(MADV_NORMAL),
+      adviseEnd(0) {
+  pthread_once(&gBusHandlerOnce, installBusHandler);
+}
+
+MMapFileIO::~MMapFileIO() { unmap(); }
+
+int MMapFileIO::open(int flags) {
+  int oldFd = fd;
+  int res = RawFileIO::open(flags);
+  // a new descriptor may be for a different file
+  if (res >= 0 && res != oldFd) {
+    unmap();
+  }
+  return res;
+}
+
+void MMapFileIO::release(bool closeFd) {
+  if (closeFd) {
+    unmap();
+  }
+  RawFileIO::release(closeFd);
+}
+
+ssize_t MMapFileIO::read(const IORequest &req) const {
+  ssize_t res = readMapped(req.offset, req.dataLen,
+                           [&](const unsigned char *data, size_t len) {
+                             memcpy(req.data, data, len);
+                             return 0;
+                           });
+  if (res == -EOPNOTSUPP) {
+    return RawFileIO::read(req);
+  }
+  return res;
+}
+
+ssize_t MMapFileIO::readMapped(off_t offset, size_t len,
+                               const DataFn &fn) const {
+  if (fd < 0) {
+    return -EOPNOTSUPP;
+  }
+  off_t size = getSize();
+  if (size < 0) {
+    return size;
+  }
+  if (offset >= size) {
+    return 0;
+  }
+  size_t count = (size_t)std::min((off_t)len, size - offset);
+  if (!mapTo(offset + count)) {
+    return -EOPNOTSUPP;
+  }
+  advise(offset, count);
+
+  const unsigned char *data = mapData + offset;
+  tFaulted = 0;
+  tGuardStart = data;
+  tGuardEnd = data + count;
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+
+  int res = fn(data, count);
+
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  tGuardStart = nullptr;
+  tGuardEnd = nullptr;
+
+  if (tFaulted != 0) {
+    // the mapping has 0's where the file was cut, start over with pread()
+    VLOG(1) << "file truncated under the mapping: " << name;
+    unmap();
+    const_cast<MMapFileIO *>(this)->knownSize = false;
+    return -EOPNOTSUPP;
+  }
+  return res < 0 ? res : (ssize_t)count;
+}
+
+/*
+    The mapping covers the file with some room to grow, which fills in as
+    data is appended.  It is only replaced when a read goes past it.
+*/
+bool MMapFileIO::mapTo(off_t end) const {
+  if (mapData != nullptr && (size_t)end <= mapLen) {
+    return true;
+  }
+  unmap();
+
+  off_t len = end + end / 4;
+  len = (len + gPageSize - 1) / gPageSize * gPageSize;
+  void *data = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    VLOG(1) << "mmap failed for " << name << ": " << strerror(errno);
+    return false;
+  }
+  mapData = static_cast<unsigned char *>(data);
+  mapLen = len;
+
+  if (advice != MADV_NORMAL) {
+    madvise(mapData, mapLen, advice);
+  }
+  adviseEnd = 0;
+  return true;
+}
+
+void MMapFileIO::unmap() const {
+  if (mapData != nullptr) {
+    munmap(mapData, mapLen);
+    mapData = nullptr;
+    mapLen = 0;
+  }
+}
+
+/*
+    A few reads in a row which follow each other switch the mapping to
+    sequential access, and the pages ahead of the reader are asked for.  A
+    few reads all over the place switch it to random access, which stops
+    the kernel from reading around every fault.
+*/
+void MMapFileIO::advise(off_t offset, size_t len) const {
+  if (offset == nextOffset) {
+    randomReads = 0;
+    if (++sequentialReads >= PatternReads && advice != MADV_SEQUENTIAL) {
+      advice = MADV_SEQUENTIAL;
+      madvise(mapData, mapLen, advice);
+    }
+  } else {
+    sequentialReads = 0;
+    if (++randomReads >= PatternReads && advice != MADV_RANDOM) {
+      advice = MADV_RANDOM;
+      madvise(mapData, mapLen, advice);
+    }
+  }
+  nextOffset = offset + len;
+
+  if (advice == MADV_SEQUENTIAL && nextOffset + ReadAhead / 2 > adviseEnd) {
+    off_t start = std::max(adviseEnd, nextOffset);
+    start -= start % gPageSize;
+    off_t end = std::min(start + ReadAhead, (off_t)mapLen);
+    if (end > start) {
+      madvise(mapData + start, end - start, MADV_WILLNEED);
+    }
+    adviseEnd = end;
+  }
+}
+
+}  // namespace encfs
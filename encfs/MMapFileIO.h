@@ -0,0 +1,71 @@
+/*****************************************************************************
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MMapFileIO_incl_
+#define _MMapFileIO_incl_
+
+#include <string>
+#include <sys/types.h>
+
+#include "RawFileIO.h"
+
+namespace encfs {
+
+/*
+    RawFileIO which reads through a shared mapping of the file, for
+    read-mostly volumes.
+
+    readMapped() hands out the mapped data, so that CipherFileIO decodes it
+    straight into the caller's buffer, without a read() into the buffer
+    first.  Writes and everything else go through RawFileIO.
+
+    If the file is truncated behind our back, accessing the pages past its
+    new end raises SIGBUS.  A handler puts 0's in place of the missing pages
+    for the access in progress, and the read is then done again with
+    pread().  Sequential and random access patterns are passed on to the
+    kernel with madvise().
+*/
+class MMapFileIO : public RawFileIO {
+ public:
+  MMapFileIO(std::string fileName, bool syncTruncate = true,
+             bool ioUring = false);
+  virtual ~MMapFileIO();
+
+  virtual int open(int flags);
+  virtual void release(bool closeFd);
+
+  virtual ssize_t read(const IORequest &req) const;
+  virtual ssize_t readMapped(off_t offset, size_t len,
+                             const DataFn &fn) const;
+
+ private:
+  bool mapTo(off_t end) const;
+  void unmap() const;
+  void advise(off_t offset, size_t len) const;
+
+  mutable unsigned char *mapData;
+  mutable size_t mapLen;
+
+  // access pattern detection
+  mutable off_t nextOffset;
+  mutable int sequentialReads;
+  mutable int randomReads;
+  mutable int advice;
+  mutable off_t adviseEnd;
+};
+
+}  // namespace encfs
+
+#endif
@@ -20,8 +20,11 @@
 
 #include "MemoryPool.h"
 
+#include <atomic>
+#include <cstdlib>
 #include <cstring>
-#include <openssl/ossl_typ.h>
+#include <map>
+#include <new>
 #include <pthread.h>
 
 #ifdef HAVE_VALGRIND_MEMCHECK_H
@@ -31,63 +34,88 @@
 #define VALGRIND_MAKE_MEM_UNDEFINED(a, b)
 #endif
 
-#include <openssl/buffer.h>
-
-#define BLOCKDATA(BLOCK) (unsigned char *)(BLOCK)->data->data
+#define BLOCKDATA(BLOCK) (BLOCK)->data
 
 namespace encfs {
 
 struct BlockList {
   BlockList *next;
   int size;
-  BUF_MEM *data;
+  // size of the last allocation, which is all that needs clearing
+  int used;
+  unsigned char *data;
 };
 
 static BlockList *allocBlock(int size) {
+  void *data = nullptr;
+  if (posix_memalign(&data, MemoryPool::Alignment, size) != 0) {
+    throw std::bad_alloc();
+  }
   auto *block = new BlockList;
   block->size = size;
-  block->data = BUF_MEM_new();
-  BUF_MEM_grow(block->data, size);
-  VALGRIND_MAKE_MEM_NOACCESS(block->data->data, block->data->max);
+  block->data = static_cast<unsigned char *>(data);
+  VALGRIND_MAKE_MEM_NOACCESS(block->data, size);
 
   return block;
 }
 
 static void freeBlock(BlockList *el) {
-  VALGRIND_MAKE_MEM_UNDEFINED(el->data->data, el->data->max);
-  BUF_MEM_free(el->data);
+  VALGRIND_MAKE_MEM_UNDEFINED(el->data, el->size);
+  free(el->data);
 
   delete el;
 }
 
+// Free blocks are kept up to this many bytes in total, so that the buffers
+// of large filesystem blocks are not held on to forever.
+static const long MaxPoolBytes = 16 * 1024 * 1024;
+
 static pthread_mutex_t gMPoolMutex = PTHREAD_MUTEX_INITIALIZER;
 static BlockList *gMemPool = nullptr;
+static long gPoolBytes = 0;
+
+// all blocks, free or in use, by address
+static std::map<const unsigned char *, BlockList *> gBlocks;
+static std::atomic<unsigned long> gGeneration(0);
 
 MemBlock MemoryPool::allocate(int size) {
   pthread_mutex_lock(&gMPoolMutex);
 
+  // take the smallest block which is large enough, so that small requests
+  // don't use up the large blocks
+  BlockList *bestParent = nullptr;
+  BlockList *block = nullptr;
   BlockList *parent = nullptr;
-  BlockList *block = gMemPool;
-  // check if we already have a large enough block available..
-  while (block != nullptr && block->size < size) {
-    parent = block;
-    block = block->next;
+  for (BlockList *el = gMemPool; el != nullptr; el = el->next) {
+    if (el->size >= size && (block == nullptr || el->size < block->size)) {
+      bestParent = parent;
+      block = el;
+      if (el->size == size) {
+        break;
+      }
+    }
+    parent = el;
   }
 
   // unlink block from list
   if (block != nullptr) {
-    if (parent == nullptr) {
+    if (bestParent == nullptr) {
       gMemPool = block->next;
     } else {
-      parent->next = block->next;
+      bestParent->next = block->next;
     }
+    gPoolBytes -= block->size;
   }
   pthread_mutex_unlock(&gMPoolMutex);
 
   if (block == nullptr) {
     block = allocBlock(size);
+    pthread_mutex_lock(&gMPoolMutex);
+    gBlocks[BLOCKDATA(block)] = block;
+    pthread_mutex_unlock(&gMPoolMutex);
   }
   block->next = nullptr;
+  block->used = size;
 
   MemBlock result;
   result.data = BLOCKDATA(block);
@@ -99,19 +127,28 @@ MemBlock MemoryPool::allocate(int size) {
 }
 
 void MemoryPool::release(const MemBlock &mb) {
-  pthread_mutex_lock(&gMPoolMutex);
-
   auto *block = (BlockList *)mb.internalData;
 
   // just to be sure there's nothing important left in buffers..
-  VALGRIND_MAKE_MEM_UNDEFINED(block->data->data, block->size);
-  memset(BLOCKDATA(block), 0, block->size);
-  VALGRIND_MAKE_MEM_NOACCESS(block->data->data, block->data->max);
-
-  block->next = gMemPool;
-  gMemPool = block;
+  VALGRIND_MAKE_MEM_UNDEFINED(block->data, block->used);
+  memset(BLOCKDATA(block), 0, block->used);
+  VALGRIND_MAKE_MEM_NOACCESS(block->data, block->size);
 
+  pthread_mutex_lock(&gMPoolMutex);
+  if (gPoolBytes + block->size <= MaxPoolBytes) {
+    block->next = gMemPool;
+    gMemPool = block;
+    gPoolBytes += block->size;
+    block = nullptr;
+  } else {
+    gBlocks.erase(BLOCKDATA(block));
+    ++gGeneration;
+  }
   pthread_mutex_unlock(&gMPoolMutex);
+
+  if (block != nullptr) {
+    freeBlock(block);
+  }
 }
 
 void MemoryPool::destroyAll() {
@@ -119,6 +156,11 @@ void MemoryPool::destroyAll() {
 
   BlockList *block = gMemPool;
   gMemPool = nullptr;
+  gPoolBytes = 0;
+  for (BlockList *el = block; el != nullptr; el = el->next) {
+    gBlocks.erase(BLOCKDATA(el));
+  }
+  ++gGeneration;
 
   pthread_mutex_unlock(&gMPoolMutex);
 
@@ -130,4 +172,25 @@ void MemoryPool::destroyAll() {
   }
 }
 
+bool MemoryPool::findBlock(const unsigned char *p,
+                           const unsigned char **start, int *size) {
+  bool found = false;
+  pthread_mutex_lock(&gMPoolMutex);
+
+  auto it = gBlocks.upper_bound(p);
+  if (it != gBlocks.begin()) {
+    --it;
+    if (p < it->first + it->second->size) {
+      *start = it->first;
+      *size = it->second->size;
+      found = true;
+    }
+  }
+
+  pthread_mutex_unlock(&gMPoolMutex);
+  return found;
+}
+
+unsigned long MemoryPool::generation() { return gGeneration.load(); }
+
 }  // namespace encfs
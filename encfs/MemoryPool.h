@@ -36,6 +36,10 @@ inline MemBlock::MemBlock() : data(0), internalData(0) {}
 /*
     Memory Pool for fixed sized objects.
 
+    Released blocks are cleared and kept for reuse, up to a limit on the
+    total size of the pool.  Blocks start on a page boundary, so they can be
+    used for direct I/O.
+
     Usage:
     MemBlock mb = MemoryPool::allocate( size );
     // do things with storage in   mb.data
@@ -43,9 +47,19 @@ inline MemBlock::MemBlock() : data(0), internalData(0) {}
     MemoryPool::release( mb );
 */
 namespace MemoryPool {
+// alignment of the start of every block
+const int Alignment = 4096;
+
 MemBlock allocate(int size);
 void release(const MemBlock &el);
 void destroyAll();
+
+// Find the block which contains 'p', whether in use or not, for registering
+// it with the kernel.  Returns false if p isn't part of a block.  Blocks
+// only go away when they are freed, which changes generation().
+bool findBlock(const unsigned char *p, const unsigned char **start,
+               int *size);
+unsigned long generation();
 }
 
 }  // namespace encfs
@@ -21,6 +21,7 @@
 #include "NameIO.h"
 
 #include "easylogging++.h"
+#include <cerrno>
 #include <cstring>
 // for static build.  Need to reference the modules which are registered at
 // run-time, to ensure that the linker doesn't optimize them away.
@@ -139,16 +140,22 @@ void NameIO::setReverseEncryption(bool enable) { reverseEncryption = enable; }
 
 bool NameIO::getReverseEncryption() const { return reverseEncryption; }
 
-std::string NameIO::recodePath(
+int NameIO::recodePath(
     const char *path, int (NameIO::*_length)(int) const,
     int (NameIO::*_code)(const char *, int, uint64_t *, char *, int) const,
-    uint64_t *iv) const {
-  string output;
+    uint64_t *iv, char *output, int bufferLength) const {
+  int outLen = 0;
+  if (bufferLength <= 0) {
+    return -ENAMETOOLONG;
+  }
 
   while (*path != 0) {
     if (*path == '/') {
-      if (!output.empty()) {  // don't start the string with '/'
-        output += '/';
+      if (outLen > 0) {  // don't start the string with '/'
+        if (outLen + 1 >= bufferLength) {
+          return -ENAMETOOLONG;
+        }
+        output[outLen++] = '/';
       }
       ++path;
     } else {
@@ -158,7 +165,11 @@ std::string NameIO::recodePath(
 
       // at this point we know that len > 0
       if (isDotFile && (path[len - 1] == '.') && (len <= 2)) {
-        output.append(len, '.');  // append [len] copies of '.'
+        if (outLen + len >= bufferLength) {
+          return -ENAMETOOLONG;
+        }
+        memset(output + outLen, '.', len);  // copy [len] copies of '.'
+        outLen += len;
         path += len;
         continue;
       }
@@ -166,26 +177,68 @@ std::string NameIO::recodePath(
       // figure out buffer sizes
       int approxLen = (this->*_length)(len);
       if (approxLen <= 0) {
-        throw Error("Filename too small to decode");
+        VLOG(1) << "Filename too small to decode";
+        return -EINVAL;
+      }
+      if (outLen + approxLen >= bufferLength) {
+        return -ENAMETOOLONG;
       }
-      int bufSize = 0;
-
-      BUFFER_INIT_S(codeBuf, 32, (unsigned int)approxLen + 1, bufSize)
 
-      // code the name
-      int codedLen = (this->*_code)(path, len, iv, codeBuf, bufSize);
+      // code the name directly into the output buffer
+      int codedLen =
+          (this->*_code)(path, len, iv, output + outLen, bufferLength - outLen);
+      if (codedLen < 0) {
+        return codedLen;
+      }
       rAssert(codedLen <= approxLen);
-      rAssert(codeBuf[codedLen] == '\0');
+      outLen += codedLen;
       path += len;
+    }
+  }
 
-      // append result to string
-      output += (char *)codeBuf;
+  output[outLen] = '\0';
+  return outLen;
+}
 
-      BUFFER_RESET(codeBuf)
+int NameIO::recodePath(
+    const char *path, int (NameIO::*_length)(int) const,
+    int (NameIO::*_code)(const char *, int, uint64_t *, char *, int) const,
+    uint64_t *iv, std::string *output) const {
+  // upper bound on the coded size, including the terminating null
+  unsigned int size = 1;
+  for (const char *p = path; *p != 0;) {
+    const char *next = strchr(p, '/');
+    int len = next != nullptr ? next - p : strlen(p);
+    if (len > 0) {
+      int approxLen = (this->*_length)(len);
+      size += (approxLen > len ? approxLen : len) + 1;
     }
+    p += next != nullptr ? len + 1 : len;
   }
 
-  return output;
+  int bufSize = 0;
+  BUFFER_INIT_S(codeBuf, 1024, size, bufSize)
+
+  int res = recodePath(path, _length, _code, iv, codeBuf, bufSize);
+  if (res >= 0) {
+    output->assign(codeBuf, res);
+  } else {
+    output->clear();
+  }
+
+  BUFFER_RESET(codeBuf)
+
+  return res < 0 ? res : 0;
+}
+
+// Throw on decoding errors, for callers which don't expect any.
+static void checkRecode(int res) {
+  if (res == -EBADMSG) {
+    throw Error("checksum mismatch in filename decode");
+  }
+  if (res < 0) {
+    throw Error("Filename can't be decoded");
+  }
 }
 
 std::string NameIO::encodePath(const char *plaintextPath) const {
@@ -198,30 +251,75 @@ std::string NameIO::decodePath(const char *cipherPath) const {
   return decodePath(cipherPath, &iv);
 }
 
-std::string NameIO::_encodePath(const char *plaintextPath, uint64_t *iv) const {
+int NameIO::_encodePath(const char *plaintextPath, uint64_t *iv,
+                        std::string *output) const {
+  // if chaining is not enabled, then the iv pointer is not used..
+  if (!chainedNameIV) {
+    iv = nullptr;
+  }
+  return recodePath(plaintextPath, &NameIO::maxEncodedNameLen,
+                    &NameIO::encodeName, iv, output);
+}
+
+int NameIO::_decodePath(const char *cipherPath, uint64_t *iv,
+                        std::string *output) const {
+  // if chaining is not enabled, then the iv pointer is not used..
+  if (!chainedNameIV) {
+    iv = nullptr;
+  }
+  return recodePath(cipherPath, &NameIO::maxDecodedNameLen, &NameIO::decodeName,
+                    iv, output);
+}
+
+int NameIO::_encodePath(const char *plaintextPath, uint64_t *iv, char *output,
+                        int bufferLength) const {
   // if chaining is not enabled, then the iv pointer is not used..
   if (!chainedNameIV) {
     iv = nullptr;
   }
   return recodePath(plaintextPath, &NameIO::maxEncodedNameLen,
-                    &NameIO::encodeName, iv);
+                    &NameIO::encodeName, iv, output, bufferLength);
 }
 
-std::string NameIO::_decodePath(const char *cipherPath, uint64_t *iv) const {
+int NameIO::_decodePath(const char *cipherPath, uint64_t *iv, char *output,
+                        int bufferLength) const {
   // if chaining is not enabled, then the iv pointer is not used..
   if (!chainedNameIV) {
     iv = nullptr;
   }
   return recodePath(cipherPath, &NameIO::maxDecodedNameLen, &NameIO::decodeName,
-                    iv);
+                    iv, output, bufferLength);
+}
+
+int NameIO::encodePath(const char *path, uint64_t *iv, char *output,
+                       int bufferLength) const {
+  return getReverseEncryption() ? _decodePath(path, iv, output, bufferLength)
+                                : _encodePath(path, iv, output, bufferLength);
+}
+
+int NameIO::decodePath(const char *path, uint64_t *iv, char *output,
+                       int bufferLength) const {
+  return getReverseEncryption() ? _encodePath(path, iv, output, bufferLength)
+                                : _decodePath(path, iv, output, bufferLength);
 }
 
 std::string NameIO::encodePath(const char *path, uint64_t *iv) const {
-  return getReverseEncryption() ? _decodePath(path, iv) : _encodePath(path, iv);
+  std::string output;
+  checkRecode(getReverseEncryption() ? _decodePath(path, iv, &output)
+                                     : _encodePath(path, iv, &output));
+  return output;
 }
 
 std::string NameIO::decodePath(const char *path, uint64_t *iv) const {
-  return getReverseEncryption() ? _encodePath(path, iv) : _decodePath(path, iv);
+  std::string output;
+  checkRecode(tryDecodePath(path, iv, &output));
+  return output;
+}
+
+int NameIO::tryDecodePath(const char *path, uint64_t *iv,
+                          std::string *output) const {
+  return getReverseEncryption() ? _encodePath(path, iv, output)
+                                : _decodePath(path, iv, output);
 }
 
 int NameIO::encodeName(const char *input, int length, char *output,
@@ -234,52 +332,71 @@ int NameIO::decodeName(const char *input, int length, char *output,
   return decodeName(input, length, (uint64_t *)nullptr, output, bufferLength);
 }
 
-std::string NameIO::_encodeName(const char *plaintextName, int length) const {
+int NameIO::_encodeName(const char *plaintextName, int length,
+                        std::string *output) const {
   int approxLen = maxEncodedNameLen(length);
   int bufSize = 0;
 
-  BUFFER_INIT_S(codeBuf, 32, (unsigned int)approxLen + 1, bufSize)
+  BUFFER_INIT_S(codeBuf, 512, (unsigned int)approxLen + 1, bufSize)
 
   // code the name
   int codedLen = encodeName(plaintextName, length, nullptr, codeBuf, bufSize);
-  rAssert(codedLen <= approxLen);
-  rAssert(codeBuf[codedLen] == '\0');
+  if (codedLen >= 0) {
+    rAssert(codedLen <= approxLen);
+    rAssert(codeBuf[codedLen] == '\0');
 
-  // append result to string
-  std::string result = (char *)codeBuf;
+    // append result to string
+    *output = (char *)codeBuf;
+  }
 
   BUFFER_RESET(codeBuf)
 
-  return result;
+  return codedLen < 0 ? codedLen : 0;
 }
 
-std::string NameIO::_decodeName(const char *encodedName, int length) const {
+int NameIO::_decodeName(const char *encodedName, int length,
+                        std::string *output) const {
   int approxLen = maxDecodedNameLen(length);
+  if (approxLen <= 0) {
+    VLOG(1) << "Filename too small to decode";
+    return -EINVAL;
+  }
   int bufSize = 0;
 
-  BUFFER_INIT_S(codeBuf, 32, (unsigned int)approxLen + 1, bufSize)
+  BUFFER_INIT_S(codeBuf, 512, (unsigned int)approxLen + 1, bufSize)
 
   // code the name
   int codedLen = decodeName(encodedName, length, nullptr, codeBuf, bufSize);
-  rAssert(codedLen <= approxLen);
-  rAssert(codeBuf[codedLen] == '\0');
+  if (codedLen >= 0) {
+    rAssert(codedLen <= approxLen);
+    rAssert(codeBuf[codedLen] == '\0');
 
-  // append result to string
-  std::string result = (char *)codeBuf;
+    // append result to string
+    *output = (char *)codeBuf;
+  }
 
   BUFFER_RESET(codeBuf)
 
-  return result;
+  return codedLen < 0 ? codedLen : 0;
 }
 
 std::string NameIO::encodeName(const char *path, int length) const {
-  return getReverseEncryption() ? _decodeName(path, length)
-                                : _encodeName(path, length);
+  std::string output;
+  checkRecode(getReverseEncryption() ? _decodeName(path, length, &output)
+                                     : _encodeName(path, length, &output));
+  return output;
 }
 
 std::string NameIO::decodeName(const char *path, int length) const {
-  return getReverseEncryption() ? _encodeName(path, length)
-                                : _decodeName(path, length);
+  std::string output;
+  checkRecode(tryDecodeName(path, length, &output));
+  return output;
+}
+
+int NameIO::tryDecodeName(const char *path, int length,
+                          std::string *output) const {
+  return getReverseEncryption() ? _encodeName(path, length, output)
+                                : _decodeName(path, length, output);
 }
 /*
 int NameIO::encodeName( const char *path, int length,
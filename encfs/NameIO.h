@@ -77,6 +77,29 @@ class NameIO {
   std::string encodePath(const char *plaintextPath, uint64_t *iv) const;
   std::string decodePath(const char *encodedPath, uint64_t *iv) const;
 
+  /*
+      Same as decodePath / decodeName, except that names which can't be
+      decoded (such as files not created by EncFS) are reported by returning
+      a negative errno value instead of throwing.  Returns 0 on success.
+      Meant for loops over directory contents, where foreign names are
+      expected.
+  */
+  int tryDecodePath(const char *encodedPath, uint64_t *iv,
+                    std::string *plaintextPath) const;
+  int tryDecodeName(const char *encodedName, int length,
+                    std::string *plaintextName) const;
+
+  /*
+      Allocation free variants of encodePath / tryDecodePath, which write the
+      null terminated result into a caller supplied buffer.  Return the
+      length of the result, or a negative errno value: -ENAMETOOLONG if the
+      buffer is too small, otherwise the same values as tryDecodePath.
+  */
+  int encodePath(const char *plaintextPath, uint64_t *iv, char *encodedPath,
+                 int bufferLength) const;
+  int decodePath(const char *encodedPath, uint64_t *iv, char *plaintextPath,
+                 int bufferLength) const;
+
   virtual int maxEncodedNameLen(int plaintextNameLen) const = 0;
   virtual int maxDecodedNameLen(int encodedNameLen) const = 0;
 
@@ -89,22 +112,35 @@ class NameIO {
   virtual int decodeName(const char *encodedName, int length,
                          char *plaintextName, int bufferLength) const;
 
+  // Return the coded length on success.  decodeName returns a negative errno
+  // value if the name can't be decoded, rather than throwing.
   virtual int encodeName(const char *plaintextName, int length, uint64_t *iv,
                          char *encodedName, int bufferLength) const = 0;
   virtual int decodeName(const char *encodedName, int length, uint64_t *iv,
                          char *plaintextName, int bufferLength) const = 0;
 
  private:
-  std::string recodePath(const char *path, int (NameIO::*codingLen)(int) const,
-                         int (NameIO::*codingFunc)(const char *, int,
-                                                   uint64_t *, char *, int)
-                             const,
-                         uint64_t *iv) const;
-
-  std::string _encodePath(const char *plaintextPath, uint64_t *iv) const;
-  std::string _decodePath(const char *encodedPath, uint64_t *iv) const;
-  std::string _encodeName(const char *plaintextName, int length) const;
-  std::string _decodeName(const char *encodedName, int length) const;
+  int recodePath(const char *path, int (NameIO::*codingLen)(int) const,
+                 int (NameIO::*codingFunc)(const char *, int, uint64_t *,
+                                           char *, int) const,
+                 uint64_t *iv, std::string *output) const;
+  int recodePath(const char *path, int (NameIO::*codingLen)(int) const,
+                 int (NameIO::*codingFunc)(const char *, int, uint64_t *,
+                                           char *, int) const,
+                 uint64_t *iv, char *output, int bufferLength) const;
+
+  int _encodePath(const char *plaintextPath, uint64_t *iv,
+                  std::string *output) const;
+  int _decodePath(const char *encodedPath, uint64_t *iv,
+                  std::string *output) const;
+  int _encodePath(const char *plaintextPath, uint64_t *iv, char *output,
+                  int bufferLength) const;
+  int _decodePath(const char *encodedPath, uint64_t *iv, char *output,
+                  int bufferLength) const;
+  int _encodeName(const char *plaintextName, int length,
+                  std::string *output) const;
+  int _decodeName(const char *encodedName, int length,
+                  std::string *output) const;
 
   bool chainedNameIV;
   bool reverseEncryption;
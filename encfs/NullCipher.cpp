@@ -33,7 +33,7 @@ namespace encfs {
 
 static Interface NullInterface("nullCipher", 1, 0, 0);
 static Range NullKeyRange(0);
-static Range NullBlockRange(1, 4096, 1);
+static Range NullBlockRange(1, 1024 * 1024, 1);
 
 static std::shared_ptr<Cipher> NewNullCipher(const Interface &iface,
                                              int keyLen) {
@@ -152,6 +152,18 @@ bool NullCipher::blockDecode(unsigned char *, int, uint64_t,
   return true;
 }
 
+bool NullCipher::hasBlockParts() const { return true; }
+
+bool NullCipher::blockEncodePart(unsigned char *, int, const unsigned char *,
+                                 uint64_t, const CipherKey &) const {
+  return true;
+}
+
+bool NullCipher::blockDecodePart(unsigned char *, int, const unsigned char *,
+                                 uint64_t, const CipherKey &) const {
+  return true;
+}
+
 bool NullCipher::Enabled() { return true; }
 
 }  // namespace encfs
@@ -78,6 +78,14 @@ class NullCipher : public Cipher {
   virtual bool blockDecode(unsigned char *buf, int size, uint64_t iv64,
                            const CipherKey &key) const;
 
+  virtual bool hasBlockParts() const;
+  virtual bool blockEncodePart(unsigned char *buf, int size,
+                               const unsigned char *chain, uint64_t iv64,
+                               const CipherKey &key) const;
+  virtual bool blockDecodePart(unsigned char *buf, int size,
+                               const unsigned char *chain, uint64_t iv64,
+                               const CipherKey &key) const;
+
   // hack to help with static builds
   static bool Enabled();
 };
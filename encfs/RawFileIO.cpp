@@ -22,17 +22,22 @@
 #define _XOPEN_SOURCE 500  // pick up pread , pwrite
 #endif
 #include "easylogging++.h"
+#include <algorithm>
 #include <cerrno>
 #include <cinttypes>
 #include <cstring>
 #include <fcntl.h>
+#include <limits>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <utility>
 
 #include "Error.h"
 #include "FileIO.h"
+#include "IOUring.h"
+#include "MemoryPool.h"
 #include "RawFileIO.h"
+#include "SyncScheduler.h"
 
 using namespace std;
 
@@ -52,17 +57,40 @@ inline void swap(int &x, int &y) {
 }
 
 RawFileIO::RawFileIO()
-    : knownSize(false), fileSize(0), fd(-1), oldfd(-1), canWrite(false) {}
-
-RawFileIO::RawFileIO(std::string fileName)
+    : knownSize(false),
+      fileSize(0),
+      fd(-1),
+      oldfd(-1),
+      canWrite(false),
+      syncTruncate(true),
+      extentStart(0),
+      extentEnd(0),
+      extentHole(false),
+      ioUring(false),
+      readInFlight(false),
+      directIO(false),
+      fdDirect(false) {}
+
+RawFileIO::RawFileIO(std::string fileName, bool syncTruncate, bool ioUring,
+                     bool directIO)
     : name(std::move(fileName)),
       knownSize(false),
       fileSize(0),
       fd(-1),
       oldfd(-1),
-      canWrite(false) {}
+      canWrite(false),
+      syncTruncate(syncTruncate),
+      extentStart(0),
+      extentEnd(0),
+      extentHole(false),
+      ioUring(ioUring),
+      readInFlight(false),
+      directIO(directIO),
+      fdDirect(false) {}
 
 RawFileIO::~RawFileIO() {
+  waitWrites();
+
   int _fd = -1;
   int _oldfd = -1;
 
@@ -107,6 +135,36 @@ static int open_readonly_workaround(const char *path, int flags) {
   return fd;
 }
 
+/*
+    open(), with O_DIRECT if asked for and the filesystem supports it.
+    Filesystems without direct I/O refuse the flag with EINVAL, and the file
+    is then opened the usual way.
+*/
+static int directOpen(const char *path, int flags, mode_t mode,
+                      bool direct) {
+#if defined(O_DIRECT)
+  if (direct) {
+    int fd = ::open(path, flags | O_DIRECT, mode);
+    if (fd >= 0 || errno != EINVAL) {
+      return fd;
+    }
+    VLOG(1) << "O_DIRECT not supported for " << path;
+  }
+#else
+  (void)direct;
+#endif
+  return ::open(path, flags, mode);
+}
+
+static bool isDirect(int fd) {
+#if defined(O_DIRECT)
+  return (fcntl(fd, F_GETFL) & O_DIRECT) != 0;
+#else
+  (void)fd;
+  return false;
+#endif
+}
+
 /*
     We shouldn't have to support all possible open flags, so untaint the flags
     argument by only taking ones we understand and accept.
@@ -135,7 +193,7 @@ int RawFileIO::open(int flags) {
 #endif
 
   int eno = 0;
-  int newFd = ::open(name.c_str(), finalFlags);
+  int newFd = directOpen(name.c_str(), finalFlags, 0, directIO);
   if (newFd < 0) {
     eno = errno;
   }
@@ -158,21 +216,101 @@ int RawFileIO::open(int flags) {
                 << ", newfd = " << newFd;
   }
 
+  // A cached size from before the first open came from a path lookup, and
+  // the file may have changed since.  Drop it, the next getSize() asks the
+  // new descriptor.  When reopening for write, the cached size is for the
+  // same open file and stays valid.
+  if (fd < 0) {
+    knownSize = false;
+    extentEnd = extentStart;
+  }
+
   // the old fd might still be in use, so just keep it around for
   // now.
   canWrite = requestWrite;
   oldfd = fd;
   fd = newFd;
+  fdDirect = isDirect(fd);
+
+  return fd;
+}
+
+/*
+    Create the file and keep the descriptor, so that create() + open() is a
+    single syscall.  As with open(), writers always get O_RDWR.
+*/
+int RawFileIO::create(int flags, mode_t mode) {
+  if (fd >= 0) {
+    // we already have the file open, so it exists
+    return -EEXIST;
+  }
+
+  bool requestWrite = (((flags & O_RDWR) != 0) || ((flags & O_WRONLY) != 0));
+  int finalFlags = O_CREAT | O_EXCL | (requestWrite ? O_RDWR : O_RDONLY);
+
+#if defined(O_LARGEFILE)
+  if ((flags & O_LARGEFILE) != 0) {
+    finalFlags |= O_LARGEFILE;
+  }
+#endif
+
+  int newFd = directOpen(name.c_str(), finalFlags, mode, directIO);
+  if (newFd < 0) {
+    int eno = errno;
+    VLOG(1) << "create error: " << strerror(eno);
+    return -eno;
+  }
+
+  VLOG(1) << "created file with flags " << finalFlags << ", result = "
+          << newFd;
+
+  canWrite = requestWrite;
+  fd = newFd;
+  fdDirect = isDirect(fd);
+
+  // we just made it, so no need to stat it for the size
+  fileSize = 0;
+  knownSize = true;
 
   return fd;
 }
 
+/*
+    Nobody uses the old descriptor of a released file anymore, so it can go
+    in any case.  The size may be changed through another path (hard links)
+    before the file is used again, so it is forgotten.
+*/
+void RawFileIO::release(bool closeFd) {
+  waitWrites();
+  if (oldfd >= 0) {
+    close(oldfd);
+    oldfd = -1;
+  }
+  if (closeFd && fd >= 0) {
+    close(fd);
+    fd = -1;
+    canWrite = false;
+    fdDirect = false;
+  }
+  knownSize = false;
+  extentEnd = extentStart;
+}
+
+/*
+    Files with an open descriptor are stat'ed through it, which saves a walk
+    of the (possibly deep) ciphertext path.  Only regular files are opened, so
+    there is no difference with lstat() for links.
+*/
 int RawFileIO::getAttr(struct stat *stbuf) const {
-  int res = lstat(name.c_str(), stbuf);
+  int res = (fd >= 0) ? fstat(fd, stbuf) : lstat(name.c_str(), stbuf);
   int eno = errno;
 
   if (res < 0) {
     RLOG(DEBUG) << "getAttr error on " << name << ": " << strerror(eno);
+  } else if (S_ISREG(stbuf->st_mode)) {
+    // we have the size for free, save a getSize() call
+    const_cast<RawFileIO *>(this)->fileSize = stbuf->st_size;
+    const_cast<RawFileIO *>(this)->knownSize = true;
   }
 
   return (res < 0) ? -eno : 0;
@@ -184,12 +322,33 @@ const char *RawFileIO::getFileName() const { return name.c_str(); }
 
 off_t RawFileIO::getSize() const {
   if (!knownSize) {
-    struct stat stbuf;
-    memset(&stbuf, 0, sizeof(struct stat));
-    int res = lstat(name.c_str(), &stbuf);
+    off_t size = 0;
+    int res;
+    if (fd >= 0) {
+      // the open descriptor saves a path lookup
+#if defined(HAVE_STATX)
+      struct statx stxbuf;
+      res = statx(fd, "", AT_EMPTY_PATH, STATX_SIZE, &stxbuf);
+      if (res == 0 && (stxbuf.stx_mask & STATX_SIZE) == 0) {
+        res = -1;
+        errno = EIO;
+      }
+      size = stxbuf.stx_size;
+#else
+      struct stat stbuf;
+      memset(&stbuf, 0, sizeof(struct stat));
+      res = fstat(fd, &stbuf);
+      size = stbuf.st_size;
+#endif
+    } else {
+      struct stat stbuf;
+      memset(&stbuf, 0, sizeof(struct stat));
+      res = lstat(name.c_str(), &stbuf);
+      size = stbuf.st_size;
+    }
 
     if (res == 0) {
-      const_cast<RawFileIO *>(this)->fileSize = stbuf.st_size;
+      const_cast<RawFileIO *>(this)->fileSize = size;
       const_cast<RawFileIO *>(this)->knownSize = true;
       return fileSize;
     }
@@ -200,16 +359,165 @@ off_t RawFileIO::getSize() const {
   return fileSize;
 }
 
+// wait for the only operation on the ring
+static ssize_t ringResult(IOUring *ring) {
+  uint64_t tag;
+  int res;
+  while (!ring->reap(&tag, &res)) {
+    int sres = ring->submit(1);
+    if (sres < 0) {
+      return sres;
+    }
+  }
+  return res;
+}
+
+/*
+    pread() / pwrite() through the thread's io_uring, if the file uses one
+    and no writes are in flight on it.  Return -errno on failure.
+*/
+ssize_t RawFileIO::rawRead(unsigned char *buf, size_t len,
+                           off_t offset) const {
+  IOUring *ring = ioUring ? IOUring::get() : nullptr;
+  if (ring != nullptr && ring->pending() == 0 &&
+      ring->prepRead(fd, buf, len, offset, 0)) {
+    return ringResult(ring);
+  }
+  ssize_t res = ::pread(fd, buf, len, offset);
+  return res < 0 ? -errno : res;
+}
+
+ssize_t RawFileIO::rawWrite(const unsigned char *buf, size_t len,
+                            off_t offset) {
+  IOUring *ring = ioUring ? IOUring::get() : nullptr;
+  if (ring != nullptr && ring->pending() == 0 &&
+      ring->prepWrite(fd, buf, len, offset, 0)) {
+    return ringResult(ring);
+  }
+  ssize_t res = ::pwrite(fd, buf, len, offset);
+  return res < 0 ? -errno : res;
+}
+
+// whether the request can be done with O_DIRECT as it is
+static bool directAligned(const unsigned char *buf, size_t len,
+                          off_t offset) {
+  return (((uintptr_t)buf | len | (uint64_t)offset) %
+          MemoryPool::Alignment) == 0;
+}
+
+ssize_t RawFileIO::readAt(unsigned char *buf, size_t len, off_t offset) const {
+  if (fdDirect && !directAligned(buf, len, offset)) {
+    return bounceRead(buf, len, offset);
+  }
+  return rawRead(buf, len, offset);
+}
+
+ssize_t RawFileIO::writeAt(const unsigned char *buf, size_t len,
+                           off_t offset) {
+  if (fdDirect && !directAligned(buf, len, offset)) {
+    return bounceWrite(buf, len, offset);
+  }
+  return rawWrite(buf, len, offset);
+}
+
+/*
+    With O_DIRECT, the file offset, the length and the memory have to be
+    page aligned.  Other requests go through a MemoryPool buffer holding the
+    pages they touch.
+*/
+ssize_t RawFileIO::bounceRead(unsigned char *buf, size_t len,
+                              off_t offset) const {
+  const off_t align = MemoryPool::Alignment;
+  off_t start = offset - offset % align;
+  off_t end = (offset + (off_t)len + align - 1) / align * align;
+
+  MemBlock mb = MemoryPool::allocate(end - start);
+  ssize_t res = rawRead(mb.data, end - start, start);
+  if (res > offset - start) {
+    res = std::min(res - (ssize_t)(offset - start), (ssize_t)len);
+    memcpy(buf, mb.data + (offset - start), res);
+  } else if (res > 0) {
+    res = 0;
+  }
+  MemoryPool::release(mb);
+
+  return res;
+}
+
+/*
+    The first and last page are read in, unless the request covers them, and
+    written back with the new data.  Pages past the end of the file are
+    written padded with 0's, which are cut off again afterwards.
+*/
+ssize_t RawFileIO::bounceWrite(const unsigned char *buf, size_t len,
+                               off_t offset) {
+  // pages written through the ring may be read back below
+  int wres = waitWrites();
+  if (wres < 0) {
+    return wres;
+  }
+  off_t size = getSize();
+  if (size < 0) {
+    return size;
+  }
+
+  const off_t align = MemoryPool::Alignment;
+  off_t last = offset + (off_t)len;
+  off_t start = offset - offset % align;
+  off_t end = (last + align - 1) / align * align;
+
+  MemBlock mb = MemoryPool::allocate(end - start);
+
+  // fill in one page of the buffer with what's in the file
+  auto keepPage = [&](off_t page) -> ssize_t {
+    unsigned char *data = mb.data + (page - start);
+    memset(data, 0, align);
+    if (page >= size) {
+      return 0;
+    }
+    return rawRead(data, align, page);
+  };
+
+  ssize_t res = 0;
+  if (offset > start) {
+    res = keepPage(start);
+  }
+  if (res >= 0 && last < end && (offset == start || end - align > start)) {
+    res = keepPage(end - align);
+  }
+
+  if (res >= 0) {
+    memcpy(mb.data + (offset - start), buf, len);
+    for (off_t done = 0; done < end - start;) {
+      res = rawWrite(mb.data + done, end - start - done, start + done);
+      if (res <= 0) {
+        res = (res == 0) ? -EIO : res;
+        break;
+      }
+      done += res;
+    }
+  }
+  MemoryPool::release(mb);
+
+  off_t newSize = std::max(size, last);
+  if (res >= 0 && end > newSize && ::ftruncate(fd, newSize) == -1) {
+    res = -errno;
+  }
+  if (res < 0) {
+    knownSize = false;
+    return res;
+  }
+  return len;
+}
+
 ssize_t RawFileIO::read(const IORequest &req) const {
   rAssert(fd >= 0);
 
-  ssize_t readSize = pread(fd, req.data, req.dataLen, req.offset);
+  ssize_t readSize = readAt(req.data, req.dataLen, req.offset);
 
   if (readSize < 0) {
-    int eno = errno;
     RLOG(WARNING) << "read failed at offset " << req.offset << " for "
-                  << req.dataLen << " bytes: " << strerror(eno);
-    return -eno;
+                  << req.dataLen << " bytes: " << strerror(-readSize);
   }
 
   return readSize;
@@ -219,8 +527,14 @@ ssize_t RawFileIO::write(const IORequest &req) {
   rAssert(fd >= 0);
   rAssert(canWrite);
 
+  // data written into the cached hole ends it
+  if (extentHole && req.offset < extentEnd &&
+      req.offset + (off_t)req.dataLen > extentStart) {
+    extentEnd = extentStart;
+  }
+
   // int retrys = 10;
-  void *buf = req.data;
+  const unsigned char *buf = req.data;
   ssize_t bytes = req.dataLen;
   off_t offset = req.offset;
 
@@ -232,24 +546,22 @@ ssize_t RawFileIO::write(const IORequest &req) {
    */
   // while ((bytes != 0) && retrys > 0) {
   while (bytes != 0) {
-    ssize_t writeSize = ::pwrite(fd, buf, bytes, offset);
+    ssize_t writeSize = writeAt(buf, bytes, offset);
 
     if (writeSize < 0) {
-      int eno = errno;
       knownSize = false;
       RLOG(WARNING) << "write failed at offset " << offset << " for " << bytes
-                    << " bytes: " << strerror(eno);
-      // pwrite is not expected to return 0, so eno should always be set, but we
-      // never know...
-      return -eno;
+                    << " bytes: " << strerror(-writeSize);
+      return writeSize;
     }
+    // pwrite is not expected to return 0, but we never know...
     if (writeSize == 0) {
       return -EIO;
     }
 
     bytes -= writeSize;
     offset += writeSize;
-    buf = (void *)((char *)buf + writeSize);
+    buf += writeSize;
   }
 
   // if (bytes != 0) {
@@ -269,6 +581,135 @@ ssize_t RawFileIO::write(const IORequest &req) {
   return req.dataLen;
 }
 
+/*
+    The read is queued on the thread's io_uring, and waitRead() collects its
+    result.  Without a ring, while the ring is in use, or for an O_DIRECT
+    request which isn't aligned, nothing is read and -EOPNOTSUPP tells the
+    caller to read() the data itself.
+*/
+int RawFileIO::startRead(const IORequest &req) const {
+  rAssert(fd >= 0);
+  rAssert(!readInFlight);
+
+  IOUring *ring = ioUring ? IOUring::get() : nullptr;
+  if (ring == nullptr || ring->pending() != 0 ||
+      (fdDirect && !directAligned(req.data, req.dataLen, req.offset)) ||
+      !ring->prepRead(fd, req.data, req.dataLen, req.offset, 0)) {
+    return -EOPNOTSUPP;
+  }
+  readReq = req;
+  readInFlight = true;
+
+  int res = ring->submit(0);
+  if (res < 0) {
+    RLOG(WARNING) << "io_uring submit failed: " << strerror(-res);
+    waitRead();
+    return res;
+  }
+  return 0;
+}
+
+ssize_t RawFileIO::waitRead() const {
+  rAssert(readInFlight);
+  readInFlight = false;
+
+  ssize_t res = ringResult(IOUring::get());
+  if (res < 0) {
+    RLOG(WARNING) << "read failed at offset " << readReq.offset << " for "
+                  << readReq.dataLen << " bytes: " << strerror(-res);
+  }
+  return res;
+}
+
+/*
+    The write is queued on the thread's io_uring, and the caller can go on
+    while the kernel does it.  Without a ring, or while the ring is in use
+    by another file, it's written right away.
+*/
+ssize_t RawFileIO::startWrite(const IORequest &req) {
+  IOUring *ring = ioUring ? IOUring::get() : nullptr;
+  if (ring == nullptr || (writesInFlight.empty() && ring->pending() != 0) ||
+      (fdDirect && !directAligned(req.data, req.dataLen, req.offset))) {
+    return write(req);
+  }
+  rAssert(fd >= 0);
+  rAssert(canWrite);
+
+  if (extentHole && req.offset < extentEnd &&
+      req.offset + (off_t)req.dataLen > extentStart) {
+    extentEnd = extentStart;
+  }
+
+  if (!ring->prepWrite(fd, req.data, req.dataLen, req.offset,
+                       writesInFlight.size())) {
+    // the ring is full
+    int res = waitWrites();
+    if (res < 0) {
+      return res;
+    }
+    return write(req);
+  }
+  writesInFlight.push_back(req);
+
+  int res = ring->submit(0);
+  if (res < 0) {
+    RLOG(WARNING) << "io_uring submit failed: " << strerror(-res);
+    waitWrites();
+    return res;
+  }
+  return req.dataLen;
+}
+
+int RawFileIO::waitWrites() {
+  if (writesInFlight.empty()) {
+    return 0;
+  }
+  IOUring *ring = IOUring::get();
+
+  int result = 0;
+  size_t left = writesInFlight.size();
+  while (left > 0) {
+    uint64_t tag;
+    int res;
+    if (!ring->reap(&tag, &res)) {
+      res = ring->submit(1);
+      if (res < 0) {
+        RLOG(ERROR) << "io_uring wait failed: " << strerror(-res);
+        result = res;
+        break;
+      }
+      continue;
+    }
+    --left;
+    rAssert(tag < writesInFlight.size());
+    const IORequest &req = writesInFlight[tag];
+
+    if (res < 0) {
+      knownSize = false;
+      RLOG(WARNING) << "write failed at offset " << req.offset << " for "
+                    << req.dataLen << " bytes: " << strerror(-res);
+      if (result == 0) {
+        result = res;
+      }
+    } else if ((size_t)res < req.dataLen) {
+      // the rest is written the usual way
+      IORequest rest = req;
+      rest.offset += res;
+      rest.data += res;
+      rest.dataLen -= res;
+      ssize_t wres = write(rest);
+      if (wres < 0 && result == 0) {
+        result = wres;
+      }
+    } else if (knownSize && req.offset + (off_t)req.dataLen > fileSize) {
+      fileSize = req.offset + req.dataLen;
+    }
+  }
+
+  writesInFlight.clear();
+  return result;
+}
+
 int RawFileIO::truncate(off_t size) {
   int res;
 
@@ -290,15 +731,129 @@ int RawFileIO::truncate(off_t size) {
     knownSize = true;
   }
 
-  if (fd >= 0 && canWrite) {
-#if defined(HAVE_FDATASYNC)
-    ::fdatasync(fd);
+  extentEnd = extentStart;
+
+  if (fd >= 0 && canWrite && syncTruncate) {
+    SyncScheduler::sync(fd, true);
+  }
+
+  return res;
+}
+
+/*
+    The size is kept, the caller extends the file (and pads it, unless holes
+    are allowed) through truncate().
+*/
+int RawFileIO::allocate(off_t offset, off_t length) {
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+  if (fd < 0 || !canWrite) {
+    return -EBADF;
+  }
+  if (::fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, length) == -1) {
+    int eno = errno;
+    VLOG(1) << "fallocate failed for " << name << ": " << strerror(eno);
+    return -eno;
+  }
+  return 0;
 #else
-    ::fsync(fd);
+  (void)offset;
+  (void)length;
+  return -EOPNOTSUPP;
 #endif
+}
+
+/*
+    The extent around the last offset asked for is kept, so reading through a
+    file costs two lseek() calls per data or hole extent.  Filesystems
+    without SEEK_DATA support are treated as having no holes.
+*/
+bool RawFileIO::isHole(off_t offset, size_t length) const {
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  if (fd < 0) {
+    return false;
   }
 
-  return res;
+  if (offset < extentStart || offset >= extentEnd) {
+    off_t data = ::lseek(fd, offset, SEEK_DATA);
+    if (data < 0) {
+      if (errno != ENXIO) {
+        // no SEEK_DATA support, don't ask again
+        extentStart = 0;
+        extentEnd = std::numeric_limits<off_t>::max();
+        extentHole = false;
+        return false;
+      }
+      // no data after offset, up to the end of the file
+      off_t size = getSize();
+      if (size <= offset) {
+        return false;
+      }
+      extentStart = offset;
+      extentEnd = size;
+      extentHole = true;
+    } else if (data > offset) {
+      extentStart = offset;
+      extentEnd = data;
+      extentHole = true;
+    } else {
+      off_t hole = ::lseek(fd, offset, SEEK_HOLE);
+      if (hole <= offset) {
+        return false;
+      }
+      extentStart = offset;
+      extentEnd = hole;
+      extentHole = false;
+    }
+  }
+
+  return extentHole && offset + (off_t)length <= extentEnd;
+#else
+  (void)offset;
+  (void)length;
+  return false;
+#endif
+}
+
+/*
+    Ranges past the end of the file become a hole by extending the file.
+    Inside the file, the blocks are deallocated with FALLOC_FL_PUNCH_HOLE.
+*/
+int RawFileIO::punchHole(off_t offset, off_t length) {
+  if (fd < 0 || !canWrite) {
+    return -EBADF;
+  }
+
+  off_t size = getSize();
+  if (size < 0) {
+    return (int)size;
+  }
+
+  if (offset < size) {
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+    off_t len = std::min(length, size - offset);
+    if (::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                    len) == -1) {
+      int eno = errno;
+      VLOG(1) << "punching hole failed for " << name << ": " << strerror(eno);
+      return -eno;
+    }
+#else
+    return -EOPNOTSUPP;
+#endif
+  }
+
+  if (offset + length > size) {
+    if (::ftruncate(fd, offset + length) == -1) {
+      int eno = errno;
+      knownSize = false;
+      return -eno;
+    }
+    fileSize = offset + length;
+    knownSize = true;
+  }
+
+  extentEnd = extentStart;
+  return 0;
 }
 
 bool RawFileIO::isWritable() const { return canWrite; }
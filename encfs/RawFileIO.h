@@ -23,6 +23,7 @@
 
 #include <string>
 #include <sys/types.h>
+#include <vector>
 
 #include "FileIO.h"
 #include "Interface.h"
@@ -32,7 +33,8 @@ namespace encfs {
 class RawFileIO : public FileIO {
  public:
   RawFileIO();
-  RawFileIO(std::string fileName);
+  RawFileIO(std::string fileName, bool syncTruncate = true,
+            bool ioUring = false, bool directIO = false);
   virtual ~RawFileIO();
 
   virtual Interface interface() const;
@@ -41,6 +43,8 @@ class RawFileIO : public FileIO {
   virtual const char *getFileName() const;
 
   virtual int open(int flags);
+  virtual int create(int flags, mode_t mode);
+  virtual void release(bool closeFd);
 
   virtual int getAttr(struct stat *stbuf) const;
   virtual off_t getSize() const;
@@ -48,7 +52,17 @@ class RawFileIO : public FileIO {
   virtual ssize_t read(const IORequest &req) const;
   virtual ssize_t write(const IORequest &req);
 
+  // with io_uring, reads and writes are only waited for in waitRead() and
+  // waitWrites()
+  virtual int startRead(const IORequest &req) const;
+  virtual ssize_t waitRead() const;
+  virtual ssize_t startWrite(const IORequest &req);
+  virtual int waitWrites();
+
   virtual int truncate(off_t size);
+  virtual int allocate(off_t offset, off_t length);
+  virtual bool isHole(off_t offset, size_t length) const;
+  virtual int punchHole(off_t offset, off_t length);
 
   virtual bool isWritable() const;
 
@@ -61,6 +75,35 @@ class RawFileIO : public FileIO {
   int fd;
   int oldfd;
   bool canWrite;
+
+  // sync the file after truncating it
+  bool syncTruncate;
+
+  // last extent found with SEEK_DATA / SEEK_HOLE, empty if unknown
+  mutable off_t extentStart;
+  mutable off_t extentEnd;
+  mutable bool extentHole;
+
+  // do the I/O through the thread's io_uring, when there is one
+  bool ioUring;
+  // writes started through io_uring, in the order they were started
+  std::vector<IORequest> writesInFlight;
+  // the read started through io_uring, if readInFlight
+  mutable IORequest readReq;
+  mutable bool readInFlight;
+
+  // open the file with O_DIRECT, bypassing the page cache
+  bool directIO;
+  // whether the open descriptor has O_DIRECT
+  bool fdDirect;
+
+ private:
+  ssize_t readAt(unsigned char *buf, size_t len, off_t offset) const;
+  ssize_t writeAt(const unsigned char *buf, size_t len, off_t offset);
+  ssize_t rawRead(unsigned char *buf, size_t len, off_t offset) const;
+  ssize_t rawWrite(const unsigned char *buf, size_t len, off_t offset);
+  ssize_t bounceRead(unsigned char *buf, size_t len, off_t offset) const;
+  ssize_t bounceWrite(const unsigned char *buf, size_t len, off_t offset);
 };
 
 }  // namespace encfs
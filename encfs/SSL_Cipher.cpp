@@ -155,14 +155,17 @@ int TimedPBKDF2(const char *pass, int passlen, const unsigned char *salt,
 // - Version 2:1 adds support for Message Digest function interface
 // - Version 2:2 adds PBKDF2 for password derivation
 // - Version 3:0 adds a new IV mechanism
-static Interface BlowfishInterface("ssl/blowfish", 3, 0, 2);
-static Interface AESInterface("ssl/aes", 3, 0, 2);
-static Interface CAMELLIAInterface("ssl/camellia", 3, 0, 2);
+// - Version 4:0 marks volumes with block layouts 3:0 can't read, the page
+// aligned file header and MAC tag blocks.  Other volumes are still created
+// as 3:0.
+static Interface BlowfishInterface("ssl/blowfish", 4, 0, 3);
+static Interface AESInterface("ssl/aes", 4, 0, 3);
+static Interface CAMELLIAInterface("ssl/camellia", 4, 0, 3);
 
 #ifndef OPENSSL_NO_CAMELLIA
 
 static Range CAMELLIAKeyRange(128, 256, 64);
-static Range CAMELLIABlockRange(64, 4096, 16);
+static Range CAMELLIABlockRange(64, 1024 * 1024, 16);
 
 static std::shared_ptr<Cipher> NewCAMELLIACipher(const Interface &iface,
                                                  int keyLen) {
@@ -204,7 +207,7 @@ static bool CAMELLIA_Cipher_registered =
 #ifndef OPENSSL_NO_BF
 
 static Range BFKeyRange(128, 256, 32);
-static Range BFBlockRange(64, 4096, 8);
+static Range BFBlockRange(64, 1024 * 1024, 8);
 
 static std::shared_ptr<Cipher> NewBFCipher(const Interface &iface, int keyLen) {
   if (keyLen <= 0) {
@@ -230,7 +233,7 @@ static bool BF_Cipher_registered =
 #ifndef OPENSSL_NO_AES
 
 static Range AESKeyRange(128, 256, 64);
-static Range AESBlockRange(64, 4096, 16);
+static Range AESBlockRange(64, 1024 * 1024, 16);
 
 static std::shared_ptr<Cipher> NewAESCipher(const Interface &iface,
                                             int keyLen) {
@@ -860,6 +863,24 @@ bool SSL_Cipher::streamDecode(unsigned char *buf, int size, uint64_t iv64,
 
 bool SSL_Cipher::blockEncode(unsigned char *buf, int size, uint64_t iv64,
                              const CipherKey &ckey) const {
+  return blockEncodePart(buf, size, nullptr, iv64, ckey);
+}
+
+bool SSL_Cipher::blockEncodeTo(const unsigned char *src, unsigned char *dst,
+                               int size, uint64_t iv64,
+                               const CipherKey &ckey) const {
+  return encodeBlocks(src, dst, size, nullptr, iv64, ckey);
+}
+
+bool SSL_Cipher::blockEncodePart(unsigned char *buf, int size,
+                                 const unsigned char *chain, uint64_t iv64,
+                                 const CipherKey &ckey) const {
+  return encodeBlocks(buf, buf, size, chain, iv64, ckey);
+}
+
+bool SSL_Cipher::encodeBlocks(const unsigned char *src, unsigned char *dst,
+                              int size, const unsigned char *chain,
+                              uint64_t iv64, const CipherKey &ckey) const {
   rAssert(size > 0);
   std::shared_ptr<SSLKey> key = dynamic_pointer_cast<SSLKey>(ckey);
   rAssert(key->keySize == _keySize);
@@ -877,11 +898,16 @@ bool SSL_Cipher::blockEncode(unsigned char *buf, int size, uint64_t iv64,
   unsigned char ivec[MAX_IVLENGTH];
 
   int dstLen = 0, tmpLen = 0;
-  setIVec(ivec, iv64, key);
+  if (chain != nullptr) {
+    // CBC continues from the cipher block in front of the part
+    memcpy(ivec, chain, _ivLength);
+  } else {
+    setIVec(ivec, iv64, key);
+  }
 
   EVP_EncryptInit_ex(key->block_enc, nullptr, nullptr, nullptr, ivec);
-  EVP_EncryptUpdate(key->block_enc, buf, &dstLen, buf, size);
-  EVP_EncryptFinal_ex(key->block_enc, buf + dstLen, &tmpLen);
+  EVP_EncryptUpdate(key->block_enc, dst, &dstLen, src, size);
+  EVP_EncryptFinal_ex(key->block_enc, dst + dstLen, &tmpLen);
   dstLen += tmpLen;
 
   if (dstLen != size) {
@@ -895,6 +921,24 @@ bool SSL_Cipher::blockEncode(unsigned char *buf, int size, uint64_t iv64,
 
 bool SSL_Cipher::blockDecode(unsigned char *buf, int size, uint64_t iv64,
                              const CipherKey &ckey) const {
+  return decodeBlocks(buf, buf, size, nullptr, iv64, ckey);
+}
+
+bool SSL_Cipher::blockDecodeTo(const unsigned char *src, unsigned char *dst,
+                               int size, uint64_t iv64,
+                               const CipherKey &ckey) const {
+  return decodeBlocks(src, dst, size, nullptr, iv64, ckey);
+}
+
+bool SSL_Cipher::blockDecodePart(unsigned char *buf, int size,
+                                 const unsigned char *chain, uint64_t iv64,
+                                 const CipherKey &ckey) const {
+  return decodeBlocks(buf, buf, size, chain, iv64, ckey);
+}
+
+bool SSL_Cipher::decodeBlocks(const unsigned char *src, unsigned char *dst,
+                              int size, const unsigned char *chain,
+                              uint64_t iv64, const CipherKey &ckey) const {
   rAssert(size > 0);
   std::shared_ptr<SSLKey> key = dynamic_pointer_cast<SSLKey>(ckey);
   rAssert(key->keySize == _keySize);
@@ -912,11 +956,16 @@ bool SSL_Cipher::blockDecode(unsigned char *buf, int size, uint64_t iv64,
   unsigned char ivec[MAX_IVLENGTH];
 
   int dstLen = 0, tmpLen = 0;
-  setIVec(ivec, iv64, key);
+  if (chain != nullptr) {
+    // CBC continues from the cipher block in front of the part
+    memcpy(ivec, chain, _ivLength);
+  } else {
+    setIVec(ivec, iv64, key);
+  }
 
   EVP_DecryptInit_ex(key->block_dec, nullptr, nullptr, nullptr, ivec);
-  EVP_DecryptUpdate(key->block_dec, buf, &dstLen, buf, size);
-  EVP_DecryptFinal_ex(key->block_dec, buf + dstLen, &tmpLen);
+  EVP_DecryptUpdate(key->block_dec, dst, &dstLen, src, size);
+  EVP_DecryptFinal_ex(key->block_dec, dst + dstLen, &tmpLen);
   dstLen += tmpLen;
 
   if (dstLen != size) {
@@ -928,6 +977,69 @@ bool SSL_Cipher::blockDecode(unsigned char *buf, int size, uint64_t iv64,
   return true;
 }
 
+template <bool Encode>
+bool SSL_Cipher::codeRun(const unsigned char *src, unsigned char *dst,
+                         int size, int count, uint64_t blockNum,
+                         uint64_t iv64, const CipherKey &ckey) const {
+  rAssert(size > 0);
+  std::shared_ptr<SSLKey> key = dynamic_pointer_cast<SSLKey>(ckey);
+  rAssert(key->keySize == _keySize);
+  rAssert(key->ivLength == _ivLength);
+
+  EVP_CIPHER_CTX *ctx = Encode ? key->block_enc : key->block_dec;
+
+  // data must be integer number of blocks
+  const int blockMod = size % EVP_CIPHER_CTX_block_size(ctx);
+  if (blockMod != 0) {
+    RLOG(ERROR) << "Invalid data size, not multiple of block size";
+    return false;
+  }
+
+  Lock lock(key->mutex);
+
+  unsigned char ivec[MAX_IVLENGTH];
+  for (int i = 0; i < count; ++i, src += size, dst += size) {
+    setIVec(ivec, (blockNum + i) ^ iv64, key);
+
+    int dstLen = 0, tmpLen = 0;
+    if (Encode) {
+      EVP_EncryptInit_ex(ctx, nullptr, nullptr, nullptr, ivec);
+      EVP_EncryptUpdate(ctx, dst, &dstLen, src, size);
+      EVP_EncryptFinal_ex(ctx, dst + dstLen, &tmpLen);
+    } else {
+      EVP_DecryptInit_ex(ctx, nullptr, nullptr, nullptr, ivec);
+      EVP_DecryptUpdate(ctx, dst, &dstLen, src, size);
+      EVP_DecryptFinal_ex(ctx, dst + dstLen, &tmpLen);
+    }
+    dstLen += tmpLen;
+
+    if (dstLen != size) {
+      RLOG(ERROR) << (Encode ? "encoding " : "decoding ") << size
+                  << " bytes, got back " << dstLen << " (" << tmpLen
+                  << " in final_ex)";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool SSL_Cipher::blockEncodeRun(const unsigned char *src, unsigned char *dst,
+                                int size, int count, uint64_t blockNum,
+                                uint64_t iv64, const CipherKey &ckey) const {
+  return codeRun<true>(src, dst, size, count, blockNum, iv64, ckey);
+}
+
+bool SSL_Cipher::blockDecodeRun(const unsigned char *src, unsigned char *dst,
+                                int size, int count, uint64_t blockNum,
+                                uint64_t iv64, const CipherKey &ckey) const {
+  return codeRun<false>(src, dst, size, count, blockNum, iv64, ckey);
+}
+
+bool SSL_Cipher::hasBlockParts() const {
+  return (int)_ivLength == EVP_CIPHER_block_size(_blockCipher);
+}
+
 bool SSL_Cipher::Enabled() { return true; }
 
 }  // namespace encfs
@@ -137,6 +137,30 @@ class SSL_Cipher : public Cipher {
                            const CipherKey &key) const;
   virtual bool blockDecode(unsigned char *buf, int size, uint64_t iv64,
                            const CipherKey &key) const;
+  virtual bool blockEncodeTo(const unsigned char *src, unsigned char *dst,
+                             int size, uint64_t iv64,
+                             const CipherKey &key) const;
+  virtual bool blockDecodeTo(const unsigned char *src, unsigned char *dst,
+                             int size, uint64_t iv64,
+                             const CipherKey &key) const;
+  virtual bool blockEncodeRun(const unsigned char *src, unsigned char *dst,
+                              int size, int count, uint64_t blockNum,
+                              uint64_t iv64, const CipherKey &key) const;
+  virtual bool blockDecodeRun(const unsigned char *src, unsigned char *dst,
+                              int size, int count, uint64_t blockNum,
+                              uint64_t iv64, const CipherKey &key) const;
+
+  /*
+      CBC mode, so a part continues from the encoded cipher block in front of
+      it.
+  */
+  virtual bool hasBlockParts() const;
+  virtual bool blockEncodePart(unsigned char *buf, int size,
+                               const unsigned char *chain, uint64_t iv64,
+                               const CipherKey &key) const;
+  virtual bool blockDecodePart(unsigned char *buf, int size,
+                               const unsigned char *chain, uint64_t iv64,
+                               const CipherKey &key) const;
 
   // hack to help with static builds
   static bool Enabled();
@@ -145,6 +169,20 @@ class SSL_Cipher : public Cipher {
   void setIVec(unsigned char *ivec, uint64_t seed,
                const std::shared_ptr<SSLKey> &key) const;
 
+  // CBC coding of src into dst, which may be the same
+  bool encodeBlocks(const unsigned char *src, unsigned char *dst, int size,
+                    const unsigned char *chain, uint64_t iv64,
+                    const CipherKey &key) const;
+  bool decodeBlocks(const unsigned char *src, unsigned char *dst, int size,
+                    const unsigned char *chain, uint64_t iv64,
+                    const CipherKey &key) const;
+
+  // CBC coding of a run of blocks, with the key looked up and locked once
+  template <bool Encode>
+  bool codeRun(const unsigned char *src, unsigned char *dst, int size,
+               int count, uint64_t blockNum, uint64_t iv64,
+               const CipherKey &key) const;
+
   // deprecated - for backward compatibility
   void setIVec_old(unsigned char *ivec, unsigned int seed,
                    const std::shared_ptr<SSLKey> &key) const;
@@ -21,6 +21,7 @@
 #include "StreamNameIO.h"
 
 #include "easylogging++.h"
+#include <cerrno>
 #include <cstring>
 #include <utility>
 
@@ -134,16 +135,16 @@ int StreamNameIO::encodeName(const char *plaintextName, int length,
 
 int StreamNameIO::decodeName(const char *encodedName, int length, uint64_t *iv,
                              char *plaintextName, int bufferLength) const {
-  rAssert(length > 2);
   int decLen256 = B64ToB256Bytes(length);
   int decodedStreamLen = decLen256 - 2;
-  rAssert(decodedStreamLen <= bufferLength);
 
   if (decodedStreamLen <= 0) {
-    throw Error("Filename too small to decode");
+    VLOG(1) << "Rejecting filename " << encodedName;
+    return -EINVAL;
   }
+  rAssert(decodedStreamLen <= bufferLength);
 
-  BUFFER_INIT(tmpBuf, 32, (unsigned int)length);
+  BUFFER_INIT(tmpBuf, 256, (unsigned int)length);
 
   // decode into tmpBuf, because this step produces more data then we can fit
   // into the result buffer..
@@ -184,7 +185,7 @@ int StreamNameIO::decodeName(const char *encodedName, int length, uint64_t *iv,
   if (mac2 != mac) {
     VLOG(1) << "checksum mismatch: expected " << mac << ", got " << mac2;
     VLOG(1) << "on decode of " << decodedStreamLen << " bytes";
-    throw Error("checksum mismatch in filename decode");
+    return -EBADMSG;
   }
 
   return decodedStreamLen;
@@ -0,0 +1,224 @@
+/*****************************************************************************
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "SyncScheduler.h"
+
+#include <atomic>
+#include <cerrno>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "IOUring.h"
+#include "Mutex.h"
+#include "config.h"
+
+namespace encfs {
+
+namespace {
+
+struct Request {
+  bool dataSync;
+  int result;
+  bool done;
+};
+
+// requests for one file
+struct FileQueue {
+  FileQueue() : syncing(false) {}
+  bool syncing;
+  std::vector<Request *> waiting;
+};
+
+// requests for one backing filesystem
+struct Device {
+  Device() : waitingFiles(0), syncfsRunning(false) {
+    pthread_mutex_init(&mutex, nullptr);
+    pthread_cond_init(&cond, nullptr);
+  }
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  std::unordered_map<ino_t, FileQueue> files;
+  // number of files with waiting requests
+  int waitingFiles;
+  bool syncfsRunning;
+};
+
+// There are only a few backing filesystems, so their entries are never freed.
+pthread_mutex_t devicesMutex = PTHREAD_MUTEX_INITIALIZER;
+std::unordered_map<dev_t, Device *> devices;
+
+std::atomic<int> syncfsThreshold(0);
+std::atomic<bool> useIOUring(false);
+std::atomic<SyncScheduler::SyncHook> syncHook(nullptr);
+
+void callHook(int fd, bool syncfs) {
+  SyncScheduler::SyncHook hook = syncHook.load(std::memory_order_acquire);
+  if (hook != nullptr) {
+    hook(fd, syncfs);
+  }
+}
+
+Device &deviceFor(dev_t dev) {
+  Lock lock(devicesMutex);
+  Device *&entry = devices[dev];
+  if (entry == nullptr) {
+    entry = new Device;
+  }
+  return *entry;
+}
+
+int syncFile(int fd, bool dataSync) {
+  callHook(fd, false);
+  IOUring *ring =
+      useIOUring.load(std::memory_order_relaxed) ? IOUring::get() : nullptr;
+  if (ring != nullptr && ring->pending() == 0 &&
+      ring->prepFsync(fd, dataSync, 0)) {
+    uint64_t tag;
+    int res;
+    while (!ring->reap(&tag, &res)) {
+      res = ring->submit(1);
+      if (res < 0) {
+        return res;
+      }
+    }
+    return res;
+  }
+
+  int res;
+#if defined(HAVE_FDATASYNC)
+  if (dataSync) {
+    res = ::fdatasync(fd);
+  } else {
+    res = ::fsync(fd);
+  }
+#else
+  (void)dataSync;
+  res = ::fsync(fd);
+#endif
+  return res == -1 ? -errno : 0;
+}
+
+void complete(const std::vector<Request *> &batch, int res) {
+  for (Request *req : batch) {
+    req->result = res;
+    req->done = true;
+  }
+}
+
+}  // namespace
+
+/*
+    Whoever finds nothing in progress does the sync for everyone waiting,
+    so an uncontended request costs one fstat() more than a plain fsync().
+    A file's queue is looked up again after every wait, as it is removed by
+    the last thread to leave it.
+*/
+int SyncScheduler::sync(int fd, bool dataSync) {
+  struct stat st;
+  if (::fstat(fd, &st) != 0) {
+    return -errno;
+  }
+  Device &dev = deviceFor(st.st_dev);
+
+  Request req;
+  req.dataSync = dataSync;
+  req.result = 0;
+  req.done = false;
+
+  pthread_mutex_lock(&dev.mutex);
+  FileQueue &queue = dev.files[st.st_ino];
+  if (queue.waiting.empty()) {
+    ++dev.waitingFiles;
+  }
+  queue.waiting.push_back(&req);
+
+  while (!req.done) {
+#if defined(HAVE_SYNCFS)
+    int threshold = syncfsThreshold.load(std::memory_order_relaxed);
+    if (threshold > 0 && dev.waitingFiles >= threshold &&
+        !dev.syncfsRunning) {
+      // one syncfs() covers everyone waiting on this filesystem
+      std::vector<Request *> batch;
+      for (auto &entry : dev.files) {
+        std::vector<Request *> &waiting = entry.second.waiting;
+        batch.insert(batch.end(), waiting.begin(), waiting.end());
+        waiting.clear();
+      }
+      dev.waitingFiles = 0;
+      dev.syncfsRunning = true;
+      pthread_mutex_unlock(&dev.mutex);
+
+      callHook(fd, true);
+      int res = ::syncfs(fd) == -1 ? -errno : 0;
+
+      pthread_mutex_lock(&dev.mutex);
+      complete(batch, res);
+      dev.syncfsRunning = false;
+      pthread_cond_broadcast(&dev.cond);
+      continue;
+    }
+#endif
+
+    FileQueue &current = dev.files[st.st_ino];
+    if (!current.syncing && !current.waiting.empty()) {
+      std::vector<Request *> batch;
+      batch.swap(current.waiting);
+      --dev.waitingFiles;
+      current.syncing = true;
+      bool fullSync = false;
+      for (Request *r : batch) {
+        fullSync = fullSync || !r->dataSync;
+      }
+      pthread_mutex_unlock(&dev.mutex);
+
+      int res = syncFile(fd, !fullSync);
+
+      pthread_mutex_lock(&dev.mutex);
+      complete(batch, res);
+      dev.files[st.st_ino].syncing = false;
+      pthread_cond_broadcast(&dev.cond);
+      continue;
+    }
+
+    pthread_cond_wait(&dev.cond, &dev.mutex);
+  }
+
+  auto it = dev.files.find(st.st_ino);
+  if (it != dev.files.end() && !it->second.syncing &&
+      it->second.waiting.empty()) {
+    dev.files.erase(it);
+  }
+  pthread_mutex_unlock(&dev.mutex);
+
+  return req.result;
+}
+
+void SyncScheduler::setSyncfsThreshold(int files) {
+  syncfsThreshold.store(files, std::memory_order_relaxed);
+}
+
+void SyncScheduler::setSyncHook(SyncHook hook) {
+  syncHook.store(hook, std::memory_order_release);
+}
+
+void SyncScheduler::setIOUring(bool enable) {
+  useIOUring.store(enable, std::memory_order_relaxed);
+}
+
+}  // namespace encfs
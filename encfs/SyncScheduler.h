@@ -0,0 +1,57 @@
+/*****************************************************************************
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SyncScheduler_incl_
+#define _SyncScheduler_incl_
+
+namespace encfs {
+
+/*
+    Group commit for fsync() of backing files.
+
+    Concurrent sync requests for the same file share one fsync: a request
+    which arrives while the file is being synced waits for the sync in
+    progress, and is then covered by the next one, together with everyone
+    else who arrived in the meantime.
+
+    Optionally (--syncfs), when requests for several files of the same
+    filesystem are waiting, a single syncfs() is used for all of them
+    instead.  That writes back everything on the filesystem, and before
+    Linux 5.8 it doesn't report writeback errors, so it is off by default.
+
+    Usage:
+    int res = SyncScheduler::sync( fd, dataSync );
+*/
+namespace SyncScheduler {
+// Returns 0 on success, -errno on failure.
+int sync(int fd, bool dataSync);
+
+// number of files of a filesystem which must be waiting before they are
+// synced with syncfs() instead of one by one.  0 (the default) disables
+// syncfs().
+void setSyncfsThreshold(int files);
+
+// called before every fsync(), fdatasync() or syncfs() of a backing file,
+// from the thread doing it.  Used by the tests to count and hold up syncs.
+typedef void (*SyncHook)(int fd, bool syncfs);
+void setSyncHook(SyncHook hook);
+
+// sync single files through the thread's io_uring, see IOUring
+void setIOUring(bool enable);
+}
+
+}  // namespace encfs
+
+#endif
@@ -0,0 +1,126 @@
+/*****************************************************************************
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ZeroBlock.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ZEROBLOCK_SIMD 1
+#include <immintrin.h>
+#define SSE2_FUNC __attribute__((target("sse2")))
+#define AVX2_FUNC __attribute__((target("avx2")))
+#endif
+
+namespace encfs {
+
+/*
+    Data blocks almost always have a non-zero byte near the start, so the
+    first bytes are checked on their own.  After that the buffer is or'ed
+    together a chunk at a time, with one test per chunk.
+*/
+static const size_t HeadBytes = 16;
+
+static bool isZeroGeneric(const unsigned char *buf, size_t length) {
+  const unsigned char *end = buf + length;
+  while (buf + sizeof(uint64_t) * 4 <= end) {
+    uint64_t w[4];
+    memcpy(w, buf, sizeof(w));
+    if ((w[0] | w[1] | w[2] | w[3]) != 0) {
+      return false;
+    }
+    buf += sizeof(w);
+  }
+  unsigned char acc = 0;
+  while (buf != end) {
+    acc |= *buf++;
+  }
+  return acc == 0;
+}
+
+#ifdef ZEROBLOCK_SIMD
+SSE2_FUNC static bool isZeroSSE2(const unsigned char *buf, size_t length) {
+  const unsigned char *end = buf + length;
+  const __m128i zero = _mm_setzero_si128();
+  while (buf + 64 <= end) {
+    __m128i acc = _mm_or_si128(
+        _mm_or_si128(_mm_loadu_si128((const __m128i *)buf),
+                     _mm_loadu_si128((const __m128i *)(buf + 16))),
+        _mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + 32)),
+                     _mm_loadu_si128((const __m128i *)(buf + 48))));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff) {
+      return false;
+    }
+    buf += 64;
+  }
+  return isZeroGeneric(buf, end - buf);
+}
+
+AVX2_FUNC static bool isZeroAVX2(const unsigned char *buf, size_t length) {
+  const unsigned char *end = buf + length;
+  while (buf + 128 <= end) {
+    __m256i acc = _mm256_or_si256(
+        _mm256_or_si256(_mm256_loadu_si256((const __m256i *)buf),
+                        _mm256_loadu_si256((const __m256i *)(buf + 32))),
+        _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(buf + 64)),
+                        _mm256_loadu_si256((const __m256i *)(buf + 96))));
+    if (_mm256_testz_si256(acc, acc) == 0) {
+      return false;
+    }
+    buf += 128;
+  }
+  return isZeroSSE2(buf, end - buf);
+}
+
+typedef bool (*ZeroFunc)(const unsigned char *, size_t);
+
+static ZeroFunc bestZeroFunc() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") != 0) {
+    return isZeroAVX2;
+  }
+  if (__builtin_cpu_supports("sse2") != 0) {
+    return isZeroSSE2;
+  }
+  return isZeroGeneric;
+}
+static ZeroFunc zeroFunc = bestZeroFunc();
+
+bool zeroBlockSetSIMD(bool enable) {
+  zeroFunc = enable ? bestZeroFunc() : isZeroGeneric;
+  return zeroFunc != isZeroGeneric;
+}
+#else
+bool zeroBlockSetSIMD(bool) { return false; }
+#endif
+
+bool isZeroBlock(const unsigned char *buf, size_t length) {
+  if (length <= HeadBytes) {
+    return isZeroGeneric(buf, length);
+  }
+  uint64_t head[HeadBytes / sizeof(uint64_t)];
+  memcpy(head, buf, HeadBytes);
+  if ((head[0] | head[1]) != 0) {
+    return false;
+  }
+#ifdef ZEROBLOCK_SIMD
+  return zeroFunc(buf + HeadBytes, length - HeadBytes);
+#else
+  return isZeroGeneric(buf + HeadBytes, length - HeadBytes);
+#endif
+}
+
+}  // namespace encfs
@@ -0,0 +1,36 @@
+/*****************************************************************************
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ZeroBlock_incl_
+#define _ZeroBlock_incl_
+
+#include <cstddef>
+
+namespace encfs {
+
+// Returns true if the buffer holds only 0's.  Blocks read from holes in the
+// backing file are all 0's, and are passed through without decoding.
+bool isZeroBlock(const unsigned char *buf, size_t length);
+
+/*
+    isZeroBlock() uses SSE2, or AVX2 when the CPU supports it.  Returns
+    whether the vector code is in use; passing false forces the portable
+    code, which is useful for testing.
+*/
+bool zeroBlockSetSIMD(bool enable);
+
+}  // namespace encfs
+
+#endif
@@ -20,12 +20,35 @@
 
 #include "base64.h"
 
-#include <cctype>  // for toupper
+#include <cctype>   // for toupper
+#include <cstdint>  // for uint32_t
+#include <cstring>  // for memcpy
 
 #include "Error.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BASE64_SSSE3 1
+#include <tmmintrin.h>
+#define SSSE3_FUNC __attribute__((target("ssse3")))
+#endif
+
 namespace encfs {
 
+#ifdef BASE64_SSSE3
+static bool cpuHasSSSE3() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("ssse3") != 0;
+}
+static bool useSSSE3 = cpuHasSSSE3();
+
+bool base64SetSIMD(bool enable) {
+  useSSSE3 = enable && cpuHasSSSE3();
+  return useSSSE3;
+}
+#else
+bool base64SetSIMD(bool) { return false; }
+#endif
+
 // change between two powers of two, stored as the low bits of the bytes in the
 // arrays.
 // It is the caller's responsibility to make sure the output array is large
@@ -63,11 +86,14 @@ void changeBase2(unsigned char *src, int srcLen, int src2Pow,
 
     Uses the stack to store output values.  Recurse every time a new value is
     to be written, then write the value at the tail end of the recursion.
+
+    Only used for conversions which the iterative versions below don't handle.
 */
-static void changeBase2Inline(unsigned char *src, int srcLen, int src2Pow,
-                              int dst2Pow, bool outputPartialLastByte,
-                              unsigned long work, int workBits,
-                              unsigned char *outLoc) {
+static void changeBase2InlineRecursive(unsigned char *src, int srcLen,
+                                       int src2Pow, int dst2Pow,
+                                       bool outputPartialLastByte,
+                                       unsigned long work, int workBits,
+                                       unsigned char *outLoc) {
   const int mask = (1 << dst2Pow) - 1;
   if (outLoc == nullptr) {
     outLoc = src;
@@ -88,8 +114,9 @@ static void changeBase2Inline(unsigned char *src, int srcLen, int src2Pow,
 
   if (srcLen != 0) {
     // more input left, so recurse
-    changeBase2Inline(src, srcLen, src2Pow, dst2Pow, outputPartialLastByte,
-                      work, workBits, outLoc + 1);
+    changeBase2InlineRecursive(src, srcLen, src2Pow, dst2Pow,
+                               outputPartialLastByte, work, workBits,
+                               outLoc + 1);
     *outLoc = outVal;
   } else {
     // no input left, we can write remaining values directly
@@ -106,10 +133,168 @@ static void changeBase2Inline(unsigned char *src, int srcLen, int src2Pow,
   }
 }
 
+/*
+    Expand bytes into smaller values in place.  Output value j holds bits
+    [j * dst2Pow, (j + 1) * dst2Pow) of the input, so working backwards from
+    the last value never overwrites input which is still needed.  Values below
+    index stop are left alone.
+*/
+static void expandBase2Generic(unsigned char *buf, int srcLen, int dst2Pow,
+                               int outLen, int stop) {
+  const int mask = (1 << dst2Pow) - 1;
+  for (int j = outLen - 1; j >= stop; --j) {
+    int bit = j * dst2Pow;
+    int i = bit >> 3;
+    int shift = bit & 7;
+    unsigned int value = i < srcLen ? buf[i] >> shift : 0;
+    if (shift + dst2Pow > 8 && i + 1 < srcLen) {
+      value |= (unsigned int)buf[i + 1] << (8 - shift);
+    }
+    buf[j] = value & mask;
+  }
+}
+
+#ifdef BASE64_SSSE3
+// 12 bytes => 16 base64 values, or 10 bytes => 16 base32 values.
+SSSE3_FUNC static void expandBase2SSSE3(unsigned char *buf, int srcLen,
+                                        int dst2Pow, int outLen) {
+  const int inBytes = dst2Pow == 6 ? 12 : 10;
+  int groups = srcLen / inBytes;
+  if (groups > outLen / 16) {
+    groups = outLen / 16;
+  }
+
+  // values past the vectorized groups first, as they overlap the input
+  expandBase2Generic(buf, srcLen, dst2Pow, outLen, groups * 16);
+
+  for (int g = groups - 1; g >= 0; --g) {
+    const unsigned char *in = buf + g * inBytes;
+    uint32_t tail = 0;
+    memcpy(&tail, in + 8, inBytes - 8);
+    __m128i v = _mm_unpacklo_epi64(
+        _mm_loadl_epi64((const __m128i *)in), _mm_cvtsi32_si128(tail));
+
+    __m128i out;
+    if (dst2Pow == 6) {
+      // 3 bytes per 32 bit lane, split into 4 values of 6 bits
+      __m128i w = _mm_shuffle_epi8(
+          v, _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+                           -1));
+      out = _mm_and_si128(w, _mm_set1_epi32(0x3f));
+      out = _mm_or_si128(out, _mm_and_si128(_mm_slli_epi32(w, 2),
+                                            _mm_set1_epi32(0x3f00)));
+      out = _mm_or_si128(out, _mm_and_si128(_mm_slli_epi32(w, 4),
+                                            _mm_set1_epi32(0x3f0000)));
+      out = _mm_or_si128(out, _mm_and_si128(_mm_slli_epi32(w, 6),
+                                            _mm_set1_epi32(0x3f000000)));
+    } else {
+      // 5 bytes per 64 bit lane, split into 8 values of 5 bits
+      __m128i w = _mm_shuffle_epi8(
+          v, _mm_setr_epi8(0, 1, 2, 3, 4, -1, -1, -1, 5, 6, 7, 8, 9, -1, -1,
+                           -1));
+      out = _mm_and_si128(w, _mm_set1_epi64x(0x1f));
+      out = _mm_or_si128(out, _mm_and_si128(_mm_slli_epi64(w, 3),
+                                            _mm_set1_epi64x(0x1fLL << 8)));
+      out = _mm_or_si128(out, _mm_and_si128(_mm_slli_epi64(w, 6),
+                                            _mm_set1_epi64x(0x1fLL << 16)));
+      out = _mm_or_si128(out, _mm_and_si128(_mm_slli_epi64(w, 9),
+                                            _mm_set1_epi64x(0x1fLL << 24)));
+      out = _mm_or_si128(out, _mm_and_si128(_mm_slli_epi64(w, 12),
+                                            _mm_set1_epi64x(0x1fLL << 32)));
+      out = _mm_or_si128(out, _mm_and_si128(_mm_slli_epi64(w, 15),
+                                            _mm_set1_epi64x(0x1fLL << 40)));
+      out = _mm_or_si128(out, _mm_and_si128(_mm_slli_epi64(w, 18),
+                                            _mm_set1_epi64x(0x1fLL << 48)));
+      out = _mm_or_si128(out, _mm_and_si128(_mm_slli_epi64(w, 21),
+                                            _mm_set1_epi64x(0x1fLL << 56)));
+    }
+    _mm_storeu_si128((__m128i *)(buf + g * 16), out);
+  }
+}
+
+// 16 base64 values => 12 bytes, or 16 base32 values => 10 bytes.  Returns the
+// number of values consumed, which stops early at any out of range value so
+// that the generic code reproduces its overflow into the neighbouring bits.
+SSSE3_FUNC static int shrinkBase2SSSE3(unsigned char *buf, int srcLen,
+                                       int src2Pow) {
+  const int outBytes = src2Pow == 6 ? 12 : 10;
+  const __m128i limit = _mm_set1_epi8((char)(1 << src2Pow));
+  int done = 0;
+  for (; done + 16 <= srcLen; done += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(buf + done));
+    __m128i tooBig = _mm_cmpeq_epi8(_mm_max_epu8(v, limit), v);
+    if (_mm_movemask_epi8(tooBig) != 0) {
+      break;
+    }
+
+    __m128i w;
+    if (src2Pow == 6) {
+      // pairs of 6 bit values => 12 bits, then pairs of those => 24 bits
+      w = _mm_maddubs_epi16(v, _mm_set1_epi16(0x4001));
+      w = _mm_madd_epi16(w, _mm_set1_epi32(0x10000001));
+      w = _mm_shuffle_epi8(
+          w, _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1,
+                           -1));
+    } else {
+      // 5 bit values => 10 bits => 20 bits => 40 bits per 64 bit lane
+      w = _mm_maddubs_epi16(v, _mm_set1_epi16(0x2001));
+      w = _mm_madd_epi16(w, _mm_set1_epi32(0x04000001));
+      w = _mm_or_si128(_mm_and_si128(w, _mm_set1_epi64x(0xfffff)),
+                       _mm_and_si128(_mm_srli_epi64(w, 12),
+                                     _mm_set1_epi64x(0xfffffLL << 20)));
+      w = _mm_shuffle_epi8(
+          w, _mm_setr_epi8(0, 1, 2, 3, 4, 8, 9, 10, 11, 12, -1, -1, -1, -1, -1,
+                           -1));
+    }
+
+    unsigned char *out = buf + (done / 16) * outBytes;
+    _mm_storel_epi64((__m128i *)out, w);
+    uint32_t tail = _mm_cvtsi128_si32(_mm_srli_si128(w, 8));
+    memcpy(out + 8, &tail, outBytes - 8);
+  }
+  return done;
+}
+#endif
+
 void changeBase2Inline(unsigned char *src, int srcLen, int src2Pow, int dst2Pow,
                        bool outputPartialLastByte) {
-  changeBase2Inline(src, srcLen, src2Pow, dst2Pow, outputPartialLastByte, 0, 0,
-                    nullptr);
+  bool expand = src2Pow == 8 && dst2Pow < 8;
+  bool shrink = dst2Pow == 8 && src2Pow < 8;
+  if (srcLen <= 0 || (!expand && !shrink)) {
+    changeBase2InlineRecursive(src, srcLen, src2Pow, dst2Pow,
+                               outputPartialLastByte, 0, 0, nullptr);
+    return;
+  }
+
+  // number of values the recursive version writes
+  int outLen = ((srcLen - 1) * src2Pow) / dst2Pow + 1;
+  if (outputPartialLastByte) {
+    int allBits = (srcLen * src2Pow + dst2Pow - 1) / dst2Pow;
+    if (allBits > outLen) {
+      outLen = allBits;
+    }
+  }
+
+  if (expand) {
+#ifdef BASE64_SSSE3
+    if (useSSSE3 && (dst2Pow == 6 || dst2Pow == 5)) {
+      expandBase2SSSE3(src, srcLen, dst2Pow, outLen);
+      return;
+    }
+#endif
+    expandBase2Generic(src, srcLen, dst2Pow, outLen, 0);
+  } else {
+    int done = 0;
+#ifdef BASE64_SSSE3
+    if (useSSSE3 && (src2Pow == 6 || src2Pow == 5)) {
+      done = shrinkBase2SSSE3(src, srcLen, src2Pow);
+    }
+#endif
+    // output never overtakes the input, so changeBase2 works in place
+    int outDone = (done * src2Pow) / 8;
+    changeBase2(src + done, srcLen - done, src2Pow, src + outDone,
+                outLen - outDone, dst2Pow);
+  }
 }
 
 // character set for ascii b64:
@@ -119,7 +304,7 @@ void changeBase2Inline(unsigned char *src, int srcLen, int src2Pow, int dst2Pow,
 // '.' included in the encrypted names, so that it can be reserved for files
 // with special meaning.
 static const char B642AsciiTable[] = ",-0123456789";
-void B64ToAscii(unsigned char *in, int length) {
+static void B64ToAsciiGeneric(unsigned char *in, int length) {
   for (int offset = 0; offset < length; ++offset) {
     int ch = in[offset];
     if (ch > 11) {
@@ -140,11 +325,8 @@ static const unsigned char Ascii2B64Table[] =
     "                                            01  23456789:;       ";
 //  0123456789 123456789 123456789 123456789 123456789 123456789 1234
 //  0         1         2         3         4         5         6
-void AsciiToB64(unsigned char *in, int length) {
-  return AsciiToB64(in, in, length);
-}
-
-void AsciiToB64(unsigned char *out, const unsigned char *in, int length) {
+static void AsciiToB64Generic(unsigned char *out, const unsigned char *in,
+                              int length) {
   while ((length--) != 0) {
     unsigned char ch = *in++;
     if (ch >= 'A') {
@@ -160,7 +342,7 @@ void AsciiToB64(unsigned char *out, const unsigned char *in, int length) {
   }
 }
 
-void B32ToAscii(unsigned char *buf, int len) {
+static void B32ToAsciiGeneric(unsigned char *buf, int len) {
   for (int offset = 0; offset < len; ++offset) {
     int ch = buf[offset];
     if (ch >= 0 && ch < 26) {
@@ -173,11 +355,8 @@ void B32ToAscii(unsigned char *buf, int len) {
   }
 }
 
-void AsciiToB32(unsigned char *in, int length) {
-  return AsciiToB32(in, in, length);
-}
-
-void AsciiToB32(unsigned char *out, const unsigned char *in, int length) {
+static void AsciiToB32Generic(unsigned char *out, const unsigned char *in,
+                              int length) {
   while ((length--) != 0) {
     unsigned char ch = *in++;
     int lch = toupper(ch);
@@ -190,6 +369,133 @@ void AsciiToB32(unsigned char *out, const unsigned char *in, int length) {
   }
 }
 
+#ifdef BASE64_SSSE3
+// all-ones in each byte of v which is >= min (unsigned)
+SSSE3_FUNC static inline __m128i atLeast(__m128i v, int min) {
+  return _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8((char)min)), v);
+}
+
+SSSE3_FUNC static inline __m128i blend(__m128i mask, __m128i a, __m128i b) {
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// The translations below add a per-range offset to each byte, matching the
+// generic versions (including their wrap around) for every input value.
+SSSE3_FUNC static void B64ToAsciiSSSE3(unsigned char *buf, int length) {
+  int offset = 0;
+  for (; offset + 16 <= length; offset += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(buf + offset));
+    // ',' '-' for 0-1, digits from 2, upper case from 12, lower from 38
+    __m128i add = _mm_set1_epi8(',');
+    add = _mm_add_epi8(add, _mm_and_si128(atLeast(v, 2), _mm_set1_epi8(2)));
+    add = _mm_add_epi8(add, _mm_and_si128(atLeast(v, 12), _mm_set1_epi8(7)));
+    add = _mm_add_epi8(add, _mm_and_si128(atLeast(v, 38), _mm_set1_epi8(6)));
+    _mm_storeu_si128((__m128i *)(buf + offset), _mm_add_epi8(v, add));
+  }
+  B64ToAsciiGeneric(buf + offset, length - offset);
+}
+
+SSSE3_FUNC static void AsciiToB64SSSE3(unsigned char *out,
+                                       const unsigned char *in, int length) {
+  int offset = 0;
+  for (; offset + 16 <= length; offset += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(in + offset));
+    __m128i letters = _mm_sub_epi8(
+        v, blend(atLeast(v, 'a'), _mm_set1_epi8('a' - 38),
+                  _mm_set1_epi8('A' - 12)));
+
+    // everything below 'A' which isn't in the table maps to ' ' - '0'
+    __m128i punct = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(',')),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('-')));
+    __m128i digits =
+        _mm_andnot_si128(atLeast(v, '9' + 1), atLeast(v, '0'));
+    __m128i other = _mm_set1_epi8((char)(' ' - '0'));
+    other = blend(digits, _mm_sub_epi8(v, _mm_set1_epi8('0' - 2)), other);
+    other = blend(punct, _mm_sub_epi8(v, _mm_set1_epi8(',')), other);
+
+    _mm_storeu_si128((__m128i *)(out + offset),
+                     blend(atLeast(v, 'A'), letters, other));
+  }
+  AsciiToB64Generic(out + offset, in + offset, length - offset);
+}
+
+SSSE3_FUNC static void B32ToAsciiSSSE3(unsigned char *buf, int length) {
+  int offset = 0;
+  for (; offset + 16 <= length; offset += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(buf + offset));
+    __m128i add = blend(atLeast(v, 26), _mm_set1_epi8('2' - 26),
+                         _mm_set1_epi8('A'));
+    _mm_storeu_si128((__m128i *)(buf + offset), _mm_add_epi8(v, add));
+  }
+  B32ToAsciiGeneric(buf + offset, length - offset);
+}
+
+// Only valid while toupper() maps 'a'-'z' to 'A'-'Z'.  Blocks containing
+// non-ascii bytes are left to the generic code, as toupper() depends on the
+// locale there.
+SSSE3_FUNC static void AsciiToB32SSSE3(unsigned char *out,
+                                       const unsigned char *in, int length) {
+  int offset = 0;
+  for (; offset + 16 <= length; offset += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(in + offset));
+    if (_mm_movemask_epi8(v) != 0) {
+      AsciiToB32Generic(out + offset, in + offset, 16);
+      continue;
+    }
+    __m128i lower = _mm_andnot_si128(atLeast(v, 'z' + 1), atLeast(v, 'a'));
+    __m128i upper = _mm_sub_epi8(v, _mm_and_si128(lower, _mm_set1_epi8(32)));
+    __m128i sub = blend(atLeast(upper, 'A'), _mm_set1_epi8('A'),
+                         _mm_set1_epi8('2' - 26));
+    _mm_storeu_si128((__m128i *)(out + offset), _mm_sub_epi8(upper, sub));
+  }
+  AsciiToB32Generic(out + offset, in + offset, length - offset);
+}
+#endif
+
+void B64ToAscii(unsigned char *in, int length) {
+#ifdef BASE64_SSSE3
+  if (useSSSE3) {
+    return B64ToAsciiSSSE3(in, length);
+  }
+#endif
+  B64ToAsciiGeneric(in, length);
+}
+
+void AsciiToB64(unsigned char *in, int length) {
+  return AsciiToB64(in, in, length);
+}
+
+void AsciiToB64(unsigned char *out, const unsigned char *in, int length) {
+#ifdef BASE64_SSSE3
+  if (useSSSE3) {
+    return AsciiToB64SSSE3(out, in, length);
+  }
+#endif
+  AsciiToB64Generic(out, in, length);
+}
+
+void B32ToAscii(unsigned char *buf, int len) {
+#ifdef BASE64_SSSE3
+  if (useSSSE3) {
+    return B32ToAsciiSSSE3(buf, len);
+  }
+#endif
+  B32ToAsciiGeneric(buf, len);
+}
+
+void AsciiToB32(unsigned char *in, int length) {
+  return AsciiToB32(in, in, length);
+}
+
+void AsciiToB32(unsigned char *out, const unsigned char *in, int length) {
+#ifdef BASE64_SSSE3
+  if (useSSSE3 && toupper('i') == 'I') {
+    return AsciiToB32SSSE3(out, in, length);
+  }
+#endif
+  AsciiToB32Generic(out, in, length);
+}
+
 #define WHITESPACE 64
 #define EQUALS 65
 #define INVALID 66
@@ -67,6 +67,13 @@ void AsciiToB64(unsigned char *out, const unsigned char *in, int length);
 void AsciiToB32(unsigned char *buf, int length);
 void AsciiToB32(unsigned char *out, const unsigned char *in, int length);
 
+/*
+    The conversions above use SSSE3 when the CPU supports it, producing the
+    same output as the portable code.  Returns whether the vector code is in
+    use; passing false forces the portable code, which is useful for testing.
+*/
+bool base64SetSIMD(bool enable);
+
 // Decode standard B64 into the output array.
 // Used only to decode legacy Boost XML serialized config format.
 // The output size must be at least B64ToB256Bytes(inputLen).
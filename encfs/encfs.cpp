@@ -19,6 +19,7 @@
 
 #include <cerrno>
 #include <cinttypes>
+#include <climits>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
@@ -77,7 +78,7 @@ static bool isReadOnly(EncFS_Context *ctx) { return ctx->opts->readOnly; }
 // helper function -- apply a functor to a cipher path, given the plain path
 static int withCipherPath(
     const char *opName, const char *path,
-    const function<int(EncFS_Context *, const string &)> &op,
+    const function<int(EncFS_Context *, const char *)> &op,
     bool passReturnCode = false) {
   EncFS_Context *ctx = context();
 
@@ -88,7 +89,14 @@ static int withCipherPath(
   }
 
   try {
-    string cyName = FSRoot->cipherPath(path);
+    // translate the path on the stack, the backing filesystem rejects
+    // anything longer than PATH_MAX anyway.
+    char cyName[PATH_MAX];
+    int cyLen = FSRoot->cipherPath(path, cyName, sizeof(cyName));
+    if (cyLen < 0) {
+      VLOG(1) << "op: " << opName << " error: " << strerror(-cyLen);
+      return cyLen == -ENAMETOOLONG ? cyLen : -EIO;
+    }
     VLOG(1) << "op: " << opName << " : " << cyName;
 
     res = op(ctx, cyName);
@@ -107,6 +115,27 @@ static int withCipherPath(
   return res;
 }
 
+// withCipherPath for operations which change the attributes of the path, or
+// with entryChange its directory entry.  What getattr cached for it is
+// dropped afterwards.
+static int withChangedCipherPath(
+    const char *opName, const char *path,
+    const function<int(EncFS_Context *, const char *)> &op,
+    bool entryChange = false) {
+  int res = withCipherPath(opName, path, op);
+
+  int err = -EIO;
+  std::shared_ptr<DirNode> FSRoot = context()->getRoot(&err, true);
+  if (FSRoot) {
+    if (entryChange) {
+      FSRoot->invalidateEntry(path);
+    } else {
+      FSRoot->invalidateAttr(path);
+    }
+  }
+  return res;
+}
+
 static void checkCanary(const std::shared_ptr<FileNode> &fnode) {
   if (fnode->canary == CANARY_OK) {
     return;
@@ -203,29 +232,37 @@ int _do_getattr(FileNode *fnode, struct stat *stbuf) {
     EncFS_Context *ctx = context();
     std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
     if (FSRoot) {
-      // determine plaintext link size..  Easiest to read and decrypt..
-      std::vector<char> buf(stbuf->st_size + 1, '\0');
-
-      res = ::readlink(fnode->cipherName(), buf.data(), stbuf->st_size);
-      if (res >= 0) {
-        // other functions expect c-strings to be null-terminated, which
-        // readlink doesn't provide
-        buf[res] = '\0';
-
-        stbuf->st_size = FSRoot->plainPath(buf.data()).length();
-
-        res = ESUCCESS;
-      } else {
-        res = -errno;
-      }
+      res = FSRoot->adjustLinkSize(fnode->cipherName(), stbuf);
     }
   }
 
   return res;
 }
 
+/*
+    getattr without a file handle is the most frequent operation, so it skips
+    withFileNode: building a FileNode (and its FileIO stack) just to lstat()
+    the backing file costs more than the lstat itself.
+*/
 int encfs_getattr(const char *path, struct stat *stbuf) {
-  return withFileNode("getattr", path, nullptr, bind(_do_getattr, _1, stbuf));
+  EncFS_Context *ctx = context();
+
+  int res = -EIO;
+  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res, strlen(path) == 1);
+  if (!FSRoot) {
+    return res;
+  }
+
+  try {
+    res = FSRoot->getAttr(path, stbuf);
+    if (res < 0) {
+      RLOG(DEBUG) << "op: getattr error: " << strerror(-res);
+    }
+  } catch (encfs::Error &err) {
+    RLOG(ERROR) << "encfs_getattr: error caught: " << err.what();
+    res = -EIO;
+  }
+  return res;
 }
 
 int encfs_fgetattr(const char *path, struct stat *stbuf,
@@ -299,6 +336,8 @@ int encfs_mknod(const char *path, mode_t mode, dev_t rdev) {
   }
 
   try {
+    // a released node for this path refers to a file which is gone
+    ctx->dropReleasedNode(path);
     std::shared_ptr<FileNode> fnode = FSRoot->lookupNode(path, "mknod");
 
     VLOG(1) << "mknod on " << fnode->cipherName() << ", mode " << mode
@@ -393,8 +432,8 @@ int encfs_unlink(const char *path) {
   return res;
 }
 
-int _do_rmdir(EncFS_Context *, const string &cipherPath) {
-  return rmdir(cipherPath.c_str());
+int _do_rmdir(EncFS_Context *, const char *cipherPath) {
+  return rmdir(cipherPath);
 }
 
 int encfs_rmdir(const char *path) {
@@ -402,10 +441,11 @@ int encfs_rmdir(const char *path) {
   if (isReadOnly(ctx)) {
     return -EROFS;
   }
-  return withCipherPath("rmdir", path, bind(_do_rmdir, _1, _2));
+  return withChangedCipherPath("rmdir", path, bind(_do_rmdir, _1, _2),
+                               true);
 }
 
-int _do_readlink(EncFS_Context *ctx, const string &cyName, char *buf,
+int _do_readlink(EncFS_Context *ctx, const char *cyName, char *buf,
                  size_t size) {
   int res = ESUCCESS;
   std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
@@ -413,7 +453,7 @@ int _do_readlink(EncFS_Context *ctx, const string &cyName, char *buf,
     return res;
   }
 
-  res = ::readlink(cyName.c_str(), buf, size - 1);
+  res = ::readlink(cyName, buf, size - 1);
 
   if (res == -1) {
     return -errno;
@@ -481,6 +521,7 @@ int encfs_symlink(const char *to, const char *from) {
       }
     }
     res = ::symlink(toCName.c_str(), fromCName.c_str());
+    FSRoot->invalidateEntry(from);
     if (olduid >= 0) {
       if(setfsuid(olduid) == -1) {
         int eno = errno;
@@ -549,8 +590,8 @@ int encfs_rename(const char *from, const char *to) {
   return res;
 }
 
-int _do_chmod(EncFS_Context *, const string &cipherPath, mode_t mode) {
-  return chmod(cipherPath.c_str(), mode);
+int _do_chmod(EncFS_Context *, const char *cipherPath, mode_t mode) {
+  return chmod(cipherPath, mode);
 }
 
 int encfs_chmod(const char *path, mode_t mode) {
@@ -558,11 +599,11 @@ int encfs_chmod(const char *path, mode_t mode) {
   if (isReadOnly(ctx)) {
     return -EROFS;
   }
-  return withCipherPath("chmod", path, bind(_do_chmod, _1, _2, mode));
+  return withChangedCipherPath("chmod", path, bind(_do_chmod, _1, _2, mode));
 }
 
-int _do_chown(EncFS_Context *, const string &cyName, uid_t u, gid_t g) {
-  int res = lchown(cyName.c_str(), u, g);
+int _do_chown(EncFS_Context *, const char *cyName, uid_t u, gid_t g) {
+  int res = lchown(cyName, u, g);
   return (res == -1) ? -errno : ESUCCESS;
 }
 
@@ -571,7 +612,8 @@ int encfs_chown(const char *path, uid_t uid, gid_t gid) {
   if (isReadOnly(ctx)) {
     return -EROFS;
   }
-  return withCipherPath("chown", path, bind(_do_chown, _1, _2, uid, gid));
+  return withChangedCipherPath("chown", path,
+                               bind(_do_chown, _1, _2, uid, gid));
 }
 
 int _do_truncate(FileNode *fnode, off_t size) { return fnode->truncate(size); }
@@ -592,8 +634,31 @@ int encfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
   return withFileNode("ftruncate", path, fi, bind(_do_truncate, _1, size));
 }
 
-int _do_utime(EncFS_Context *, const string &cyName, struct utimbuf *buf) {
-  int res = utime(cyName.c_str(), buf);
+int _do_fallocate(FileNode *fnode, int mode, off_t offset, off_t length) {
+  bool keepSize = false;
+#ifdef FALLOC_FL_KEEP_SIZE
+  keepSize = (mode & FALLOC_FL_KEEP_SIZE) != 0;
+  mode &= ~FALLOC_FL_KEEP_SIZE;
+#endif
+  // punching holes or zeroing ranges would need blocks to be rewritten
+  if (mode != 0) {
+    return -EOPNOTSUPP;
+  }
+  return fnode->allocate(offset, length, keepSize);
+}
+
+int encfs_fallocate(const char *path, int mode, off_t offset, off_t length,
+                    struct fuse_file_info *fi) {
+  EncFS_Context *ctx = context();
+  if (isReadOnly(ctx)) {
+    return -EROFS;
+  }
+  return withFileNode("fallocate", path, fi,
+                      bind(_do_fallocate, _1, mode, offset, length));
+}
+
+int _do_utime(EncFS_Context *, const char *cyName, struct utimbuf *buf) {
+  int res = utime(cyName, buf);
   return (res == -1) ? -errno : ESUCCESS;
 }
 
@@ -602,13 +667,13 @@ int encfs_utime(const char *path, struct utimbuf *buf) {
   if (isReadOnly(ctx)) {
     return -EROFS;
   }
-  return withCipherPath("utime", path, bind(_do_utime, _1, _2, buf));
+  return withChangedCipherPath("utime", path, bind(_do_utime, _1, _2, buf));
 }
 
-int _do_utimens(EncFS_Context *, const string &cyName,
+int _do_utimens(EncFS_Context *, const char *cyName,
                 const struct timespec ts[2]) {
 #ifdef HAVE_UTIMENSAT
-  int res = utimensat(AT_FDCWD, cyName.c_str(), ts, AT_SYMLINK_NOFOLLOW);
+  int res = utimensat(AT_FDCWD, cyName, ts, AT_SYMLINK_NOFOLLOW);
 #else
   struct timeval tv[2];
   tv[0].tv_sec = ts[0].tv_sec;
@@ -616,7 +681,7 @@ int _do_utimens(EncFS_Context *, const string &cyName,
   tv[1].tv_sec = ts[1].tv_sec;
   tv[1].tv_usec = ts[1].tv_nsec / 1000;
 
-  int res = lutimes(cyName.c_str(), tv);
+  int res = lutimes(cyName, tv);
 #endif
   return (res == -1) ? -errno : ESUCCESS;
 }
@@ -626,7 +691,8 @@ int encfs_utimens(const char *path, const struct timespec ts[2]) {
   if (isReadOnly(ctx)) {
     return -EROFS;
   }
-  return withCipherPath("utimens", path, bind(_do_utimens, _1, _2, ts));
+  return withChangedCipherPath("utimens", path,
+                               bind(_do_utimens, _1, _2, ts));
 }
 
 int encfs_open(const char *path, struct fuse_file_info *file) {
@@ -652,9 +718,10 @@ int encfs_open(const char *path, struct fuse_file_info *file) {
               << file->flags;
 
       if (res >= 0) {
-        ctx->putNode(path, fnode);
-        file->fh = fnode->fuseFh;
-        res = ESUCCESS;
+        res = ctx->putNode(path, fnode);
+        if (res == ESUCCESS) {
+          file->fh = fnode->fuseFh;
+        }
       }
     }
   } catch (encfs::Error &err) {
@@ -664,13 +731,70 @@ int encfs_open(const char *path, struct fuse_file_info *file) {
   return res;
 }
 
+/*
+    Create and open a regular file with a single open(O_CREAT | O_EXCL), and
+    keep that descriptor, rather than mknod + open.
+*/
 int encfs_create(const char *path, mode_t mode, struct fuse_file_info *file) {
-  int res = encfs_mknod(path, mode, 0);
-  if (res != 0) {
+  if (!S_ISREG(mode)) {
+    int res = encfs_mknod(path, mode, 0);
+    if (res != 0) {
+      return res;
+    }
+    return encfs_open(path, file);
+  }
+
+  EncFS_Context *ctx = context();
+
+  if (isReadOnly(ctx)) {
+    return -EROFS;
+  }
+
+  int res = -EIO;
+  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
+  if (!FSRoot) {
     return res;
   }
 
-  return encfs_open(path, file);
+  try {
+    uid_t uid = 0;
+    gid_t gid = 0;
+    if (ctx->publicFilesystem) {
+      fuse_context *context = fuse_get_context();
+      uid = context->uid;
+      gid = context->gid;
+    }
+    std::shared_ptr<FileNode> fnode =
+        FSRoot->createNode(path, "create", mode, file->flags, uid, gid, &res);
+    // Is this error due to access problems?
+    if (!fnode && ctx->publicFilesystem && -res == EACCES) {
+      // try again using the parent dir's group
+      string parent = FSRoot->lookupNode(path, "create")->plaintextParent();
+      VLOG(1) << "trying public filesystem workaround for " << parent;
+      std::shared_ptr<FileNode> dnode =
+          FSRoot->lookupNode(parent.c_str(), "create");
+
+      struct stat st;
+      if (dnode->getAttr(&st) == 0) {
+        fnode = FSRoot->createNode(path, "create", mode, file->flags, uid,
+                                   st.st_gid, &res);
+      }
+    }
+
+    if (fnode) {
+      VLOG(1) << "encfs_create for " << fnode->cipherName() << ", mode "
+              << mode << ", flags " << file->flags;
+
+      res = ctx->putNode(path, fnode);
+      if (res == ESUCCESS) {
+        file->fh = fnode->fuseFh;
+      }
+    }
+  } catch (encfs::Error &err) {
+    RLOG(ERROR) << "error caught in create: " << err.what();
+  }
+
+  return res;
 }
 
 int _do_flush(FileNode *fnode) {
@@ -700,9 +824,8 @@ int encfs_flush(const char *path, struct fuse_file_info *fi) {
 }
 
 /*
-Note: This is advisory -- it might benefit us to keep file nodes around for a
-bit after they are released just in case they are reopened soon.  But that
-requires a cache layer.
+The node is kept by EncFS_Context for a while after its last release, in case
+the file is reopened soon.
  */
 int encfs_release(const char *path, struct fuse_file_info *finfo) {
   EncFS_Context *ctx = context();
@@ -792,10 +915,10 @@ int encfs_statfs(const char *path, struct statvfs *st) {
 #ifdef HAVE_XATTR
 
 #ifdef XATTR_ADD_OPT
-int _do_setxattr(EncFS_Context *, const string &cyName, const char *name,
+int _do_setxattr(EncFS_Context *, const char *cyName, const char *name,
                  const char *value, size_t size, uint32_t pos) {
   int options = XATTR_NOFOLLOW;
-  return ::setxattr(cyName.c_str(), name, value, size, pos, options);
+  return ::setxattr(cyName, name, value, size, pos, options);
 }
 int encfs_setxattr(const char *path, const char *name, const char *value,
                    size_t size, int flags, uint32_t position) {
@@ -804,13 +927,14 @@ int encfs_setxattr(const char *path, const char *name, const char *value,
     return -EROFS;
   }
   (void)flags;
-  return withCipherPath("setxattr", path, bind(_do_setxattr, _1, _2, name,
-                                               value, size, position));
+  return withChangedCipherPath("setxattr", path,
+                               bind(_do_setxattr, _1, _2, name, value, size,
+                                    position));
 }
 #else
-int _do_setxattr(EncFS_Context *, const string &cyName, const char *name,
+int _do_setxattr(EncFS_Context *, const char *cyName, const char *name,
                  const char *value, size_t size, int flags) {
-  return ::lsetxattr(cyName.c_str(), name, value, size, flags);
+  return ::lsetxattr(cyName, name, value, size, flags);
 }
 int encfs_setxattr(const char *path, const char *name, const char *value,
                    size_t size, int flags) {
@@ -818,16 +942,16 @@ int encfs_setxattr(const char *path, const char *name, const char *value,
   if (isReadOnly(ctx)) {
     return -EROFS;
   }
-  return withCipherPath("setxattr", path,
-                        bind(_do_setxattr, _1, _2, name, value, size, flags));
+  return withChangedCipherPath(
+      "setxattr", path, bind(_do_setxattr, _1, _2, name, value, size, flags));
 }
 #endif
 
 #ifdef XATTR_ADD_OPT
-int _do_getxattr(EncFS_Context *, const string &cyName, const char *name,
+int _do_getxattr(EncFS_Context *, const char *cyName, const char *name,
                  void *value, size_t size, uint32_t pos) {
   int options = XATTR_NOFOLLOW;
-  return ::getxattr(cyName.c_str(), name, value, size, pos, options);
+  return ::getxattr(cyName, name, value, size, pos, options);
 }
 int encfs_getxattr(const char *path, const char *name, char *value, size_t size,
                    uint32_t position) {
@@ -836,9 +960,9 @@ int encfs_getxattr(const char *path, const char *name, char *value, size_t size,
       bind(_do_getxattr, _1, _2, name, (void *)value, size, position), true);
 }
 #else
-int _do_getxattr(EncFS_Context *, const string &cyName, const char *name,
+int _do_getxattr(EncFS_Context *, const char *cyName, const char *name,
                  void *value, size_t size) {
-  return ::lgetxattr(cyName.c_str(), name, value, size);
+  return ::lgetxattr(cyName, name, value, size);
 }
 int encfs_getxattr(const char *path, const char *name, char *value,
                    size_t size) {
@@ -848,13 +972,13 @@ int encfs_getxattr(const char *path, const char *name, char *value,
 }
 #endif
 
-int _do_listxattr(EncFS_Context *, const string &cyName, char *list,
+int _do_listxattr(EncFS_Context *, const char *cyName, char *list,
                   size_t size) {
 #ifdef XATTR_ADD_OPT
   int options = XATTR_NOFOLLOW;
-  int res = ::listxattr(cyName.c_str(), list, size, options);
+  int res = ::listxattr(cyName, list, size, options);
 #else
-  int res = ::llistxattr(cyName.c_str(), list, size);
+  int res = ::llistxattr(cyName, list, size);
 #endif
   return (res == -1) ? -errno : res;
 }
@@ -864,12 +988,12 @@ int encfs_listxattr(const char *path, char *list, size_t size) {
                         bind(_do_listxattr, _1, _2, list, size), true);
 }
 
-int _do_removexattr(EncFS_Context *, const string &cyName, const char *name) {
+int _do_removexattr(EncFS_Context *, const char *cyName, const char *name) {
 #ifdef XATTR_ADD_OPT
   int options = XATTR_NOFOLLOW;
-  int res = ::removexattr(cyName.c_str(), name, options);
+  int res = ::removexattr(cyName, name, options);
 #else
-  int res = ::lremovexattr(cyName.c_str(), name);
+  int res = ::lremovexattr(cyName, name);
 #endif
   return (res == -1) ? -errno : res;
 }
@@ -880,8 +1004,8 @@ int encfs_removexattr(const char *path, const char *name) {
     return -EROFS;
   }
 
-  return withCipherPath("removexattr", path,
-                        bind(_do_removexattr, _1, _2, name));
+  return withChangedCipherPath("removexattr", path,
+                               bind(_do_removexattr, _1, _2, name));
 }
 
 #endif  // HAVE_XATTR
@@ -75,6 +75,8 @@ int encfs_chmod(const char *path, mode_t mode);
 int encfs_chown(const char *path, uid_t uid, gid_t gid);
 int encfs_truncate(const char *path, off_t size);
 int encfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi);
+int encfs_fallocate(const char *path, int mode, off_t offset, off_t length,
+                    struct fuse_file_info *fi);
 int encfs_utime(const char *path, struct utimbuf *buf);
 int encfs_open(const char *path, struct fuse_file_info *info);
 int encfs_create(const char *path, mode_t mode, struct fuse_file_info *info);
@@ -38,7 +38,9 @@
 #include "Context.h"
 #include "Error.h"
 #include "FileUtils.h"
+#include "IOUring.h"
 #include "MemoryPool.h"
+#include "SyncScheduler.h"
 #include "autosprintf.h"
 #include "config.h"
 #include "encfs.h"
@@ -54,6 +56,12 @@
 #define LONG_OPT_NOATTRCACHE 516
 #define LONG_OPT_REQUIRE_MAC 517
 #define LONG_OPT_INSECURE 518
+#define LONG_OPT_NOSYNCTRUNCATE 519
+#define LONG_OPT_IOURING 520
+#define LONG_OPT_ODIRECT 521
+#define LONG_OPT_MMAP 522
+#define LONG_OPT_CHECKATTR 523
+#define LONG_OPT_SYNCFS 524
 
 using namespace std;
 using namespace encfs;
@@ -262,6 +270,12 @@ static bool processArgs(int argc, char *argv[],
       {"nocache", 0, nullptr, LONG_OPT_NOCACHE},         // disable all caching
       {"nodatacache", 0, nullptr, LONG_OPT_NODATACACHE}, // disable data caching
       {"noattrcache", 0, nullptr, LONG_OPT_NOATTRCACHE}, // disable attr caching
+      {"checkattr", 0, nullptr, LONG_OPT_CHECKATTR},  // stat before cached attrs
+      {"nosynctruncate", 0, nullptr, LONG_OPT_NOSYNCTRUNCATE}, // no sync after truncate
+      {"syncfs", 1, nullptr, LONG_OPT_SYNCFS},  // batch syncs with syncfs()
+      {"io-uring", 0, nullptr, LONG_OPT_IOURING},  // backing I/O via io_uring
+      {"odirect", 0, nullptr, LONG_OPT_ODIRECT},    // backing I/O with O_DIRECT
+      {"mmap", 0, nullptr, LONG_OPT_MMAP},  // read backing files via mmap
       {"verbose", 0, nullptr, 'v'},               // verbose mode
       {"version", 0, nullptr, 'V'},               // version
       {"reverse", 0, nullptr, 'r'},               // reverse encryption
@@ -320,6 +334,24 @@ static bool processArgs(int argc, char *argv[],
       case LONG_OPT_INSECURE:
         out->opts->insecure = true;
         break;
+      case LONG_OPT_NOSYNCTRUNCATE:
+        out->opts->syncTruncate = false;
+        break;
+      case LONG_OPT_SYNCFS:
+        out->opts->syncfsThreshold = strtol(optarg, (char **)nullptr, 10);
+        if (out->opts->syncfsThreshold < 0) {
+          out->opts->syncfsThreshold = 0;
+        }
+        break;
+      case LONG_OPT_IOURING:
+        out->opts->ioUring = true;
+        break;
+      case LONG_OPT_ODIRECT:
+        out->opts->directIO = true;
+        break;
+      case LONG_OPT_MMAP:
+        out->opts->mmapRead = true;
+        break;
       case 'c':
         /* Take config file path from command 
          * line instead of ENV variable */
@@ -398,6 +430,9 @@ static bool processArgs(int argc, char *argv[],
       case LONG_OPT_NODATACACHE:
         out->opts->noCache = true;
         break;
+      case LONG_OPT_CHECKATTR:
+        out->opts->checkAttr = true;
+        break;
       case LONG_OPT_NOATTRCACHE:
         PUSHARG("-oattr_timeout=0");
         PUSHARG("-oentry_timeout=0");
@@ -559,6 +594,33 @@ static bool processArgs(int argc, char *argv[],
     }
   }
 
+  if (out->opts->mmapRead && out->opts->directIO) {
+    cerr <<
+        // xgroup(usage)
+        _("--mmap reads through the page cache, it can't be used with "
+          "--odirect")
+         << endl;
+    return false;
+  }
+
+  if (out->opts->ioUring && !IOUring::available()) {
+    cerr <<
+        // xgroup(usage)
+        _("io_uring is not available, using the usual system calls") << endl;
+    out->opts->ioUring = false;
+  }
+  SyncScheduler::setIOUring(out->opts->ioUring);
+
+#if !defined(HAVE_SYNCFS)
+  if (out->opts->syncfsThreshold > 0) {
+    cerr <<
+        // xgroup(usage)
+        _("syncfs() is not available, syncing files one by one") << endl;
+    out->opts->syncfsThreshold = 0;
+  }
+#endif
+  SyncScheduler::setSyncfsThreshold(out->opts->syncfsThreshold);
+
   if (out->opts->delayMount && !out->opts->mountOnDemand) {
     cerr <<
         // xgroup(usage)
@@ -727,6 +789,9 @@ int main(int argc, char *argv[]) {
   // encfs_oper.access = encfs_access;
   encfs_oper.create = encfs_create;
   encfs_oper.ftruncate = encfs_ftruncate;
+#if defined(__linux__) && FUSE_VERSION >= 29
+  encfs_oper.fallocate = encfs_fallocate;
+#endif
   encfs_oper.fgetattr = encfs_fgetattr;
   // encfs_oper.lock = encfs_lock;
   encfs_oper.utimens = encfs_utimens;
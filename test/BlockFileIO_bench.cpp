@@ -0,0 +1,110 @@
+#include "benchmark/benchmark.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "encfs/CipherFileIO.h"
+#include "encfs/FSConfig.h"
+#include "encfs/MACFileIO.h"
+#include "encfs/RawFileIO.h"
+#include "TestUtils.h"
+
+using namespace encfs;
+
+namespace {
+
+std::atomic<bool> countCopies(false);
+std::atomic<unsigned long long> copiedBytes(0);
+
+}  // namespace
+
+// Every memcpy() of this binary, and of the libraries it uses, goes through
+// here, so that the bytes copied per byte of file data can be reported.  It
+// is built as copybenchmarks, apart from the other benchmarks, which
+// shouldn't pay for the counting.
+extern "C" void *memcpy(void *dst, const void *src, size_t n) noexcept {
+  if (countCopies.load(std::memory_order_relaxed)) {
+    copiedBytes.fetch_add(n, std::memory_order_relaxed);
+  }
+  return memmove(dst, src, n);
+}
+
+namespace {
+
+const int BlockSize = 4096;
+const int FileBlocks = 256;
+
+// Reads or writes the blocks of a file in turn, through CipherFileIO and
+// optionally MACFileIO.  The arguments select the MAC layer and requests
+// of 100 bytes within each block instead of whole blocks.
+void blockCopies(benchmark::State &state, bool write) {
+  test::TempDir tmp("/var/tmp");
+  if (tmp.path().empty()) {
+    state.SkipWithError("mkdtemp failed");
+    return;
+  }
+  std::string fileName = tmp.file("file");
+
+  FSConfigPtr fsCfg = test::newFSConfig(BlockSize, true, 256);
+  if (state.range(0) != 0) {
+    fsCfg->config->blockMACBytes = 8;
+  }
+
+  std::shared_ptr<FileIO> raw = std::make_shared<RawFileIO>(fileName);
+  std::shared_ptr<FileIO> io = std::make_shared<CipherFileIO>(raw, fsCfg);
+  if (state.range(0) != 0) {
+    io = std::make_shared<MACFileIO>(io, fsCfg);
+  }
+  io->create(O_RDWR, 0644);
+
+  const size_t bs = io->blockSize();
+  std::vector<unsigned char> buf(bs * FileBlocks, 1);
+  IORequest req;
+  req.offset = 0;
+  req.data = buf.data();
+  req.dataLen = buf.size();
+  io->write(req);
+
+  const bool partial = state.range(1) != 0;
+  req.dataLen = partial ? 100 : bs;
+  off_t blockNum = 0;
+  copiedBytes = 0;
+  countCopies = true;
+  while (state.KeepRunning()) {
+    req.offset = blockNum * bs + (partial ? 1000 : 0);
+    if (write) {
+      io->write(req);
+    } else {
+      io->read(req);
+    }
+    blockNum = (blockNum + 1) % FileBlocks;
+  }
+  countCopies = false;
+
+  size_t bytes = state.iterations() * req.dataLen;
+  state.SetBytesProcessed(bytes);
+  state.counters["copied/byte"] = bytes == 0 ? 0 : (double)copiedBytes / bytes;
+}
+
+}  // namespace
+
+static void BM_BlockCopiesRead(benchmark::State &state) {
+  blockCopies(state, false);
+}
+BENCHMARK(BM_BlockCopiesRead)->Args({0, 0})->Args({0, 1})->Args({1, 0})->Args(
+    {1, 1});
+
+static void BM_BlockCopiesWrite(benchmark::State &state) {
+  blockCopies(state, true);
+}
+BENCHMARK(BM_BlockCopiesWrite)
+    ->Args({0, 0})
+    ->Args({0, 1})
+    ->Args({1, 0})
+    ->Args({1, 1});
@@ -0,0 +1,161 @@
+#include "benchmark/benchmark.h"
+
+#include <cstdlib>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "encfs/CipherFileIO.h"
+#include "encfs/FSConfig.h"
+#include "encfs/MACFileIO.h"
+#include "encfs/MMapFileIO.h"
+#include "encfs/RawFileIO.h"
+#include "TestUtils.h"
+
+using namespace encfs;
+
+namespace {
+
+const int BlockSize = 4096;
+const int FileBlocks = 1024;
+// not tmpfs, which has no O_DIRECT
+const char BenchDir[] = "/var/tmp";
+
+// Overwrite random 4 KiB blocks of a file, syncing after each write.  The
+// arguments select the page aligned header layout and O_DIRECT.
+void writeSync(benchmark::State &state) {
+  test::TempDir tmp(BenchDir);
+  if (tmp.path().empty()) {
+    state.SkipWithError("mkdtemp failed");
+    return;
+  }
+  std::string fileName = tmp.file("file");
+
+  FSConfigPtr fsCfg = test::newFSConfig(BlockSize, true, 256);
+  fsCfg->config->alignedHeader = state.range(0) != 0;
+
+  auto raw = std::make_shared<RawFileIO>(fileName, true, false,
+                                         state.range(1) != 0);
+  CipherFileIO io(raw, fsCfg);
+  io.create(O_RDWR, 0644);
+
+  std::vector<unsigned char> buf(BlockSize * FileBlocks, 1);
+  IORequest req;
+  req.offset = 0;
+  req.data = buf.data();
+  req.dataLen = buf.size();
+  io.write(req);
+  int fd = raw->open(O_RDWR);
+  fsync(fd);
+
+  req.dataLen = BlockSize;
+  unsigned int seed = 1;
+  while (state.KeepRunning()) {
+    req.offset = (off_t)(rand_r(&seed) % FileBlocks) * BlockSize;
+    io.write(req);
+    fdatasync(fd);
+  }
+  state.SetBytesProcessed(state.iterations() * BlockSize);
+}
+
+// Read a 16 MiB file in requests of the given size, sequentially or at
+// random offsets, through MMapFileIO instead of pread(), with 8 byte block
+// MACs, through io_uring or with O_DIRECT, as selected.
+void readFile(benchmark::State &state, size_t chunk, bool mmap, bool random,
+              bool mac, bool ioUring, bool directIO) {
+  test::TempDir tmp(BenchDir);
+  if (tmp.path().empty()) {
+    state.SkipWithError("mkdtemp failed");
+    return;
+  }
+  std::string fileName = tmp.file("file");
+
+  FSConfigPtr fsCfg = test::newFSConfig(BlockSize, true, 256);
+  fsCfg->config->alignedHeader = directIO;
+  if (mac) {
+    fsCfg->config->blockMACBytes = 8;
+  }
+
+  auto newIO = [&](std::shared_ptr<RawFileIO> raw) {
+    std::shared_ptr<FileIO> io = std::make_shared<CipherFileIO>(raw, fsCfg);
+    if (mac) {
+      io = std::make_shared<MACFileIO>(io, fsCfg);
+    }
+    return io;
+  };
+
+  const size_t FileSize = 16 * 1024 * 1024;
+  // page aligned, for O_DIRECT
+  std::vector<unsigned char> mem(FileSize + BlockSize, 1);
+  unsigned char *buf =
+      mem.data() + (BlockSize - (uintptr_t)mem.data() % BlockSize);
+  {
+    std::shared_ptr<FileIO> io = newIO(std::make_shared<RawFileIO>(fileName));
+    io->create(O_RDWR, 0644);
+    IORequest req;
+    req.data = buf;
+    req.dataLen = FileSize;
+    io->write(req);
+  }
+
+  std::shared_ptr<RawFileIO> raw;
+  if (mmap) {
+    raw = std::make_shared<MMapFileIO>(fileName);
+  } else {
+    raw = std::make_shared<RawFileIO>(fileName, true, ioUring, directIO);
+  }
+  std::shared_ptr<FileIO> io = newIO(raw);
+  io->open(O_RDONLY);
+
+  IORequest req;
+  req.offset = 0;
+  req.data = buf;
+  req.dataLen = chunk;
+  unsigned int seed = 1;
+  while (state.KeepRunning()) {
+    if (random) {
+      req.offset = (off_t)(rand_r(&seed) % (FileSize / chunk)) * chunk;
+    } else {
+      req.offset = (req.offset + chunk) % FileSize;
+    }
+    io->read(req);
+  }
+  state.SetBytesProcessed(state.iterations() * chunk);
+}
+
+}  // namespace
+
+static void BM_CipherRead(benchmark::State &state) {
+  readFile(state, 128 * 1024, state.range(0) != 0, state.range(1) != 0,
+           state.range(2) != 0, false, false);
+}
+BENCHMARK(BM_CipherRead)
+    ->Args({0, 0, 0})
+    ->Args({1, 0, 0})
+    ->Args({0, 1, 0})
+    ->Args({1, 1, 0})
+    ->Args({0, 0, 1})
+    ->Args({1, 0, 1})
+    ->UseRealTime();
+
+// 1 MiB sequential reads, through io_uring and with O_DIRECT as selected
+static void BM_CipherReadLarge(benchmark::State &state) {
+  readFile(state, 1024 * 1024, false, false, false, state.range(0) != 0,
+           state.range(1) != 0);
+}
+BENCHMARK(BM_CipherReadLarge)
+    ->Args({0, 0})
+    ->Args({1, 0})
+    ->Args({0, 1})
+    ->Args({1, 1})
+    ->UseRealTime();
+
+static void BM_CipherWriteSync(benchmark::State &state) { writeSync(state); }
+BENCHMARK(BM_CipherWriteSync)
+    ->Args({0, 0})
+    ->Args({1, 0})
+    ->Args({0, 1})
+    ->Args({1, 1})
+    ->UseRealTime();
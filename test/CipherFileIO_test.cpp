@@ -0,0 +1,622 @@
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "encfs/Cipher.h"
+#include "encfs/CipherFileIO.h"
+#include "encfs/FSConfig.h"
+#include "encfs/FileUtils.h"
+#include "encfs/IOUring.h"
+#include "encfs/RawFileIO.h"
+#include "TestUtils.h"
+
+using namespace encfs;
+using namespace testing;
+
+namespace {
+
+const int FSBlockSize = 1024;
+const int HeaderSize = 8;
+
+// RawFileIO which counts the calls reaching the backing file.
+class CountingFileIO : public RawFileIO {
+ public:
+  explicit CountingFileIO(const std::string &name, bool ioUring = false,
+                          bool directIO = false)
+      : RawFileIO(name, true, ioUring, directIO),
+        reads(0),
+        startedReads(0),
+        writes(0),
+        sizes(0),
+        bytesRead(0),
+        bytesWritten(0) {}
+
+  virtual off_t getSize() const {
+    ++sizes;
+    return RawFileIO::getSize();
+  }
+
+  virtual ssize_t read(const IORequest &req) const {
+    ++reads;
+    bytesRead += req.dataLen;
+    return RawFileIO::read(req);
+  }
+  virtual int startRead(const IORequest &req) const {
+    int res = RawFileIO::startRead(req);
+    if (res == 0) {
+      ++startedReads;
+    }
+    return res;
+  }
+  virtual ssize_t write(const IORequest &req) {
+    ++writes;
+    bytesWritten += req.dataLen;
+    return RawFileIO::write(req);
+  }
+
+  mutable int reads;
+  mutable int startedReads;
+  int writes;
+  mutable int sizes;
+  mutable size_t bytesRead;
+  size_t bytesWritten;
+};
+
+class CipherFileIOTest : public Test {
+ protected:
+  virtual void SetUp() {
+    fileName = tmp.file("file");
+    fsCfg = test::newFSConfig(FSBlockSize);
+    directIO = false;
+  }
+
+  void newIO() {
+    raw = std::make_shared<CountingFileIO>(fileName, false, directIO);
+    io.reset(new CipherFileIO(raw, fsCfg));
+  }
+
+  off_t rawSize() { return test::fileSize(fileName); }
+
+  std::vector<unsigned char> readAll(off_t size) {
+    newIO();
+    return test::readAll(*io, size);
+  }
+
+  std::vector<unsigned char> writeFile(int size) {
+    newIO();
+    EXPECT_GE(io->create(O_RDWR, 0644), 0);
+    std::vector<unsigned char> data = test::testData(size);
+    EXPECT_EQ(test::writeAt(*io, 0, data), size);
+    return data;
+  }
+
+  test::TempDir tmp;
+  std::string fileName;
+  FSConfigPtr fsCfg;
+  bool directIO;
+  std::shared_ptr<CountingFileIO> raw;
+  std::unique_ptr<FileIO> io;
+};
+
+TEST_F(CipherFileIOTest, CreateWritesHeaderWithFirstBlock) {
+  newIO();
+  ASSERT_GE(io->create(O_WRONLY, 0644), 0);
+  EXPECT_EQ(io->create(O_WRONLY, 0644), -EEXIST);
+
+  std::vector<unsigned char> data(100, 'x');
+  IORequest req;
+  req.offset = 0;
+  req.data = data.data();
+  req.dataLen = data.size();
+  ASSERT_EQ(io->write(req), (ssize_t)data.size());
+
+  // header and data in one write, and no read of the new file
+  EXPECT_EQ(raw->writes, 1);
+  EXPECT_EQ(raw->reads, 0);
+  EXPECT_EQ(rawSize(), (off_t)data.size() + HeaderSize);
+  EXPECT_EQ(readAll(data.size()), data);
+}
+
+TEST_F(CipherFileIOTest, CreateExisting) {
+  newIO();
+  ASSERT_GE(io->create(O_RDWR, 0644), 0);
+  newIO();
+  EXPECT_EQ(io->create(O_RDWR, 0644), -EEXIST);
+}
+
+TEST_F(CipherFileIOTest, CreateWithoutWrite) {
+  newIO();
+  ASSERT_GE(io->create(O_RDWR, 0644), 0);
+  EXPECT_EQ(io->getSize(), 0);
+  io.reset();
+  // no header for an empty file
+  EXPECT_EQ(rawSize(), 0);
+}
+
+TEST_F(CipherFileIOTest, WriteAfterHole) {
+  newIO();
+  ASSERT_GE(io->create(O_RDWR, 0644), 0);
+
+  std::vector<unsigned char> data(10, 'y');
+  IORequest req;
+  req.offset = 3 * FSBlockSize + 5;
+  req.data = data.data();
+  req.dataLen = data.size();
+  ASSERT_EQ(io->write(req), (ssize_t)data.size());
+  EXPECT_EQ(rawSize(), req.offset + (off_t)data.size() + HeaderSize);
+
+  std::vector<unsigned char> expected(req.offset, 0);
+  expected.insert(expected.end(), data.begin(), data.end());
+  EXPECT_EQ(readAll(expected.size()), expected);
+}
+
+TEST_F(CipherFileIOTest, TruncateNewFile) {
+  newIO();
+  ASSERT_GE(io->create(O_RDWR, 0644), 0);
+  ASSERT_EQ(io->truncate(FSBlockSize + 1), 0);
+  EXPECT_EQ(rawSize(), FSBlockSize + 1 + HeaderSize);
+  EXPECT_EQ(readAll(FSBlockSize + 1),
+            std::vector<unsigned char>(FSBlockSize + 1, 0));
+}
+
+TEST_F(CipherFileIOTest, FirstReadIncludesHeader) {
+  std::vector<unsigned char> data = writeFile(FSBlockSize / 2);
+
+  newIO();
+  ASSERT_GE(io->open(O_RDONLY), 0);
+  std::vector<unsigned char> buf(FSBlockSize);
+  IORequest req;
+  req.offset = 0;
+  req.data = buf.data();
+  req.dataLen = buf.size();
+  ASSERT_EQ(io->read(req), (ssize_t)data.size());
+  buf.resize(data.size());
+  EXPECT_EQ(buf, data);
+  EXPECT_EQ(raw->reads, 1);
+  EXPECT_EQ(raw->sizes, 0);
+}
+
+TEST_F(CipherFileIOTest, FirstReadPastFirstBlock) {
+  std::vector<unsigned char> data = writeFile(3 * FSBlockSize);
+
+  newIO();
+  ASSERT_GE(io->open(O_RDONLY), 0);
+  std::vector<unsigned char> buf(10);
+  IORequest req;
+  req.offset = 2 * FSBlockSize + 7;
+  req.data = buf.data();
+  req.dataLen = buf.size();
+  ASSERT_EQ(io->read(req), (ssize_t)buf.size());
+  EXPECT_TRUE(std::equal(buf.begin(), buf.end(), data.begin() + req.offset));
+  // block and header, but no stat of the file
+  EXPECT_EQ(raw->reads, 2);
+  EXPECT_EQ(raw->sizes, 0);
+
+  req.offset = 0;
+  ASSERT_EQ(io->read(req), (ssize_t)buf.size());
+  EXPECT_TRUE(std::equal(buf.begin(), buf.end(), data.begin()));
+}
+
+TEST_F(CipherFileIOTest, ReadEmptyFile) {
+  newIO();
+  ASSERT_GE(io->create(O_RDWR, 0644), 0);
+  io.reset();
+  EXPECT_EQ(readAll(0).size(), 0u);
+}
+
+TEST_F(CipherFileIOTest, WholeBlocksInOneWrite) {
+  newIO();
+  ASSERT_GE(io->create(O_RDWR, 0644), 0);
+
+  std::vector<unsigned char> data(3 * FSBlockSize + 17);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = i * 7;
+  }
+  std::vector<unsigned char> copy = data;
+  IORequest req;
+  req.offset = 0;
+  req.data = data.data();
+  req.dataLen = data.size();
+  ASSERT_EQ(io->write(req), (ssize_t)data.size());
+
+  // the whole blocks with the header, and the partial last block
+  EXPECT_EQ(raw->writes, 2);
+  // the caller's buffer is not encrypted in place
+  EXPECT_EQ(data, copy);
+  EXPECT_EQ(readAll(data.size()), data);
+}
+
+TEST_F(CipherFileIOTest, PadInBatches) {
+  std::vector<unsigned char> data = writeFile(10);
+  const off_t newSize = 3000 * FSBlockSize + 5;
+  int writes = raw->writes;
+  ASSERT_EQ(io->truncate(newSize), 0);
+  EXPECT_EQ(rawSize(), newSize + HeaderSize);
+
+  // first and last block, and ~3 MiB of zero blocks in 1 MiB writes
+  EXPECT_LE(raw->writes - writes, 6);
+
+  std::vector<unsigned char> expected(newSize, 0);
+  std::copy(data.begin(), data.end(), expected.begin());
+  EXPECT_EQ(readAll(newSize), expected);
+}
+
+TEST_F(CipherFileIOTest, Allocate) {
+  std::vector<unsigned char> data = writeFile(10);
+  int res = io->allocate(0, 64 * FSBlockSize);
+  if (res == -EOPNOTSUPP) {
+    return;  // not supported by the filesystem of the test directory
+  }
+  ASSERT_EQ(res, 0);
+  // the space is reserved, but the size is unchanged
+  EXPECT_EQ(rawSize(), (off_t)data.size() + HeaderSize);
+  struct stat st;
+  ASSERT_EQ(lstat(fileName.c_str(), &st), 0);
+  EXPECT_GE(st.st_blocks * 512, 64 * FSBlockSize);
+  EXPECT_EQ(readAll(data.size()), data);
+}
+
+TEST_F(CipherFileIOTest, AlignedHeader) {
+  fsCfg->config->alignedHeader = true;
+  const int DataOffset = 4096;
+  EXPECT_EQ(CipherFileIO::headerSpace(fsCfg), DataOffset);
+
+  for (int size : {1, 100, FSBlockSize, 5 * FSBlockSize + 17}) {
+    std::vector<unsigned char> data = writeFile(size);
+    // the header goes with the first write
+    EXPECT_EQ(raw->writes, size > FSBlockSize ? 2 : 1);
+    EXPECT_EQ(rawSize(), size + DataOffset);
+    EXPECT_EQ(io->getSize(), size);
+
+    struct stat st;
+    ASSERT_EQ(io->getAttr(&st), 0);
+    EXPECT_EQ(st.st_size, size);
+
+    // the padding after the IV is 0's
+    FILE *f = fopen(fileName.c_str(), "rb");
+    ASSERT_NE(f, nullptr);
+    std::vector<unsigned char> header(DataOffset);
+    ASSERT_EQ(fread(header.data(), 1, header.size(), f), header.size());
+    fclose(f);
+    EXPECT_TRUE(std::all_of(header.begin() + HeaderSize, header.end(),
+                            [](unsigned char c) { return c == 0; }));
+
+    EXPECT_EQ(readAll(size), data);
+    ASSERT_EQ(unlink(fileName.c_str()), 0);
+  }
+}
+
+TEST_F(CipherFileIOTest, AlignedHeaderTruncate) {
+  fsCfg->config->alignedHeader = true;
+  const int DataOffset = 4096;
+  newIO();
+  ASSERT_GE(io->create(O_RDWR, 0644), 0);
+  ASSERT_EQ(io->truncate(0), 0);
+  EXPECT_EQ(rawSize(), DataOffset);
+  EXPECT_EQ(io->getSize(), 0);
+
+  const off_t size = 10 * FSBlockSize + 3;
+  ASSERT_EQ(io->truncate(size), 0);
+  EXPECT_EQ(rawSize(), size + DataOffset);
+  EXPECT_EQ(readAll(size), std::vector<unsigned char>(size, 0));
+}
+
+TEST_F(CipherFileIOTest, AlignedHeaderLargeBlocks) {
+  fsCfg->config->alignedHeader = true;
+  fsCfg->config->blockSize = 3 * 4096 - 1024;
+  EXPECT_EQ(CipherFileIO::headerSpace(fsCfg), 3 * 4096);
+  fsCfg->config->uniqueIV = false;
+  EXPECT_EQ(CipherFileIO::headerSpace(fsCfg), 0);
+}
+
+TEST_F(CipherFileIOTest, HolesAreNotRead) {
+  fsCfg->config->allowHoles = true;
+  std::vector<unsigned char> data = writeFile(10);
+  const off_t newSize = 256 * FSBlockSize + 5;
+  ASSERT_EQ(io->truncate(newSize), 0);
+
+  std::vector<unsigned char> expected(newSize, 0);
+  std::copy(data.begin(), data.end(), expected.begin());
+  EXPECT_EQ(readAll(newSize), expected);
+  // the blocks sharing a page with the first and last block
+  EXPECT_LE(raw->reads, 16);
+}
+
+TEST_F(CipherFileIOTest, ZeroBlocksWrittenAsHoles) {
+  fsCfg->config->allowHoles = true;
+  const int Blocks = 256;
+  std::vector<unsigned char> data = writeFile(Blocks * FSBlockSize + 5);
+  struct stat st;
+  ASSERT_EQ(lstat(fileName.c_str(), &st), 0);
+  const blkcnt_t written = st.st_blocks;
+
+  // overwrite everything except the first and last block with 0's
+  std::fill(data.begin() + FSBlockSize, data.end() - FSBlockSize - 5, 0);
+  int writes = raw->writes;
+  IORequest req;
+  req.offset = FSBlockSize;
+  req.data = data.data() + FSBlockSize;
+  req.dataLen = (Blocks - 2) * FSBlockSize;
+  ASSERT_EQ(io->write(req), (ssize_t)req.dataLen);
+  EXPECT_EQ(raw->writes, writes);
+
+  ASSERT_EQ(lstat(fileName.c_str(), &st), 0);
+  EXPECT_LT(st.st_blocks, written / 4);
+  EXPECT_EQ(rawSize(), (off_t)data.size() + HeaderSize);
+  EXPECT_EQ(readAll(data.size()), data);
+}
+
+TEST_F(CipherFileIOTest, ZeroBlocksExtendSparse) {
+  fsCfg->config->allowHoles = true;
+  newIO();
+  ASSERT_GE(io->create(O_RDWR, 0644), 0);
+
+  std::vector<unsigned char> data(300 * FSBlockSize, 0);
+  data[0] = 1;
+  data[data.size() - 1] = 2;
+  IORequest req;
+  req.offset = 0;
+  req.data = data.data();
+  req.dataLen = data.size();
+  ASSERT_EQ(io->write(req), (ssize_t)data.size());
+
+  struct stat st;
+  ASSERT_EQ(lstat(fileName.c_str(), &st), 0);
+  EXPECT_LT(st.st_blocks * 512, 100 * FSBlockSize);
+  EXPECT_EQ(readAll(data.size()), data);
+}
+
+TEST_F(CipherFileIOTest, LargeBlockParts) {
+  const int BlockSize = 64 * 1024;
+  fsCfg->config->blockSize = BlockSize;
+  std::vector<unsigned char> data = writeFile(4 * BlockSize);
+
+  // only the cipher blocks around the request are read
+  newIO();
+  ASSERT_GE(io->open(O_RDWR), 0);
+  std::vector<unsigned char> buf(100);
+  IORequest req;
+  req.offset = BlockSize + 1000;
+  req.data = buf.data();
+  req.dataLen = buf.size();
+  ASSERT_EQ(io->read(req), (ssize_t)buf.size());
+  EXPECT_TRUE(std::equal(buf.begin(), buf.end(), data.begin() + req.offset));
+  EXPECT_LT(raw->bytesRead, 200u);
+
+  // and a change near the end of a block only rewrites the end
+  std::fill(buf.begin(), buf.end(), 'x');
+  req.offset = 3 * BlockSize - 1000;
+  ASSERT_EQ(io->write(req), (ssize_t)buf.size());
+  std::copy(buf.begin(), buf.end(), data.begin() + req.offset);
+  EXPECT_LT(raw->bytesWritten, 1100u);
+  EXPECT_LT(raw->bytesRead, 1400u);
+
+  EXPECT_EQ(rawSize(), (off_t)data.size() + HeaderSize);
+  EXPECT_EQ(readAll(data.size()), data);
+}
+
+TEST_F(CipherFileIOTest, LargeBlockRandomIO) {
+  const int BlockSize = 32 * 1024;
+  fsCfg->config->blockSize = BlockSize;
+  fsCfg->config->allowHoles = true;
+  std::vector<unsigned char> data = writeFile(3 * BlockSize + 100);
+  // a hole in the middle of the file
+  std::fill(data.begin() + BlockSize, data.begin() + 2 * BlockSize, 0);
+  IORequest req;
+  req.offset = BlockSize;
+  req.data = data.data() + BlockSize;
+  req.dataLen = BlockSize;
+  ASSERT_EQ(io->write(req), BlockSize);
+
+  srand(1234);
+  for (int i = 0; i < 500; ++i) {
+    if (i % 50 == 0) {
+      newIO();
+      ASSERT_GE(io->open(O_RDWR), 0);
+    }
+    off_t offset = rand() % (data.size() + 100);
+    size_t len = rand() % 3000 + 1;
+    std::vector<unsigned char> buf(len);
+    req.offset = offset;
+    req.data = buf.data();
+    req.dataLen = len;
+
+    if ((i & 1) != 0) {
+      for (size_t j = 0; j < len; ++j) {
+        buf[j] = rand();
+      }
+      ASSERT_EQ(io->write(req), (ssize_t)len);
+      if (offset + len > data.size()) {
+        data.resize(offset + len, 0);
+      }
+      std::copy(buf.begin(), buf.end(), data.begin() + offset);
+    } else {
+      ssize_t expected =
+          std::max((ssize_t)0, std::min((ssize_t)len,
+                                        (ssize_t)data.size() - (ssize_t)offset));
+      ASSERT_EQ(io->read(req), expected) << "offset " << offset;
+      ASSERT_TRUE(std::equal(buf.begin(), buf.begin() + expected,
+                             data.begin() + offset))
+          << "offset " << offset << ", length " << len;
+    }
+  }
+
+  EXPECT_EQ(readAll(data.size()), data);
+}
+
+TEST_F(CipherFileIOTest, IOUringBatches) {
+  if (!IOUring::available()) {
+    return;
+  }
+  raw = std::make_shared<CountingFileIO>(fileName, true);
+  io.reset(new CipherFileIO(raw, fsCfg));
+  ASSERT_GE(io->create(O_RDWR, 0644), 0);
+
+  // several batches, each encrypted while the one before is written
+  std::vector<unsigned char> data(5 * 1024 * 1024 + 3 * FSBlockSize + 10);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = i * 13;
+  }
+  IORequest req;
+  req.offset = 0;
+  req.data = data.data();
+  req.dataLen = data.size();
+  ASSERT_EQ(io->write(req), (ssize_t)data.size());
+  EXPECT_EQ(rawSize(), (off_t)data.size() + HeaderSize);
+  EXPECT_EQ(readAll(data.size()), data);
+}
+
+TEST_F(CipherFileIOTest, DirectIO) {
+  directIO = true;
+  fsCfg->config->blockSize = 4096;
+
+  // with the 8 byte header, all block I/O is unaligned, with the aligned
+  // header only the end of the file is
+  for (bool aligned : {false, true}) {
+    fsCfg->config->alignedHeader = aligned;
+    std::vector<unsigned char> data = writeFile(20 * 4096 + 123);
+
+    srand(42);
+    for (int i = 0; i < 50; ++i) {
+      std::vector<unsigned char> buf(rand() % 10000 + 1);
+      for (size_t j = 0; j < buf.size(); ++j) {
+        buf[j] = rand();
+      }
+      IORequest req;
+      req.offset = rand() % (data.size() + 5000);
+      req.data = buf.data();
+      req.dataLen = buf.size();
+      ASSERT_EQ(io->write(req), (ssize_t)buf.size());
+      if (req.offset + buf.size() > data.size()) {
+        data.resize(req.offset + buf.size(), 0);
+      }
+      std::copy(buf.begin(), buf.end(), data.begin() + req.offset);
+    }
+
+    off_t header = aligned ? 4096 : HeaderSize;
+    EXPECT_EQ(rawSize(), (off_t)data.size() + header);
+    EXPECT_EQ(readAll(data.size()), data);
+    ASSERT_EQ(unlink(fileName.c_str()), 0);
+  }
+}
+
+TEST_F(CipherFileIOTest, ReadInBatches) {
+  fsCfg->config->allowHoles = true;
+  std::vector<unsigned char> data = writeFile(40 * FSBlockSize + 100);
+  // 0 blocks in the middle of a run are passed through
+  std::fill(data.begin() + 10 * FSBlockSize, data.begin() + 12 * FSBlockSize,
+            0);
+  IORequest req;
+  req.offset = 10 * FSBlockSize;
+  req.data = data.data() + req.offset;
+  req.dataLen = 2 * FSBlockSize;
+  ASSERT_EQ(io->write(req), 2 * FSBlockSize);
+
+  // the header is read along with the first run, and the rest of the file
+  // with a second one
+  EXPECT_EQ(readAll(data.size()), data);
+  EXPECT_EQ(raw->reads, 2);
+
+  // a run from the middle of the file, which ends with the last block
+  std::vector<unsigned char> buf(5 * FSBlockSize);
+  req.offset = 37 * FSBlockSize;
+  req.data = buf.data();
+  req.dataLen = buf.size();
+  raw->reads = 0;
+  ASSERT_EQ(io->read(req), 3 * FSBlockSize + 100);
+  EXPECT_EQ(raw->reads, 1);
+  EXPECT_TRUE(std::equal(data.begin() + req.offset, data.end(), buf.begin()));
+}
+
+TEST_F(CipherFileIOTest, ReadInChunks) {
+  std::vector<unsigned char> data = writeFile(700 * FSBlockSize + 100);
+
+  for (bool ioUring : {false, true}) {
+    raw = std::make_shared<CountingFileIO>(fileName, ioUring);
+    io.reset(new CipherFileIO(raw, fsCfg));
+    ASSERT_GE(io->open(O_RDONLY), 0);
+
+    // the header comes with the first block
+    std::vector<unsigned char> buf(1024 * 1024);
+    IORequest req;
+    req.offset = 0;
+    req.data = buf.data();
+    req.dataLen = FSBlockSize;
+    ASSERT_EQ(io->read(req), FSBlockSize);
+
+    // the rest of the file in 128 KiB chunks through io_uring, the last
+    // one short, otherwise with one read
+    req.offset = FSBlockSize;
+    req.dataLen = buf.size();
+    raw->reads = 0;
+    ASSERT_EQ(io->read(req), (ssize_t)data.size() - FSBlockSize);
+    if (ioUring && IOUring::available()) {
+      EXPECT_EQ(raw->startedReads, 6);
+      EXPECT_EQ(raw->reads, 0);
+    } else {
+      EXPECT_EQ(raw->reads, 1);
+    }
+    EXPECT_TRUE(
+        std::equal(data.begin() + FSBlockSize, data.end(), buf.begin()));
+  }
+}
+
+TEST_F(CipherFileIOTest, WriteLeavesBufferUntouched) {
+  // whole blocks, several whole blocks, and a partial block merged with the
+  // cached one
+  for (int size : {FSBlockSize, 5 * FSBlockSize, 3 * FSBlockSize + 17}) {
+    std::vector<unsigned char> data = writeFile(size);
+    for (int i = 0; i < size; ++i) {
+      ASSERT_EQ(data[i], (unsigned char)(i * 13));
+    }
+
+    std::vector<unsigned char> buf(100, 7);
+    IORequest req;
+    req.offset = 10;
+    req.data = buf.data();
+    req.dataLen = buf.size();
+    ASSERT_EQ(io->write(req), 100);
+    EXPECT_EQ(buf, std::vector<unsigned char>(100, 7));
+    std::fill(data.begin() + 10, data.begin() + 110, 7);
+    EXPECT_EQ(readAll(size), data);
+    ASSERT_EQ(unlink(fileName.c_str()), 0);
+  }
+}
+
+TEST_F(CipherFileIOTest, HeaderInHeadroom) {
+  // the header of a new file is written in front of the block, and read
+  // back from there
+  std::vector<unsigned char> buf(HeaderSize + FSBlockSize);
+  for (int i = 0; i < FSBlockSize; ++i) {
+    buf[HeaderSize + i] = i * 7;
+  }
+  std::vector<unsigned char> data(buf.begin() + HeaderSize, buf.end());
+
+  newIO();
+  ASSERT_GE(io->create(O_RDWR, 0644), 0);
+  IORequest req;
+  req.offset = 0;
+  req.data = buf.data() + HeaderSize;
+  req.dataLen = FSBlockSize;
+  req.headroom = HeaderSize;
+  ASSERT_EQ(io->write(req), FSBlockSize);
+  EXPECT_EQ(raw->writes, 1);
+  EXPECT_TRUE(std::equal(data.begin(), data.end(), req.data));
+
+  newIO();
+  ASSERT_GE(io->open(O_RDONLY), 0);
+  std::fill(buf.begin(), buf.end(), 0);
+  ASSERT_EQ(io->read(req), FSBlockSize);
+  EXPECT_EQ(raw->reads, 1);
+  EXPECT_TRUE(std::equal(data.begin(), data.end(), req.data));
+}
+
+}  // namespace
@@ -1,9 +1,15 @@
 #include "gtest/gtest.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
 #include "encfs/BlockNameIO.h"
 #include "encfs/Cipher.h"
 #include "encfs/CipherKey.h"
 #include "encfs/DirNode.h"
+#include "encfs/Error.h"
 #include "encfs/FSConfig.h"
 #include "encfs/FileUtils.h"
 #include "encfs/StreamNameIO.h"
@@ -38,6 +44,43 @@ static void testNameCoding(DirNode &dirNode) {
   }
 }
 
+static void testForeignNames(const NameIO &naming) {
+  // names which are too short to have been produced by any encoding.
+  const char *name[] = {"a", "ab", "abc", "abc/def", NULL};
+
+  for (const char **foreign = name; *foreign; ++foreign) {
+    uint64_t iv = 0;
+    string plainName;
+    EXPECT_LT(naming.tryDecodePath(*foreign, &iv, &plainName), 0);
+    EXPECT_LT(naming.tryDecodeName(*foreign, strlen(*foreign), &plainName), 0);
+    EXPECT_THROW(naming.decodePath(*foreign), encfs::Error);
+  }
+
+  uint64_t iv = 0;
+  string encName = naming.encodePath("test/name", &iv);
+  string plainName;
+  iv = 0;
+  EXPECT_EQ(naming.tryDecodePath(encName.c_str(), &iv, &plainName), 0);
+  EXPECT_EQ(plainName, "test/name");
+}
+
+// Longer names which block coding can reject without decrypting: none of them
+// decode to a whole number of cipher blocks.
+static void testLongForeignNames(const NameIO &naming) {
+  const char *name[] = {"report-final-version.tmp~~",
+                        ".sync-conflict-00000001.partial",
+                        "Screenshot from 2024-01-00000001.png", NULL};
+
+  for (const char **foreign = name; *foreign; ++foreign) {
+    uint64_t iv = 0;
+    string plainName;
+    EXPECT_EQ(naming.tryDecodePath(*foreign, &iv, &plainName), -EINVAL);
+    EXPECT_EQ(naming.tryDecodeName(*foreign, strlen(*foreign), &plainName),
+              -EINVAL);
+    EXPECT_THROW(naming.decodePath(*foreign), encfs::Error);
+  }
+}
+
 class CipherTest : public TestWithParam<Cipher::CipherAlgorithm> {
  protected:
   virtual void SetUp() {
@@ -80,11 +123,13 @@ TEST_P(CipherTest, NameStreamEncoding) {
     fsCfg->nameCoding->setChainedNameIV(true);
     DirNode dirNode(NULL, TEST_ROOTDIR, fsCfg);
     testNameCoding(dirNode);
+    testForeignNames(*fsCfg->nameCoding);
   }
   {
     fsCfg->nameCoding->setChainedNameIV(false);
     DirNode dirNode(NULL, TEST_ROOTDIR, fsCfg);
     testNameCoding(dirNode);
+    testForeignNames(*fsCfg->nameCoding);
   }
 }
 
@@ -106,11 +151,15 @@ TEST_P(CipherTest, NameBlockEncoding) {
     fsCfg->nameCoding->setChainedNameIV(true);
     DirNode dirNode(NULL, TEST_ROOTDIR, fsCfg);
     testNameCoding(dirNode);
+    testForeignNames(*fsCfg->nameCoding);
+    testLongForeignNames(*fsCfg->nameCoding);
   }
   {
     fsCfg->nameCoding->setChainedNameIV(false);
     DirNode dirNode(NULL, TEST_ROOTDIR, fsCfg);
     testNameCoding(dirNode);
+    testForeignNames(*fsCfg->nameCoding);
+    testLongForeignNames(*fsCfg->nameCoding);
   }
 }
 
@@ -133,12 +182,16 @@ TEST_P(CipherTest, NameBlockBase32Encoding) {
     fsCfg->nameCoding->setChainedNameIV(true);
     DirNode dirNode(NULL, TEST_ROOTDIR, fsCfg);
     testNameCoding(dirNode);
+    testForeignNames(*fsCfg->nameCoding);
+    testLongForeignNames(*fsCfg->nameCoding);
   }
 
   {
     fsCfg->nameCoding->setChainedNameIV(false);
     DirNode dirNode(NULL, TEST_ROOTDIR, fsCfg);
     testNameCoding(dirNode);
+    testForeignNames(*fsCfg->nameCoding);
+    testLongForeignNames(*fsCfg->nameCoding);
   }
 }
 
@@ -191,5 +244,110 @@ TEST_P(CipherTest, ConfigLoadStore) {
   EXPECT_TRUE(cipher->compareKey(key, key2));
 }
 
+TEST_P(CipherTest, BlockParts) {
+  if (!cipher->hasBlockParts()) {
+    return;
+  }
+  auto key = cipher->newRandomKey();
+  const int cbs = cipher->cipherBlockSize();
+  const uint64_t iv = 1234;
+
+  std::vector<unsigned char> data(FSBlockSize);
+  for (int i = 0; i < FSBlockSize; ++i) {
+    data[i] = i * 7;
+  }
+  std::vector<unsigned char> encoded = data;
+  ASSERT_TRUE(cipher->blockEncode(encoded.data(), FSBlockSize, iv, key));
+
+  // parts coded on their own match the same range of the whole block
+  for (int start = 0; start < FSBlockSize; start += 3 * cbs) {
+    int size = std::min(5 * cbs, FSBlockSize - start);
+    const unsigned char *chain =
+        start > 0 ? encoded.data() + start - cbs : nullptr;
+
+    std::vector<unsigned char> part(encoded.begin() + start,
+                                    encoded.begin() + start + size);
+    ASSERT_TRUE(cipher->blockDecodePart(part.data(), size, chain, iv, key));
+    ASSERT_TRUE(std::equal(part.begin(), part.end(), data.begin() + start));
+
+    ASSERT_TRUE(cipher->blockEncodePart(part.data(), size, chain, iv, key));
+    ASSERT_TRUE(std::equal(part.begin(), part.end(), encoded.begin() + start));
+  }
+}
+
+TEST_P(CipherTest, BlockDecodeTo) {
+  auto key = cipher->newRandomKey();
+  const uint64_t iv = 4321;
+
+  std::vector<unsigned char> data(FSBlockSize);
+  for (int i = 0; i < FSBlockSize; ++i) {
+    data[i] = i * 3;
+  }
+  std::vector<unsigned char> encoded = data;
+  ASSERT_TRUE(cipher->blockEncode(encoded.data(), FSBlockSize, iv, key));
+
+  // the source is left as it is
+  const std::vector<unsigned char> source = encoded;
+  std::vector<unsigned char> decoded(FSBlockSize);
+  ASSERT_TRUE(cipher->blockDecodeTo(encoded.data(), decoded.data(),
+                                    FSBlockSize, iv, key));
+  EXPECT_EQ(decoded, data);
+  EXPECT_EQ(encoded, source);
+}
+
+TEST_P(CipherTest, BlockEncodeTo) {
+  auto key = cipher->newRandomKey();
+  const uint64_t iv = 4321;
+
+  std::vector<unsigned char> data(FSBlockSize);
+  for (int i = 0; i < FSBlockSize; ++i) {
+    data[i] = i * 3;
+  }
+  std::vector<unsigned char> expected = data;
+  ASSERT_TRUE(cipher->blockEncode(expected.data(), FSBlockSize, iv, key));
+
+  // the source is left as it is
+  const std::vector<unsigned char> source = data;
+  std::vector<unsigned char> encoded(FSBlockSize);
+  ASSERT_TRUE(cipher->blockEncodeTo(data.data(), encoded.data(), FSBlockSize,
+                                    iv, key));
+  EXPECT_EQ(encoded, expected);
+  EXPECT_EQ(data, source);
+}
+
+TEST_P(CipherTest, BlockRuns) {
+  auto key = cipher->newRandomKey();
+  const uint64_t iv = 4321;
+  const int count = 5;
+  const uint64_t blockNum = 7;
+
+  std::vector<unsigned char> data(count * FSBlockSize);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = i * 3;
+  }
+  std::vector<unsigned char> expected = data;
+  for (int i = 0; i < count; ++i) {
+    ASSERT_TRUE(cipher->blockEncode(expected.data() + i * FSBlockSize,
+                                    FSBlockSize, (blockNum + i) ^ iv, key));
+  }
+
+  // from one buffer into another, and in place
+  std::vector<unsigned char> encoded(data.size());
+  ASSERT_TRUE(cipher->blockEncodeRun(data.data(), encoded.data(), FSBlockSize,
+                                     count, blockNum, iv, key));
+  EXPECT_EQ(encoded, expected);
+  std::vector<unsigned char> decoded(data.size());
+  ASSERT_TRUE(cipher->blockDecodeRun(encoded.data(), decoded.data(),
+                                     FSBlockSize, count, blockNum, iv, key));
+  EXPECT_EQ(decoded, data);
+
+  ASSERT_TRUE(cipher->blockDecodeRun(encoded.data(), encoded.data(),
+                                     FSBlockSize, count, blockNum, iv, key));
+  EXPECT_EQ(encoded, data);
+  ASSERT_TRUE(cipher->blockEncodeRun(encoded.data(), encoded.data(),
+                                     FSBlockSize, count, blockNum, iv, key));
+  EXPECT_EQ(encoded, expected);
+}
+
 INSTANTIATE_TEST_SUITE_P(CipherKey, CipherTest,
                         ValuesIn(Cipher::GetAlgorithmList()));
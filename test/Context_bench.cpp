@@ -0,0 +1,104 @@
+#include "benchmark/benchmark.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "encfs/BlockNameIO.h"
+#include "encfs/Context.h"
+#include "encfs/DirNode.h"
+#include "encfs/FSConfig.h"
+#include "encfs/FileNode.h"
+#include "TestUtils.h"
+
+using namespace encfs;
+
+namespace {
+
+EncFS_Context *sharedContext() {
+  static EncFS_Context *ctx = nullptr;
+  if (ctx == nullptr) {
+    FSConfigPtr fsCfg = test::newFSConfig(1024, false);
+    fsCfg->opts->idleTracking = false;
+    fsCfg->nameCoding.reset(new BlockNameIO(
+        BlockNameIO::CurrentInterface(), fsCfg->cipher, fsCfg->key,
+        fsCfg->cipher->cipherBlockSize()));
+    ctx = new EncFS_Context;
+    ctx->opts = fsCfg->opts;
+    ctx->setRoot(std::make_shared<DirNode>(ctx, "/foo/", fsCfg));
+  }
+  return ctx;
+}
+
+const int OpenFiles = 4096;
+
+std::string fileName(int i) { return "/dir/file" + std::to_string(i); }
+
+// Handles of OpenFiles files which stay open for all benchmarks.
+const std::vector<uint64_t> &openHandles() {
+  static std::vector<uint64_t> handles;
+  if (handles.empty()) {
+    EncFS_Context *ctx = sharedContext();
+    int res = 0;
+    std::shared_ptr<DirNode> root = ctx->getRoot(&res);
+    for (int i = 0; i < OpenFiles; ++i) {
+      std::string name = fileName(i);
+      auto node = root->lookupNode(name.c_str(), "bench");
+      ctx->putNode(name.c_str(), node);
+      handles.push_back(node->fuseFh);
+    }
+  }
+  return handles;
+}
+
+}  // namespace
+
+// Every FUSE operation starts with getRoot(), so this is what a parallel stat
+// storm looks like to the context.
+static void BM_GetRoot(benchmark::State &state) {
+  EncFS_Context *ctx = sharedContext();
+  while (state.KeepRunning()) {
+    int res = 0;
+    std::shared_ptr<DirNode> root = ctx->getRoot(&res);
+    benchmark::DoNotOptimize(root);
+  }
+}
+BENCHMARK(BM_GetRoot)->ThreadRange(1, 8)->UseRealTime();
+
+// Done for every read and write.
+static void BM_LookupFuseFh(benchmark::State &state) {
+  EncFS_Context *ctx = sharedContext();
+  const std::vector<uint64_t> &handles = openHandles();
+  unsigned int i = state.thread_index * 997;
+  while (state.KeepRunning()) {
+    auto node = ctx->lookupFuseFh(handles[i++ % OpenFiles]);
+    benchmark::DoNotOptimize(node);
+  }
+}
+BENCHMARK(BM_LookupFuseFh)->ThreadRange(1, 8)->UseRealTime();
+
+// Open and release of files while thousands of others are open.  Each thread
+// works on its own files.
+static void BM_OpenRelease(benchmark::State &state) {
+  EncFS_Context *ctx = sharedContext();
+  openHandles();
+  int res = 0;
+  std::shared_ptr<DirNode> root = ctx->getRoot(&res);
+
+  std::vector<std::string> names;
+  std::vector<std::shared_ptr<FileNode>> nodes;
+  for (int i = 0; i < 64; ++i) {
+    names.push_back(fileName(OpenFiles + state.thread_index * 64 + i));
+    nodes.push_back(root->lookupNode(names.back().c_str(), "bench"));
+  }
+
+  unsigned int i = 0;
+  while (state.KeepRunning()) {
+    unsigned int n = i++ % names.size();
+    ctx->putNode(names[n].c_str(), nodes[n]);
+    auto node = ctx->lookupNode(names[n].c_str());
+    benchmark::DoNotOptimize(node);
+    ctx->eraseNode(names[n].c_str(), nodes[n]);
+  }
+}
+BENCHMARK(BM_OpenRelease)->ThreadRange(1, 8)->UseRealTime();
@@ -0,0 +1,484 @@
+#include "gtest/gtest.h"
+
+#include <atomic>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+#include "encfs/BlockNameIO.h"
+#include "encfs/Cipher.h"
+#include "encfs/Context.h"
+#include "encfs/DirNode.h"
+#include "encfs/FSConfig.h"
+#include "encfs/FileNode.h"
+#include "encfs/FileUtils.h"
+#include "TestUtils.h"
+
+using namespace encfs;
+using namespace testing;
+
+namespace {
+
+class ContextTest : public Test {
+ protected:
+  virtual void SetUp() {
+    fsCfg = test::newFSConfig(1024, false);
+    fsCfg->opts->idleTracking = false;
+    fsCfg->opts->mountOnDemand = true;
+    fsCfg->nameCoding.reset(new BlockNameIO(
+        BlockNameIO::CurrentInterface(), fsCfg->cipher, fsCfg->key,
+        fsCfg->cipher->cipherBlockSize()));
+    ctx.opts = fsCfg->opts;
+  }
+
+  std::shared_ptr<DirNode> newRoot(const char *dir) {
+    return std::make_shared<DirNode>(&ctx, dir, fsCfg);
+  }
+
+  EncFS_Context ctx;
+  FSConfigPtr fsCfg;
+};
+
+int countOpenFds() {
+  int count = 0;
+  DIR *dir = opendir("/proc/self/fd");
+  if (dir == nullptr) {
+    return -1;
+  }
+  while (readdir(dir) != nullptr) {
+    ++count;
+  }
+  closedir(dir);
+  return count;
+}
+
+// Released nodes are only kept for files which really exist, so these tests
+// use a scratch directory.
+class ReleasedNodeTest : public ContextTest {
+ protected:
+  virtual void SetUp() {
+    ContextTest::SetUp();
+    fsCfg->config->uniqueIV = true;
+    root = newRoot((tmp.path() + "/").c_str());
+    ctx.setRoot(root);
+  }
+
+  virtual void TearDown() {
+    ctx.setRoot(nullptr);
+    root.reset();
+  }
+
+  // open, write and release a file, as a FUSE create/write/release does
+  std::shared_ptr<FileNode> makeFile(const char *name) {
+    int res = -1;
+    std::shared_ptr<FileNode> node =
+        root->createNode(name, "test", S_IFREG | 0644, O_RDWR, 0, 0, &res);
+    if (!node || ctx.putNode(name, node) != 0) {
+      return nullptr;
+    }
+    unsigned char data[100];
+    memset(data, name[1], sizeof(data));
+    node->write(0, data, sizeof(data));
+    ctx.eraseNode(name, node);
+    return node;
+  }
+
+  std::shared_ptr<FileNode> openFile(const char *name) {
+    int res = -1;
+    std::shared_ptr<FileNode> node = root->openNode(name, "test", O_RDONLY, &res);
+    if (!node || res < 0) {
+      return nullptr;
+    }
+    return node;
+  }
+
+  test::TempDir tmp;
+  std::shared_ptr<DirNode> root;
+};
+
+TEST_F(ContextTest, IdleDetach) {
+  std::weak_ptr<DirNode> weakRoot;
+  {
+    std::shared_ptr<DirNode> root = newRoot("/foo/");
+    weakRoot = root;
+    ctx.setRoot(root);
+  }
+  EXPECT_EQ(ctx.rootCipherDir, "/foo");
+
+  int res = 0;
+  EXPECT_NE(ctx.getRoot(&res), nullptr);
+  EXPECT_FALSE(ctx.usageAndUnmount(2));
+  EXPECT_FALSE(weakRoot.expired());
+
+  // calls which skip usage counting don't keep the filesystem alive
+  EXPECT_NE(ctx.getRoot(&res, true), nullptr);
+  EXPECT_FALSE(ctx.usageAndUnmount(2));
+  EXPECT_FALSE(weakRoot.expired());
+
+  // second idle cycle detaches the root, as done by --ondemand
+  EXPECT_FALSE(ctx.usageAndUnmount(2));
+  EXPECT_TRUE(weakRoot.expired());
+  EXPECT_EQ(res, 0);
+}
+
+TEST_F(ContextTest, ConcurrentGetRoot) {
+  std::shared_ptr<DirNode> roots[] = {newRoot("/foo/"), newRoot("/bar/")};
+  ctx.setRoot(roots[0]);
+
+  std::atomic<bool> done(false);
+  std::atomic<int> failures(0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([&]() {
+      while (!done) {
+        int res = 0;
+        std::shared_ptr<DirNode> root = ctx.getRoot(&res);
+        if (!root || res != 0 ||
+            (root != roots[0] && root != roots[1])) {
+          ++failures;
+        }
+      }
+    });
+  }
+
+  for (int i = 0; i < 10000; ++i) {
+    ctx.setRoot(roots[i % 2]);
+  }
+  done = true;
+  for (auto &t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(failures, 0);
+
+  // any activity is recorded for the idle monitor
+  EXPECT_FALSE(ctx.usageAndUnmount(1));
+  EXPECT_FALSE(ctx.usageAndUnmount(2));
+  EXPECT_EQ(roots[0].use_count() + roots[1].use_count(), 3);
+}
+
+TEST_F(ContextTest, FuseFhLookup) {
+  std::shared_ptr<DirNode> root = newRoot("/foo/");
+  ctx.setRoot(root);
+
+  std::shared_ptr<FileNode> node = root->lookupNode("/a", "test");
+  ASSERT_EQ(ctx.putNode("/a", node), 0);
+  uint64_t fh = node->fuseFh;
+  EXPECT_NE(fh, 0u);
+  EXPECT_EQ(ctx.lookupFuseFh(fh), node);
+  EXPECT_EQ(ctx.lookupNode("/a"), node);
+  EXPECT_EQ(ctx.openFileCount(), 1);
+
+  // a second open of the same file shares the handle
+  ASSERT_EQ(ctx.putNode("/a", root->lookupNode("/a", "test")), 0);
+  EXPECT_EQ(node->fuseFh, fh);
+  ctx.eraseNode("/a", node);
+  EXPECT_EQ(ctx.lookupFuseFh(fh), node);
+  EXPECT_EQ(node->canary, CANARY_OK);
+
+  ctx.eraseNode("/a", node);
+  EXPECT_EQ(ctx.lookupFuseFh(fh), nullptr);
+  EXPECT_EQ(ctx.lookupNode("/a"), nullptr);
+  EXPECT_EQ(node->canary, CANARY_RELEASED);
+  EXPECT_EQ(ctx.openFileCount(), 0);
+
+  // the slot is reused, but the old handle stays invalid
+  std::shared_ptr<FileNode> other = root->lookupNode("/b", "test");
+  ASSERT_EQ(ctx.putNode("/b", other), 0);
+  EXPECT_NE(other->fuseFh, fh);
+  EXPECT_EQ((uint32_t)other->fuseFh, (uint32_t)fh);
+  EXPECT_EQ(ctx.lookupFuseFh(fh), nullptr);
+  EXPECT_EQ(ctx.lookupFuseFh(other->fuseFh), other);
+
+  EXPECT_EQ(ctx.lookupFuseFh(0), nullptr);
+  EXPECT_EQ(ctx.lookupFuseFh(other->fuseFh + 1), nullptr);
+  EXPECT_EQ(ctx.lookupFuseFh(~0ULL), nullptr);
+  ctx.eraseNode("/b", other);
+}
+
+TEST_F(ContextTest, RenameKeepsHandle) {
+  std::shared_ptr<DirNode> root = newRoot("/foo/");
+  ctx.setRoot(root);
+
+  std::shared_ptr<FileNode> node = root->lookupNode("/a", "test");
+  ASSERT_EQ(ctx.putNode("/a", node), 0);
+  uint64_t fh = node->fuseFh;
+
+  // check a few names, so both the same and different shards are used
+  const char *names[] = {"/b", "/c", "/d", "/e", "/f", "/a"};
+  const char *from = "/a";
+  for (const char *to : names) {
+    ctx.renameNode(from, to);
+    EXPECT_EQ(ctx.lookupNode(to), node);
+    if (strcmp(from, to) != 0) {
+      EXPECT_EQ(ctx.lookupNode(from), nullptr);
+    }
+    EXPECT_EQ(ctx.lookupFuseFh(fh), node);
+    from = to;
+  }
+
+  ctx.eraseNode("/a", node);
+  EXPECT_EQ(ctx.lookupFuseFh(fh), nullptr);
+  EXPECT_EQ(ctx.openFileCount(), 0);
+}
+
+TEST_F(ContextTest, ConcurrentOpenRelease) {
+  std::shared_ptr<DirNode> root = newRoot("/foo/");
+  ctx.setRoot(root);
+
+  const int Threads = 4;
+  const int FilesPerThread = 100;
+  std::atomic<int> failures(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < Threads; ++t) {
+    threads.emplace_back([&, t]() {
+      for (int round = 0; round < 20; ++round) {
+        std::vector<std::shared_ptr<FileNode>> nodes;
+        for (int i = 0; i < FilesPerThread; ++i) {
+          std::string name =
+              "/t" + std::to_string(t) + "-" + std::to_string(i);
+          auto node = root->lookupNode(name.c_str(), "test");
+          if (ctx.putNode(name.c_str(), node) != 0) {
+            ++failures;
+          }
+          nodes.push_back(node);
+        }
+        for (int i = 0; i < FilesPerThread; ++i) {
+          std::string name =
+              "/t" + std::to_string(t) + "-" + std::to_string(i);
+          if (ctx.lookupFuseFh(nodes[i]->fuseFh) != nodes[i]) {
+            ++failures;
+          }
+          ctx.eraseNode(name.c_str(), nodes[i]);
+          if (ctx.lookupFuseFh(nodes[i]->fuseFh) != nullptr) {
+            ++failures;
+          }
+        }
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(failures, 0);
+  EXPECT_EQ(ctx.openFileCount(), 0);
+}
+
+// Lookups racing with the release and reuse of the slot they index get
+// either the node the handle was given to or nothing.
+TEST_F(ContextTest, ConcurrentLookupRelease) {
+  std::shared_ptr<DirNode> root = newRoot("/foo/");
+  ctx.setRoot(root);
+
+  const char *names[] = {"/x", "/y"};
+  std::atomic<uint64_t> handle(0);
+  std::atomic<bool> done(false);
+  std::atomic<int> failures(0);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 2; ++t) {
+    readers.emplace_back([&]() {
+      while (!done) {
+        uint64_t fh = handle;
+        std::shared_ptr<FileNode> node = ctx.lookupFuseFh(fh);
+        // the handle is only ever given to "/x" nodes
+        if (node != nullptr && strcmp(node->plaintextName(), "/x") != 0) {
+          ++failures;
+        }
+      }
+    });
+  }
+
+  for (int round = 0; round < 2000; ++round) {
+    for (const char *name : names) {
+      auto node = root->lookupNode(name, "test");
+      EXPECT_EQ(ctx.putNode(name, node), 0);
+      if (name == names[0]) {
+        handle = node->fuseFh;
+      }
+      ctx.eraseNode(name, node);
+    }
+  }
+  done = true;
+  for (auto &t : readers) {
+    t.join();
+  }
+  EXPECT_EQ(failures, 0);
+  EXPECT_EQ(ctx.openFileCount(), 0);
+}
+
+TEST_F(ReleasedNodeTest, Reuse) {
+  std::shared_ptr<FileNode> node = makeFile("/a");
+  ASSERT_TRUE(node != nullptr);
+  EXPECT_EQ(node->canary, CANARY_RELEASED);
+  EXPECT_EQ(ctx.releasedNodeCount(), 1);
+  EXPECT_EQ(ctx.lookupNode("/a"), nullptr);
+
+  std::shared_ptr<FileNode> reopened = openFile("/a");
+  EXPECT_EQ(reopened, node);
+  EXPECT_EQ(reopened->canary, CANARY_OK);
+  EXPECT_EQ(ctx.releasedNodeCount(), 0);
+
+  unsigned char buf[100];
+  ASSERT_EQ(reopened->read(0, buf, sizeof(buf)), (ssize_t)sizeof(buf));
+  EXPECT_EQ(buf[0], 'a');
+  EXPECT_EQ(buf[99], 'a');
+
+  // the file changes through a second name while the node is released
+  ASSERT_EQ(ctx.putNode("/a", reopened), 0);
+  ctx.eraseNode("/a", reopened);
+  ASSERT_EQ(root->link("/a", "/b"), 0);
+  std::shared_ptr<FileNode> other = openFile("/b");
+  ASSERT_TRUE(other != nullptr);
+  ASSERT_EQ(other->truncate(10), 0);
+  reopened = openFile("/a");
+  EXPECT_EQ(reopened, node);
+  EXPECT_EQ(reopened->getSize(), 10);
+  EXPECT_EQ(reopened->read(0, buf, sizeof(buf)), 10);
+}
+
+TEST_F(ReleasedNodeTest, Limits) {
+  ctx.setReleasedNodeLimits(4, 2);
+  int fds = countOpenFds();
+
+  std::vector<std::weak_ptr<FileNode>> nodes;
+  const char *names[] = {"/a", "/b", "/c", "/d", "/e", "/f"};
+  for (const char *name : names) {
+    std::shared_ptr<FileNode> node = makeFile(name);
+    ASSERT_TRUE(node != nullptr);
+    nodes.push_back(node);
+  }
+  EXPECT_EQ(ctx.releasedNodeCount(), 4);
+  EXPECT_EQ(countOpenFds(), fds + 2);
+
+  // the least recently released nodes are gone
+  EXPECT_TRUE(nodes[0].expired());
+  EXPECT_TRUE(nodes[1].expired());
+
+  // a kept node without descriptor reopens its file
+  std::shared_ptr<FileNode> node = openFile("/c");
+  EXPECT_EQ(node, nodes[2].lock());
+  unsigned char buf[100];
+  ASSERT_EQ(node->read(0, buf, sizeof(buf)), (ssize_t)sizeof(buf));
+  EXPECT_EQ(buf[0], 'c');
+  EXPECT_EQ(countOpenFds(), fds + 3);
+
+  ctx.setReleasedNodeLimits(0, 0);
+  EXPECT_EQ(ctx.releasedNodeCount(), 0);
+  node.reset();
+  EXPECT_EQ(countOpenFds(), fds);
+}
+
+TEST_F(ReleasedNodeTest, Invalidation) {
+  std::weak_ptr<FileNode> a = makeFile("/a");
+  std::weak_ptr<FileNode> b = makeFile("/b");
+  ASSERT_EQ(ctx.releasedNodeCount(), 2);
+
+  ASSERT_EQ(root->unlink("/a"), 0);
+  EXPECT_TRUE(a.expired());
+  EXPECT_EQ(ctx.releasedNodeCount(), 1);
+
+  // the file is created again, the new node must not use the old IV
+  std::shared_ptr<FileNode> node = makeFile("/a");
+  ASSERT_TRUE(node != nullptr);
+  EXPECT_EQ(ctx.releasedNodeCount(), 2);
+
+  ASSERT_EQ(root->rename("/b", "/c"), 0);
+  EXPECT_TRUE(b.expired());
+  EXPECT_EQ(ctx.releasedNodeCount(), 0);
+
+  node = openFile("/c");
+  ASSERT_TRUE(node != nullptr);
+  unsigned char buf[100];
+  ASSERT_EQ(node->read(0, buf, sizeof(buf)), (ssize_t)sizeof(buf));
+  EXPECT_EQ(buf[0], 'b');
+}
+
+TEST_F(ReleasedNodeTest, UnlinkAndCreate) {
+  // keep the old node alive, so its address can't come back
+  std::shared_ptr<FileNode> old = makeFile("/a");
+  ASSERT_TRUE(old != nullptr);
+  ASSERT_EQ(ctx.releasedNodeCount(), 1);
+  ASSERT_EQ(root->unlink("/a"), 0);
+  EXPECT_EQ(ctx.releasedNodeCount(), 0);
+
+  // a new file with the same name gets a new node, also once it is released
+  int res = -1;
+  std::shared_ptr<FileNode> node =
+      root->createNode("/a", "test", S_IFREG | 0644, O_RDWR, 0, 0, &res);
+  ASSERT_TRUE(node != nullptr);
+  EXPECT_NE(node, old);
+  ASSERT_EQ(ctx.putNode("/a", node), 0);
+  unsigned char data[50];
+  memset(data, 'x', sizeof(data));
+  ASSERT_EQ(node->write(0, data, sizeof(data)), (ssize_t)sizeof(data));
+  ctx.eraseNode("/a", node);
+  EXPECT_EQ(ctx.releasedNodeCount(), 1);
+
+  std::shared_ptr<FileNode> reopened = openFile("/a");
+  EXPECT_EQ(reopened, node);
+  EXPECT_NE(reopened, old);
+  unsigned char buf[100];
+  ASSERT_EQ(reopened->read(0, buf, sizeof(buf)), (ssize_t)sizeof(data));
+  EXPECT_EQ(buf[0], 'x');
+  EXPECT_EQ(buf[49], 'x');
+}
+
+// Replaces "/a" with a new file holding 50 'y's, by unlinking it or renaming
+// it to "/b", while openNode is between preparing its node and taking the
+// path lock.
+bool replaceByRename = false;
+
+void replaceFile(DirNode *dirNode, const char *plainName) {
+  dirNode->setPrepareHook(nullptr);
+  if (replaceByRename) {
+    EXPECT_EQ(dirNode->rename(plainName, "/b"), 0);
+  } else {
+    EXPECT_EQ(dirNode->unlink(plainName), 0);
+  }
+  int res = -1;
+  std::shared_ptr<FileNode> node = dirNode->createNode(
+      plainName, "test", S_IFREG | 0644, O_RDWR, 0, 0, &res);
+  ASSERT_TRUE(node != nullptr);
+  unsigned char data[50];
+  memset(data, 'y', sizeof(data));
+  EXPECT_EQ(node->write(0, data, sizeof(data)), (ssize_t)sizeof(data));
+}
+
+TEST_F(ReleasedNodeTest, ReplacedWhileOpening) {
+  for (bool rename : {false, true}) {
+    std::shared_ptr<FileNode> old = makeFile("/a");
+    ASSERT_TRUE(old != nullptr);
+    ASSERT_EQ(ctx.releasedNodeCount(), 1);
+
+    replaceByRename = rename;
+    root->setPrepareHook(replaceFile);
+    std::shared_ptr<FileNode> node = openFile("/a");
+    root->setPrepareHook(nullptr);
+
+    // the released node still has the old file open
+    ASSERT_TRUE(node != nullptr);
+    EXPECT_NE(node, old);
+    unsigned char buf[100];
+    ASSERT_EQ(node->read(0, buf, sizeof(buf)), 50);
+    EXPECT_EQ(buf[0], 'y');
+    EXPECT_EQ(buf[49], 'y');
+
+    ASSERT_EQ(root->unlink("/a"), 0);
+    if (rename) {
+      ASSERT_EQ(root->unlink("/b"), 0);
+    }
+  }
+}
+
+TEST_F(ReleasedNodeTest, NoCache) {
+  fsCfg->opts->noCache = true;
+  std::weak_ptr<FileNode> node = makeFile("/a");
+  EXPECT_TRUE(node.expired());
+  EXPECT_EQ(ctx.releasedNodeCount(), 0);
+}
+
+}  // namespace
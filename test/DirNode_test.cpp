@@ -0,0 +1,427 @@
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <tuple>
+#include <unistd.h>
+#include <vector>
+
+#include "encfs/BlockNameIO.h"
+#include "encfs/Cipher.h"
+#include "encfs/Context.h"
+#include "encfs/DirNode.h"
+#include "encfs/FSConfig.h"
+#include "encfs/FileNode.h"
+#include "encfs/FileUtils.h"
+#include "TestUtils.h"
+
+using namespace encfs;
+using namespace testing;
+
+namespace {
+
+const int FSBlockSize = 1024;
+
+// Parameters are the number of MAC bytes, whether unique IVs are enabled and
+// whether the MACs are stored in tag blocks.
+class DirNodeTest : public TestWithParam<std::tuple<int, bool, bool>> {
+ protected:
+  virtual void SetUp() {
+    fsCfg = test::newFSConfig(FSBlockSize, std::get<1>(GetParam()));
+    fsCfg->config->blockMACBytes = std::get<0>(GetParam());
+    fsCfg->config->blockMACRandBytes = 0;
+    fsCfg->config->blockMACTagBlocks = std::get<2>(GetParam());
+    fsCfg->opts->idleTracking = false;
+    fsCfg->opts->mountPoint = "/nonexistent-mountpoint/";
+    fsCfg->nameCoding.reset(new BlockNameIO(
+        BlockNameIO::CurrentInterface(), fsCfg->cipher, fsCfg->key,
+        fsCfg->cipher->cipherBlockSize()));
+
+    ctx.opts = fsCfg->opts;
+    reopen();
+  }
+
+  // rebuild the DirNode after changing the options
+  void reopen() { dirNode.reset(new DirNode(&ctx, tmp.path() + "/", fsCfg)); }
+
+  virtual void TearDown() { dirNode.reset(); }
+
+  test::TempDir tmp;
+  EncFS_Context ctx;
+  FSConfigPtr fsCfg;
+  std::unique_ptr<DirNode> dirNode;
+};
+
+TEST_P(DirNodeTest, GetAttrMatchesFileNode) {
+  for (int size : {0, 1, 1000, FSBlockSize, 3 * FSBlockSize + 17}) {
+    std::string name = "/file" + std::to_string(size);
+    std::shared_ptr<FileNode> node = dirNode->lookupNode(name.c_str(), "test");
+    ASSERT_EQ(node->mknod(S_IFREG | 0644, 0), 0);
+    ASSERT_GE(node->open(O_RDWR), 0);
+    if (size > 0) {
+      std::vector<unsigned char> data(size, 'x');
+      ASSERT_EQ(node->write(0, data.data(), size), size);
+    }
+
+    struct stat expected;
+    ASSERT_EQ(node->getAttr(&expected), 0);
+    EXPECT_EQ(expected.st_size, size);
+
+    // second call is answered from the cache
+    for (int i = 0; i < 2; ++i) {
+      struct stat st;
+      ASSERT_EQ(dirNode->getAttr(name.c_str(), &st), 0);
+      EXPECT_EQ(st.st_size, expected.st_size);
+      EXPECT_EQ(st.st_mode, expected.st_mode);
+      EXPECT_EQ(st.st_ino, expected.st_ino);
+    }
+  }
+}
+
+TEST_P(DirNodeTest, GetAttrSeesChanges) {
+  std::shared_ptr<FileNode> node = dirNode->lookupNode("/file", "test");
+  ASSERT_EQ(node->mknod(S_IFREG | 0644, 0), 0);
+  ASSERT_GE(node->open(O_RDWR), 0);
+
+  struct stat st;
+  ASSERT_EQ(dirNode->getAttr("/file", &st), 0);
+  EXPECT_EQ(st.st_size, 0);
+
+  // changes through encfs drop the cached attributes
+  unsigned char data[100] = {0};
+  ASSERT_EQ(node->write(0, data, sizeof(data)), (ssize_t)sizeof(data));
+  ASSERT_EQ(dirNode->getAttr("/file", &st), 0);
+  EXPECT_EQ(st.st_size, (off_t)sizeof(data));
+
+  ASSERT_EQ(node->truncate(10), 0);
+  ASSERT_EQ(dirNode->getAttr("/file", &st), 0);
+  EXPECT_EQ(st.st_size, 10);
+
+  ASSERT_EQ(node->allocate(0, 50, false), 0);
+  ASSERT_EQ(dirNode->getAttr("/file", &st), 0);
+  EXPECT_EQ(st.st_size, 50);
+
+  // the directory's link count changes with mkdir
+  struct stat root;
+  ASSERT_EQ(dirNode->getAttr("/", &root), 0);
+  ASSERT_EQ(dirNode->mkdir("/dir", 0755), 0);
+  ASSERT_EQ(dirNode->getAttr("/", &st), 0);
+  EXPECT_EQ(st.st_nlink, root.st_nlink + 1);
+
+  ASSERT_EQ(dirNode->getAttr("/file", &st), 0);
+  node.reset();
+  ASSERT_EQ(dirNode->unlink("/file"), 0);
+  EXPECT_EQ(dirNode->getAttr("/file", &st), -ENOENT);
+}
+
+TEST_P(DirNodeTest, GetAttrCached) {
+  std::shared_ptr<FileNode> node = dirNode->lookupNode("/file", "test");
+  ASSERT_EQ(node->mknod(S_IFREG | 0644, 0), 0);
+  std::shared_ptr<FileNode> other = dirNode->lookupNode("/other", "test");
+  ASSERT_EQ(other->mknod(S_IFREG | 0644, 0), 0);
+
+  struct stat st;
+  ASSERT_EQ(dirNode->getAttr("/file", &st), 0);
+  EXPECT_EQ(st.st_mode & 0777, 0644u);
+
+  // changes to the backing file which don't go through encfs aren't seen
+  ASSERT_EQ(chmod(node->cipherName(), 0600), 0);
+  ASSERT_EQ(dirNode->getAttr("/file", &st), 0);
+  EXPECT_EQ(st.st_mode & 0777, 0644u);
+
+  // not even after changes to other paths
+  ASSERT_EQ(dirNode->getAttr("/other", &st), 0);
+  dirNode->invalidateAttr("/other");
+  dirNode->invalidateAttr("/missing");
+  ASSERT_EQ(dirNode->getAttr("/file", &st), 0);
+  EXPECT_EQ(st.st_mode & 0777, 0644u);
+
+  // until the path is invalidated
+  dirNode->invalidateAttr("/file");
+  ASSERT_EQ(dirNode->getAttr("/file", &st), 0);
+  EXPECT_EQ(st.st_mode & 0777, 0600u);
+}
+
+// In reverse mode and with --checkattr, every call sees changes made behind
+// our back.
+TEST_P(DirNodeTest, GetAttrChecked) {
+  for (int reverse = 0; reverse < 2; ++reverse) {
+    fsCfg->opts->checkAttr = reverse == 0;
+    fsCfg->reverseEncryption = reverse != 0;
+    reopen();
+    std::string name = "/file" + std::to_string(reverse);
+    std::shared_ptr<FileNode> node = dirNode->lookupNode(name.c_str(), "test");
+    ASSERT_EQ(node->mknod(S_IFREG | 0644, 0), 0);
+
+    struct stat st;
+    ASSERT_EQ(dirNode->getAttr(name.c_str(), &st), 0);
+    ASSERT_EQ(chmod(node->cipherName(), 0600), 0);
+    ASSERT_EQ(dirNode->getAttr(name.c_str(), &st), 0);
+    EXPECT_EQ(st.st_mode & 0777, 0600u);
+
+    // same size and mode, new inode
+    ASSERT_EQ(unlink(node->cipherName()), 0);
+    int fd = open(node->cipherName(), O_CREAT | O_WRONLY, 0600);
+    ASSERT_GE(fd, 0);
+    struct stat created;
+    ASSERT_EQ(fstat(fd, &created), 0);
+    close(fd);
+    ASSERT_EQ(dirNode->getAttr(name.c_str(), &st), 0);
+    EXPECT_EQ(st.st_ino, created.st_ino);
+
+    ASSERT_EQ(unlink(node->cipherName()), 0);
+    EXPECT_EQ(dirNode->getAttr(name.c_str(), &st), -ENOENT);
+  }
+}
+
+// A hard linked file can be changed through its other name.
+TEST_P(DirNodeTest, GetAttrHardLink) {
+  std::shared_ptr<FileNode> node = dirNode->lookupNode("/file", "test");
+  ASSERT_EQ(node->mknod(S_IFREG | 0644, 0), 0);
+
+  struct stat st;
+  ASSERT_EQ(dirNode->getAttr("/file", &st), 0);
+  EXPECT_EQ(st.st_nlink, 1u);
+  int res = dirNode->link("/file", "/link");
+  if (res == -EPERM) {
+    // not supported with external IV chaining
+    return;
+  }
+  ASSERT_EQ(res, 0);
+  ASSERT_EQ(dirNode->getAttr("/file", &st), 0);
+  EXPECT_EQ(st.st_nlink, 2u);
+
+  ASSERT_EQ(chmod(node->cipherName(), 0600), 0);
+  ASSERT_EQ(dirNode->getAttr("/file", &st), 0);
+  EXPECT_EQ(st.st_mode & 0777, 0600u);
+}
+
+TEST_P(DirNodeTest, GetAttrCacheEviction) {
+  // twice as many paths as fit
+  const unsigned int Entries = DirNode::AttrCacheEntries;
+  const unsigned int Files = 2 * Entries;
+  std::vector<std::string> cipherNames;
+  for (unsigned int i = 0; i < Files; ++i) {
+    std::string name = "/f" + std::to_string(i);
+    std::string cipherName = dirNode->cipherPath(name.c_str());
+    int fd = open(cipherName.c_str(), O_CREAT | O_WRONLY, 0644);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    cipherNames.push_back(cipherName);
+  }
+
+  struct stat st;
+  for (unsigned int i = 0; i < Files; ++i) {
+    ASSERT_EQ(dirNode->getAttr(("/f" + std::to_string(i)).c_str(), &st), 0);
+  }
+  for (const std::string &cipherName : cipherNames) {
+    ASSERT_EQ(chmod(cipherName.c_str(), 0600), 0);
+  }
+
+  // the most recently used path is still cached, the least recently used
+  // one isn't, and no more than AttrCacheEntries are
+  std::string last = "/f" + std::to_string(Files - 1);
+  ASSERT_EQ(dirNode->getAttr(last.c_str(), &st), 0);
+  EXPECT_EQ(st.st_mode & 0777, 0644u);
+  ASSERT_EQ(dirNode->getAttr("/f0", &st), 0);
+  EXPECT_EQ(st.st_mode & 0777, 0600u);
+
+  // newest first, so that the misses don't evict paths we haven't looked at
+  unsigned int cached = 0;
+  for (unsigned int i = Files - 2; i > 0; --i) {
+    ASSERT_EQ(dirNode->getAttr(("/f" + std::to_string(i)).c_str(), &st), 0);
+    if ((st.st_mode & 0777) == 0644u) {
+      ++cached;
+    }
+  }
+  EXPECT_GT(cached, 0u);
+  EXPECT_LE(cached, Entries);
+}
+
+TEST_P(DirNodeTest, GetAttrSymlink) {
+  // the cached symlink length is checked against a fresh lstat()
+  fsCfg->opts->checkAttr = true;
+  reopen();
+  std::string target = "some/target/name";
+  std::string cipherLink = dirNode->cipherPath("/link");
+  std::string cipherTarget = dirNode->relativeCipherPath(target.c_str());
+  ASSERT_EQ(symlink(cipherTarget.c_str(), cipherLink.c_str()), 0);
+
+  struct stat st;
+  ASSERT_EQ(dirNode->getAttr("/link", &st), 0);
+  EXPECT_TRUE(S_ISLNK(st.st_mode));
+  EXPECT_EQ(st.st_size, (off_t)target.length());
+
+  // replace the link behind our back, the cached length must not be used
+  target = "another/much/longer/target/name";
+  cipherTarget = dirNode->relativeCipherPath(target.c_str());
+  ASSERT_EQ(unlink(cipherLink.c_str()), 0);
+  ASSERT_EQ(symlink(cipherTarget.c_str(), cipherLink.c_str()), 0);
+  ASSERT_EQ(dirNode->getAttr("/link", &st), 0);
+  EXPECT_EQ(st.st_size, (off_t)target.length());
+
+  // and through encfs
+  ASSERT_EQ(dirNode->unlink("/link"), 0);
+  EXPECT_EQ(dirNode->getAttr("/link", &st), -ENOENT);
+}
+
+TEST_P(DirNodeTest, GetAttrErrors) {
+  struct stat st;
+  EXPECT_EQ(dirNode->getAttr("/missing", &st), -ENOENT);
+
+  std::string longName(PATH_MAX, 'x');
+  longName[0] = '/';
+  EXPECT_EQ(dirNode->getAttr(longName.c_str(), &st), -ENAMETOOLONG);
+
+  ASSERT_EQ(dirNode->mkdir("/dir", 0755), 0);
+  EXPECT_EQ(dirNode->getAttr("/dir", &st), 0);
+  EXPECT_TRUE(S_ISDIR(st.st_mode));
+}
+
+TEST_P(DirNodeTest, CreateNode) {
+  int res = -1;
+  std::shared_ptr<FileNode> node =
+      dirNode->createNode("/new", "test", S_IFREG | 0640, O_WRONLY, 0, 0, &res);
+  ASSERT_TRUE(node != nullptr);
+  ASSERT_GE(res, 0);
+
+  std::vector<unsigned char> data(3 * FSBlockSize + 17, 'z');
+  ASSERT_EQ(node->write(0, data.data(), data.size()), (ssize_t)data.size());
+
+  struct stat st;
+  ASSERT_EQ(dirNode->getAttr("/new", &st), 0);
+  EXPECT_EQ(st.st_size, (off_t)data.size());
+  EXPECT_EQ(st.st_mode & 0777, 0640u);
+
+  // read back through a new node
+  node.reset();
+  node = dirNode->openNode("/new", "test", O_RDONLY, &res);
+  ASSERT_TRUE(node != nullptr);
+  std::vector<unsigned char> buf(data.size());
+  ASSERT_EQ(node->read(0, buf.data(), buf.size()), (ssize_t)buf.size());
+  EXPECT_EQ(buf, data);
+
+  EXPECT_EQ(dirNode->createNode("/new", "test", S_IFREG | 0640, O_WRONLY, 0, 0,
+                                &res),
+            nullptr);
+  EXPECT_EQ(res, -EEXIST);
+}
+
+TEST_P(DirNodeTest, ConcurrentOpenAndRename) {
+  const int Threads = 4;
+  const int Files = 20;
+  for (int t = 0; t < Threads; ++t) {
+    for (int i = 0; i < Files; ++i) {
+      std::string name = "/f" + std::to_string(t) + "-" + std::to_string(i);
+      auto node = dirNode->lookupNode(name.c_str(), "test");
+      ASSERT_EQ(node->mknod(S_IFREG | 0644, 0), 0);
+    }
+  }
+  ASSERT_EQ(dirNode->mkdir("/dir", 0755), 0);
+
+  std::atomic<bool> done(false);
+  std::atomic<int> failures(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < Threads; ++t) {
+    threads.emplace_back([&, t]() {
+      while (!done) {
+        for (int i = 0; i < Files; ++i) {
+          std::string name =
+              "/f" + std::to_string(t) + "-" + std::to_string(i);
+          int res = -1;
+          auto node = dirNode->openNode(name.c_str(), "test", O_RDONLY, &res);
+          if (!node || res < 0 ||
+              dirNode->cipherPath(name.c_str()) != node->cipherName()) {
+            ++failures;
+            continue;
+          }
+          if (ctx.putNode(name.c_str(), node) != 0) {
+            ++failures;
+            continue;
+          }
+          if (dirNode->lookupNode(name.c_str(), "test") != node) {
+            ++failures;
+          }
+          ctx.eraseNode(name.c_str(), node);
+        }
+      }
+    });
+  }
+
+  // renames take every path lock
+  for (int i = 0; i < 200; ++i) {
+    ASSERT_EQ(dirNode->rename(i % 2 == 0 ? "/dir" : "/dir2",
+                              i % 2 == 0 ? "/dir2" : "/dir"),
+              0);
+  }
+  done = true;
+  for (auto &t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(failures, 0);
+  EXPECT_EQ(ctx.openFileCount(), 0);
+}
+
+TEST_P(DirNodeTest, Allocate) {
+  int res = -1;
+  std::shared_ptr<FileNode> node =
+      dirNode->createNode("/file", "test", S_IFREG | 0644, O_RDWR, 0, 0, &res);
+  ASSERT_TRUE(node != nullptr);
+  std::vector<unsigned char> data(100, 'a');
+  ASSERT_EQ(node->write(0, data.data(), data.size()), (ssize_t)data.size());
+
+  const off_t size = 100 * FSBlockSize + 10;
+  res = node->allocate(50, size - 50, true);
+  if (res != -EOPNOTSUPP) {
+    ASSERT_EQ(res, 0);
+  }
+  EXPECT_EQ(node->getSize(), (off_t)data.size());
+
+  ASSERT_EQ(node->allocate(50, size - 50, false), 0);
+  EXPECT_EQ(node->getSize(), size);
+  // a range inside the file doesn't change it
+  ASSERT_EQ(node->allocate(0, 10, false), 0);
+  EXPECT_EQ(node->getSize(), size);
+
+  std::vector<unsigned char> buf(size);
+  ASSERT_EQ(node->read(0, buf.data(), buf.size()), size);
+  std::vector<unsigned char> expected(size, 0);
+  std::copy(data.begin(), data.end(), expected.begin());
+  EXPECT_EQ(buf, expected);
+}
+
+TEST_P(DirNodeTest, ZeroBlocksAsHoles) {
+  fsCfg->config->allowHoles = true;
+  int res = -1;
+  std::shared_ptr<FileNode> node =
+      dirNode->createNode("/file", "test", S_IFREG | 0644, O_RDWR, 0, 0, &res);
+  ASSERT_TRUE(node != nullptr);
+
+  std::vector<unsigned char> data(200 * FSBlockSize, 'a');
+  ASSERT_EQ(node->write(0, data.data(), data.size()), (ssize_t)data.size());
+  std::fill(data.begin() + 10, data.end() - 10, 0);
+  ASSERT_EQ(node->write(0, data.data(), data.size()), (ssize_t)data.size());
+
+  struct stat st;
+  ASSERT_EQ(lstat(node->cipherName(), &st), 0);
+  EXPECT_LT(st.st_blocks * 512, 100 * FSBlockSize);
+
+  // read back through a new node, MACs of 0 blocks aren't checked
+  node.reset();
+  node = dirNode->openNode("/file", "test", O_RDONLY, &res);
+  ASSERT_TRUE(node != nullptr);
+  std::vector<unsigned char> buf(data.size());
+  ASSERT_EQ(node->read(0, buf.data(), buf.size()), (ssize_t)buf.size());
+  EXPECT_EQ(buf, data);
+}
+
+INSTANTIATE_TEST_SUITE_P(DirNode, DirNodeTest,
+                         Combine(Values(0, 8), Bool(), Bool()));
+
+}  // namespace
@@ -0,0 +1,97 @@
+#include "gtest/gtest.h"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+
+#include "encfs/FSConfig.h"
+#include "encfs/FileUtils.h"
+#include "encfs/Interface.h"
+#include "TestUtils.h"
+
+using namespace encfs;
+using namespace testing;
+
+namespace {
+
+class ConfigTest : public Test {
+ protected:
+  virtual void SetUp() {
+    fileName = tmp.file(".encfs6.xml");
+
+    cfg.cipherIface = Interface("ssl/aes", 3, 0, 2);
+    cfg.nameIface = Interface("nameio/block", 4, 0, 2);
+    cfg.keySize = 192;
+    cfg.blockSize = 1024;
+    cfg.uniqueIV = true;
+    unsigned char key[44] = {1, 2, 3};
+    cfg.assignKeyData(key, sizeof(key));
+    unsigned char salt[20] = {4, 5, 6};
+    cfg.assignSaltData(salt, sizeof(salt));
+    cfg.kdfIterations = 1000;
+  }
+
+  bool reread(EncFSConfig *out) {
+    return readV6Config(fileName.c_str(), out, nullptr);
+  }
+
+  test::TempDir tmp;
+  std::string fileName;
+  EncFSConfig cfg;
+};
+
+}  // namespace
+
+TEST_F(ConfigTest, RoundTrip) {
+  ASSERT_TRUE(writeV6Config(fileName.c_str(), &cfg));
+  EncFSConfig out;
+  ASSERT_TRUE(reread(&out));
+  EXPECT_EQ(out.cipherIface.name(), "ssl/aes");
+  EXPECT_EQ(out.cipherIface.current(), 3);
+  EXPECT_EQ(out.blockSize, cfg.blockSize);
+  EXPECT_TRUE(out.uniqueIV);
+  EXPECT_FALSE(out.alignedHeader);
+}
+
+TEST_F(ConfigTest, AlignedHeaderNeedsLayoutCipherVersion) {
+  cfg.alignedHeader = true;
+  ASSERT_TRUE(writeV6Config(fileName.c_str(), &cfg));
+  EncFSConfig out;
+  EXPECT_FALSE(reread(&out));
+
+  cfg.cipherIface = Interface("ssl/aes", 4, 0, 3);
+  ASSERT_TRUE(writeV6Config(fileName.c_str(), &cfg));
+  EncFSConfig out2;
+  ASSERT_TRUE(reread(&out2));
+  EXPECT_TRUE(out2.alignedHeader);
+}
+
+TEST_F(ConfigTest, MACTagBlocksNeedLayoutCipherVersion) {
+  cfg.blockMACBytes = 8;
+  cfg.blockMACTagBlocks = true;
+  ASSERT_TRUE(writeV6Config(fileName.c_str(), &cfg));
+  EncFSConfig out;
+  EXPECT_FALSE(reread(&out));
+
+  cfg.cipherIface = Interface("ssl/aes", 4, 0, 3);
+  ASSERT_TRUE(writeV6Config(fileName.c_str(), &cfg));
+  EncFSConfig out2;
+  ASSERT_TRUE(reread(&out2));
+  EXPECT_TRUE(out2.blockMACTagBlocks);
+}
+
+TEST_F(ConfigTest, RefusesNewerVersion) {
+  ASSERT_TRUE(writeV6Config(fileName.c_str(), &cfg));
+  std::stringstream text;
+  text << std::ifstream(fileName).rdbuf();
+  std::string xml = text.str();
+  std::string::size_type pos = xml.find("<version>");
+  ASSERT_NE(pos, std::string::npos);
+  std::string::size_type end = xml.find("</version>", pos);
+  xml.replace(pos, end - pos, "<version>29991231");
+  std::ofstream(fileName) << xml;
+
+  EncFSConfig out;
+  EXPECT_FALSE(reread(&out));
+}
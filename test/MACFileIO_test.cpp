@@ -0,0 +1,145 @@
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "encfs/Cipher.h"
+#include "encfs/CipherFileIO.h"
+#include "encfs/FSConfig.h"
+#include "encfs/FileUtils.h"
+#include "encfs/MACFileIO.h"
+#include "encfs/RawFileIO.h"
+#include "TestUtils.h"
+
+using namespace encfs;
+using namespace testing;
+
+namespace {
+
+const int FSBlockSize = 1024;
+const int MACBytes = 8;
+
+// Parameter is the number of random bytes per block.
+class MACFileIOTest : public TestWithParam<int> {
+ protected:
+  virtual void SetUp() {
+    fileName = tmp.file("file");
+    fsCfg = test::newFSConfig(FSBlockSize);
+    fsCfg->config->blockMACBytes = MACBytes;
+    fsCfg->config->blockMACRandBytes = GetParam();
+  }
+
+  void newIO() {
+    std::shared_ptr<FileIO> raw = std::make_shared<RawFileIO>(fileName);
+    io.reset(
+        new MACFileIO(std::make_shared<CipherFileIO>(raw, fsCfg), fsCfg));
+  }
+
+  int dataBlockSize() const { return FSBlockSize - MACBytes - GetParam(); }
+
+  std::vector<unsigned char> readAll(off_t size) {
+    newIO();
+    return test::readAll(*io, size);
+  }
+
+  test::TempDir tmp;
+  std::string fileName;
+  FSConfigPtr fsCfg;
+  std::unique_ptr<FileIO> io;
+};
+
+TEST_P(MACFileIOTest, RoundTrip) {
+  const int bs = dataBlockSize();
+  for (int size : {1, bs, 3 * bs + 17, 40 * bs}) {
+    newIO();
+    ASSERT_GE(io->create(O_RDWR, 0644), 0);
+    std::vector<unsigned char> data(size);
+    for (int i = 0; i < size; ++i) {
+      data[i] = i * 13 + 1;
+    }
+    std::vector<unsigned char> copy = data;
+    ASSERT_EQ(test::writeAt(*io, 0, data), size);
+    EXPECT_EQ(data, copy);
+    EXPECT_EQ(readAll(size), data);
+    ASSERT_EQ(unlink(fileName.c_str()), 0);
+  }
+}
+
+// Partial blocks are merged in the cache and written with their header in
+// its headroom.
+TEST_P(MACFileIOTest, RandomIO) {
+  newIO();
+  ASSERT_GE(io->create(O_RDWR, 0644), 0);
+  std::vector<unsigned char> data;
+
+  srand(1234);
+  for (int i = 0; i < 300; ++i) {
+    if (i % 50 == 0) {
+      newIO();
+      ASSERT_GE(io->open(O_RDWR), 0);
+    }
+    off_t offset = rand() % (data.size() + 100);
+    std::vector<unsigned char> buf(rand() % 3000 + 1);
+    if ((i & 1) != 0) {
+      for (size_t j = 0; j < buf.size(); ++j) {
+        buf[j] = rand();
+      }
+      std::vector<unsigned char> copy = buf;
+      ASSERT_EQ(test::writeAt(*io, offset, buf), (ssize_t)buf.size());
+      ASSERT_EQ(buf, copy);
+      if (offset + buf.size() > data.size()) {
+        data.resize(offset + buf.size(), 0);
+      }
+      std::copy(buf.begin(), buf.end(), data.begin() + offset);
+    } else {
+      ssize_t expected = std::max(
+          (ssize_t)0, std::min((ssize_t)buf.size(),
+                               (ssize_t)data.size() - (ssize_t)offset));
+      ASSERT_EQ(test::readAt(*io, offset, &buf), expected)
+          << "offset " << offset;
+      ASSERT_TRUE(std::equal(buf.begin(), buf.begin() + expected,
+                             data.begin() + offset))
+          << "offset " << offset;
+    }
+  }
+
+  EXPECT_EQ(readAll(data.size()), data);
+}
+
+TEST_P(MACFileIOTest, DetectsChanges) {
+  newIO();
+  ASSERT_GE(io->create(O_RDWR, 0644), 0);
+  std::vector<unsigned char> data(3 * dataBlockSize(), 5);
+  ASSERT_EQ(test::writeAt(*io, 0, data), (ssize_t)data.size());
+
+  // flip a byte of the second block in the backing file
+  FILE *f = fopen(fileName.c_str(), "r+b");
+  ASSERT_NE(f, nullptr);
+  ASSERT_EQ(fseek(f, 8 + FSBlockSize + 100, SEEK_SET), 0);
+  int c = fgetc(f);
+  ASSERT_EQ(fseek(f, 8 + FSBlockSize + 100, SEEK_SET), 0);
+  fputc(c ^ 1, f);
+  fclose(f);
+
+  newIO();
+  ASSERT_GE(io->open(O_RDONLY), 0);
+  std::vector<unsigned char> buf(dataBlockSize());
+  EXPECT_EQ(test::readAt(*io, 0, &buf), dataBlockSize());
+  EXPECT_EQ(test::readAt(*io, dataBlockSize(), &buf), -EBADMSG);
+  // the second block of a run
+  buf.resize(3 * dataBlockSize());
+  EXPECT_EQ(test::readAt(*io, 0, &buf), -EBADMSG);
+  // part of the block goes through the cache
+  buf.resize(10);
+  EXPECT_EQ(test::readAt(*io, dataBlockSize() + 5, &buf), -EBADMSG);
+}
+
+INSTANTIATE_TEST_SUITE_P(MACFileIO, MACFileIOTest, Values(0, 8));
+
+}  // namespace
@@ -0,0 +1,224 @@
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#include "encfs/Cipher.h"
+#include "encfs/CipherFileIO.h"
+#include "encfs/FSConfig.h"
+#include "encfs/FileNode.h"
+#include "encfs/FileUtils.h"
+#include "encfs/MACTagFileIO.h"
+#include "encfs/RawFileIO.h"
+#include "TestUtils.h"
+
+using namespace encfs;
+using namespace testing;
+
+namespace {
+
+const int FSBlockSize = 1024;
+const int HeaderSize = 8;
+const int MACBytes = 8;
+
+// RawFileIO which records the requests reaching the backing file.
+class RecordingFileIO : public RawFileIO {
+ public:
+  explicit RecordingFileIO(const std::string &name) : RawFileIO(name) {}
+
+  virtual ssize_t read(const IORequest &req) const {
+    reads.push_back(req.offset);
+    return RawFileIO::read(req);
+  }
+  virtual ssize_t write(const IORequest &req) {
+    writes.push_back(req.offset);
+    return RawFileIO::write(req);
+  }
+
+  mutable std::vector<off_t> reads;
+  std::vector<off_t> writes;
+};
+
+// Parameter is the number of random bytes per block.
+class MACTagFileIOTest : public TestWithParam<int> {
+ protected:
+  virtual void SetUp() {
+    fileName = tmp.file("file");
+    fsCfg = test::newFSConfig(FSBlockSize);
+    fsCfg->config->blockMACBytes = MACBytes;
+    fsCfg->config->blockMACRandBytes = GetParam();
+    fsCfg->config->blockMACTagBlocks = true;
+  }
+
+  void newIO() {
+    raw = std::make_shared<RecordingFileIO>(fileName);
+    io.reset(new MACTagFileIO(std::make_shared<CipherFileIO>(raw, fsCfg),
+                              fsCfg));
+  }
+
+  int tagsPerBlock() const {
+    return FSBlockSize / (MACBytes + GetParam());
+  }
+
+  std::vector<unsigned char> readAll(off_t size) {
+    newIO();
+    return test::readAll(*io, size);
+  }
+
+  test::TempDir tmp;
+  std::string fileName;
+  FSConfigPtr fsCfg;
+  std::shared_ptr<RecordingFileIO> raw;
+  std::unique_ptr<FileIO> io;
+};
+
+TEST_P(MACTagFileIOTest, RoundTrip) {
+  const int n = tagsPerBlock();
+  for (int size : {1, FSBlockSize, 3 * FSBlockSize + 17, n * FSBlockSize,
+                   n * FSBlockSize + 1, 2 * n * FSBlockSize + 100}) {
+    newIO();
+    ASSERT_GE(io->create(O_RDWR, 0644), 0);
+    std::vector<unsigned char> data(size);
+    for (int i = 0; i < size; ++i) {
+      data[i] = i * 13 + 1;
+    }
+    std::vector<unsigned char> copy = data;
+    ASSERT_EQ(test::writeAt(*io, 0, data), size);
+    EXPECT_EQ(data, copy);
+
+    // a full tag block in front of every group of blocks
+    off_t blocks = (size + FSBlockSize - 1) / FSBlockSize;
+    off_t groups = (blocks + n - 1) / n;
+    EXPECT_EQ(test::fileSize(fileName),
+              HeaderSize + size + groups * FSBlockSize)
+        << "size " << size;
+
+    struct stat st;
+    ASSERT_EQ(io->getAttr(&st), 0);
+    EXPECT_EQ(st.st_size, size);
+    ASSERT_EQ(lstat(fileName.c_str(), &st), 0);
+    FileNode::adjustAttr(fsCfg, &st);
+    EXPECT_EQ(st.st_size, size);
+
+    EXPECT_EQ(readAll(size), data);
+    ASSERT_EQ(unlink(fileName.c_str()), 0);
+  }
+}
+
+TEST_P(MACTagFileIOTest, Overwrite) {
+  newIO();
+  ASSERT_GE(io->create(O_RDWR, 0644), 0);
+  const int size = 3 * tagsPerBlock() * FSBlockSize;
+  std::vector<unsigned char> data(size, 'a');
+  ASSERT_EQ(test::writeAt(*io, 0, data), size);
+
+  // unaligned writes, spanning tag groups
+  for (off_t offset : {(off_t)10, (off_t)FSBlockSize * tagsPerBlock() - 5,
+                       (off_t)size - 3000}) {
+    std::vector<unsigned char> patch(2500, 'b' + offset % 7);
+    ASSERT_EQ(test::writeAt(*io, offset, patch), (ssize_t)patch.size());
+    std::copy(patch.begin(), patch.end(), data.begin() + offset);
+  }
+  EXPECT_EQ(readAll(size), data);
+}
+
+TEST_P(MACTagFileIOTest, DetectsChanges) {
+  newIO();
+  ASSERT_GE(io->create(O_RDWR, 0644), 0);
+  std::vector<unsigned char> data(4 * FSBlockSize, 'x');
+  ASSERT_EQ(test::writeAt(*io, 0, data), (ssize_t)data.size());
+
+  // change a byte of the third block, after the header and the tag block
+  FILE *f = fopen(fileName.c_str(), "r+b");
+  ASSERT_NE(f, nullptr);
+  ASSERT_EQ(fseek(f, HeaderSize + 3 * FSBlockSize + 100, SEEK_SET), 0);
+  int c = fgetc(f);
+  ASSERT_EQ(fseek(f, -1, SEEK_CUR), 0);
+  fputc(c ^ 1, f);
+  fclose(f);
+
+  newIO();
+  ASSERT_GE(io->open(O_RDONLY), 0);
+  std::vector<unsigned char> buf(FSBlockSize);
+  EXPECT_EQ(test::readAt(*io, 0, &buf), FSBlockSize);
+  EXPECT_EQ(test::readAt(*io, 2 * FSBlockSize, &buf), -EBADMSG);
+  EXPECT_EQ(test::readAt(*io, 3 * FSBlockSize, &buf), FSBlockSize);
+}
+
+TEST_P(MACTagFileIOTest, WritesBlocksBeforeTags) {
+  newIO();
+  ASSERT_GE(io->create(O_RDWR, 0644), 0);
+  std::vector<unsigned char> data(3 * FSBlockSize, 'w');
+  ASSERT_EQ(test::writeAt(*io, 0, data), (ssize_t)data.size());
+
+  // the block at the second slot of the first group, then the group's tags
+  std::vector<unsigned char> block(FSBlockSize, 'v');
+  raw->writes.clear();
+  ASSERT_EQ(test::writeAt(*io, FSBlockSize, block), FSBlockSize);
+  std::vector<off_t> expected = {HeaderSize + 2 * FSBlockSize, HeaderSize};
+  EXPECT_EQ(raw->writes, expected);
+
+  std::copy(block.begin(), block.end(), data.begin() + FSBlockSize);
+  EXPECT_EQ(readAll(data.size()), data);
+}
+
+TEST_P(MACTagFileIOTest, ReadsGroupsWhole) {
+  const int n = tagsPerBlock();
+  newIO();
+  ASSERT_GE(io->create(O_RDWR, 0644), 0);
+  std::vector<unsigned char> data(3 * n * FSBlockSize - 100);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = i * 7;
+  }
+  ASSERT_EQ(test::writeAt(*io, 0, data), (ssize_t)data.size());
+
+  // a tag block and the group's whole blocks for each group, then the
+  // partial block at the end
+  EXPECT_EQ(readAll(data.size()), data);
+  EXPECT_EQ(raw->reads.size(), 7u);
+}
+
+TEST_P(MACTagFileIOTest, Truncate) {
+  newIO();
+  ASSERT_GE(io->create(O_RDWR, 0644), 0);
+  const off_t size = 2 * tagsPerBlock() * FSBlockSize + 10;
+  std::vector<unsigned char> data(size, 'y');
+  ASSERT_EQ(test::writeAt(*io, 0, data), size);
+
+  const off_t shrunk = tagsPerBlock() * FSBlockSize - 500;
+  ASSERT_EQ(io->truncate(shrunk), 0);
+  EXPECT_EQ(io->getSize(), shrunk);
+  EXPECT_EQ(test::fileSize(fileName), HeaderSize + FSBlockSize + shrunk);
+
+  ASSERT_EQ(io->truncate(size), 0);
+  EXPECT_EQ(io->getSize(), size);
+  std::vector<unsigned char> expected(size, 0);
+  std::fill(expected.begin(), expected.begin() + shrunk, 'y');
+  EXPECT_EQ(readAll(size), expected);
+}
+
+TEST_P(MACTagFileIOTest, Holes) {
+  fsCfg->config->allowHoles = true;
+  newIO();
+  ASSERT_GE(io->create(O_RDWR, 0644), 0);
+  std::vector<unsigned char> data(10, 'z');
+  ASSERT_EQ(test::writeAt(*io, 0, data), (ssize_t)data.size());
+
+  const off_t size = 5 * tagsPerBlock() * FSBlockSize + 10;
+  ASSERT_EQ(io->truncate(size), 0);
+  std::vector<unsigned char> zeros(3 * FSBlockSize, 0);
+  ASSERT_EQ(test::writeAt(*io, FSBlockSize, zeros), (ssize_t)zeros.size());
+
+  std::vector<unsigned char> expected(size, 0);
+  std::copy(data.begin(), data.end(), expected.begin());
+  EXPECT_EQ(readAll(size), expected);
+}
+
+INSTANTIATE_TEST_SUITE_P(MACTagFileIO, MACTagFileIOTest, Values(0, 8));
+
+}  // namespace
@@ -0,0 +1,145 @@
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "encfs/Cipher.h"
+#include "encfs/CipherFileIO.h"
+#include "encfs/FSConfig.h"
+#include "encfs/FileUtils.h"
+#include "encfs/MMapFileIO.h"
+#include "TestUtils.h"
+
+using namespace encfs;
+using namespace testing;
+
+namespace {
+
+class MMapFileIOTest : public Test {
+ protected:
+  virtual void SetUp() { fileName = tmp.file("file"); }
+
+  std::vector<unsigned char> writeFile(FileIO &io, size_t size) {
+    std::vector<unsigned char> data = test::testData(size, 11);
+    EXPECT_EQ(test::writeAt(io, 0, data), (ssize_t)size);
+    return data;
+  }
+
+  test::TempDir tmp;
+  std::string fileName;
+};
+
+TEST_F(MMapFileIOTest, ReadMapped) {
+  MMapFileIO io(fileName);
+  ASSERT_GE(io.create(O_RDWR, 0644), 0);
+  std::vector<unsigned char> data = writeFile(io, 100000);
+
+  std::vector<unsigned char> buf;
+  auto copy = [&](const unsigned char *src, size_t len) {
+    buf.assign(src, src + len);
+    return 0;
+  };
+  EXPECT_EQ(io.readMapped(1000, 5000, copy), 5000);
+  EXPECT_TRUE(std::equal(buf.begin(), buf.end(), data.begin() + 1000));
+
+  // short at the end of the file, nothing past it
+  EXPECT_EQ(io.readMapped(99000, 5000, copy), 1000);
+  EXPECT_TRUE(std::equal(buf.begin(), buf.end(), data.begin() + 99000));
+  EXPECT_EQ(io.readMapped(100000, 10, copy), 0);
+
+  // errors of the callback are passed on
+  EXPECT_EQ(io.readMapped(0, 10, [](const unsigned char *, size_t) {
+    return -EBADMSG;
+  }),
+            -EBADMSG);
+
+  // appended data is seen, the mapping grows
+  std::vector<unsigned char> more(300000, 7);
+  IORequest req;
+  req.offset = data.size();
+  req.data = more.data();
+  req.dataLen = more.size();
+  ASSERT_EQ(io.write(req), (ssize_t)more.size());
+  EXPECT_EQ(io.readMapped(data.size() + 250000, 100, copy), 100);
+  EXPECT_EQ(buf, std::vector<unsigned char>(100, 7));
+}
+
+TEST_F(MMapFileIOTest, TruncatedUnderMapping) {
+  MMapFileIO io(fileName);
+  ASSERT_GE(io.create(O_RDWR, 0644), 0);
+  std::vector<unsigned char> data = writeFile(io, 64 * 1024);
+
+  std::vector<unsigned char> buf(4096);
+  IORequest req;
+  req.offset = 8192;
+  req.data = buf.data();
+  req.dataLen = buf.size();
+  ASSERT_EQ(io.read(req), 4096);
+
+  // cut behind its back, the size it knows is stale
+  ASSERT_EQ(truncate(fileName.c_str(), 100), 0);
+  volatile unsigned sum = 0;
+  EXPECT_EQ(io.readMapped(8192, 4096,
+                          [&](const unsigned char *src, size_t len) {
+                            for (size_t i = 0; i < len; ++i) {
+                              sum += src[i];
+                            }
+                            return 0;
+                          }),
+            -EOPNOTSUPP);
+  // the missing pages read as 0's
+  EXPECT_EQ(sum, 0u);
+
+  EXPECT_EQ(io.read(req), 0);
+  req.offset = 0;
+  ASSERT_EQ(io.read(req), 100);
+  EXPECT_TRUE(std::equal(buf.begin(), buf.begin() + 100, data.begin()));
+}
+
+TEST_F(MMapFileIOTest, CipherFileIO) {
+  FSConfigPtr fsCfg = test::newFSConfig(1024);
+  fsCfg->config->allowHoles = true;
+
+  std::vector<unsigned char> data;
+  {
+    CipherFileIO cipherIO(std::make_shared<MMapFileIO>(fileName), fsCfg);
+    FileIO &io = cipherIO;
+    ASSERT_GE(io.create(O_RDWR, 0644), 0);
+    data = writeFile(io, 50 * 1024 + 77);
+    // a hole in the middle, read as 0's
+    std::vector<unsigned char> zeros(10 * 1024, 0);
+    IORequest req;
+    req.offset = 20 * 1024;
+    req.data = zeros.data();
+    req.dataLen = zeros.size();
+    ASSERT_EQ(io.write(req), (ssize_t)zeros.size());
+    std::copy(zeros.begin(), zeros.end(), data.begin() + req.offset);
+  }
+
+  // blocks are decoded from the mapping, the last partial one too
+  CipherFileIO cipherIO(std::make_shared<MMapFileIO>(fileName), fsCfg);
+  FileIO &io = cipherIO;
+  ASSERT_GE(io.open(O_RDONLY), 0);
+  std::vector<unsigned char> buf(data.size() + 100);
+  IORequest req;
+  req.offset = 0;
+  req.data = buf.data();
+  req.dataLen = buf.size();
+  ASSERT_EQ(io.read(req), (ssize_t)data.size());
+  buf.resize(data.size());
+  EXPECT_EQ(buf, data);
+
+  req.offset = 3000;
+  req.dataLen = 5000;
+  ASSERT_EQ(io.read(req), 5000);
+  EXPECT_TRUE(std::equal(buf.begin(), buf.begin() + 5000,
+                         data.begin() + 3000));
+}
+
+}  // namespace
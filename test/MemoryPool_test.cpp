@@ -1,5 +1,8 @@
 #include "gtest/gtest.h"
 
+#include <cstdint>
+#include <cstring>
+
 #include "encfs/MemoryPool.h"
 
 using namespace encfs;
@@ -8,5 +11,32 @@ TEST(MemoryPool, Allocate) {
   auto block = MemoryPool::allocate(1024);
   ASSERT_TRUE(block.data != nullptr);
   ASSERT_TRUE(block.internalData != nullptr);
+  EXPECT_EQ((uintptr_t)block.data % MemoryPool::Alignment, 0u);
+  MemoryPool::release(block);
+}
+
+TEST(MemoryPool, ReleasedBlocksAreCleared) {
+  auto block = MemoryPool::allocate(1024);
+  memset(block.data, 0xff, 1024);
   MemoryPool::release(block);
-}
\ No newline at end of file
+
+  block = MemoryPool::allocate(1024);
+  for (int i = 0; i < 1024; ++i) {
+    ASSERT_EQ(block.data[i], 0);
+  }
+  MemoryPool::release(block);
+}
+
+TEST(MemoryPool, SmallestBlockIsReused) {
+  MemoryPool::destroyAll();
+  auto large = MemoryPool::allocate(1024 * 1024);
+  auto small = MemoryPool::allocate(1024);
+  unsigned char *smallData = small.data;
+  MemoryPool::release(large);
+  MemoryPool::release(small);
+
+  // the large block is left for large requests
+  small = MemoryPool::allocate(512);
+  EXPECT_EQ(small.data, smallData);
+  MemoryPool::release(small);
+}
@@ -0,0 +1,105 @@
+#include "benchmark/benchmark.h"
+
+#include <cstdio>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+
+#include "encfs/BlockNameIO.h"
+#include "encfs/DirNode.h"
+#include "encfs/FSConfig.h"
+#include "encfs/StreamNameIO.h"
+#include "TestUtils.h"
+
+using namespace encfs;
+
+namespace {
+
+const int FSBlockSize = 256;
+const int ForeignNames = 1000;
+
+// Directory full of names which were not written through encfs, as left
+// behind by NFS, editors, sync clients or screenshot tools.  The longer ones
+// get past the short name check.  Shared by all benchmarks.
+const std::string &foreignDir() {
+  static test::TempDir tmp;
+  static bool filled = false;
+  if (!filled) {
+    filled = true;
+    const char *pattern[] = {".nfs%08x", "report-%d.tmp~",
+                             ".sync-conflict-%08d.partial",
+                             "Screenshot from 2024-01-%08d.png"};
+    for (int i = 0; i < ForeignNames; ++i) {
+      char name[64];
+      snprintf(name, sizeof(name), pattern[i % 4], i);
+      int fd = ::open(tmp.file(name).c_str(), O_CREAT | O_WRONLY, 0600);
+      if (fd >= 0) {
+        ::close(fd);
+      }
+    }
+  }
+  return tmp.path();
+}
+
+FSConfigPtr makeConfig(bool blockCoding) {
+  FSConfigPtr fsCfg = test::newFSConfig(FSBlockSize, false);
+  fsCfg->opts->idleTracking = false;
+
+  if (blockCoding) {
+    fsCfg->nameCoding.reset(new BlockNameIO(
+        BlockNameIO::CurrentInterface(), fsCfg->cipher, fsCfg->key,
+        fsCfg->cipher->cipherBlockSize()));
+  } else {
+    fsCfg->nameCoding.reset(new StreamNameIO(StreamNameIO::CurrentInterface(),
+                                             fsCfg->cipher, fsCfg->key));
+  }
+  fsCfg->nameCoding->setChainedNameIV(true);
+  return fsCfg;
+}
+
+void scanForeignDir(benchmark::State &state, bool blockCoding) {
+  FSConfigPtr fsCfg = makeConfig(blockCoding);
+  DirNode dirNode(nullptr, foreignDir() + "/", fsCfg);
+
+  while (state.KeepRunning()) {
+    DirTraverse dt = dirNode.openDir("/");
+    int count = 0;
+    while (!dt.nextPlaintextName().empty()) {
+      ++count;
+    }
+    benchmark::DoNotOptimize(count);
+  }
+  state.SetItemsProcessed(state.iterations() * ForeignNames);
+}
+
+}  // namespace
+
+static void BM_ReaddirForeignStream(benchmark::State &state) {
+  scanForeignDir(state, false);
+}
+BENCHMARK(BM_ReaddirForeignStream);
+
+static void BM_ReaddirForeignBlock(benchmark::State &state) {
+  scanForeignDir(state, true);
+}
+BENCHMARK(BM_ReaddirForeignBlock);
+
+static void tryDecodeForeignName(benchmark::State &state, const char *name) {
+  FSConfigPtr fsCfg = makeConfig(true);
+  std::string plainName;
+  while (state.KeepRunning()) {
+    uint64_t iv = 0;
+    int res = fsCfg->nameCoding->tryDecodePath(name, &iv, &plainName);
+    benchmark::DoNotOptimize(res);
+  }
+}
+
+static void BM_TryDecodeForeignName(benchmark::State &state) {
+  tryDecodeForeignName(state, ".nfs0000002a");
+}
+BENCHMARK(BM_TryDecodeForeignName);
+
+static void BM_TryDecodeLongForeignName(benchmark::State &state) {
+  tryDecodeForeignName(state, ".sync-conflict-0000002a.partial");
+}
+BENCHMARK(BM_TryDecodeLongForeignName);
@@ -0,0 +1,167 @@
+#include "gtest/gtest.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include "encfs/BlockNameIO.h"
+#include "encfs/Cipher.h"
+#include "encfs/CipherKey.h"
+#include "encfs/DirNode.h"
+#include "encfs/FSConfig.h"
+#include "encfs/FileUtils.h"
+#include "encfs/StreamNameIO.h"
+
+using namespace encfs;
+using namespace testing;
+
+// Count global operator new calls made while counting is enabled on the
+// current thread.
+static thread_local bool countAllocations = false;
+static thread_local int allocationCount = 0;
+
+void *operator new(std::size_t size) {
+  if (countAllocations) {
+    ++allocationCount;
+  }
+  void *p = malloc(size == 0 ? 1 : size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+void operator delete(void *p, std::size_t) noexcept { free(p); }
+
+namespace {
+
+class AllocationCounter {
+ public:
+  AllocationCounter() {
+    allocationCount = 0;
+    countAllocations = true;
+  }
+  ~AllocationCounter() { countAllocations = false; }
+  int count() const { return allocationCount; }
+};
+
+const int FSBlockSize = 256;
+const char *TEST_ROOTDIR = "/foo";
+
+class NameIOTest : public TestWithParam<bool> {
+ protected:
+  virtual void SetUp() {
+    cipher = Cipher::New("AES", 192);
+    key = cipher->newRandomKey();
+
+    fsCfg = FSConfigPtr(new FSConfig);
+    fsCfg->cipher = cipher;
+    fsCfg->key = key;
+    fsCfg->config.reset(new EncFSConfig);
+    fsCfg->config->blockSize = FSBlockSize;
+    fsCfg->opts.reset(new EncFS_Opts);
+    fsCfg->opts->idleTracking = false;
+    fsCfg->config->uniqueIV = false;
+
+    if (GetParam()) {
+      fsCfg->nameCoding.reset(new BlockNameIO(BlockNameIO::CurrentInterface(),
+                                              cipher, key,
+                                              cipher->cipherBlockSize()));
+    } else {
+      fsCfg->nameCoding.reset(
+          new StreamNameIO(StreamNameIO::CurrentInterface(), cipher, key));
+    }
+    fsCfg->nameCoding->setChainedNameIV(true);
+  }
+
+  std::shared_ptr<Cipher> cipher;
+  CipherKey key;
+  FSConfigPtr fsCfg;
+};
+
+const char *testPath = "/a/rather/long/path/with/some/components/that_do_not_"
+                       "fit_in_small_buffers.txt";
+
+TEST_P(NameIOTest, BufferMatchesString) {
+  const NameIO &naming = *fsCfg->nameCoding;
+  char encoded[1024];
+  char decoded[1024];
+
+  uint64_t iv = 0;
+  std::string expected = naming.encodePath(testPath, &iv);
+
+  iv = 0;
+  int len = naming.encodePath(testPath, &iv, encoded, sizeof(encoded));
+  ASSERT_EQ(len, (int)expected.length());
+  EXPECT_EQ(expected, encoded);
+
+  iv = 0;
+  len = naming.decodePath(encoded, &iv, decoded, sizeof(decoded));
+  ASSERT_GT(len, 0);
+  // leading separator is dropped by the coders
+  EXPECT_EQ(std::string(testPath + 1), decoded);
+}
+
+TEST_P(NameIOTest, BufferTooSmall) {
+  const NameIO &naming = *fsCfg->nameCoding;
+  char encoded[1024];
+
+  uint64_t iv = 0;
+  int len = naming.encodePath(testPath, &iv, encoded, sizeof(encoded));
+  ASSERT_GT(len, 0);
+
+  char small[16];
+  iv = 0;
+  EXPECT_EQ(naming.encodePath(testPath, &iv, small, sizeof(small)),
+            -ENAMETOOLONG);
+  iv = 0;
+  EXPECT_EQ(naming.decodePath(encoded, &iv, small, sizeof(small)),
+            -ENAMETOOLONG);
+  iv = 0;
+  EXPECT_EQ(naming.encodePath(testPath, &iv, encoded, len), -ENAMETOOLONG);
+}
+
+TEST_P(NameIOTest, EncodeWithoutAllocation) {
+  const NameIO &naming = *fsCfg->nameCoding;
+  char encoded[1024];
+  char decoded[1024];
+
+  // warm up any lazily initialized cipher state
+  uint64_t iv = 0;
+  ASSERT_GT(naming.encodePath(testPath, &iv, encoded, sizeof(encoded)), 0);
+
+  {
+    // the string interface returns a heap allocated result, which also shows
+    // the counter is working
+    AllocationCounter counter;
+    iv = 0;
+    std::string name = naming.encodePath(testPath, &iv);
+    EXPECT_GT(counter.count(), 0);
+  }
+
+  AllocationCounter counter;
+  iv = 0;
+  EXPECT_GT(naming.encodePath(testPath, &iv, encoded, sizeof(encoded)), 0);
+  iv = 0;
+  EXPECT_GT(naming.decodePath(encoded, &iv, decoded, sizeof(decoded)), 0);
+  EXPECT_EQ(counter.count(), 0);
+}
+
+TEST_P(NameIOTest, CipherPathWithoutAllocation) {
+  DirNode dirNode(nullptr, TEST_ROOTDIR, fsCfg);
+  std::string expected = dirNode.cipherPath(testPath);
+
+  char buf[1024];
+  AllocationCounter counter;
+  int len = dirNode.cipherPath(testPath, buf, sizeof(buf));
+  EXPECT_EQ(counter.count(), 0);
+  ASSERT_EQ(len, (int)expected.length());
+  EXPECT_EQ(expected, buf);
+}
+
+INSTANTIATE_TEST_SUITE_P(NameIO, NameIOTest, Values(false, true));
+
+}  // namespace
@@ -0,0 +1,142 @@
+#include "benchmark/benchmark.h"
+
+#include <cstdlib>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "encfs/CipherFileIO.h"
+#include "encfs/FSConfig.h"
+#include "encfs/IOUring.h"
+#include "encfs/MemoryPool.h"
+#include "encfs/RawFileIO.h"
+#include "TestUtils.h"
+
+using namespace encfs;
+
+namespace {
+
+const off_t FileSize = 64 * 1024 * 1024;
+
+// fio style jobs on a backing file.  The argument selects the engine,
+// 0 for pread / pwrite and 1 for io_uring.
+class BackingFile {
+ public:
+  explicit BackingFile(benchmark::State &state) : ok(false), tmp("/var/tmp") {
+    useRing = state.range(0) != 0;
+    if (useRing && !IOUring::available()) {
+      state.SkipWithError("io_uring not available");
+      return;
+    }
+    if (tmp.path().empty()) {
+      state.SkipWithError("mkdtemp failed");
+      return;
+    }
+    fileName = tmp.file("file");
+    ok = true;
+  }
+
+  // write the whole file once
+  void fill(FileIO &io, size_t chunk) {
+    std::vector<unsigned char> buf(chunk, 1);
+    IORequest req;
+    req.data = buf.data();
+    req.dataLen = chunk;
+    for (req.offset = 0; req.offset < FileSize; req.offset += chunk) {
+      io.write(req);
+    }
+  }
+
+  bool ok;
+  bool useRing;
+  test::TempDir tmp;
+  std::string fileName;
+};
+
+// rw=write bs=1M
+void seqWrite(benchmark::State &state) {
+  BackingFile file(state);
+  if (!file.ok) {
+    return;
+  }
+  RawFileIO io(file.fileName, true, file.useRing);
+  io.create(O_RDWR, 0644);
+
+  const size_t Chunk = 1024 * 1024;
+  MemBlock mb = MemoryPool::allocate(Chunk);
+  IORequest req;
+  req.offset = 0;
+  req.data = mb.data;
+  req.dataLen = Chunk;
+  while (state.KeepRunning()) {
+    io.write(req);
+    req.offset = (req.offset + Chunk) % FileSize;
+  }
+  state.SetBytesProcessed(state.iterations() * Chunk);
+  MemoryPool::release(mb);
+}
+
+// rw=randread bs=4k
+void randRead(benchmark::State &state) {
+  BackingFile file(state);
+  if (!file.ok) {
+    return;
+  }
+  RawFileIO io(file.fileName, true, file.useRing);
+  io.create(O_RDWR, 0644);
+  file.fill(io, 1024 * 1024);
+
+  const size_t Chunk = 4096;
+  MemBlock mb = MemoryPool::allocate(Chunk);
+  IORequest req;
+  req.data = mb.data;
+  req.dataLen = Chunk;
+  unsigned int seed = 1;
+  while (state.KeepRunning()) {
+    req.offset = (off_t)(rand_r(&seed) % (FileSize / Chunk)) * Chunk;
+    io.read(req);
+  }
+  state.SetBytesProcessed(state.iterations() * Chunk);
+  MemoryPool::release(mb);
+}
+
+// rw=write bs=8M through CipherFileIO, where io_uring lets the encryption
+// of a batch overlap with the write of the one before
+void cipherSeqWrite(benchmark::State &state) {
+  BackingFile file(state);
+  if (!file.ok) {
+    return;
+  }
+  FSConfigPtr fsCfg = test::newFSConfig(4096, true, 256);
+
+  auto raw = std::make_shared<RawFileIO>(file.fileName, true, file.useRing);
+  CipherFileIO io(raw, fsCfg);
+  io.create(O_RDWR, 0644);
+
+  const size_t Chunk = 8 * 1024 * 1024;
+  std::vector<unsigned char> buf(Chunk, 1);
+  IORequest req;
+  req.offset = 0;
+  req.data = buf.data();
+  req.dataLen = Chunk;
+  while (state.KeepRunning()) {
+    io.write(req);
+    req.offset = (req.offset + Chunk) % FileSize;
+  }
+  state.SetBytesProcessed(state.iterations() * Chunk);
+}
+
+}  // namespace
+
+static void BM_RawSeqWrite(benchmark::State &state) { seqWrite(state); }
+BENCHMARK(BM_RawSeqWrite)->Arg(0)->Arg(1)->UseRealTime();
+
+static void BM_RawRandRead(benchmark::State &state) { randRead(state); }
+BENCHMARK(BM_RawRandRead)->Arg(0)->Arg(1)->UseRealTime();
+
+static void BM_CipherSeqWrite(benchmark::State &state) {
+  cipherSeqWrite(state);
+}
+BENCHMARK(BM_CipherSeqWrite)->Arg(0)->Arg(1)->UseRealTime();
@@ -0,0 +1,200 @@
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "encfs/IOUring.h"
+#include "encfs/MemoryPool.h"
+#include "encfs/RawFileIO.h"
+#include "encfs/SyncScheduler.h"
+#include "TestUtils.h"
+
+using namespace encfs;
+using namespace testing;
+
+namespace {
+
+class RawFileIOTest : public Test {
+ protected:
+  virtual void SetUp() { fileName = tmp.file("file"); }
+
+  test::TempDir tmp;
+  std::string fileName;
+};
+
+TEST_F(RawFileIOTest, StatThroughDescriptor) {
+  RawFileIO io(fileName);
+  ASSERT_GE(io.create(O_RDWR, 0644), 0);
+
+  unsigned char data[100] = {0};
+  IORequest req;
+  req.offset = 0;
+  req.data = data;
+  req.dataLen = sizeof(data);
+  ASSERT_EQ(io.write(req), (ssize_t)sizeof(data));
+
+  // the path is gone, but the open file can still be stat'ed
+  std::string movedName = tmp.file("moved");
+  ASSERT_EQ(rename(fileName.c_str(), movedName.c_str()), 0);
+
+  struct stat st;
+  ASSERT_EQ(io.getAttr(&st), 0);
+  EXPECT_EQ(st.st_size, (off_t)sizeof(data));
+  EXPECT_EQ(io.getSize(), (off_t)sizeof(data));
+
+  RawFileIO closed(fileName);
+  EXPECT_EQ(closed.getAttr(&st), -ENOENT);
+}
+
+TEST_F(RawFileIOTest, SizeAfterOpen) {
+  int fd = ::open(fileName.c_str(), O_CREAT | O_WRONLY, 0644);
+  ASSERT_GE(fd, 0);
+  ::close(fd);
+
+  RawFileIO io(fileName);
+  EXPECT_EQ(io.getSize(), 0);
+
+  // changed before we opened it
+  ASSERT_EQ(::truncate(fileName.c_str(), 1234), 0);
+  ASSERT_GE(io.open(O_RDONLY), 0);
+  EXPECT_EQ(io.getSize(), 1234);
+
+  // reopening for write keeps the descriptor's view
+  ASSERT_GE(io.open(O_RDWR), 0);
+  EXPECT_EQ(io.getSize(), 1234);
+  ASSERT_EQ(io.truncate(10), 0);
+  EXPECT_EQ(io.getSize(), 10);
+}
+
+TEST_F(RawFileIOTest, IOUring) {
+  if (!IOUring::available()) {
+    return;
+  }
+  RawFileIO io(fileName, true, true);
+  ASSERT_GE(io.create(O_RDWR, 0644), 0);
+
+  std::vector<unsigned char> data(100000);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = i * 7;
+  }
+  IORequest req;
+  req.offset = 10;
+  req.data = data.data();
+  req.dataLen = data.size();
+  ASSERT_EQ(io.write(req), (ssize_t)data.size());
+  EXPECT_EQ(io.getSize(), (off_t)data.size() + 10);
+
+  std::vector<unsigned char> buf(data.size() + 100);
+  req.data = buf.data();
+  req.dataLen = buf.size();
+  ASSERT_EQ(io.read(req), (ssize_t)data.size());
+  buf.resize(data.size());
+  EXPECT_EQ(buf, data);
+
+  SyncScheduler::setIOUring(true);
+  EXPECT_EQ(SyncScheduler::sync(io.open(O_RDWR), true), 0);
+  SyncScheduler::setIOUring(false);
+}
+
+TEST_F(RawFileIOTest, IOUringWritesInFlight) {
+  if (!IOUring::available()) {
+    return;
+  }
+  RawFileIO io(fileName, true, true);
+  ASSERT_GE(io.create(O_RDWR, 0644), 0);
+  EXPECT_EQ(io.getSize(), 0);
+
+  // more writes than fit into the ring at once, from pool buffers which
+  // get registered with it
+  const int Writes = 200;
+  const int Size = 4096;
+  MemBlock mb = MemoryPool::allocate(Writes * Size);
+  for (int i = 0; i < Writes * Size; ++i) {
+    mb.data[i] = i / Size;
+  }
+  for (int i = Writes - 1; i >= 0; --i) {
+    IORequest req;
+    req.offset = i * Size;
+    req.data = mb.data + i * Size;
+    req.dataLen = Size;
+    ASSERT_EQ(io.startWrite(req), Size);
+  }
+  ASSERT_EQ(io.waitWrites(), 0);
+  EXPECT_EQ(io.getSize(), Writes * Size);
+
+  std::vector<unsigned char> buf(Writes * Size);
+  IORequest req;
+  req.offset = 0;
+  req.data = buf.data();
+  req.dataLen = buf.size();
+  ASSERT_EQ(io.read(req), Writes * Size);
+  EXPECT_TRUE(std::equal(buf.begin(), buf.end(), mb.data));
+  MemoryPool::release(mb);
+}
+
+TEST_F(RawFileIOTest, DirectIO) {
+  RawFileIO io(fileName, true, false, true);
+  int fd = io.create(O_RDWR, 0644);
+  ASSERT_GE(fd, 0);
+#if defined(O_DIRECT)
+  EXPECT_NE(fcntl(fd, F_GETFL) & O_DIRECT, 0);
+#endif
+
+  // aligned requests go straight to the file, the others are read back
+  // and written in whole pages
+  std::vector<unsigned char> expect;
+  unsigned int seed = 3;
+  for (int i = 0; i < 200; ++i) {
+    off_t offset = rand_r(&seed) % 50000;
+    size_t len = 1 + rand_r(&seed) % 10000;
+    if (i % 4 == 0) {
+      offset = offset / 4096 * 4096;
+      len = (len + 4095) / 4096 * 4096;
+    }
+    MemBlock mb = MemoryPool::allocate(len + 1);
+    unsigned char *data = mb.data + (i % 2);
+    for (size_t j = 0; j < len; ++j) {
+      data[j] = rand_r(&seed);
+    }
+    if (expect.size() < offset + len) {
+      expect.resize(offset + len);
+    }
+    std::copy(data, data + len, expect.begin() + offset);
+
+    IORequest req;
+    req.offset = offset;
+    req.data = data;
+    req.dataLen = len;
+    ASSERT_EQ(io.write(req), (ssize_t)len);
+    MemoryPool::release(mb);
+  }
+  EXPECT_EQ(io.getSize(), (off_t)expect.size());
+
+  struct stat st;
+  ASSERT_EQ(stat(fileName.c_str(), &st), 0);
+  EXPECT_EQ(st.st_size, (off_t)expect.size());
+
+  std::vector<unsigned char> buf(expect.size() + 5000);
+  IORequest req;
+  req.offset = 0;
+  req.data = buf.data();
+  req.dataLen = buf.size();
+  ASSERT_EQ(io.read(req), (ssize_t)expect.size());
+  buf.resize(expect.size());
+  EXPECT_EQ(buf, expect);
+
+  req.offset = 1000;
+  req.data = buf.data() + 1;
+  req.dataLen = 333;
+  ASSERT_EQ(io.read(req), 333);
+  EXPECT_TRUE(std::equal(buf.begin() + 1, buf.begin() + 334,
+                         expect.begin() + 1000));
+}
+
+}  // namespace
@@ -0,0 +1,194 @@
+#include "gtest/gtest.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <fcntl.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "config.h"
+#include "encfs/SyncScheduler.h"
+#include "TestUtils.h"
+
+using namespace encfs;
+using namespace testing;
+
+namespace {
+
+// Parameter is the syncfs() threshold, 0 syncs every file on its own.
+class SyncSchedulerTest : public TestWithParam<int> {
+ protected:
+  virtual void SetUp() {
+    SyncScheduler::setSyncfsThreshold(GetParam());
+  }
+
+  virtual void TearDown() {
+    SyncScheduler::setSyncfsThreshold(0);
+    SyncScheduler::setSyncHook(nullptr);
+  }
+
+  int openFile(int n) {
+    std::string name = tmp.file("file" + std::to_string(n));
+    return ::open(name.c_str(), O_CREAT | O_RDWR, 0644);
+  }
+
+  test::TempDir tmp;
+};
+
+TEST_P(SyncSchedulerTest, Single) {
+  int fd = openFile(0);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(write(fd, "data", 4), 4);
+  EXPECT_EQ(SyncScheduler::sync(fd, true), 0);
+  EXPECT_EQ(SyncScheduler::sync(fd, false), 0);
+  close(fd);
+
+  EXPECT_EQ(SyncScheduler::sync(fd, true), -EBADF);
+}
+
+TEST_P(SyncSchedulerTest, Concurrent) {
+  const int Threads = 8;
+  const int Files = 3;
+  int fds[Files];
+  for (int i = 0; i < Files; ++i) {
+    fds[i] = openFile(i);
+    ASSERT_GE(fds[i], 0);
+  }
+
+  // several threads per file, so requests for the same file are coalesced
+  std::atomic<int> failures(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < Threads; ++t) {
+    threads.emplace_back([&, t]() {
+      int fd = fds[t % Files];
+      for (int i = 0; i < 20; ++i) {
+        if (pwrite(fd, &i, sizeof(i), t * sizeof(i)) != sizeof(i) ||
+            SyncScheduler::sync(fd, (i & 1) != 0) != 0) {
+          ++failures;
+        }
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(failures, 0);
+
+  for (int fd : fds) {
+    close(fd);
+  }
+}
+
+// Counts the syncs, and holds up file syncs while holdSyncs is set.
+std::atomic<int> fileSyncs(0);
+std::atomic<int> fsSyncs(0);
+std::atomic<bool> holdSyncs(false);
+
+void countingHook(int, bool syncfs) {
+  if (syncfs) {
+    ++fsSyncs;
+    return;
+  }
+  ++fileSyncs;
+  while (holdSyncs) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+void waitFor(const std::atomic<int> &counter, int value) {
+  for (int i = 0; i < 5000 && counter < value; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+TEST_P(SyncSchedulerTest, CoalescesRequests) {
+  const int Threads = 8;
+  int fd = openFile(0);
+  ASSERT_GE(fd, 0);
+  fileSyncs = 0;
+  fsSyncs = 0;
+  holdSyncs = true;
+  SyncScheduler::setSyncHook(countingHook);
+
+  std::atomic<int> failures(0);
+  std::vector<std::thread> threads;
+  auto syncOnce = [&]() {
+    if (SyncScheduler::sync(fd, true) != 0) {
+      ++failures;
+    }
+  };
+  threads.emplace_back(syncOnce);
+  waitFor(fileSyncs, 1);
+  EXPECT_EQ(fileSyncs, 1);
+
+  // everyone arriving during the first sync shares the next one
+  for (int t = 1; t < Threads; ++t) {
+    threads.emplace_back(syncOnce);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_EQ(fileSyncs, 1);
+  holdSyncs = false;
+  for (auto &t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(failures, 0);
+  EXPECT_EQ(fileSyncs, 2);
+  EXPECT_EQ(fsSyncs, 0);
+  close(fd);
+}
+
+TEST_P(SyncSchedulerTest, SyncfsOnlyWhenEnabled) {
+  int fds[2];
+  for (int i = 0; i < 2; ++i) {
+    fds[i] = openFile(i);
+    ASSERT_GE(fds[i], 0);
+  }
+  fileSyncs = 0;
+  fsSyncs = 0;
+  holdSyncs = true;
+  SyncScheduler::setSyncHook(countingHook);
+
+  // both files are being synced, then one more request for each waits
+  std::atomic<int> failures(0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([&, i]() {
+      if (SyncScheduler::sync(fds[i % 2], true) != 0) {
+        ++failures;
+      }
+    });
+    if (i == 1) {
+      waitFor(fileSyncs, 2);
+      EXPECT_EQ(fileSyncs, 2);
+    }
+  }
+
+#if defined(HAVE_SYNCFS)
+  bool syncfs = GetParam() > 0 && GetParam() <= 2;
+#else
+  bool syncfs = false;
+#endif
+  if (syncfs) {
+    waitFor(fsSyncs, 1);
+  } else {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  holdSyncs = false;
+  for (auto &t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(failures, 0);
+  EXPECT_EQ(fsSyncs, syncfs ? 1 : 0);
+  EXPECT_EQ(fileSyncs, syncfs ? 2 : 4);
+
+  for (int fd : fds) {
+    close(fd);
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(SyncScheduler, SyncSchedulerTest, Values(0, 2, 4));
+
+}  // namespace
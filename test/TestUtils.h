@@ -0,0 +1,125 @@
+#ifndef _TestUtils_incl_
+#define _TestUtils_incl_
+
+#include "gtest/gtest.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <ftw.h>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#include "encfs/Cipher.h"
+#include "encfs/FSConfig.h"
+#include "encfs/FileIO.h"
+#include "encfs/FileUtils.h"
+
+// Helpers shared by the unit tests and benchmarks.
+namespace encfs {
+namespace test {
+
+// Scratch directory in base, removed with everything below it when the
+// object goes away.  path() is empty if it couldn't be created.
+class TempDir {
+ public:
+  explicit TempDir(const std::string &base = "/tmp") {
+    std::string tmpl = base + "/encfstestXXXXXX";
+    if (mkdtemp(&tmpl[0]) == nullptr) {
+      ADD_FAILURE() << "mkdtemp failed in " << base;
+      return;
+    }
+    dir = tmpl;
+  }
+
+  ~TempDir() {
+    if (!dir.empty()) {
+      EXPECT_EQ(nftw(dir.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS), 0);
+    }
+  }
+
+  const std::string &path() const { return dir; }
+
+  // path of a name inside the directory
+  std::string file(const std::string &name) const { return dir + "/" + name; }
+
+ private:
+  TempDir(const TempDir &) = delete;
+  TempDir &operator=(const TempDir &) = delete;
+
+  static int removeEntry(const char *path, const struct stat *, int,
+                         struct FTW *) {
+    return ::remove(path);
+  }
+
+  std::string dir;
+};
+
+// AES with a new random key, unique IVs and the default options.
+inline FSConfigPtr newFSConfig(int blockSize, bool uniqueIV = true,
+                               int keyLength = 192) {
+  std::shared_ptr<Cipher> cipher = Cipher::New("AES", keyLength);
+  FSConfigPtr fsCfg(new FSConfig);
+  fsCfg->cipher = cipher;
+  fsCfg->key = cipher->newRandomKey();
+  fsCfg->config.reset(new EncFSConfig);
+  fsCfg->config->blockSize = blockSize;
+  fsCfg->config->uniqueIV = uniqueIV;
+  fsCfg->opts.reset(new EncFS_Opts);
+  return fsCfg;
+}
+
+// size of the file at path, -1 if it doesn't exist
+inline off_t fileSize(const std::string &path) {
+  struct stat st;
+  if (lstat(path.c_str(), &st) != 0) {
+    return -1;
+  }
+  return st.st_size;
+}
+
+// read or write all of buf at offset
+inline ssize_t readAt(const FileIO &io, off_t offset,
+                      std::vector<unsigned char> *buf) {
+  IORequest req;
+  req.offset = offset;
+  req.data = buf->data();
+  req.dataLen = buf->size();
+  return io.read(req);
+}
+
+inline ssize_t writeAt(FileIO &io, off_t offset,
+                       std::vector<unsigned char> &buf) {
+  IORequest req;
+  req.offset = offset;
+  req.data = buf.data();
+  req.dataLen = buf.size();
+  return io.write(req);
+}
+
+// open io for reading and check that it holds size bytes, which are returned
+inline std::vector<unsigned char> readAll(FileIO &io, off_t size) {
+  EXPECT_GE(io.open(O_RDONLY), 0);
+  EXPECT_EQ(io.getSize(), size);
+  std::vector<unsigned char> buf(size + 1);
+  EXPECT_EQ(readAt(io, 0, &buf), size);
+  buf.resize(size);
+  return buf;
+}
+
+// size bytes of a counting pattern, data[i] = i * mult + add
+inline std::vector<unsigned char> testData(size_t size, int mult = 13,
+                                           int add = 0) {
+  std::vector<unsigned char> data(size);
+  for (size_t i = 0; i < size; ++i) {
+    data[i] = i * mult + add;
+  }
+  return data;
+}
+
+}  // namespace test
+}  // namespace encfs
+
+#endif
@@ -0,0 +1,30 @@
+#include "benchmark/benchmark.h"
+
+#include <vector>
+
+#include "encfs/ZeroBlock.h"
+
+using namespace encfs;
+
+// Check a block of 0's, as done for every block read when holes are allowed.
+// The argument is the block size.
+static void checkZeroBlock(benchmark::State &state, bool simd) {
+  zeroBlockSetSIMD(simd);
+  std::vector<unsigned char> buf(state.range(0), 0);
+
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(isZeroBlock(buf.data(), buf.size()));
+  }
+  state.SetBytesProcessed(state.iterations() * buf.size());
+  zeroBlockSetSIMD(true);
+}
+
+static void BM_ZeroBlockGeneric(benchmark::State &state) {
+  checkZeroBlock(state, false);
+}
+BENCHMARK(BM_ZeroBlockGeneric)->Arg(1024)->Arg(4096)->Arg(65536);
+
+static void BM_ZeroBlockSIMD(benchmark::State &state) {
+  checkZeroBlock(state, true);
+}
+BENCHMARK(BM_ZeroBlockSIMD)->Arg(1024)->Arg(4096)->Arg(65536);
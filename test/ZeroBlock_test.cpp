@@ -0,0 +1,56 @@
+#include "gtest/gtest.h"
+
+#include <cstdlib>
+#include <vector>
+
+#include "encfs/ZeroBlock.h"
+
+using namespace encfs;
+using namespace testing;
+
+namespace {
+
+class ZeroBlockTest : public TestWithParam<bool> {
+ protected:
+  virtual void SetUp() { zeroBlockSetSIMD(GetParam()); }
+  virtual void TearDown() { zeroBlockSetSIMD(true); }
+};
+
+TEST_P(ZeroBlockTest, Zeros) {
+  std::vector<unsigned char> buf(4096 + 64, 0);
+  for (size_t len = 0; len <= 300; ++len) {
+    EXPECT_TRUE(isZeroBlock(buf.data(), len)) << "len " << len;
+  }
+  // unaligned starts
+  for (int start = 0; start < 64; ++start) {
+    EXPECT_TRUE(isZeroBlock(buf.data() + start, 4096));
+  }
+}
+
+TEST_P(ZeroBlockTest, OneByteSet) {
+  std::vector<unsigned char> buf(600, 0);
+  for (size_t len = 1; len <= 520; ++len) {
+    for (size_t pos = 0; pos < len; ++pos) {
+      for (int start : {0, 3}) {
+        buf[start + pos] = 1 << (pos % 8);
+        ASSERT_FALSE(isZeroBlock(buf.data() + start, len))
+            << "len " << len << ", pos " << pos << ", start " << start;
+        buf[start + pos] = 0;
+      }
+    }
+  }
+}
+
+TEST_P(ZeroBlockTest, ByteAfterEnd) {
+  // bytes past the end of the buffer aren't looked at
+  std::vector<unsigned char> buf(4096 + 1, 0);
+  for (size_t len : {15, 16, 17, 63, 64, 65, 128, 1000, 4096}) {
+    buf[len] = 0xff;
+    EXPECT_TRUE(isZeroBlock(buf.data(), len)) << "len " << len;
+    buf[len] = 0;
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(ZeroBlock, ZeroBlockTest, Values(false, true));
+
+}  // namespace
@@ -0,0 +1,73 @@
+#include "benchmark/benchmark.h"
+
+#include <cstring>
+
+#include "encfs/base64.h"
+
+using namespace encfs;
+
+// Base64 encode and decode a filename sized buffer, as done for every path
+// component.  The argument is the number of plaintext bytes.
+static void encodeDecodeB64(benchmark::State &state, bool simd) {
+  base64SetSIMD(simd);
+  const int len = state.range(0);
+  const int encLen = B256ToB64Bytes(len);
+  unsigned char data[512];
+  unsigned char buf[512];
+  for (int i = 0; i < len; ++i) {
+    data[i] = i * 7;
+  }
+
+  while (state.KeepRunning()) {
+    memcpy(buf, data, len);
+    changeBase2Inline(buf, len, 8, 6, true);
+    B64ToAscii(buf, encLen);
+    AsciiToB64(buf, encLen);
+    changeBase2Inline(buf, encLen, 6, 8, false);
+    benchmark::DoNotOptimize(buf);
+  }
+  state.SetBytesProcessed(state.iterations() * len);
+  base64SetSIMD(true);
+}
+
+static void encodeDecodeB32(benchmark::State &state, bool simd) {
+  base64SetSIMD(simd);
+  const int len = state.range(0);
+  const int encLen = B256ToB32Bytes(len);
+  unsigned char data[512];
+  unsigned char buf[512];
+  for (int i = 0; i < len; ++i) {
+    data[i] = i * 7;
+  }
+
+  while (state.KeepRunning()) {
+    memcpy(buf, data, len);
+    changeBase2Inline(buf, len, 8, 5, true);
+    B32ToAscii(buf, encLen);
+    AsciiToB32(buf, encLen);
+    changeBase2Inline(buf, encLen, 5, 8, false);
+    benchmark::DoNotOptimize(buf);
+  }
+  state.SetBytesProcessed(state.iterations() * len);
+  base64SetSIMD(true);
+}
+
+static void BM_Base64Generic(benchmark::State &state) {
+  encodeDecodeB64(state, false);
+}
+BENCHMARK(BM_Base64Generic)->Arg(18)->Arg(48)->Arg(160);
+
+static void BM_Base64SIMD(benchmark::State &state) {
+  encodeDecodeB64(state, true);
+}
+BENCHMARK(BM_Base64SIMD)->Arg(18)->Arg(48)->Arg(160);
+
+static void BM_Base32Generic(benchmark::State &state) {
+  encodeDecodeB32(state, false);
+}
+BENCHMARK(BM_Base32Generic)->Arg(18)->Arg(48)->Arg(160);
+
+static void BM_Base32SIMD(benchmark::State &state) {
+  encodeDecodeB32(state, true);
+}
+BENCHMARK(BM_Base32SIMD)->Arg(18)->Arg(48)->Arg(160);
@@ -0,0 +1,246 @@
+#include "gtest/gtest.h"
+
+#include <cctype>
+#include <cstdlib>
+#include <vector>
+
+#include "encfs/base64.h"
+
+using namespace encfs;
+using namespace testing;
+
+namespace {
+
+// Reference versions of the conversions, as they were before the vector code
+// was added.  The optimized versions must match them for every input.
+void refChangeBase2Inline(unsigned char *src, int srcLen, int src2Pow,
+                          int dst2Pow, bool outputPartialLastByte,
+                          unsigned long work, int workBits,
+                          unsigned char *outLoc) {
+  const int mask = (1 << dst2Pow) - 1;
+  if (outLoc == nullptr) {
+    outLoc = src;
+  }
+
+  while ((srcLen != 0) && workBits < dst2Pow) {
+    work |= ((unsigned long)(*src++)) << workBits;
+    workBits += src2Pow;
+    --srcLen;
+  }
+
+  unsigned char outVal = work & mask;
+  work >>= dst2Pow;
+  workBits -= dst2Pow;
+
+  if (srcLen != 0) {
+    refChangeBase2Inline(src, srcLen, src2Pow, dst2Pow, outputPartialLastByte,
+                         work, workBits, outLoc + 1);
+    *outLoc = outVal;
+  } else {
+    *outLoc++ = outVal;
+
+    if (outputPartialLastByte) {
+      while (workBits > 0) {
+        *outLoc++ = work & mask;
+        work >>= dst2Pow;
+        workBits -= dst2Pow;
+      }
+    }
+  }
+}
+
+void refB64ToAscii(unsigned char *in, int length) {
+  static const char B642AsciiTable[] = ",-0123456789";
+  for (int offset = 0; offset < length; ++offset) {
+    int ch = in[offset];
+    if (ch > 11) {
+      if (ch > 37) {
+        ch += 'a' - 38;
+      } else {
+        ch += 'A' - 12;
+      }
+    } else {
+      ch = B642AsciiTable[ch];
+    }
+    in[offset] = ch;
+  }
+}
+
+void refAsciiToB64(unsigned char *out, const unsigned char *in, int length) {
+  static const unsigned char Ascii2B64Table[] =
+      "                                            01  23456789:;       ";
+  while ((length--) != 0) {
+    unsigned char ch = *in++;
+    if (ch >= 'A') {
+      if (ch >= 'a') {
+        ch += 38 - 'a';
+      } else {
+        ch += 12 - 'A';
+      }
+    } else {
+      ch = Ascii2B64Table[ch] - '0';
+    }
+    *out++ = ch;
+  }
+}
+
+void refB32ToAscii(unsigned char *buf, int len) {
+  for (int offset = 0; offset < len; ++offset) {
+    int ch = buf[offset];
+    if (ch >= 0 && ch < 26) {
+      ch += 'A';
+    } else {
+      ch += '2' - 26;
+    }
+    buf[offset] = ch;
+  }
+}
+
+void refAsciiToB32(unsigned char *out, const unsigned char *in, int length) {
+  while ((length--) != 0) {
+    unsigned char ch = *in++;
+    int lch = toupper(ch);
+    if (lch >= 'A') {
+      lch -= 'A';
+    } else {
+      lch += 26 - '2';
+    }
+    *out++ = (unsigned char)lch;
+  }
+}
+
+std::vector<unsigned char> randomBytes(int len, int range) {
+  std::vector<unsigned char> buf(len);
+  for (auto &b : buf) {
+    b = rand() % range;
+  }
+  return buf;
+}
+
+std::vector<unsigned char> randomAlphabet(int len, const char *alphabet) {
+  int alphabetLen = strlen(alphabet);
+  std::vector<unsigned char> buf(len);
+  for (auto &b : buf) {
+    b = alphabet[rand() % alphabetLen];
+  }
+  return buf;
+}
+
+const char *B64Alphabet =
+    ",-0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+const char *B32Alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567abcdefghijklmnopqrstuvwxyz";
+
+const int Iterations = 2000;
+const int MaxLen = 300;
+
+class Base64Test : public TestWithParam<bool> {
+ protected:
+  virtual void SetUp() {
+    srand(1234);
+    simd = base64SetSIMD(GetParam());
+  }
+  virtual void TearDown() { base64SetSIMD(true); }
+  bool simd;
+};
+
+void checkChangeBase2Inline(int src2Pow, int dst2Pow, bool partial,
+                            int range) {
+  for (int i = 0; i < Iterations; ++i) {
+    int len = rand() % MaxLen;
+    // room for the expanded output, with random bytes after the input
+    std::vector<unsigned char> buf = randomBytes(len * 2 + 16, 256);
+    std::vector<unsigned char> input = randomBytes(len, range);
+    std::copy(input.begin(), input.end(), buf.begin());
+    std::vector<unsigned char> expected = buf;
+
+    refChangeBase2Inline(expected.data(), len, src2Pow, dst2Pow, partial, 0, 0,
+                         nullptr);
+    changeBase2Inline(buf.data(), len, src2Pow, dst2Pow, partial);
+    ASSERT_EQ(expected, buf) << "len " << len << ", " << src2Pow << " => "
+                             << dst2Pow;
+  }
+}
+
+TEST_P(Base64Test, ChangeBase2Encode) {
+  checkChangeBase2Inline(8, 6, true, 256);
+  checkChangeBase2Inline(8, 5, true, 256);
+  checkChangeBase2Inline(8, 6, false, 256);
+  checkChangeBase2Inline(8, 5, false, 256);
+}
+
+TEST_P(Base64Test, ChangeBase2Decode) {
+  checkChangeBase2Inline(6, 8, false, 64);
+  checkChangeBase2Inline(5, 8, false, 32);
+  checkChangeBase2Inline(6, 8, true, 64);
+  checkChangeBase2Inline(5, 8, true, 32);
+}
+
+TEST_P(Base64Test, ChangeBase2DecodeInvalid) {
+  // invalid characters decode to values which overflow into their neighbours
+  checkChangeBase2Inline(6, 8, false, 256);
+  checkChangeBase2Inline(5, 8, false, 256);
+}
+
+TEST_P(Base64Test, ToAscii) {
+  for (int i = 0; i < Iterations; ++i) {
+    int len = rand() % MaxLen;
+    int range = (i & 1) != 0 ? 256 : 64;
+
+    std::vector<unsigned char> buf = randomBytes(len, range);
+    std::vector<unsigned char> expected = buf;
+    refB64ToAscii(expected.data(), len);
+    B64ToAscii(buf.data(), len);
+    ASSERT_EQ(expected, buf);
+
+    buf = randomBytes(len, range / 2);
+    expected = buf;
+    refB32ToAscii(expected.data(), len);
+    B32ToAscii(buf.data(), len);
+    ASSERT_EQ(expected, buf);
+  }
+}
+
+TEST_P(Base64Test, FromAscii) {
+  for (int i = 0; i < Iterations; ++i) {
+    int len = rand() % MaxLen;
+
+    std::vector<unsigned char> in = (i & 1) != 0
+                                        ? randomBytes(len, 256)
+                                        : randomAlphabet(len, B64Alphabet);
+    std::vector<unsigned char> expected(len);
+    std::vector<unsigned char> out(len);
+    refAsciiToB64(expected.data(), in.data(), len);
+    AsciiToB64(out.data(), in.data(), len);
+    ASSERT_EQ(expected, out);
+    AsciiToB64(in.data(), len);
+    ASSERT_EQ(expected, in);
+
+    in = (i & 1) != 0 ? randomBytes(len, 256)
+                      : randomAlphabet(len, B32Alphabet);
+    refAsciiToB32(expected.data(), in.data(), len);
+    AsciiToB32(out.data(), in.data(), len);
+    ASSERT_EQ(expected, out);
+    AsciiToB32(in.data(), len);
+    ASSERT_EQ(expected, in);
+  }
+}
+
+TEST_P(Base64Test, RoundTrip) {
+  for (int i = 0; i < Iterations; ++i) {
+    int len = rand() % MaxLen + 1;
+    std::vector<unsigned char> data = randomBytes(len, 256);
+
+    int encLen = B256ToB64Bytes(len);
+    std::vector<unsigned char> buf(encLen);
+    std::copy(data.begin(), data.end(), buf.begin());
+    changeBase2Inline(buf.data(), len, 8, 6, true);
+    B64ToAscii(buf.data(), encLen);
+    AsciiToB64(buf.data(), encLen);
+    changeBase2Inline(buf.data(), encLen, 6, 8, false);
+    ASSERT_TRUE(std::equal(data.begin(), data.end(), buf.begin()));
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(Base64, Base64Test, Values(false, true));
+
+}  // namespace